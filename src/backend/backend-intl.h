@@ -15,9 +15,19 @@ struct ptree_ref {
     fs_rid pred;
     fs_ptree *ptree_s;
     fs_ptree *ptree_o;
+    int newer;          /* LRU links, indexes into ptrees_priv or -1 */
+    int older;
+    size_t mapped;      /* bytes mapped by both trees when they were opened */
+    int opened;         /* has been opened before, so opening again is a reopen */
 };
 
-#define FS_MAX_OPEN_PTREES 300
+/* shared by all the backend processes of a segment, see
+ * fs_backend_ptree_stats() */
+struct ptree_stats_file {
+    char id[4];
+    int32_t padding;
+    fs_ptree_stats stats;
+};
 
 #define FS_PENDED_LISTS 16
 
@@ -45,13 +55,27 @@ struct _fs_backend {
     GHashTable *rid_id_map;
     int ptree_open_flags;
     int ptree_open_count;
-    int open_ptrees[FS_MAX_OPEN_PTREES];
-    int open_ptrees_newest;
-    int open_ptrees_oldest;
+    int ptree_newest;   /* ends of the LRU list of open ptrees */
+    int ptree_oldest;
+    size_t ptree_mapped;
+    int ptree_max_open;
+    size_t ptree_max_mapped;
+    long long ptree_hits; /* not yet added to ptree_stats */
+    struct ptree_stats_file *ptree_stats;
+    int shared_ptrees;  /* small predicates share a tree, see ptree.h */
+    fs_ptree *shared_ptree_s;
+    fs_ptree *shared_ptree_o;
     fs_import_timing in_time[FS_MAX_SEGMENTS];
     fs_query_timing out_time[FS_MAX_SEGMENTS];
     int checked_transaction;
     int transaction;
+    struct _fs_wal *trans_log; /* pending changes of an open transaction */
+    struct _fs_wal *redo_log;  /* small updates not yet in the indexes */
+    struct _fs_textindex *text; /* literals are queued here until commit */
+    int commit_lock;    /* fd holding the commit lock, or -1 */
+    int write_lock;     /* fd holding the index writer lock, or -1 */
+    int replay_again;   /* replaying a log that was partly applied before,
+                         * so imported quads may be in the indexes already */
     int mid_commit;
     int model_data;
     int model_dirs;
@@ -60,6 +84,7 @@ struct _fs_backend {
 			    * not guaranteed to be accurate */
     float min_free;
     char *store_uuid;
+    volatile unsigned long long *generation; /* shared with other backend processes */
 };
 
 #endif
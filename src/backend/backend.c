@@ -25,6 +25,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 #include <errno.h>
 #include <signal.h>
 
@@ -40,6 +43,8 @@
 #include "lock.h"
 #include "mhash.h"
 #include "tlist.h"
+#include "wal.h"
+#include "textindex.h"
 
 /* used to indicate to backend processes that they need to reopen thier
  * index files */
@@ -82,6 +87,12 @@ fs_backend *fs_backend_init(const char *db_name, int flags)
     fs_backend *ret = calloc(1, sizeof(fs_backend));
     ret->db_name = db_name;
     ret->segment = -1;
+    ret->commit_lock = -1;
+    ret->write_lock = -1;
+    ret->ptree_newest = -1;
+    ret->ptree_oldest = -1;
+    ret->ptree_max_open = FS_PTREE_MAX_OPEN;
+    ret->ptree_max_mapped = (size_t)FS_PTREE_MAX_MAPPED << 20;
     if (flags & FS_BACKEND_NO_OPEN) {
 	return ret;
     }
@@ -183,6 +194,11 @@ fs_backend *fs_backend_init(const char *db_name, int flags)
     ret->model_data = fs_metadata_get_bool(ret->md, FS_MD_MODEL_DATA, 0);
     ret->model_dirs = fs_metadata_get_bool(ret->md, FS_MD_MODEL_DIRS, 0);
     ret->model_files = fs_metadata_get_bool(ret->md, FS_MD_MODEL_FILES, 0);
+    ret->shared_ptrees = fs_metadata_get_bool(ret->md, FS_MD_SHARED_PTREES, 0);
+    ret->ptree_max_open = fs_metadata_get_int(ret->md, FS_MD_PTREE_MAX_OPEN,
+					      FS_PTREE_MAX_OPEN);
+    ret->ptree_max_mapped = fs_metadata_get_int(ret->md, FS_MD_PTREE_MAX_MAPPED,
+						FS_PTREE_MAX_MAPPED) << 20;
 
     ret->transaction = -1;
 
@@ -228,6 +244,21 @@ void fs_backend_fini(fs_backend *be)
     fs_backend_cleanup_files(be);
     fs_backend_close_files(be, be->segment);
     fs_metadata_close(be->md);
+    if (be->trans_log) {
+	fs_wal_close(be->trans_log);
+    }
+    if (be->redo_log) {
+	fs_wal_close(be->redo_log);
+    }
+    if (be->commit_lock != -1) {
+	close(be->commit_lock);
+    }
+    if (be->write_lock != -1) {
+	close(be->write_lock);
+    }
+    if (be->generation) {
+	munmap((void *)be->generation, sizeof(unsigned long long));
+    }
     g_free((void *)be->hash);
     free(be);
 }
@@ -317,33 +348,192 @@ int fs_start_import(fs_backend *be, int seg)
     return errs;
 }
 
+static struct ptree_stats_file *ptree_stats_map(fs_backend *be)
+{
+    if (be->ptree_stats) return be->ptree_stats;
+    if (be->segment < 0) return NULL;
+
+    char *fn = g_strdup_printf(fs_get_stats_format(), be->db_name, be->segment, "ptrees");
+    int fd = open(fn, O_RDWR | O_CREAT, FS_FILE_MODE);
+    if (fd == -1) {
+	fs_error(LOG_ERR, "failed to open %s: %s", fn, strerror(errno));
+	g_free(fn);
+
+	return NULL;
+    }
+    flock(fd, LOCK_EX);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size < sizeof(struct ptree_stats_file)) {
+	struct ptree_stats_file init = { .id = "JXS0" };
+	if (pwrite(fd, &init, sizeof(init), 0) != sizeof(init)) {
+	    fs_error(LOG_ERR, "failed to initialise %s: %s", fn, strerror(errno));
+	}
+    }
+    flock(fd, LOCK_UN);
+    void *map = mmap(NULL, sizeof(struct ptree_stats_file),
+		     PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	fs_error(LOG_ERR, "failed to map %s: %s", fn, strerror(errno));
+	g_free(fn);
+
+	return NULL;
+    }
+    g_free(fn);
+    be->ptree_stats = map;
+
+    return be->ptree_stats;
+}
+
+#define PTREE_STAT(be, field, n) do { \
+    struct ptree_stats_file *sf = ptree_stats_map(be); \
+    if (sf) __sync_fetch_and_add(&sf->stats.field, (n)); \
+} while (0)
+
+static void ptree_flush_hits(fs_backend *be)
+{
+    if (be->ptree_hits) {
+	PTREE_STAT(be, hits, be->ptree_hits);
+	be->ptree_hits = 0;
+    }
+}
+
+int fs_backend_ptree_stats(const char *kb_name, fs_segment seg, fs_ptree_stats *stats)
+{
+    char *fn = g_strdup_printf(fs_get_stats_format(), kb_name, seg, "ptrees");
+    struct ptree_stats_file sf;
+    int fd = open(fn, O_RDONLY);
+    const int missing = fd == -1 && errno == ENOENT;
+    g_free(fn);
+    if (fd == -1) {
+	memset(stats, 0, sizeof(*stats));
+
+	/* no backend has opened a ptree in this segment yet */
+	return missing ? 0 : 1;
+    }
+    int ret = pread(fd, &sf, sizeof(sf), 0) != sizeof(sf) || memcmp(sf.id, "JXS0", 4);
+    close(fd);
+    if (ret) {
+	memset(stats, 0, sizeof(*stats));
+    } else {
+	*stats = sf.stats;
+    }
+
+    return ret;
+}
+
+/* open ptrees are kept on a list from most to least recently used */
+
+static void ptree_lru_unlink(fs_backend *be, int n)
+{
+    struct ptree_ref *ref = &be->ptrees_priv[n];
+
+    if (ref->newer >= 0) be->ptrees_priv[ref->newer].older = ref->older;
+    else be->ptree_newest = ref->older;
+    if (ref->older >= 0) be->ptrees_priv[ref->older].newer = ref->newer;
+    else be->ptree_oldest = ref->newer;
+    ref->newer = -1;
+    ref->older = -1;
+}
+
+static void ptree_lru_push(fs_backend *be, int n)
+{
+    struct ptree_ref *ref = &be->ptrees_priv[n];
+
+    ref->newer = -1;
+    ref->older = be->ptree_newest;
+    if (be->ptree_newest >= 0) be->ptrees_priv[be->ptree_newest].newer = n;
+    else be->ptree_oldest = n;
+    be->ptree_newest = n;
+}
+
+static void ptree_ref_close(fs_backend *be, int n)
+{
+    struct ptree_ref *ref = &be->ptrees_priv[n];
+
+    if (!ref->ptree_s) return;
+
+    ptree_lru_unlink(be, n);
+    fs_ptree_close(ref->ptree_s);
+    ref->ptree_s = NULL;
+    if (ref->ptree_o) fs_ptree_close(ref->ptree_o);
+    ref->ptree_o = NULL;
+    be->ptree_mapped -= ref->mapped;
+    ref->mapped = 0;
+    be->ptree_open_count--;
+}
+
+static int ptree_over_limit(fs_backend *be)
+{
+    return be->ptree_open_count > be->ptree_max_open ||
+	   be->ptree_mapped > be->ptree_max_mapped;
+}
+
+/* close least recently used ptrees until we're within the limits, except
+ * keep. Trees with iterators open can't be closed, and closing one with
+ * unpublished changes would publish them early, so those stay open over
+ * the limit until fs_backend_publish() evicts again */
+static void ptree_evict(fs_backend *be, int keep)
+{
+    int n = be->ptree_oldest;
+    while (n >= 0 && ptree_over_limit(be)) {
+	struct ptree_ref *ref = &be->ptrees_priv[n];
+	const int newer = ref->newer;
+	if (n != keep) {
+	    if (!fs_ptree_busy(ref->ptree_s) && !fs_ptree_busy(ref->ptree_o)) {
+		ptree_ref_close(be, n);
+		PTREE_STAT(be, evictions, 1);
+	    } else {
+		PTREE_STAT(be, busy, 1);
+	    }
+	}
+	n = newer;
+    }
+}
+
 void fs_backend_ptree_limited_open(fs_backend *be, int n)
 {
-    if (be->ptrees_priv[n].ptree_s) return;
+    struct ptree_ref *ref = &be->ptrees_priv[n];
 
-    if (be->ptree_open_count >= FS_MAX_OPEN_PTREES) {
-	int toclose = be->open_ptrees[be->open_ptrees_oldest++];
-	if (be->open_ptrees_oldest >= FS_MAX_OPEN_PTREES)
-	    be->open_ptrees_oldest = 0;
+    if (ref->ptree_s) {
+	if (be->ptree_newest != n) {
+	    ptree_lru_unlink(be, n);
+	    ptree_lru_push(be, n);
+	}
+	/* hits are counted locally, the shared counters are contended */
+	if (++be->ptree_hits >= 1024) ptree_flush_hits(be);
 
-	if (be->ptrees_priv[toclose].ptree_s)
-	    fs_ptree_close(be->ptrees_priv[toclose].ptree_s);
-	be->ptrees_priv[toclose].ptree_s = NULL;
-	if (be->ptrees_priv[toclose].ptree_o)
-	    fs_ptree_close(be->ptrees_priv[toclose].ptree_o);
-	be->ptrees_priv[toclose].ptree_o = NULL;
-	be->ptree_open_count--;
+	return;
     }
 
-    be->ptrees_priv[n].ptree_s = fs_ptree_open(be, be->ptrees_priv[n].pred, 's', be->ptree_open_flags | O_RDWR, be->pairs);
-    be->ptrees_priv[n].ptree_o = fs_ptree_open(be, be->ptrees_priv[n].pred, 'o', be->ptree_open_flags | O_RDWR, be->pairs);
-    be->open_ptrees[be->open_ptrees_newest++] = n;
-    fs_rid *rid = g_malloc(sizeof(fs_rid));
-    *rid = be->ptrees_priv[n].pred;
-    g_hash_table_insert(be->rid_id_map, rid, GINT_TO_POINTER(n));
-    if (be->open_ptrees_newest >= FS_MAX_OPEN_PTREES)
-	be->open_ptrees_newest = 0;
+    if (be->shared_ptree_s) {
+	ref->ptree_s = fs_ptree_open_pred(be, be->shared_ptree_s, ref->pred, 's', be->ptree_open_flags | O_RDWR);
+	ref->ptree_o = fs_ptree_open_pred(be, be->shared_ptree_o, ref->pred, 'o', be->ptree_open_flags | O_RDWR);
+    } else {
+	ref->ptree_s = fs_ptree_open(be, ref->pred, 's', be->ptree_open_flags | O_RDWR, be->pairs);
+	ref->ptree_o = fs_ptree_open(be, ref->pred, 'o', be->ptree_open_flags | O_RDWR, be->pairs);
+    }
+    if (!ref->ptree_s || !ref->ptree_o) {
+	if (ref->ptree_s) fs_ptree_close(ref->ptree_s);
+	if (ref->ptree_o) fs_ptree_close(ref->ptree_o);
+	ref->ptree_s = NULL;
+	ref->ptree_o = NULL;
+
+	return;
+    }
+    ref->mapped = fs_ptree_mapped_size(ref->ptree_s) +
+		  fs_ptree_mapped_size(ref->ptree_o);
+    be->ptree_mapped += ref->mapped;
     be->ptree_open_count++;
+    ptree_lru_push(be, n);
+    if (ref->opened) {
+	PTREE_STAT(be, reopens, 1);
+    } else {
+	PTREE_STAT(be, opens, 1);
+	ref->opened = 1;
+    }
+    ptree_flush_hits(be);
+    ptree_evict(be, n);
 }
 
 static int fs_commit(fs_backend *be, fs_segment seg, int force_trans)
@@ -430,8 +620,8 @@ int fs_stop_import(fs_backend *be, int seg)
     double then = fs_time();
 
     if (fs_backend_is_transaction_open(be)) {
-	/* were in a transaction, don't need to do anything else */
-	/* NB transactions not supported in this branch */
+	/* were in a transaction, the changes are in its log and get applied
+	 * when it commits */
 
 	return 0;
     }
@@ -441,6 +631,9 @@ int fs_stop_import(fs_backend *be, int seg)
 	fs_mhash_flush(be->models);
     }
 
+    if (fs_backend_write_lock(be, 1)) {
+	return 1;
+    }
     int ret = fs_commit(be, seg, 0);
     double now = fs_time();
     be->in_time[seg].rebuild += now - then;
@@ -450,11 +643,144 @@ int fs_stop_import(fs_backend *be, int seg)
     return ret;
 }
 
-int fs_backend_transaction(fs_backend *be, fs_segment seg, int op)
+/* the generation counter lives in a small file in the KB directory, mapped
+ * shared, so that all the backend processes (one per connection) see each
+ * others changes, and it survives restarts */
+static volatile unsigned long long *generation_map(fs_backend *be)
+{
+    if (be->generation) return be->generation;
+
+    char *fn = g_strdup_printf(fs_get_generation_format(), be->db_name);
+    int fd = open(fn, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+	fs_error(LOG_ERR, "failed to open %s: %s", fn, strerror(errno));
+	g_free(fn);
+
+	return NULL;
+    }
+    flock(fd, LOCK_EX);
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size < sizeof(unsigned long long)) {
+	/* start from the clock, so a recreated KB won't repeat old values */
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	unsigned long long start = ((unsigned long long)tv.tv_sec << 20) +
+				   tv.tv_usec;
+	if (pwrite(fd, &start, sizeof(start), 0) != sizeof(start)) {
+	    fs_error(LOG_ERR, "failed to initialise %s: %s", fn, strerror(errno));
+	}
+    }
+    flock(fd, LOCK_UN);
+    void *map = mmap(NULL, sizeof(unsigned long long), PROT_READ | PROT_WRITE,
+		     MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+	fs_error(LOG_ERR, "failed to map %s: %s", fn, strerror(errno));
+	g_free(fn);
+
+	return NULL;
+    }
+    g_free(fn);
+    be->generation = map;
+
+    return be->generation;
+}
+
+int fs_backend_get_generation(fs_backend *be, unsigned long long *generation)
+{
+    volatile unsigned long long *gen = generation_map(be);
+    if (!gen) return 1;
+    *generation = __sync_add_and_fetch(gen, 0);
+
+    return 0;
+}
+
+void fs_backend_bump_generation(fs_backend *be)
+{
+    volatile unsigned long long *gen = generation_map(be);
+
+    if (gen) __sync_add_and_fetch(gen, 1);
+}
+
+/* the ptrees lock themselves from their first change until they're
+ * published, and are changed in data order, so two processes writing the
+ * indexes at once could each wait for a tree the other holds */
+int fs_backend_write_lock(fs_backend *be, int block)
+{
+    if (be->write_lock != -1 || be->segment == -1) return 0;
+
+    char *fn = g_strdup_printf(fs_get_file_lock_format(), fs_backend_get_kb(be),
+                               fs_backend_get_segment(be), "write");
+    int fd = open(fn, FS_O_NOATIME | O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+	fs_error(LOG_ERR, "failed to open %s: %s", fn, strerror(errno));
+	g_free(fn);
+
+	return 1;
+    }
+    g_free(fn);
+    if (flock(fd, LOCK_EX | (block ? 0 : LOCK_NB)) == -1) {
+	close(fd);
+
+	return 1;
+    }
+    be->write_lock = fd;
+
+    return 0;
+}
+
+void fs_backend_write_unlock(fs_backend *be)
+{
+    if (be->write_lock == -1) return;
+
+    flock(be->write_lock, LOCK_UN);
+    close(be->write_lock);
+    be->write_lock = -1;
+}
+
+int fs_backend_publish(fs_backend *be)
 {
-    fs_error(LOG_CRIT, "transactions not supported in this branch");
+    int ret = 0;
+
+    for (int i=0; i<be->ptree_length; i++) {
+	if (be->ptrees_priv[i].ptree_s)
+	    fs_ptree_publish(be->ptrees_priv[i].ptree_s);
+	if (be->ptrees_priv[i].ptree_o)
+	    fs_ptree_publish(be->ptrees_priv[i].ptree_o);
+    }
+    /* after the views, so predicates moved out are visible first */
+    if (be->shared_ptree_s) fs_ptree_publish(be->shared_ptree_s);
+    if (be->shared_ptree_o) fs_ptree_publish(be->shared_ptree_o);
+
+    /* every tree is at its new root now, so nothing freed so far can be
+     * reached by a reader that pins from here on, what readers pinned in
+     * earlier epochs might still be following waits for them to finish */
+    if (be->pairs && fs_ptable_advance_epoch(be->pairs)) {
+	/* a reader pinned EPOCH_SLOTS epochs ago is still going, nothing
+	 * retired since can be reclaimed until it finishes */
+	fs_error(LOG_ERR, "segment %d: reader too far behind to advance "
+		 "epoch, not reclaiming", be->segment);
+	ret = 1;
+    } else if (be->pairs) {
+	const uint32_t oldest = fs_ptable_oldest_pin(be->pairs);
+	for (int i=0; i<be->ptree_length; i++) {
+	    if (be->ptrees_priv[i].ptree_s)
+		fs_ptree_reclaim(be->ptrees_priv[i].ptree_s, oldest);
+	    if (be->ptrees_priv[i].ptree_o)
+		fs_ptree_reclaim(be->ptrees_priv[i].ptree_o, oldest);
+	}
+	if (be->shared_ptree_s) fs_ptree_reclaim(be->shared_ptree_s, oldest);
+	if (be->shared_ptree_o) fs_ptree_reclaim(be->shared_ptree_o, oldest);
+	fs_ptable_reclaim(be->pairs, oldest);
+    }
+
+    /* trees held open while they were being written can go now */
+    ptree_evict(be, -1);
+    fs_backend_write_unlock(be);
+
+    fs_backend_bump_generation(be);
 
-    return 1;
+    return ret;
 }
 
 int fs_backend_model_get_usage(fs_backend *be, int seg, fs_rid model, fs_index_node *val)
@@ -509,14 +835,9 @@ struct ptree_ref *fs_backend_ptree_ref(fs_backend *be, int n)
 	return NULL;
     }
 
-    if (be->ptrees_priv[n].ptree_s) {
-	/* already open, good */
-	return &be->ptrees_priv[n];
-    } else {
-	/* needs to be opened */
-	fs_backend_ptree_limited_open(be, n);
-	return &be->ptrees_priv[n];
-    }
+    fs_backend_ptree_limited_open(be, n);
+
+    return &be->ptrees_priv[n];
 }
 
 fs_ptree *fs_backend_get_ptree(fs_backend *be, fs_rid pred, int object)
@@ -533,33 +854,52 @@ fs_ptree *fs_backend_get_ptree(fs_backend *be, fs_rid pred, int object)
     return ref->ptree_o;
 }
 
-int fs_backend_open_ptree(fs_backend *be, fs_rid pred)
+/* add a predicate to the ptree table without opening its ptrees */
+static int ptree_register(fs_backend *be, fs_rid pred)
 {
-    if (be == NULL) {
-	fs_error(LOG_CRIT, "fs_backend_open_ptree() passed NULL be");
-
-	return 0;
-    }
-
     if (be->ptree_length == be->ptree_size) {
 	be->ptree_size *= 2;
 	be->ptrees_priv = realloc(be->ptrees_priv, be->ptree_size * sizeof(struct ptree_ref));
 	if (!be->ptrees_priv) {
 	    fs_error(LOG_CRIT, "realloc failed");
 
-	    return 0;
+	    return -1;
 	}
     }
 
-    be->ptrees_priv[be->ptree_length].ptree_s = NULL;
-    be->ptrees_priv[be->ptree_length].ptree_o = NULL;
-    be->ptrees_priv[be->ptree_length].pred = pred;
-    fs_backend_ptree_limited_open(be, be->ptree_length);
-    be->approx_size += fs_ptree_count(be->ptrees_priv[be->ptree_length].ptree_s);
+    const int n = be->ptree_length;
+    struct ptree_ref *ref = &be->ptrees_priv[n];
+    ref->pred = pred;
+    ref->ptree_s = NULL;
+    ref->ptree_o = NULL;
+    ref->newer = -1;
+    ref->older = -1;
+    ref->mapped = 0;
+    ref->opened = 0;
+    fs_rid *rid = g_malloc(sizeof(fs_rid));
+    *rid = pred;
+    g_hash_table_insert(be->rid_id_map, rid, GINT_TO_POINTER(n));
 
     return (be->ptree_length)++;
 }
 
+int fs_backend_open_ptree(fs_backend *be, fs_rid pred)
+{
+    if (be == NULL) {
+	fs_error(LOG_CRIT, "fs_backend_open_ptree() passed NULL be");
+
+	return 0;
+    }
+
+    const int n = ptree_register(be, pred);
+    if (n < 0) return 0;
+    fs_backend_ptree_limited_open(be, n);
+    if (be->ptrees_priv[n].ptree_s)
+	be->approx_size += fs_ptree_count(be->ptrees_priv[n].ptree_s);
+
+    return n;
+}
+
 int fs_backend_open_files_intl(fs_backend *be, fs_segment seg, int flags, int files, char *file, int line)
 {
     if (!be) {
@@ -617,7 +957,8 @@ int fs_backend_open_files_intl(fs_backend *be, fs_segment seg, int flags, int fi
 	} else {
 	    be->ptree_size = length;
 	}
-	be->ptree_open_flags = flags;
+	/* trees are reopened after they've been evicted */
+	be->ptree_open_flags = flags & ~O_TRUNC;
 	be->ptrees_priv = calloc(be->ptree_size, sizeof(struct ptree_ref));
 	fs_list_rewind(be->predicates);
 	be->pairs = fs_ptable_open(be, "pairs", flags | O_RDWR);
@@ -628,9 +969,23 @@ int fs_backend_open_files_intl(fs_backend *be, fs_segment seg, int flags, int fi
 	}
 	be->rid_id_map = g_hash_table_new_full(rid_hash, rid_equal, g_free,
 					       NULL);
+	if (be->shared_ptrees) {
+	    be->shared_ptree_s = fs_ptree_open_shared(be, 's', flags | O_RDWR, be->pairs);
+	    be->shared_ptree_o = fs_ptree_open_shared(be, 'o', flags | O_RDWR, be->pairs);
+	    if (!be->shared_ptree_s || !be->shared_ptree_o) {
+		fs_error(LOG_CRIT, "failed to open shared ptree files");
+
+		return 1;
+	    }
+	}
 	while (fs_list_next_value(be->predicates, &pred)) {
-	    fs_backend_open_ptree(be, pred);
+	    ptree_register(be, pred);
 	}
+	/* ptrees are opened as they're used, but every quad has a row in the
+	 * pair table for each of its s and o trees */
+	be->approx_size = ((long long)fs_ptable_length(be->pairs) -
+			   fs_ptable_free_length(be->pairs) -
+			   fs_ptable_limbo_length(be->pairs)) / 2;
     }
 
     if (files & FS_OPEN_DEL) {
@@ -638,6 +993,10 @@ int fs_backend_open_files_intl(fs_backend *be, fs_segment seg, int flags, int fi
 	be->pending_insert = fs_list_open(be, "ins", sizeof(fs_rid), flags);
     }
 
+    if (!be->text) {
+	be->text = fs_textindex_open(be, flags);
+    }
+
     return 0;
 }
 
@@ -669,12 +1028,19 @@ int fs_backend_unlink_indexes(fs_backend *be, fs_segment seg)
     for (int i=0; i<be->ptree_length; i++) {
 	fs_backend_ptree_limited_open(be, i);
 	fs_ptree_unlink(be->ptrees_priv[i].ptree_s);
-	fs_ptree_close(be->ptrees_priv[i].ptree_s);
 	fs_ptree_unlink(be->ptrees_priv[i].ptree_o);
-	fs_ptree_close(be->ptrees_priv[i].ptree_o);
+	ptree_ref_close(be, i);
 	be->ptrees_priv[i].pred = 0LL;
-	be->ptrees_priv[i].ptree_s = NULL;
-	be->ptrees_priv[i].ptree_o = NULL;
+    }
+    if (be->shared_ptree_s) {
+	fs_ptree_unlink(be->shared_ptree_s);
+	fs_ptree_close(be->shared_ptree_s);
+	be->shared_ptree_s = NULL;
+    }
+    if (be->shared_ptree_o) {
+	fs_ptree_unlink(be->shared_ptree_o);
+	fs_ptree_close(be->shared_ptree_o);
+	be->shared_ptree_o = NULL;
     }
 
     be->ptree_length = 0;
@@ -703,6 +1069,10 @@ int fs_backend_unlink_indexes(fs_backend *be, fs_segment seg)
 	be->model_list = NULL;
     }
 
+    if (be->text) {
+	fs_textindex_unlink(be->text);
+    }
+
     /* TODO remove TList support or cleaner impl. here */
     gchar *command_format = g_strconcat("rm -f ",
 					fs_get_tlist_all_format(),
@@ -752,15 +1122,22 @@ int fs_backend_close_files(fs_backend *be, fs_segment seg)
 	be->pending_insert = NULL;
     }
     for (int i=0; i<be->ptree_length; i++) {
-        if (be->ptrees_priv[i].ptree_s)
-	    fs_ptree_close(be->ptrees_priv[i].ptree_s);
-        if (be->ptrees_priv[i].ptree_o)
-	    fs_ptree_close(be->ptrees_priv[i].ptree_o);
+	ptree_ref_close(be, i);
 	be->ptrees_priv[i].pred = 0LL;
-	be->ptrees_priv[i].ptree_s = NULL;
-	be->ptrees_priv[i].ptree_o = NULL;
     }
-    be->ptree_open_count = 0;
+    if (be->shared_ptree_s) {
+	fs_ptree_close(be->shared_ptree_s);
+	be->shared_ptree_s = NULL;
+    }
+    if (be->shared_ptree_o) {
+	fs_ptree_close(be->shared_ptree_o);
+	be->shared_ptree_o = NULL;
+    }
+    ptree_flush_hits(be);
+    if (be->ptree_stats) {
+	munmap(be->ptree_stats, sizeof(struct ptree_stats_file));
+	be->ptree_stats = NULL;
+    }
     free(be->ptrees_priv);
     be->ptrees_priv = NULL;
     be->ptree_length = 0;
@@ -771,6 +1148,8 @@ int fs_backend_close_files(fs_backend *be, fs_segment seg)
     be->predicates = NULL;
     g_hash_table_destroy(be->rid_id_map);
     be->rid_id_map = NULL;
+    fs_textindex_close(be->text);
+    be->text = NULL;
     be->segment = -1;
 
     return 0;
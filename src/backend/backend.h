@@ -44,6 +44,18 @@ int fs_backend_close_files(fs_backend *be, fs_segment seg);
 int fs_backend_cleanup_files(fs_backend *be);
 struct _fs_ptree *fs_backend_get_ptree(fs_backend *be, fs_rid pred, int object);
 
+/* counts from the open ptree cache, summed over every backend process that
+ * has used the segment */
+typedef struct {
+    long long hits;      /* lookups of a ptree that was already open */
+    long long opens;     /* first opens of a predicate's ptrees */
+    long long reopens;   /* opens of ptrees that had been evicted */
+    long long evictions;
+    long long busy;      /* evictions passed over because a tree was in use */
+} fs_ptree_stats;
+
+int fs_backend_ptree_stats(const char *kb_name, fs_segment seg, fs_ptree_stats *stats);
+
 void fs_bnode_alloc(fs_backend *be, int count, fs_rid *from, fs_rid *to);
 
 int fs_segments(fs_backend *be, int *segments);
@@ -56,6 +68,20 @@ int fs_start_import(fs_backend *be, int seg);
 int fs_stop_import(fs_backend *be, int seg);
 int fs_backend_transaction(fs_backend *be, fs_segment seg, int op);
 
+/* write generation, bumped after every change to data on this node */
+int fs_backend_get_generation(fs_backend *be, unsigned long long *generation);
+void fs_backend_bump_generation(fs_backend *be);
+
+/* one process at a time changes a segment's indexes, from its first change
+ * until it publishes, returns non-zero if the lock wasn't taken */
+int fs_backend_write_lock(fs_backend *be, int block);
+void fs_backend_write_unlock(fs_backend *be);
+
+/* make the index changes written so far visible to readers in other
+ * processes, bump the generation and release the writer lock, returns
+ * non-zero if old index nodes couldn't be reclaimed */
+int fs_backend_publish(fs_backend *be);
+
 int fs_backend_is_transaction_open_intl(fs_backend *be, char *file, int line);
 #define fs_backend_is_transaction_open(be) fs_backend_is_transaction_open_intl(be, __FILE__, __LINE__)
 
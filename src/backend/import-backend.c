@@ -39,6 +39,7 @@
 #include "import-backend.h"
 #include "query-backend.h"
 #include "lock.h"
+#include "sort.h"
 
 #define RES_BUF_SIZE  10240
 #define QUAD_BUF_SIZE 10240
@@ -244,10 +245,28 @@ int fs_quad_import_commit(fs_backend *be, int seg, int flags, int account)
 	return 3;
     }
 
+    if (fs_backend_write_lock(be, 1)) {
+	fs_error(LOG_ERR, "failed to take index writer lock");
+
+	return 4;
+    }
+
     double then = fs_time();
 
     TIME(NULL);
 
+    if (be->replay_again) {
+	/* the subject index is written first, so a quad that's there made it
+	 * in last time */
+	for (int i=0; i<quad_pos; i++) {
+	    fs_ptree *pt = fs_backend_get_ptree(be, quad_buffer[i].quad[2], 0);
+	    fs_rid pair[2] = { quad_buffer[i].quad[0], quad_buffer[i].quad[3] };
+	    if (pt && fs_ptree_pair_exists(pt, quad_buffer[i].quad[1], pair)) {
+		quad_buffer[i].skip = 1;
+	    }
+	}
+    }
+
     if (be->pended_import) {
 	for (int i=0; i<quad_pos; i++) {
 	    if (quad_buffer[i].skip) continue;
@@ -380,26 +399,26 @@ int fs_quad_import_commit(fs_backend *be, int seg, int flags, int account)
     return 0;
 }
 
-int fs_delete_quads(fs_backend *be, fs_rid_vector *quads[4])
+/* removes quads from the s and o ptrees in one pass, quads is reordered so
+ * that each predicate's ptrees are fetched once and searched in key order,
+ * if known is set the quads came from a model list and must be present */
+static int remove_quads(fs_backend *be, fs_rid (*quads)[4], long count,
+			fs_rid_set *models, int known)
 {
     int errors = 0;
-    fs_rid_set *preds = fs_rid_set_new();
-    for (int i=0; i<quads[2]->length; i++) {
-	fs_rid_set_add(preds, quads[2]->data[i]);
-    }
-    fs_rid_set *models = fs_rid_set_new();
-    for (int i=0; i<quads[0]->length; i++) {
-	if (quads[0]->data[i] != FS_RID_NULL) {
-	    fs_rid_set_add(models, quads[0]->data[i]);
-	}
-    }
-    fs_rid pred;
-    fs_rid_set_rewind(preds);
-    while ((pred = fs_rid_set_next(preds)) != FS_RID_NULL) {
+
+    qsort(quads, count, sizeof(fs_rid) * 4, quad_sort_by_psmo);
+    for (long start = 0, end; start < count; start = end) {
+	const fs_rid pred = quads[start][2];
+	for (end = start + 1; end < count && quads[end][2] == pred; end++);
+
 	fs_ptree *sfp = fs_backend_get_ptree(be, pred, 0);
 	fs_ptree *ofp = fs_backend_get_ptree(be, pred, 1);
 	if (!sfp && !ofp) {
-	    /* this predicate doesn't exist in this segment */
+	    if (known) {
+		fs_error(LOG_CRIT, "failed to get ptrees for pred %016llx", pred);
+	    }
+	    /* otherwise this predicate doesn't exist in this segment */
 	    continue;
 	}
 	if (!sfp) {
@@ -411,16 +430,50 @@ int fs_delete_quads(fs_backend *be, fs_rid_vector *quads[4])
 	    continue;
 	}
 
-	for (int i=0; i<quads[2]->length; i++) {
-	    if (quads[2]->data[i] == pred) {
-		fs_rid spair[2] = { quads[0]->data[i], quads[3]->data[i] };
-		fs_ptree_remove(sfp, quads[1]->data[i], spair, models);
-		fs_rid opair[2] = { quads[0]->data[i], quads[1]->data[i] };
-		fs_ptree_remove(ofp, quads[3]->data[i], opair, models);
+	for (long i=start; i<end; i++) {
+	    fs_rid *q = quads[i];
+	    fs_rid spair[2] = { q[0], q[3] };
+	    if (fs_ptree_remove(sfp, q[1], spair, models) && known) {
+		fs_error(LOG_ERR, "failed to remove known quad %016llx %016llx %016llx %016llx from s index", q[0], q[1], q[2], q[3]);
+		errors++;
+	    }
+	}
+	qsort(quads + start, end - start, sizeof(fs_rid) * 4, quad_sort_by_poms);
+	for (long i=start; i<end; i++) {
+	    fs_rid *q = quads[i];
+	    fs_rid opair[2] = { q[0], q[1] };
+	    if (fs_ptree_remove(ofp, q[3], opair, models) && known) {
+		fs_error(LOG_ERR, "failed to remove known quad %016llx %016llx %016llx %016llx from o index", q[0], q[1], q[2], q[3]);
+		errors++;
 	    }
 	}
     }
-    fs_rid_set_free(preds);
+
+    return errors;
+}
+
+int fs_delete_quads(fs_backend *be, fs_rid_vector *quads[4])
+{
+    if (fs_backend_write_lock(be, 1)) {
+	fs_error(LOG_ERR, "failed to take index writer lock");
+
+	return 1;
+    }
+    const long count = quads[2]->length;
+    fs_rid (*buffer)[4] = malloc(sizeof(fs_rid) * 4 * (count ? count : 1));
+    fs_rid_set *models = fs_rid_set_new();
+    for (long i=0; i<count; i++) {
+	for (int j=0; j<4; j++) {
+	    buffer[i][j] = quads[j]->data[i];
+	}
+	if (buffer[i][0] != FS_RID_NULL) {
+	    fs_rid_set_add(models, buffer[i][0]);
+	}
+    }
+    /* quads aren't known to exist, so failures aren't errors */
+    remove_quads(be, buffer, count, models, 0);
+    free(buffer);
+
     fs_rid model;
     fs_rid_set_rewind(models);
     while ((model = fs_rid_set_next(models)) != FS_RID_NULL) {
@@ -432,56 +485,33 @@ int fs_delete_quads(fs_backend *be, fs_rid_vector *quads[4])
     }
     fs_rid_set_free(models);
 
-    return errors;
+    return 0;
 }
 
 static int remove_by_search(fs_backend *be, fs_rid model, fs_index_node model_id)
 {
     int errors = 0;
+    long count = 0;
+    long size = fs_tbchain_length(be->model_list, model_id) + 1;
+    fs_rid (*quads)[4] = malloc(sizeof(fs_rid) * 4 * size);
+
     fs_tbchain_it *it = fs_tbchain_new_iterator(be->model_list, model, model_id);
     fs_rid triple[3];
-    fs_rid_set *preds = fs_rid_set_new();
     while (fs_tbchain_it_next(it, triple)) {
-	fs_rid_set_add(preds, triple[1]);
+	if (count == size) {
+	    size *= 2;
+	    quads = realloc(quads, sizeof(fs_rid) * 4 * size);
+	}
+	quads[count][0] = model;
+	quads[count][1] = triple[0];
+	quads[count][2] = triple[1];
+	quads[count][3] = triple[2];
+	count++;
     }
     fs_tbchain_it_free(it);
-    fs_rid pred;
-    fs_rid_set_rewind(preds);
-    while ((pred = fs_rid_set_next(preds)) != FS_RID_NULL) {
-	fs_ptree *sfp = fs_backend_get_ptree(be, pred, 0);
-	fs_ptree *ofp = fs_backend_get_ptree(be, pred, 1);
-	if (!sfp && !ofp) {
-	    fs_error(LOG_CRIT, "failed to get ptrees for pred %016llx", pred);
-	    continue;
-	}
-	if (!sfp) {
-	    fs_error(LOG_CRIT, "failed to get s ptree for pred %016llx", pred);
-	    continue;
-	}
-	if (!ofp) {
-	    fs_error(LOG_CRIT, "failed to get o ptree for pred %016llx", pred);
-	    continue;
-	}
 
-	fs_tbchain_it *it =
-	    fs_tbchain_new_iterator(be->model_list, model, model_id);
-	fs_rid triple[3];
-	while (fs_tbchain_it_next(it, triple)) {
-	    if (triple[1] == pred) {
-		fs_rid spair[2] = { model, triple[2] };
-		if (fs_ptree_remove(sfp, triple[0], spair, NULL)) {
-		    fs_error(LOG_ERR, "failed to remove known quad %016llx %016llx %016llx %016llx from s index", model, triple[0], triple[1], triple[2]);
-		    errors++;
-		}
-		fs_rid opair[2] = { model, triple[0] };
-		if (fs_ptree_remove(ofp, triple[2], opair, NULL)) {
-		    fs_error(LOG_ERR, "failed to remove known quad %016llx %016llx %016llx %016llx from o index", model, triple[0], triple[1], triple[2]);
-		    errors++;
-		}
-	    }
-	}
-    }
-    fs_rid_set_free(preds);
+    errors += remove_quads(be, quads, count, NULL, 1);
+    free(quads);
     errors += fs_tbchain_remove_chain(be->model_list, model_id);
 
     return errors;
@@ -489,6 +519,11 @@ static int remove_by_search(fs_backend *be, fs_rid model, fs_index_node model_id
 
 int fs_delete_models(fs_backend *be, int seg, fs_rid_vector *mvec)
 {
+    if (fs_backend_write_lock(be, 1)) {
+        fs_error(LOG_ERR, "failed to take index writer lock");
+
+        return 1;
+    }
     double then = fs_time();
     int errs = 0;
 
@@ -30,7 +30,7 @@
 #include "../common/error.h"
 #include "../common/4s-store-root.h"
 
-int fs_lock_kb(const char *kb)
+static int lock_kb(const char *kb, int op)
 {
     char *fn = g_strdup_printf(fs_get_md_file_format(), kb);
     int fd = open(fn, FS_O_NOATIME | O_RDONLY | O_CREAT, 0600);
@@ -41,7 +41,7 @@ int fs_lock_kb(const char *kb)
         return 1;
     }
     g_free(fn);
-    if (flock(fd, LOCK_EX | LOCK_NB) == -1) {
+    if (flock(fd, op | LOCK_NB) == -1) {
         if (errno == EWOULDBLOCK) {
 	    fs_error(LOG_ERR, "cannot get lock for kb “%s”", kb);
 
@@ -53,7 +53,18 @@ int fs_lock_kb(const char *kb)
     }
 
     return 0;
-}           
+}
+
+int fs_lock_kb(const char *kb)
+{
+    return lock_kb(kb, LOCK_EX);
+}
+
+/* excludes a running backend, but not other readers */
+int fs_lock_kb_shared(const char *kb)
+{
+    return lock_kb(kb, LOCK_SH);
+}
 
 int fs_lock(fs_backend *be, const char *name, fs_lock_action action, int block)
 {
@@ -15,6 +15,7 @@ int fs_lock(fs_backend *be, const char *name, fs_lock_action action, int block);
 int fs_lock_taken(fs_backend *be, const char *name);
 
 int fs_lock_kb(const char *kb);
+int fs_lock_kb_shared(const char *kb);
 
 int fs_flock_logged(int fd, int op, const char *file, int line);
 
@@ -20,6 +20,9 @@
 #define FS_MD_MODEL_FILES		FS_MD_PREFIX "model_files"
 #define FS_MD_CODE_VERSION		FS_MD_PREFIX "code_version"
 #define FS_MD_UUID			FS_MD_PREFIX "uuid"
+#define FS_MD_PTREE_MAX_OPEN		FS_MD_PREFIX "ptree_max_open"
+#define FS_MD_PTREE_MAX_MAPPED		FS_MD_PREFIX "ptree_max_mapped"
+#define FS_MD_SHARED_PTREES		FS_MD_PREFIX "shared_ptrees"
 
 #define FS_MD_PKSALT			FS_MD_PREFIX "pksalt"
 #define FS_MD_PWSALT			FS_MD_PREFIX "pwsalt"
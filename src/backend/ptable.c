@@ -19,6 +19,7 @@
  */
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
@@ -26,6 +27,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/file.h>
 
 #include "../common/timing.h"
 
@@ -44,7 +46,9 @@ struct ptable_header {
     int32_t length;
     int32_t free_list;
     int32_t revision;
-    char padding[492];
+    int32_t limbo;      /* rows freed while readers might still see them */
+    uint32_t epoch;     /* bumped each time the backend publishes */
+    char padding[484];
 };
 
 typedef struct _row {
@@ -52,6 +56,16 @@ typedef struct _row {
     fs_rid data[2];
 } row;
 
+/* a limbo row holds the IDs of up to three rows freed in one epoch in its
+ * data, and the epoch in the fourth slot */
+#define LIMBO_SLOTS 3
+#define LIMBO_EPOCH 3
+
+/* a pinned reader holds a read lock on byte epoch % EPOCH_SLOTS of the
+ * header padding, the writer doesn't let the epoch get so far ahead of a
+ * reader that two live epochs share a byte */
+#define EPOCH_SLOTS 32
+
 struct _fs_ptable {
   struct ptable_header *header;
   char *filename;
@@ -61,6 +75,10 @@ struct _fs_ptable {
   int flags;		/* flags used in open call */
   row *data;    	/* array of used rows, points into mmap'd space */
   fs_row_id *cons_data;
+  int pins;		/* iterators in this process reading a snapshot */
+  uint32_t pin_epoch;	/* epoch they were pinned in */
+  fs_row_id watermark;	/* rows from here on are unpublished */
+  GHashTable *recycled;	/* unpublished rows taken from the free list */
 };
 
 static char *fname_from_label(fs_backend *be, const char *label)
@@ -120,6 +138,97 @@ static int map_pt(fs_ptable *pt, long length, long size)
     return 0;
 }
 
+/* another process has grown the table, only our mapping needs to change */
+static int remap_pt(fs_ptable *pt)
+{
+    const size_t len = sizeof(struct ptable_header) + pt->header->size * sizeof(row);
+
+    if (munmap(pt->ptr, pt->len)) {
+        fs_error(LOG_ERR, "failed to unmap ptable %s", pt->filename);
+    }
+    int mflags = PROT_READ;
+    if (pt->flags & (O_RDWR | O_WRONLY)) mflags |= PROT_WRITE;
+    pt->ptr = mmap(NULL, len, mflags, MAP_FILE | MAP_SHARED, pt->fd, 0);
+    if (pt->ptr == MAP_FAILED || pt->ptr == NULL) {
+        fs_error(LOG_CRIT, "failed to mmap: %s", strerror(errno));
+        pt->ptr = NULL;
+        pt->header = NULL;
+        pt->data = NULL;
+
+        return 1;
+    }
+    pt->len = len;
+    pt->header = (struct ptable_header *)(pt->ptr);
+    pt->data = (row *)(pt->header + 1);
+
+    return 0;
+}
+
+/* make sure row b is inside our mapping */
+static inline int mapped(fs_ptable *pt, fs_row_id b)
+{
+    if (sizeof(struct ptable_header) + (b + 1) * sizeof(row) <= pt->len) {
+        return 1;
+    }
+
+    return remap_pt(pt) == 0 &&
+           sizeof(struct ptable_header) + (b + 1) * sizeof(row) <= pt->len;
+}
+
+static int is_fresh(fs_ptable *pt, fs_row_id b)
+{
+    return b >= pt->watermark ||
+           (pt->recycled && g_hash_table_lookup(pt->recycled, GUINT_TO_POINTER(b)));
+}
+
+static void push_free(fs_ptable *pt, fs_row_id b)
+{
+    pt->data[b].cont = pt->header->free_list;
+    pt->header->free_list = b;
+}
+
+static fs_row_id limbo_slot(row *r, int i)
+{
+    return (r->data[i >> 1] >> ((i & 1) * 32)) & 0xffffffffU;
+}
+
+static void set_limbo_slot(row *r, int i, fs_row_id b)
+{
+    const int shift = (i & 1) * 32;
+    r->data[i >> 1] = (r->data[i >> 1] & ~(0xffffffffULL << shift)) |
+                      ((fs_rid)b << shift);
+}
+
+static int epoch_before(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
+/* the list is newest first, and a row is only shared by rows freed in the
+ * same epoch, so reclaim can cut it at the first one that's old enough */
+static void limbo_add(fs_ptable *pt, fs_row_id b)
+{
+    const uint32_t epoch = pt->header->epoch;
+    fs_row_id l = pt->header->limbo;
+    if (l && limbo_slot(&pt->data[l], LIMBO_EPOCH) == epoch) {
+        row *r = &pt->data[l];
+        for (int i=0; i<LIMBO_SLOTS; i++) {
+            if (!limbo_slot(r, i)) {
+                set_limbo_slot(r, i, b);
+
+                return;
+            }
+        }
+    }
+
+    fs_row_id n = fs_ptable_new_row(pt);
+    if (!n) return;
+    pt->data[n].cont = l;
+    set_limbo_slot(&pt->data[n], 0, b);
+    set_limbo_slot(&pt->data[n], LIMBO_EPOCH, epoch);
+    pt->header->limbo = n;
+}
+
 fs_ptable *fs_ptable_open(fs_backend *be, const char *label, int flags)
 {
     char *fname = fname_from_label(be, label);
@@ -188,6 +297,8 @@ fs_ptable *fs_ptable_open_filename(const char *fname, int flags)
     if (munmap(header, sizeof(*header)))
         fs_error(LOG_ERR, "could not unmap %s: %s", pt->filename, strerror(errno));
 
+    pt->watermark = pt->header->length;
+
     return pt;
 }
 
@@ -208,6 +319,7 @@ void fs_ptable_print(fs_ptable *pt, FILE *out, int verbosity)
     fprintf(out, "  image:      %p - %p\n", pt->ptr, pt->ptr + pt->len);
     fprintf(out, "  length:     %d rows\n", pt->header->length);
     fprintf(out, "  freed:      %d rows\n", fs_ptable_free_length(pt));
+    fprintf(out, "  limbo:      %d rows\n", fs_ptable_limbo_length(pt));
     if (verbosity > 0) {
         for (int i=1; i<pt->header->length; i++) {
             fprintf(out, " %cR%08d", i == pt->header->free_list ? 'F' : ' ', i);
@@ -241,6 +353,13 @@ int fs_ptable_check_consistency(fs_ptable *pt, FILE *out, fs_row_id src, fs_row_
         for (fs_row_id f = pt->header->free_list; f; f=pt->data[f].cont) {
             pt->cons_data[f] = free_magic;
         }
+        for (fs_row_id l = pt->header->limbo; l; l=pt->data[l].cont) {
+            pt->cons_data[l] = free_magic;
+            for (int i=0; i<LIMBO_SLOTS; i++) {
+                fs_row_id f = limbo_slot(&pt->data[l], i);
+                if (f) pt->cons_data[f] = free_magic;
+            }
+        }
     }
 
     int len = 0;
@@ -290,6 +409,10 @@ fs_row_id fs_ptable_new_row(fs_ptable *pt)
     if (pt->header->length == 0) {
         pt->header->length = 1;
     }
+    if (!mapped(pt, pt->header->size - 1)) {
+        fs_error(LOG_CRIT, "failed to map ptable %s", pt->filename);
+        return 0;
+    }
 
     /* we can reuse a free'd row */
     if (pt->header->free_list) {
@@ -299,6 +422,10 @@ fs_row_id fs_ptable_new_row(fs_ptable *pt)
         r->cont = 0;
         r->data[0] = 0;
         r->data[1] = 0;
+        if (!pt->recycled) {
+            pt->recycled = g_hash_table_new(NULL, NULL);
+        }
+        g_hash_table_insert(pt->recycled, GUINT_TO_POINTER(newr), GUINT_TO_POINTER(newr));
 
         return newr;
     }
@@ -335,6 +462,11 @@ int fs_ptable_remove_chain(fs_ptable *pt, fs_row_id b)
 
         return 1;
     }
+    if (!mapped(pt, pt->header->length - 1)) {
+        fs_error(LOG_CRIT, "failed to map ptable %s", pt->filename);
+
+        return 1;
+    }
     do {
         fs_row_id next = pt->data[b].cont;
         fs_ptable_free_row(pt, b);
@@ -383,7 +515,7 @@ int fs_ptable_get_row(fs_ptable *pt, fs_row_id b, fs_rid pair[2])
 
         return 1;
     }
-    if (b > pt->header->length) {
+    if (b > pt->header->length || !mapped(pt, b)) {
         fs_error(LOG_CRIT, "tried to read off end of ptable %s (%d > %d / %d)\n", pt->filename, b, pt->header->length, pt->header->size);
         return 1;
     }
@@ -408,19 +540,52 @@ int fs_ptable_pair_exists(fs_ptable *pt, fs_row_id b, fs_rid pair[2])
         return 0;
     }
 
-    row *r = &(pt->data[b]);
-    while (b != 0) {
+    while (b != 0 && mapped(pt, b)) {
+        row *r = &(pt->data[b]);
         if (r->data[0] == pair[0] && r->data[1] == pair[1]) {
             return 1;
         }
         b = r->cont;
-        r = &(pt->data[b]);
     }
 
     return 0;
 }
 
-/* we add models to the models set, if the matching RID is set to a wildcard */
+static void link_row(fs_ptable *pt, fs_row_id tail, fs_row_id *head, fs_row_id b)
+{
+    if (tail) {
+        pt->data[tail].cont = b;
+    } else {
+        *head = b;
+    }
+}
+
+/* copy the rows from..to (exclusive) onto the end of tail, returns the new
+ * tail */
+static fs_row_id copy_rows(fs_ptable *pt, fs_row_id tail, fs_row_id *head,
+                           fs_row_id from, fs_row_id to)
+{
+    for (fs_row_id c = from; c != to; ) {
+        fs_row_id n = fs_ptable_new_row(pt);
+        if (!n) break;
+        row *src = &(pt->data[c]);
+        fs_row_id next = src->cont;
+        pt->data[n].data[0] = src->data[0];
+        pt->data[n].data[1] = src->data[1];
+        link_row(pt, tail, head, n);
+        fs_ptable_free_row(pt, c);
+        tail = n;
+        c = next;
+    }
+
+    return tail;
+}
+
+/* we add models to the models set, if the matching RID is set to a wildcard
+ *
+ * rows that might be visible to readers are never changed, instead the part
+ * of the chain in front of a removed row is copied, and the new head is
+ * returned */
 fs_row_id fs_ptable_remove_pair(fs_ptable *pt, fs_row_id b, fs_rid pair[2], int *removed, fs_rid_set *models)
 {
     fs_row_id ret = b;
@@ -430,7 +595,7 @@ fs_row_id fs_ptable_remove_pair(fs_ptable *pt, fs_row_id b, fs_rid pair[2], int
 
         return ret;
     }
-    if (b > pt->header->length) {
+    if (b > pt->header->length || !mapped(pt, pt->header->length - 1)) {
         fs_error(LOG_CRIT, "tried to read off end of ptable %s (%d > %d)", pt->filename, b, pt->header->length);
 
         return ret;
@@ -454,52 +619,39 @@ fs_row_id fs_ptable_remove_pair(fs_ptable *pt, fs_row_id b, fs_rid pair[2], int
         return 0;
     }
 
-    row *prevr = NULL;
+    fs_row_id tail = 0;     /* last kept row we may change, 0 for the head */
+    fs_row_id shared = 0;   /* first kept row after tail that we may not */
     while (b != 0) {
         row *r = &(pt->data[b]);
         fs_row_id nextb = r->cont;
+        int match = 0;
         if (pair[0] != FS_RID_NULL && pair[1] == FS_RID_NULL) {
-            if (r->data[0] == pair[0]) {
-                if (prevr) {
-                    prevr->cont = nextb;
-                } else {
-                    ret = nextb;
-                }
-                fs_ptable_free_row(pt, b);
-                (*removed)++;
-            } else {
-                prevr = r;
-            }
+            match = r->data[0] == pair[0];
         } else if (pair[0] == FS_RID_NULL && pair[1] != FS_RID_NULL) {
-            if (r->data[1] == pair[1]) {
-                if (models) {
-                    fs_rid_set_add(models, r->data[0]);
-                }
-                if (prevr) {
-                    prevr->cont = nextb;
-                } else {
-                    ret = nextb;
-                }
-                fs_ptable_free_row(pt, b);
-                (*removed)++;
-            } else {
-                prevr = r;
+            match = r->data[1] == pair[1];
+            if (match && models) {
+                fs_rid_set_add(models, r->data[0]);
             }
         } else if (pair[0] != FS_RID_NULL && pair[1] != FS_RID_NULL) {
-            if (r->data[0] == pair[0] && r->data[1] == pair[1]) {
-                if (prevr) {
-                    prevr->cont = nextb;
-                } else {
-                    ret = nextb;
-                }
-                fs_ptable_free_row(pt, b);
-                (*removed)++;
-            } else {
-                prevr = r;
-            }
+            match = r->data[0] == pair[0] && r->data[1] == pair[1];
         } else {
             fs_error(LOG_CRIT, "trying to remove with unsupported pattern");
         }
+        if (match) {
+            if (shared) {
+                tail = copy_rows(pt, tail, &ret, shared, b);
+                shared = 0;
+            }
+            link_row(pt, tail, &ret, nextb);
+            fs_ptable_free_row(pt, b);
+            (*removed)++;
+        } else if (!shared) {
+            if (is_fresh(pt, b)) {
+                tail = b;
+            } else {
+                shared = b;
+            }
+        }
         b = nextb;
     }
 
@@ -508,7 +660,7 @@ fs_row_id fs_ptable_remove_pair(fs_ptable *pt, fs_row_id b, fs_rid pair[2], int
 
 fs_row_id fs_ptable_get_next(fs_ptable *pt, fs_row_id r)
 {
-    if (r > pt->header->length) {
+    if (r > pt->header->length || !mapped(pt, r)) {
         fs_error(LOG_CRIT, "tried to read off end of ptable %s", pt->filename);
 
         return 0;
@@ -525,13 +677,163 @@ int fs_ptable_free_row(fs_ptable *pt, fs_row_id b)
         return 1;
     }
 
-    row *r = &(pt->data[b]);
-    r->cont = pt->header->free_list;
-    pt->header->free_list = b;
+    if (is_fresh(pt, b)) {
+        push_free(pt, b);
+    } else {
+        /* a reader could be part way along this row's chain */
+        limbo_add(pt, b);
+    }
 
     return 0;
 }
 
+static int epoch_lock(fs_ptable *pt, uint32_t epoch, short type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = offsetof(struct ptable_header, padding) + epoch % EPOCH_SLOTS;
+    fl.l_len = 1;
+
+    return fcntl(pt->fd, F_SETLKW, &fl);
+}
+
+/* returns true if a reader, in this process or another, could be pinned in
+ * epoch */
+static int epoch_pinned(fs_ptable *pt, uint32_t epoch)
+{
+    if (pt->pins && pt->pin_epoch % EPOCH_SLOTS == epoch % EPOCH_SLOTS) {
+        return 1;
+    }
+
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = offsetof(struct ptable_header, padding) + epoch % EPOCH_SLOTS;
+    fl.l_len = 1;
+    if (fcntl(pt->fd, F_GETLK, &fl) == -1) {
+        return 1;
+    }
+
+    return fl.l_type != F_UNLCK;
+}
+
+int fs_ptable_pin(fs_ptable *pt)
+{
+    if (pt->pins++ > 0) return 0;
+
+    /* the writer may move on between reading the epoch and locking it, in
+     * which case the lock doesn't protect anything and we try again */
+    for (;;) {
+        const uint32_t epoch = *(volatile uint32_t *)&pt->header->epoch;
+        if (epoch_lock(pt, epoch, F_RDLCK) == -1) {
+            fs_error(LOG_ERR, "failed to lock %s: %s", pt->filename, strerror(errno));
+
+            return 1;
+        }
+        if (*(volatile uint32_t *)&pt->header->epoch == epoch) {
+            pt->pin_epoch = epoch;
+
+            return 0;
+        }
+        epoch_lock(pt, epoch, F_UNLCK);
+    }
+}
+
+void fs_ptable_unpin(fs_ptable *pt)
+{
+    if (pt->pins > 0 && --pt->pins == 0) {
+        epoch_lock(pt, pt->pin_epoch, F_UNLCK);
+    }
+}
+
+uint32_t fs_ptable_epoch(fs_ptable *pt)
+{
+    return pt->header->epoch;
+}
+
+int fs_ptable_advance_epoch(fs_ptable *pt)
+{
+    const uint32_t next = pt->header->epoch + 1;
+
+    /* a reader EPOCH_SLOTS epochs behind would share the new epoch's lock */
+    if (epoch_pinned(pt, next)) return 1;
+
+    __sync_synchronize();
+    pt->header->epoch = next;
+    __sync_synchronize();
+
+    return 0;
+}
+
+uint32_t fs_ptable_oldest_pin(fs_ptable *pt)
+{
+    const uint32_t epoch = pt->header->epoch;
+
+    for (uint32_t e = epoch - (EPOCH_SLOTS - 1); e != epoch; e++) {
+        if (epoch_pinned(pt, e)) return e;
+    }
+
+    return epoch;
+}
+
+void fs_ptable_publish(fs_ptable *pt)
+{
+    pt->watermark = pt->header->length;
+    if (pt->recycled) {
+        g_hash_table_remove_all(pt->recycled);
+    }
+}
+
+int fs_ptable_reclaim(fs_ptable *pt, uint32_t before)
+{
+    int count = 0;
+    fs_row_id keep = 0;
+    fs_row_id l = pt->header->limbo;
+
+    while (l && !epoch_before(limbo_slot(&pt->data[l], LIMBO_EPOCH), before)) {
+        keep = l;
+        l = pt->data[l].cont;
+    }
+    if (keep) {
+        pt->data[keep].cont = 0;
+    } else {
+        pt->header->limbo = 0;
+    }
+
+    while (l) {
+        row *r = &(pt->data[l]);
+        fs_row_id next = r->cont;
+        for (int i=0; i<LIMBO_SLOTS; i++) {
+            fs_row_id b = limbo_slot(r, i);
+            if (b) {
+                push_free(pt, b);
+                count++;
+            }
+        }
+        push_free(pt, l);
+        l = next;
+    }
+
+    return count;
+}
+
+uint32_t fs_ptable_limbo_length(fs_ptable *pt)
+{
+    uint32_t ret = 0;
+
+    for (fs_row_id l = pt->header->limbo; l; l = pt->data[l].cont) {
+        for (int i=0; i<LIMBO_SLOTS; i++) {
+            if (limbo_slot(&pt->data[l], i)) ret++;
+        }
+    }
+
+    return ret;
+}
+
 unsigned int fs_ptable_chain_length(fs_ptable *pt, fs_row_id b, unsigned int max)
 {
     if (b == 0) {
@@ -545,6 +847,10 @@ unsigned int fs_ptable_chain_length(fs_ptable *pt, fs_row_id b, unsigned int max
         return 0;
     }
 
+    if (!mapped(pt, pt->header->length - 1)) {
+        return 0;
+    }
+
     int length = 1;
     row *r = &(pt->data[b]);
     if (max) {
@@ -593,6 +899,9 @@ int fs_ptable_close(fs_ptable *pt)
 
     unmap_pt(pt);
     close(pt->fd);
+    if (pt->recycled) {
+        g_hash_table_destroy(pt->recycled);
+    }
     g_free(pt->filename);
     pt->filename = NULL;
     pt->fd = -1;
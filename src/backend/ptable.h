@@ -40,9 +40,36 @@ int fs_ptable_pair_exists(fs_ptable *pt, fs_row_id b, fs_rid pair[2]);
 fs_row_id fs_ptable_remove_pair(fs_ptable *pt, fs_row_id b, fs_rid pair[2], int *removed, fs_rid_set *models);
 
 /* move a row onto the free list - caller is responsible for cleaning up the
- * links */
+ * links. Rows that were published are held in limbo, tagged with the
+ * current epoch, until fs_ptable_reclaim(), as readers may still be
+ * following them */
 int fs_ptable_free_row(fs_ptable *pt, fs_row_id b);
 
+/* readers pin the table for as long as they hold a snapshot of a chain,
+ * each pin belongs to the epoch it was taken in */
+int fs_ptable_pin(fs_ptable *pt);
+void fs_ptable_unpin(fs_ptable *pt);
+
+/* the epoch that rows and nodes freed now belong to */
+uint32_t fs_ptable_epoch(fs_ptable *pt);
+
+/* start a new epoch, once everything freed in the current one is
+ * unreachable from the published roots. Returns non 0 if a long running
+ * reader stops the epoch moving on for now */
+int fs_ptable_advance_epoch(fs_ptable *pt);
+
+/* the oldest epoch that any process may have a pin in, anything freed
+ * before it can be reused */
+uint32_t fs_ptable_oldest_pin(fs_ptable *pt);
+
+/* rows written so far may now be visible to readers, so they will be copied
+ * rather than changed from here on */
+void fs_ptable_publish(fs_ptable *pt);
+
+/* move rows freed in epochs before the given one onto the free list,
+ * returns the number of rows reclaimed */
+int fs_ptable_reclaim(fs_ptable *pt, uint32_t before);
+
 /* return the length of a chain in rows, stop counting at max, unless max is 0 */
 unsigned int fs_ptable_chain_length(fs_ptable *pt, fs_row_id b, unsigned int max);
 
@@ -50,6 +77,8 @@ unsigned int fs_ptable_chain_length(fs_ptable *pt, fs_row_id b, unsigned int max
 fs_row_id fs_ptable_length(fs_ptable *pt);
 /* return the length of free list in rows */
 uint32_t fs_ptable_free_length(fs_ptable *pt);
+/* return the number of rows waiting in limbo */
+uint32_t fs_ptable_limbo_length(fs_ptable *pt);
 
 /* return the next row in the chain, or 0 is there is none */
 fs_row_id fs_ptable_get_next(fs_ptable *pt, fs_row_id r);
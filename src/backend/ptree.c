@@ -42,6 +42,7 @@
 #define FS_PTREE_SIZE_INC  32768
 #define FS_PTREE_NULL_NODE 0x80000000U
 #define FS_PTREE_ROOT_NODE 0x80000001U
+#define FS_PTREE_MOVED     0xffffffffU  /* predicate has its own file now */
 
 #define FS_PTREE_BRANCHES    4
 #define FS_PTREE_BRANCH_BITS 2  /* log2(FS_PTREE_BRANCHES) */
@@ -83,9 +84,34 @@ struct ptree_header {
     int64_t count;
     nodeid node_free;       // list of free nodes, linked by branch[0]
     nodeid leaf_free;       // list of free leaves, linked by block
-    char padding[448];      // allign to a block
+    nodeid root;            // last published root, 0 for FS_PTREE_ROOT_NODE
+    nodeid limbo;           // nodes and leaves freed while readers might
+                            // still see them, see limbo_add()
+    int32_t shared;         // keyed on (pred, pk), see fs_ptree_open_shared()
+    char padding[436];      // allign to a block
 } FS_PACKED;
 
+/* Writers never change a node or leaf that's reachable from the published
+ * root, they copy the path down to it and publish the new root when they
+ * are done, so readers can carry on using the root they started with. */
+
+/* allocation state when the writer took the lock, anything allocated past
+ * it is unpublished */
+struct write_mark {
+    uint32_t slots;
+    uint32_t node_base;
+    uint32_t node_size;
+    uint32_t leaf_base;
+    uint32_t leaf_size;
+};
+
+/* a mapping replaced while iterators still pointed into it */
+struct old_mapping {
+    void *ptr;
+    off_t length;
+    struct old_mapping *next;
+};
+
 struct _fs_ptree {
     int fd;
     char *filename;
@@ -96,6 +122,20 @@ struct _fs_ptree {
     node *nodes;
     leaf *leaves;
     fs_ptable *table;
+    nodeid root;            // root the writer is building
+    int writing;            // holds the write lock
+    int iterators;          // live iterators, the mapping must stay put
+    int map_users;          // iterators reading through this tree's mapping
+    struct old_mapping *old_maps; // kept until map_users drops to 0
+    struct write_mark mark;
+    GHashTable *recycled;   // unpublished nodes and leaves from the free lists
+    fs_ptree *shared;       // set if this is a view of one predicate in a
+                            // shared tree, which has no file of its own
+    fs_ptree *moved;        // the predicate's own tree, once it's moved out
+    fs_rid pred;
+    nodeid top;             // the shared tree's root while the writer works
+    nodeid pred_leaf;       // on the predicate's subtree, see view_write()
+    int64_t count_before;
 };
 
 typedef struct _tree_pos {
@@ -114,10 +154,17 @@ struct _fs_ptree_it {
     fs_rid pair[2];
     int traverse;
     tree_pos *stack;
+    fs_ptable *pinned;
+    int mapped;             // counted in pt->map_users
+    fs_ptree *owner;        // the tree or view the iterator was made from
 };
 
 int fs_ptree_grow_nodes(fs_ptree *pt);
 int fs_ptree_grow_leaves(fs_ptree *pt);
+nodeid fs_ptree_new_node(fs_ptree *pt);
+nodeid fs_ptree_new_leaf(fs_ptree *pt);
+void fs_ptree_free_node(fs_ptree *pt, nodeid n);
+void fs_ptree_free_leaf(fs_ptree *pt, nodeid n);
 
 fs_ptree *fs_ptree_open(fs_backend *be, fs_rid pred, char pk, int flags, fs_ptable *chain)
 {
@@ -129,6 +176,31 @@ fs_ptree *fs_ptree_open(fs_backend *be, fs_rid pred, char pk, int flags, fs_ptab
     return pt;
 }
 
+/* A shared tree holds the trees of many predicates in one file. Its top
+ * level is keyed on the predicate, and each predicate's leaf points at the
+ * root of a subtree keyed on pk, with the predicate's quad count as its
+ * length. Nodes, leaves and the free lists are shared, and the whole file is
+ * published at once. */
+
+fs_ptree *fs_ptree_open_shared(fs_backend *be, char pk, int flags, fs_ptable *chain)
+{
+    char *filename = g_strdup_printf(fs_get_shared_ptree_format(), fs_backend_get_kb(be),
+                                     fs_backend_get_segment(be), pk);
+    fs_ptree *pt = fs_ptree_open_filename(filename, flags, chain);
+    g_free(filename);
+    if (pt && !pt->header->shared) {
+        if (pt->header->count != 0) {
+            fs_error(LOG_ERR, "%s is not a shared ptree", pt->filename);
+            fs_ptree_close(pt);
+
+            return NULL;
+        }
+        pt->header->shared = 1;
+    }
+
+    return pt;
+}
+
 node *node_ref(fs_ptree *pt, nodeid n)
 {
     if (IS_LEAF(n)) {
@@ -157,6 +229,97 @@ static void map_file(fs_ptree *pt)
     pt->leaves = (leaf *)(pt->nodes);
 }
 
+/* iterators hold pointers into the mapping, so if any are live the old one
+ * is kept until the last of them is freed, like the epochs do for nodes
+ * freed while other processes might be reading them */
+static void unmap_file(fs_ptree *pt)
+{
+    if (pt->map_users) {
+        struct old_mapping *om = malloc(sizeof(struct old_mapping));
+        om->ptr = pt->ptr;
+        om->length = pt->file_length;
+        om->next = pt->old_maps;
+        pt->old_maps = om;
+
+        return;
+    }
+    if (munmap(pt->ptr, pt->file_length) == -1) {
+        fs_error(LOG_ERR, "failed to unmap '%s'", pt->filename);
+    }
+}
+
+static void free_old_maps(fs_ptree *pt)
+{
+    while (pt->old_maps) {
+        struct old_mapping *next = pt->old_maps->next;
+        if (munmap(pt->old_maps->ptr, pt->old_maps->length) == -1) {
+            fs_error(LOG_ERR, "failed to unmap old mapping of '%s'", pt->filename);
+        }
+        free(pt->old_maps);
+        pt->old_maps = next;
+    }
+}
+
+static void remap_file(fs_ptree *pt)
+{
+    off_t alloc = pt->header->alloc;
+    unmap_file(pt);
+    pt->file_length = sizeof(struct ptree_header) + alloc;
+    map_file(pt);
+}
+
+/* another process may have grown the file since we mapped it */
+static void check_mapping(fs_ptree *pt)
+{
+    if (sizeof(struct ptree_header) + pt->header->alloc > pt->file_length) {
+        remap_file(pt);
+    }
+}
+
+static nodeid header_root(fs_ptree *pt)
+{
+    nodeid root = *(volatile nodeid *)&pt->header->root;
+    /* don't read anything under the root before the root itself */
+    __sync_synchronize();
+
+    return root ? root : FS_PTREE_ROOT_NODE;
+}
+
+static int is_fresh(fs_ptree *pt, nodeid id)
+{
+    const uint32_t slot = id & 0x7fffffffU;
+    const struct write_mark *m = &pt->mark;
+
+    if (slot >= m->slots) return 1;
+    if (IS_NODE(id) && slot >= m->node_base && slot < m->node_size) return 1;
+    if (IS_LEAF(id) && slot >= m->leaf_base && slot < m->leaf_size) return 1;
+
+    return pt->recycled &&
+           g_hash_table_lookup(pt->recycled, GUINT_TO_POINTER(id)) != NULL;
+}
+
+static void begin_write(fs_ptree *pt)
+{
+    if (pt->writing) return;
+
+    flock(pt->fd, LOCK_EX);
+    check_mapping(pt);
+    if (pt->header->node_free == 0) {
+        pt->header->node_free = FS_PTREE_NULL_NODE;
+    }
+    if (pt->header->limbo == 0) {
+        pt->header->limbo = FS_PTREE_NULL_NODE;
+    }
+    pt->root = header_root(pt);
+    pt->mark.slots = pt->header->alloc / sizeof(node);
+    pt->mark.node_base = pt->header->node_base;
+    pt->mark.node_size = pt->header->node_size;
+    pt->mark.leaf_base = pt->header->leaf_base;
+    pt->mark.leaf_size = pt->header->leaf_size;
+    pt->writing = 1;
+    if (pt->table) fs_ptable_publish(pt->table);
+}
+
 fs_ptree *fs_ptree_open_filename(const char *filename, int flags, fs_ptable *chain)
 {
     if (sizeof(struct ptree_header) != 512) {
@@ -176,10 +339,18 @@ fs_ptree *fs_ptree_open_filename(const char *filename, int flags, fs_ptable *cha
     }
     pt->filename = g_strdup(filename);
 
+    /* the lock is only needed here to create the file, writers take it again
+     * in begin_write(), so don't wait for one unless the file is empty */
+    int locked = 0;
     if (flags & (O_WRONLY | O_RDWR)) {
-        flock(pt->fd, LOCK_EX);
+        locked = flock(pt->fd, LOCK_EX | LOCK_NB) == 0;
     }
     pt->file_length = lseek(pt->fd, 0, SEEK_END);
+    if (!locked && pt->file_length == 0 && (flags & (O_WRONLY | O_RDWR))) {
+        flock(pt->fd, LOCK_EX);
+        locked = 1;
+        pt->file_length = lseek(pt->fd, 0, SEEK_END);
+    }
     if ((flags & O_TRUNC) || pt->file_length == 0) {
         fs_ptree_write_header(pt);
     } else {
@@ -199,9 +370,10 @@ fs_ptree *fs_ptree_open_filename(const char *filename, int flags, fs_ptable *cha
 
     pt->table = chain;
 
-    if (pt->header->node_free == 0) {
-        pt->header->node_free = FS_PTREE_NULL_NODE;
+    if (locked) {
+        flock(pt->fd, LOCK_UN);
     }
+    pt->root = header_root(pt);
 
     return pt;
 }
@@ -260,7 +432,7 @@ int fs_ptree_grow_nodes(fs_ptree *pt)
     off_t alloc = pt->header->alloc;
     if (msync(pt->ptr, pt->file_length, MS_SYNC))
         fs_error(LOG_ERR, "msync failed, ptree might be inconsistent");
-    munmap(pt->ptr, pt->file_length);
+    unmap_file(pt);
     pt->file_length = sizeof(struct ptree_header) + alloc;
     if (pwrite(pt->fd, &junk, 1, pt->file_length) == -1) {
         fs_error(LOG_ERR, "failed to grow ptree file");
@@ -284,7 +456,7 @@ int fs_ptree_grow_leaves(fs_ptree *pt)
     off_t alloc = pt->header->alloc;
     if (msync(pt->ptr, pt->file_length, MS_SYNC))
         fs_error(LOG_ERR, "msync failed, ptree might be inconsistent");
-    munmap(pt->ptr, pt->file_length);
+    unmap_file(pt);
     pt->file_length = sizeof(struct ptree_header) + alloc;
     if (pwrite(pt->fd, &junk, 1, pt->file_length) == -1) {
         fs_error(LOG_ERR, "failed to grow ptree file");
@@ -295,6 +467,92 @@ int fs_ptree_grow_leaves(fs_ptree *pt)
     return 0;
 }
 
+static void push_free_node(fs_ptree *pt, nodeid n)
+{
+    node *nr = NODE_REF(pt, n);
+    nr->branch[0] = pt->header->node_free;
+    pt->header->node_free = n;
+}
+
+static void push_free_leaf(fs_ptree *pt, nodeid n)
+{
+    leaf *lr = LEAF_REF(pt, n);
+    lr->block = pt->header->leaf_free;
+    pt->header->leaf_free = n;
+}
+
+/* limbo is a list of nodes, linked by branch[0], newest first. branch[1]
+ * holds the epoch the IDs in the other branches were freed in, the freed
+ * ones are left untouched */
+#define LIMBO_EPOCH 1
+
+static uint32_t current_epoch(fs_ptree *pt)
+{
+    return pt->table ? fs_ptable_epoch(pt->table) : 0;
+}
+
+static void limbo_add(fs_ptree *pt, nodeid n)
+{
+    const uint32_t epoch = current_epoch(pt);
+    nodeid l = pt->header->limbo;
+    if (l != FS_PTREE_NULL_NODE && NODE_REF(pt, l)->branch[LIMBO_EPOCH] == epoch) {
+        node *lr = NODE_REF(pt, l);
+        for (int i=LIMBO_EPOCH+1; i<FS_PTREE_BRANCHES; i++) {
+            if (lr->branch[i] == FS_PTREE_NULL_NODE) {
+                lr->branch[i] = n;
+
+                return;
+            }
+        }
+    }
+
+    nodeid block = fs_ptree_new_node(pt);
+    node *br = NODE_REF(pt, block);
+    br->branch[0] = l;
+    br->branch[LIMBO_EPOCH] = epoch;
+    br->branch[LIMBO_EPOCH+1] = n;
+    pt->header->limbo = block;
+}
+
+/* free everything that went into limbo before epoch before, called with the
+ * tree locked */
+static int reclaim(fs_ptree *pt, uint32_t before)
+{
+    int count = 0;
+    node *keep = NULL;
+    nodeid l = pt->header->limbo;
+
+    while (l != FS_PTREE_NULL_NODE &&
+           (int32_t)(NODE_REF(pt, l)->branch[LIMBO_EPOCH] - before) >= 0) {
+        keep = NODE_REF(pt, l);
+        l = keep->branch[0];
+    }
+    if (keep) {
+        keep->branch[0] = FS_PTREE_NULL_NODE;
+    } else {
+        pt->header->limbo = FS_PTREE_NULL_NODE;
+    }
+
+    while (l != FS_PTREE_NULL_NODE) {
+        node *lr = NODE_REF(pt, l);
+        nodeid next = lr->branch[0];
+        for (int i=LIMBO_EPOCH+1; i<FS_PTREE_BRANCHES; i++) {
+            if (lr->branch[i] == FS_PTREE_NULL_NODE) {
+                continue;
+            } else if (IS_NODE(lr->branch[i])) {
+                push_free_node(pt, lr->branch[i]);
+            } else {
+                push_free_leaf(pt, lr->branch[i]);
+            }
+            count++;
+        }
+        push_free_node(pt, l);
+        l = next;
+    }
+
+    return count;
+}
+
 void fs_ptree_free_node(fs_ptree *pt, nodeid n)
 {
     if (IS_LEAF(n)) {
@@ -302,14 +560,16 @@ void fs_ptree_free_node(fs_ptree *pt, nodeid n)
 
         return;
     }
-    if (n == FS_PTREE_ROOT_NODE) {
+    if (n == pt->root) {
         fs_error(LOG_ERR, "tried to free root node");
 
         return;
     }
-    node *nr = NODE_REF(pt, n);
-    nr->branch[0] = pt->header->node_free;
-    pt->header->node_free = n;
+    if (is_fresh(pt, n)) {
+        push_free_node(pt, n);
+    } else {
+        limbo_add(pt, n);
+    }
 }
 
 nodeid fs_ptree_new_node(fs_ptree *pt)
@@ -324,6 +584,10 @@ nodeid fs_ptree_new_node(fs_ptree *pt)
             for (int i=0; i<FS_PTREE_BRANCHES; i++) {
                 nr->branch[i] = FS_PTREE_NULL_NODE;
             }
+            if (!pt->recycled) {
+                pt->recycled = g_hash_table_new(NULL, NULL);
+            }
+            g_hash_table_insert(pt->recycled, GUINT_TO_POINTER(n), GUINT_TO_POINTER(n));
 
             return n;
         }
@@ -351,9 +615,11 @@ void fs_ptree_free_leaf(fs_ptree *pt, nodeid n)
 
         return;
     }
-    leaf *lr = LEAF_REF(pt, n);
-    lr->block = pt->header->leaf_free;
-    pt->header->leaf_free = n;
+    if (is_fresh(pt, n)) {
+        push_free_leaf(pt, n);
+    } else {
+        limbo_add(pt, n);
+    }
 }
 
 nodeid fs_ptree_new_leaf(fs_ptree *pt)
@@ -367,6 +633,10 @@ nodeid fs_ptree_new_leaf(fs_ptree *pt)
             lr->block = 0;
             lr->length = 0;
         }
+        if (!pt->recycled) {
+            pt->recycled = g_hash_table_new(NULL, NULL);
+        }
+        g_hash_table_insert(pt->recycled, GUINT_TO_POINTER(n), GUINT_TO_POINTER(n));
 
         return n;
     }
@@ -385,9 +655,37 @@ nodeid fs_ptree_new_leaf(fs_ptree *pt)
     return n;
 }
 
-static nodeid get_leaf_and_parent(fs_ptree *pt, fs_rid pk, nodeid *parent)
+/* returns a copy of node *n that the writer can change, unless it already
+ * has one, *n is updated to the copy's ID */
+static node *writable_node(fs_ptree *pt, nodeid *n)
 {
-    nodeid pos = FS_PTREE_ROOT_NODE;
+    if (!is_fresh(pt, *n)) {
+        nodeid old = *n;
+        nodeid copy = fs_ptree_new_node(pt);
+        *NODE_REF(pt, copy) = *NODE_REF(pt, old);
+        *n = copy;
+        fs_ptree_free_node(pt, old);
+    }
+
+    return NODE_REF(pt, *n);
+}
+
+static leaf *writable_leaf(fs_ptree *pt, nodeid *l)
+{
+    if (!is_fresh(pt, *l)) {
+        nodeid old = *l;
+        nodeid copy = fs_ptree_new_leaf(pt);
+        *LEAF_REF(pt, copy) = *LEAF_REF(pt, old);
+        *l = copy;
+        fs_ptree_free_leaf(pt, old);
+    }
+
+    return LEAF_REF(pt, *l);
+}
+
+static nodeid get_leaf_and_parent(fs_ptree *pt, nodeid root, fs_rid pk, nodeid *parent)
+{
+    nodeid pos = root;
     for (int i=0; i < 64/FS_PTREE_BRANCH_BITS; i++) {
         int kbranch = PK_BRANCH(pk, i);
         nodeid newpos = node_ref(pt, pos)->branch[kbranch];
@@ -420,14 +718,17 @@ static nodeid get_leaf_and_parent(fs_ptree *pt, fs_rid pk, nodeid *parent)
     return 0;
 }
 
-static nodeid get_leaf(fs_ptree *pt, fs_rid pk)
+static nodeid get_leaf(fs_ptree *pt, nodeid root, fs_rid pk)
 {
-    return get_leaf_and_parent(pt, pk, NULL);
+    return get_leaf_and_parent(pt, root, pk, NULL);
 }
 
+/* returns a leaf for pk that the writer can change, copying the path down to
+ * it as needed */
 static nodeid get_or_create_leaf(fs_ptree *pt, fs_rid pk)
 {
-    nodeid pos = FS_PTREE_ROOT_NODE;
+    writable_node(pt, &pt->root);
+    nodeid pos = pt->root;
     for (int i=0; i < 64/FS_PTREE_BRANCH_BITS; i++) {
         int kbranch = PK_BRANCH(pk, i);
 again:;
@@ -456,14 +757,28 @@ again:;
             const fs_rid existpk = LEAF_REF(pt, newpos)->pk;
             if (pk == existpk) {
                 /* PKs are the same, we can reuse the block */
-                return newpos;
+                nodeid lid = newpos;
+                writable_leaf(pt, &lid);
+                if (lid != newpos) {
+                    node_ref(pt, pos)->branch[kbranch] = lid;
+                }
+
+                return lid;
             }
-            /* split and insert node */
+            /* split and insert node, the existing leaf is unchanged so
+             * it can be shared */
             int oldkbr = PK_BRANCH(existpk, i-1);
             nodeid split = fs_ptree_new_node(pt);
             node_ref(pt, pos)->branch[kbranch] = split;
             node_ref(pt, split)->branch[oldkbr] = newpos;
             goto again;
+        } else {
+            nodeid copy = newpos;
+            writable_node(pt, &copy);
+            if (copy != newpos) {
+                node_ref(pt, pos)->branch[kbranch] = copy;
+                newpos = copy;
+            }
         }
         pos = newpos;
     }
@@ -482,6 +797,99 @@ again:;
     return 0;
 }
 
+/* the predicate's own tree, opened the first time a view finds it's moved */
+static fs_ptree *view_moved(fs_ptree *v)
+{
+    if (!v->moved) {
+        v->moved = fs_ptree_open_filename(v->filename, v->flags, v->table);
+    }
+
+    return v->moved;
+}
+
+/* returns the tree a view's change should be made in. If that's the shared
+ * tree its writer root is pointed at the predicate's subtree, and
+ * view_write_done() has to be called after the change. If create is 0 and the
+ * predicate isn't there it returns NULL */
+static fs_ptree *view_write(fs_ptree *v, int create)
+{
+    if (v->moved) return v->moved;
+
+    fs_ptree *sh = v->shared;
+    begin_write(sh);
+    nodeid lid = get_leaf(sh, sh->root, v->pred);
+    if (lid && LEAF_REF(sh, lid)->block == FS_PTREE_MOVED) {
+        return view_moved(v);
+    }
+    if (!lid && !create) return NULL;
+
+    lid = get_or_create_leaf(sh, v->pred);
+    if (!lid) return NULL;
+    nodeid sub = LEAF_REF(sh, lid)->block;
+    if (!sub) sub = fs_ptree_new_node(sh);
+    v->top = sh->root;
+    v->pred_leaf = lid;
+    v->count_before = sh->header->count;
+    sh->root = sub;
+
+    return sh;
+}
+
+static void view_write_done(fs_ptree *v)
+{
+    fs_ptree *sh = v->shared;
+    leaf *pl = LEAF_REF(sh, v->pred_leaf);
+
+    pl->block = sh->root;
+    pl->length += sh->header->count - v->count_before;
+    sh->root = v->top;
+}
+
+/* give the leaves under n, and their chains, to the predicate's own tree */
+static void graft_recurse(fs_ptree *sh, nodeid n, fs_ptree *own)
+{
+    for (int b=0; b<FS_PTREE_BRANCHES; b++) {
+        nodeid sub = node_ref(sh, n)->branch[b];
+        if (sub == FS_PTREE_NULL_NODE) {
+            continue;
+        } else if (IS_LEAF(sub)) {
+            const leaf l = *LEAF_REF(sh, sub);
+            nodeid lid = get_or_create_leaf(own, l.pk);
+            LEAF_REF(own, lid)->block = l.block;
+            LEAF_REF(own, lid)->length = l.length;
+            own->header->count += l.length;
+            fs_ptree_free_leaf(sh, sub);
+        } else {
+            graft_recurse(sh, sub, own);
+            fs_ptree_free_node(sh, sub);
+        }
+    }
+}
+
+/* move a predicate that's outgrown the shared tree into its own file. Other
+ * processes find out from the marker left in its leaf, which is only
+ * published after the new tree */
+static void view_promote(fs_ptree *v)
+{
+    fs_ptree *sh = v->shared;
+    nodeid lid = get_leaf(sh, sh->root, v->pred);
+    if (!lid) return;
+    const nodeid sub = LEAF_REF(sh, lid)->block;
+    const int64_t count = LEAF_REF(sh, lid)->length;
+
+    /* nothing can be using a file left by a promotion that wasn't published */
+    fs_ptree *own = fs_ptree_open_filename(v->filename,
+                        v->flags | O_CREAT | O_TRUNC, v->table);
+    if (!own) return;
+    begin_write(own);
+    graft_recurse(sh, sub, own);
+    fs_ptree_free_node(sh, sub);
+    LEAF_REF(sh, lid)->block = FS_PTREE_MOVED;
+    LEAF_REF(sh, lid)->length = 0;
+    sh->header->count -= count;
+    v->moved = own;
+}
+
 int fs_ptree_add(fs_ptree *pt, fs_rid pk, fs_rid pair[2], int force)
 {
     if (!pt) {
@@ -489,6 +897,19 @@ int fs_ptree_add(fs_ptree *pt, fs_rid pk, fs_rid pair[2], int force)
 
         return 1;
     }
+    if (pt->shared) {
+        fs_ptree *t = view_write(pt, 1);
+        if (!t) return 1;
+        if (t != pt->shared) return fs_ptree_add(t, pk, pair, force);
+        int ret = fs_ptree_add(t, pk, pair, force);
+        view_write_done(pt);
+        if (LEAF_REF(t, pt->pred_leaf)->length >= FS_PTREE_SHARED_MAX) {
+            view_promote(pt);
+        }
+
+        return ret;
+    }
+    begin_write(pt);
     nodeid lid = get_or_create_leaf(pt, pk);
     if (!pair) return 1;
     leaf *lref = LEAF_REF(pt, lid);
@@ -498,6 +919,7 @@ int fs_ptree_add(fs_ptree *pt, fs_rid pk, fs_rid pair[2], int force)
         return 0;
     }
 #endif
+    /* the new row goes on the front, so the old chain is left intact */
     fs_row_id new_block = fs_ptable_add_pair(pt->table, lref->block, pair);
     if (new_block) {
         lref->length++;
@@ -510,61 +932,71 @@ int fs_ptree_add(fs_ptree *pt, fs_rid pk, fs_rid pair[2], int force)
 
 enum recurse_action { NONE, CULL, MERGE };
 
-static enum recurse_action remove_all_recurse(fs_ptree *pt, fs_rid pair[2], nodeid n, int *removed)
+/* *n is replaced if the node had to be copied */
+static enum recurse_action remove_all_recurse(fs_ptree *pt, fs_rid pair[2], nodeid *n, int *removed)
 {
-    node *no = node_ref(pt, n);
     int branches = 0;
     int leaves = 0;
     for (int b=0; b<FS_PTREE_BRANCHES; b++) {
-        if (no->branch[b] == FS_PTREE_NULL_NODE) {
+        nodeid sub = node_ref(pt, *n)->branch[b];
+        if (sub == FS_PTREE_NULL_NODE) {
             /* dead end, do nothing */
-        } else if (IS_LEAF(no->branch[b])) {
-            leaf *lref = LEAF_REF(pt, no->branch[b]);
+        } else if (IS_LEAF(sub)) {
+            leaf *lref = LEAF_REF(pt, sub);
+            const uint32_t length = lref->length;
+            fs_row_id newblock = lref->block;
             int sub_removed = 0;
             if (lref->block) {
-                fs_row_id newblock = fs_ptable_remove_pair(pt->table,
-                                        lref->block, pair, &sub_removed, NULL);
-                if (lref->block != newblock) {
-                    lref->block = newblock;
-                }
-                if (sub_removed) {
-                    lref->length -= sub_removed;
-                }
+                newblock = fs_ptable_remove_pair(pt->table, lref->block,
+                                                 pair, &sub_removed, NULL);
                 if (removed) {
                     (*removed) += sub_removed;
                 }
             }
-            if (sub_removed && lref->length == 0) {
-                fs_ptree_free_leaf(pt, no->branch[b]);
-                no->branch[b] = FS_PTREE_NULL_NODE;
+            if (sub_removed && length == sub_removed) {
+                writable_node(pt, n)->branch[b] = FS_PTREE_NULL_NODE;
+                fs_ptree_free_leaf(pt, sub);
             } else {
+                if (sub_removed) {
+                    nodeid copy = sub;
+                    lref = writable_leaf(pt, &copy);
+                    lref->block = newblock;
+                    lref->length -= sub_removed;
+                    if (copy != sub) {
+                        writable_node(pt, n)->branch[b] = copy;
+                    }
+                }
                 branches++;
                 leaves++;
             }
         } else {
-            enum recurse_action action = remove_all_recurse(pt, pair, no->branch[b], removed);
+            nodeid copy = sub;
+            enum recurse_action action = remove_all_recurse(pt, pair, &copy, removed);
             if (action == CULL) {
-                fs_ptree_free_node(pt, no->branch[b]);
-                no->branch[b] = FS_PTREE_NULL_NODE;
+                writable_node(pt, n)->branch[b] = FS_PTREE_NULL_NODE;
+                fs_ptree_free_node(pt, copy);
             } else if (action == MERGE) {
-                node *sub = NODE_REF(pt, no->branch[b]);
+                node *subno = NODE_REF(pt, copy);
                 nodeid subn = FS_PTREE_NULL_NODE;
                 for (int subb=0; subb<FS_PTREE_BRANCHES; subb++) {
-                    if (sub->branch[subb] != FS_PTREE_NULL_NODE) {
-                        subn = sub->branch[subb];
+                    if (subno->branch[subb] != FS_PTREE_NULL_NODE) {
+                        subn = subno->branch[subb];
 
                         break;
                     }
                 }
                 if (subn != FS_PTREE_NULL_NODE) {
-                    fs_ptree_free_node(pt, no->branch[b]);
-                    no->branch[b] = subn;
+                    writable_node(pt, n)->branch[b] = subn;
+                    fs_ptree_free_node(pt, copy);
                 } else {
                     fs_error(LOG_CRIT, "tried to merge nodes, but no children were available");
                 }
 
                 branches++;
             } else {
+                if (copy != sub) {
+                    writable_node(pt, n)->branch[b] = copy;
+                }
                 branches++;
             }
         }
@@ -578,6 +1010,7 @@ static enum recurse_action remove_all_recurse(fs_ptree *pt, fs_rid pair[2], node
     return NONE;
 }
 
+/* the path to pk must already be writable, see get_or_create_leaf() */
 static enum recurse_action collapse_by_pk_recurse(fs_ptree *pt, fs_rid pk, fs_index_node n, int level)
 {
     node *no = node_ref(pt, n);
@@ -587,23 +1020,26 @@ static enum recurse_action collapse_by_pk_recurse(fs_ptree *pt, fs_rid pk, fs_in
 
         return NONE;
     } else if (IS_LEAF(no->branch[b])) {
-        leaf *lref = LEAF_REF(pt, no->branch[b]);
+        nodeid lid = no->branch[b];
+        leaf *lref = LEAF_REF(pt, lid);
         if (lref->length == 0 && lref->block == 0) {
-            fs_ptree_free_leaf(pt, no->branch[b]);
             no->branch[b] = FS_PTREE_NULL_NODE;
+            fs_ptree_free_leaf(pt, lid);
         } else {
             fs_error(LOG_ERR, "hit an unexpected non-empty leaf recursing pk %016llx in %s", pk, pt->filename);
         }
     } else {
-        enum recurse_action action = collapse_by_pk_recurse(pt, pk, no->branch[b], level+1);
+        nodeid sub = no->branch[b];
+        enum recurse_action action = collapse_by_pk_recurse(pt, pk, sub, level+1);
         if (action == CULL) {
-            fs_ptree_free_node(pt, no->branch[b]);
-            no->branch[b] = FS_PTREE_NULL_NODE;
+            node_ref(pt, n)->branch[b] = FS_PTREE_NULL_NODE;
+            fs_ptree_free_node(pt, sub);
         } else if (action == MERGE) {
 	    /* MERGE not currently implemented, harmless, but less efficient
              * than it could be */
         }
     }
+    no = node_ref(pt, n);
     int branches = 0;
     for (int c=0; c<FS_PTREE_BRANCHES; c++) {
         if (no->branch[c] != FS_PTREE_NULL_NODE) branches++;
@@ -617,7 +1053,7 @@ static enum recurse_action collapse_by_pk_recurse(fs_ptree *pt, fs_rid pk, fs_in
 
 static int collapse_by_pk(fs_ptree *pt, fs_rid pk)
 {
-    collapse_by_pk_recurse(pt, pk, FS_PTREE_ROOT_NODE, 0);
+    collapse_by_pk_recurse(pt, pk, pt->root, 0);
 
     return 0;
 }
@@ -631,8 +1067,18 @@ int fs_ptree_remove_all(fs_ptree *pt, fs_rid pair[2])
     }
     if (!pair) return 1;
 
+    if (pt->shared) {
+        fs_ptree *t = view_write(pt, 0);
+        if (!t) return 1;
+        if (t != pt->shared) return fs_ptree_remove_all(t, pair);
+        int ret = fs_ptree_remove_all(t, pair);
+        view_write_done(pt);
+
+        return ret;
+    }
+    begin_write(pt);
     int removed = 0;
-    remove_all_recurse(pt, pair, FS_PTREE_ROOT_NODE, &removed);
+    remove_all_recurse(pt, pair, &pt->root, &removed);
     pt->header->count -= removed;
 
     if (removed) {
@@ -650,7 +1096,17 @@ int fs_ptree_remove(fs_ptree *pt, fs_rid pk, fs_rid pair[2], fs_rid_set *models)
         return 1;
     }
 
-    nodeid lid = get_leaf(pt, pk);
+    if (pt->shared) {
+        fs_ptree *t = view_write(pt, 0);
+        if (!t) return 0;
+        if (t != pt->shared) return fs_ptree_remove(t, pk, pair, models);
+        int ret = fs_ptree_remove(t, pk, pair, models);
+        view_write_done(pt);
+
+        return ret;
+    }
+    begin_write(pt);
+    nodeid lid = get_leaf(pt, pt->root, pk);
     if (!lid) {
         /* the leaf doesn't exist, so it doesn't need to be deleted */
 
@@ -665,30 +1121,15 @@ int fs_ptree_remove(fs_ptree *pt, fs_rid pk, fs_rid pair[2], fs_rid_set *models)
 
     int removed = 0;
     fs_row_id newblock = fs_ptable_remove_pair(pt->table, lref->block, pair, &removed, models);
-    if (lref->block != newblock) {
-        lref->block = newblock;
-    }
     if (removed) {
+        /* only copy the path to the leaf once we know it will change */
+        lid = get_or_create_leaf(pt, pk);
+        lref = LEAF_REF(pt, lid);
+        lref->block = newblock;
         lref->length -= removed;
         pt->header->count -= removed;
         if (lref->length == 0) {
             collapse_by_pk(pt, pk);
-#if 0
-            node *nref = NODE_REF(pt, parent);
-            int collapsed = 0;
-            for (int i=0; i<FS_PTREE_BRANCHES; i++) {
-                if (nref->branch[i] == lid) {
-                    nref->branch[i] = FS_PTREE_NULL_NODE;
-                    fs_ptree_free_leaf(pt, lid);
-                    collapsed = 1;
-                    collapse_by_pk(pt, pk);
-                    break;
-                }
-            }
-            if (!collapsed) {
-                fs_error(LOG_INFO, "leaf %s/%x is empty, should be removed", pt->filename, lid);
-            }
-#endif
         }
 
         return 0;
@@ -697,6 +1138,82 @@ int fs_ptree_remove(fs_ptree *pt, fs_rid pk, fs_rid pair[2], fs_rid_set *models)
     return 1;
 }
 
+/* pins the table and returns the root a new iterator should use, readers get
+ * the last published tree, a writer sees its own changes */
+static nodeid snapshot(fs_ptree *pt)
+{
+    if (pt->table) fs_ptable_pin(pt->table);
+    if (pt->writing) return pt->root;
+
+    nodeid root = header_root(pt);
+    check_mapping(pt);
+
+    return root;
+}
+
+static void release(fs_ptree *pt)
+{
+    if (pt->table) fs_ptable_unpin(pt->table);
+}
+
+/* like snapshot(), but also works out which tree to read, *root is set to
+ * the predicate's subtree for a view. Returns non 0, with nothing pinned, if
+ * the view's predicate isn't there */
+static int view_snapshot(fs_ptree *pt, fs_ptree **tree, nodeid *root)
+{
+    if (pt->shared && !pt->moved) {
+        fs_ptree *sh = pt->shared;
+        nodeid top = snapshot(sh);
+        nodeid lid = get_leaf(sh, top, pt->pred);
+        const nodeid sub = lid ? LEAF_REF(sh, lid)->block : 0;
+        if (sub != FS_PTREE_MOVED) {
+            if (!sub) {
+                release(sh);
+
+                return 1;
+            }
+            *tree = sh;
+            *root = sub;
+
+            return 0;
+        }
+        release(sh);
+        if (!view_moved(pt)) return 1;
+    }
+    if (pt->moved) pt = pt->moved;
+    *tree = pt;
+    *root = snapshot(pt);
+
+    return 0;
+}
+
+fs_ptree *fs_ptree_open_pred(fs_backend *be, fs_ptree *shared, fs_rid pred, char pk, int flags)
+{
+    fs_ptree *pt = calloc(1, sizeof(fs_ptree));
+    pt->fd = -1;
+    pt->shared = shared;
+    pt->pred = pred;
+    pt->flags = flags & ~O_TRUNC;
+    pt->table = shared->table;
+    /* where the predicate's own tree is, or will be if it's moved out */
+    pt->filename = g_strdup_printf(fs_get_ptree_format(), fs_backend_get_kb(be),
+                                   fs_backend_get_segment(be), pk, pred);
+
+    nodeid top = snapshot(shared);
+    nodeid lid = get_leaf(shared, top, pred);
+    const nodeid sub = lid ? LEAF_REF(shared, lid)->block : 0;
+    release(shared);
+    if (sub == FS_PTREE_MOVED || (!lid && access(pt->filename, F_OK) == 0)) {
+        fs_ptree *own = fs_ptree_open_filename(pt->filename, pt->flags, pt->table);
+        g_free(pt->filename);
+        free(pt);
+
+        return own;
+    }
+
+    return pt;
+}
+
 fs_ptree_it *fs_ptree_search(fs_ptree *pt, fs_rid pk, fs_rid pair[2])
 {
     if (!pt) {
@@ -705,13 +1222,23 @@ fs_ptree_it *fs_ptree_search(fs_ptree *pt, fs_rid pk, fs_rid pair[2])
         return NULL;
     }
 
-    nodeid lid = get_leaf(pt, pk);
+    fs_ptree *tree;
+    nodeid root;
+    if (view_snapshot(pt, &tree, &root)) return NULL;
+    nodeid lid = get_leaf(tree, root, pk);
     if (!lid) {
+        release(tree);
+
         return NULL;
     }
     fs_ptree_it *it = calloc(1, sizeof(fs_ptree_it));
-    it->pt = pt;
-    it->leaf = LEAF_REF(pt, lid);
+    it->pt = tree;
+    it->pinned = tree->table;
+    it->owner = pt;
+    pt->iterators++;
+    tree->map_users++;
+    it->mapped = 1;
+    it->leaf = LEAF_REF(tree, lid);
     it->length = it->leaf->length;
     it->block = it->leaf->block;
     it->pair[0] = pair[0];
@@ -720,6 +1247,18 @@ fs_ptree_it *fs_ptree_search(fs_ptree *pt, fs_rid pk, fs_rid pair[2])
     return it;
 }
 
+int fs_ptree_pair_exists(fs_ptree *pt, fs_rid pk, fs_rid pair[2])
+{
+    fs_ptree_it *it = fs_ptree_search(pt, pk, pair);
+    if (!it) return 0;
+
+    fs_rid found[2];
+    const int ret = fs_ptree_it_next(it, found);
+    fs_ptree_it_free(it);
+
+    return ret;
+}
+
 int fs_ptree_it_get_length(fs_ptree_it *it)
 {
     if (it) return it->length;
@@ -767,13 +1306,26 @@ int fs_ptree_it_next_quad(fs_ptree_it *it, fs_rid quad[4])
 fs_ptree_it *fs_ptree_traverse(fs_ptree *pt, fs_rid mrid)
 {
     fs_ptree_it *it = calloc(1, sizeof(fs_ptree_it));
-    it->pt = pt;
+    fs_ptree *tree;
+    nodeid root;
     it->traverse = 1;
-    it->stack = malloc(sizeof(tree_pos));
     it->pair[0] = mrid;
-    it->stack->node = FS_PTREE_ROOT_NODE;
+    it->owner = pt;
+    pt->iterators++;
+    if (view_snapshot(pt, &tree, &root)) {
+        /* nothing to traverse */
+        it->pt = pt;
+
+        return it;
+    }
+    it->pt = tree;
+    tree->map_users++;
+    it->mapped = 1;
+    it->stack = malloc(sizeof(tree_pos));
+    it->stack->node = root;
     it->stack->branch = 0;
     it->stack->next = NULL;
+    it->pinned = tree->table;
 
     return it;
 }
@@ -830,14 +1382,100 @@ int fs_ptree_traverse_next(fs_ptree_it *it, fs_rid quad[4])
 
 void fs_ptree_it_free(fs_ptree_it *it)
 {
-    if (it) free(it);
+    if (!it) return;
+
+    if (it->pinned) fs_ptable_unpin(it->pinned);
+    if (it->mapped && --it->pt->map_users == 0) free_old_maps(it->pt);
+    it->owner->iterators--;
+    while (it->stack) {
+        tree_pos *next = it->stack->next;
+        free(it->stack);
+        it->stack = next;
+    }
+    free(it);
+}
+
+int fs_ptree_reclaim(fs_ptree *pt, uint32_t before)
+{
+    if (pt && pt->shared) {
+        return pt->moved ? fs_ptree_reclaim(pt->moved, before) : 0;
+    }
+    if (!pt || pt->header->limbo == 0 ||
+        pt->header->limbo == FS_PTREE_NULL_NODE) {
+        return 0;
+    }
+
+    if (!pt->writing) flock(pt->fd, LOCK_EX);
+    check_mapping(pt);
+    int count = reclaim(pt, before);
+    if (!pt->writing) flock(pt->fd, LOCK_UN);
+
+    return count;
+}
+
+int fs_ptree_publish(fs_ptree *pt)
+{
+    if (pt && pt->shared) {
+        /* the shared tree has to be published after this, so that a moved
+         * predicate's tree is visible before the marker */
+        return pt->moved ? fs_ptree_publish(pt->moved) : 0;
+    }
+    if (!pt || !pt->writing) return 0;
+
+    /* everything under the new root has to be visible before the root is */
+    __sync_synchronize();
+    pt->header->root = pt->root;
+    __sync_synchronize();
+
+    pt->writing = 0;
+    if (pt->recycled) {
+        g_hash_table_remove_all(pt->recycled);
+    }
+    flock(pt->fd, LOCK_UN);
+    if (pt->table) fs_ptable_publish(pt->table);
+
+    return 0;
 }
 
 int fs_ptree_count(fs_ptree *pt)
 {
+    if (pt->shared) {
+        fs_ptree *tree;
+        nodeid root;
+        if (view_snapshot(pt, &tree, &root)) return 0;
+        int count;
+        if (tree == pt->shared) {
+            nodeid lid = get_leaf(tree, tree->writing ? tree->root :
+                                  header_root(tree), pt->pred);
+            count = lid ? LEAF_REF(tree, lid)->length : 0;
+        } else {
+            count = tree->header->count;
+        }
+        release(tree);
+
+        return count;
+    }
+
     return pt->header->count;
 }
 
+int fs_ptree_busy(fs_ptree *pt)
+{
+    if (!pt) return 0;
+    if (pt->iterators) return 2;
+    /* closing a view doesn't publish the shared tree */
+    if (pt->shared) return pt->moved ? pt->moved->writing : 0;
+
+    return pt->writing;
+}
+
+size_t fs_ptree_mapped_size(fs_ptree *pt)
+{
+    if (pt && pt->shared) return 0;
+
+    return pt ? pt->file_length : 0;
+}
+
 int fs_ptree_unlink(fs_ptree *pt)
 {
     if (!pt) {
@@ -845,6 +1483,15 @@ int fs_ptree_unlink(fs_ptree *pt)
 
         return 1;
     }
+    if (pt->shared) {
+        /* the shared tree is unlinked by itself. The predicate may have been
+         * moved out without this view having seen the marker yet, so go by
+         * the filename rather than pt->moved, fs_ptree_open_pred() would
+         * open a file left behind */
+        if (unlink(pt->filename) == -1 && errno != ENOENT) return 1;
+
+        return 0;
+    }
     if (!pt->filename) {
         fs_error(LOG_ERR, "tried to unlink closed ptree");
 
@@ -861,16 +1508,27 @@ int fs_ptree_close(fs_ptree *pt)
 
         return 1;
     }
+    if (pt->shared) {
+        if (pt->moved) fs_ptree_close(pt->moved);
+        g_free(pt->filename);
+        free(pt);
+
+        return 0;
+    }
     if (!pt->filename) {
         fs_error(LOG_ERR, "tried to close already closed ptree");
 
         return 1;
     }
+    fs_ptree_publish(pt);
+    free_old_maps(pt);
     if (munmap(pt->ptr, pt->file_length) == -1) {
         fs_error(LOG_CRIT, "failed to unmap '%s'", pt->filename);
     }
-    flock(pt->fd, LOCK_UN);
     close(pt->fd);
+    if (pt->recycled) {
+        g_hash_table_destroy(pt->recycled);
+    }
     pt->fd = -1;
     g_free(pt->filename);
     pt->filename = NULL;
@@ -886,7 +1544,8 @@ struct ptree_stats {
     int deadends;
 };
 
-static void recurse_print(fs_ptree *pt, nodeid n, char *buffer, int pos, struct ptree_stats *stats, FILE *out, int verbosity)
+/* preds is set while walking the predicate level of a shared tree */
+static void recurse_print(fs_ptree *pt, nodeid n, char *buffer, int pos, struct ptree_stats *stats, FILE *out, int verbosity, int preds)
 {
     unsigned int len = 0;
     node *no = node_ref(pt, n);
@@ -896,6 +1555,29 @@ static void recurse_print(fs_ptree *pt, nodeid n, char *buffer, int pos, struct
         sprintf(buffer+pos, "%x", b);
         if (no->branch[b] == FS_PTREE_NULL_NODE) {
             (stats->deadends)++;
+        } else if (IS_LEAF(no->branch[b]) && preds) {
+            branches++;
+            leaves++;
+            (stats->leaves)++;
+            buffer[pos+1] ='\0';
+            const leaf pl = *LEAF_REF(pt, no->branch[b]);
+            if (pl.block == FS_PTREE_MOVED) {
+                fprintf(out, "%-32s predicate %016llx, moved to own file\n", buffer, pl.pk);
+            } else {
+                fprintf(out, "%-32s predicate %016llx x %d\n", buffer, pl.pk, pl.length);
+            }
+            if (pl.block && pl.block != FS_PTREE_MOVED) {
+                char sub[256];
+                const int before = stats->count;
+                (stats->nodes)++;
+                recurse_print(pt, pl.block, sub, 0, stats, out, verbosity, 0);
+                if (stats->count - before != pl.length) {
+                    fprintf(out, "ERROR: predicate has length %d, but its tree has %d rows\n", pl.length, stats->count - before);
+                }
+            }
+            for (int c=0; c<pos; c++) {
+                buffer[c] = '.';
+            }
         } else if (IS_LEAF(no->branch[b])) {
             branches++;
             leaves++;
@@ -940,13 +1622,13 @@ static void recurse_print(fs_ptree *pt, nodeid n, char *buffer, int pos, struct
         } else {
             (stats->nodes)++;
             branches++;
-            recurse_print(pt, no->branch[b], buffer, pos+1, stats, out, verbosity);
+            recurse_print(pt, no->branch[b], buffer, pos+1, stats, out, verbosity, preds);
         }
     }
-    if (branches == 1 && leaves == 1 && pos > 2 && n != FS_PTREE_ROOT_NODE) {
+    if (branches == 1 && leaves == 1 && pos > 2) {
         fprintf(out, "ERROR: node %08x has 1 leaf at depth %d, should have "
                      "been merged up\n", n, pos);
-    } else if (branches == 0 && n != FS_PTREE_ROOT_NODE) {
+    } else if (branches == 0 && pos > 0) {
         fprintf(out, "ERROR: node %08x has 0 branches at depth %d, should "
                      "have been culled\n", n, pos);
     }
@@ -954,7 +1636,16 @@ static void recurse_print(fs_ptree *pt, nodeid n, char *buffer, int pos, struct
 
 void fs_ptree_print(fs_ptree *pt, FILE *out, int verbosity)
 {
-    fprintf(out, "ptree: %s\n", pt->filename);
+    if (pt->shared) {
+        if (pt->moved) {
+            fs_ptree_print(pt->moved, out, verbosity);
+        } else {
+            fprintf(out, "ptree: predicate %016llx in %s\n", pt->pred, pt->shared->filename);
+        }
+
+        return;
+    }
+    fprintf(out, "ptree: %s%s\n", pt->filename, pt->header->shared ? " (shared)" : "");
     fprintf(out, "nodes: %d/%d\n", pt->header->node_count, pt->header->node_alloc);
     fprintf(out, "leaves: %d/%d\n", pt->header->leaf_count, pt->header->leaf_alloc);
     fprintf(out, "rows:    %lld\n", (long long)pt->header->count);
@@ -963,7 +1654,7 @@ void fs_ptree_print(fs_ptree *pt, FILE *out, int verbosity)
     char buffer[256];
     /* tree walk doesn't count the root, or null nodes and leaves */
     struct ptree_stats stats = { 0, 2, 2, 0 };
-    recurse_print(pt, FS_PTREE_ROOT_NODE, buffer, 0, &stats, out, verbosity);
+    recurse_print(pt, header_root(pt), buffer, 0, &stats, out, verbosity, pt->header->shared);
     int free_leaves = 0;
     int free_nodes = 0;
     nodeid n = pt->header->leaf_free;
@@ -978,15 +1669,31 @@ void fs_ptree_print(fs_ptree *pt, FILE *out, int verbosity)
         node *nr = NODE_REF(pt, n);
         n = nr->branch[0];
     }
+    int limbo_nodes = 0;
+    int limbo_leaves = 0;
+    n = pt->header->limbo;
+    while (n && n != FS_PTREE_NULL_NODE) {
+        node *nr = NODE_REF(pt, n);
+        limbo_nodes++;
+        for (int i=LIMBO_EPOCH+1; i<FS_PTREE_BRANCHES; i++) {
+            if (nr->branch[i] == FS_PTREE_NULL_NODE) continue;
+            if (IS_NODE(nr->branch[i])) limbo_nodes++;
+            else limbo_leaves++;
+        }
+        n = nr->branch[0];
+    }
     fprintf(out, "\nrows:         %d (%+lld)\n", stats.count, (long long)(stats.count - pt->header->count));
     fprintf(out, "nodes:        %d\n", stats.nodes);
     fprintf(out, "leaves:       %d\n", stats.leaves);
     fprintf(out, "freed nodes:  %d\n", free_nodes);
     fprintf(out, "freed leaves: %d\n", free_leaves);
+    fprintf(out, "limbo:        %d nodes, %d leaves\n", limbo_nodes, limbo_leaves);
     fprintf(out, "deadends:     %d (%d%%)\n", stats.deadends, 100 * stats.deadends / (stats.nodes * FS_PTREE_BRANCHES));
     if (stats.count != pt->header->count) {
         fprintf(out, "ERROR: number of rows in header (%d) does not match data (%d) in %s\n", (int)pt->header->count, stats.count, pt->filename);
     }
+    free_leaves += limbo_leaves;
+    free_nodes += limbo_nodes;
     if (stats.leaves + free_leaves != pt->header->leaf_count) {
         fprintf(out, "ERROR: %d leaves have been leaked\n",
                      pt->header->leaf_count - free_leaves - stats.leaves);
@@ -12,13 +12,32 @@ fs_ptree *fs_ptree_open(fs_backend *be, fs_rid pred, char pk, int flags, fs_ptab
 
 fs_ptree *fs_ptree_open_filename(const char *filename, int flags, fs_ptable *chain);
 
+/* predicates with few quads can share one tree file per segment, keyed on
+ * (pred, pk). fs_ptree_open_pred() returns a view of pred in the shared tree,
+ * which can be used like any other ptree, or pred's own tree if it has one.
+ * A predicate is moved to its own file once it has FS_PTREE_SHARED_MAX
+ * quads. Publishing a view only publishes the predicate's own tree, the
+ * shared tree must be published after all of its views */
+fs_ptree *fs_ptree_open_shared(fs_backend *be, char pk, int flags, fs_ptable *chain);
+fs_ptree *fs_ptree_open_pred(fs_backend *be, fs_ptree *shared, fs_rid pred, char pk, int flags);
+
 int fs_ptree_write_header(fs_ptree *pt);
 
 int fs_ptree_add(fs_ptree *pt, fs_rid pk, fs_rid pair[2], int force);
 int fs_ptree_remove(fs_ptree *pt, fs_rid pk, fs_rid pair[2], fs_rid_set *models);
 int fs_ptree_remove_all(fs_ptree *pt, fs_rid pair[2]);
 
+/* make changes since the last call visible to readers, and release the write
+ * lock taken by the first change */
+int fs_ptree_publish(fs_ptree *pt);
+
+/* reuse the nodes and leaves freed in epochs before the given one, see
+ * fs_ptable_oldest_pin(), returns the number reclaimed */
+int fs_ptree_reclaim(fs_ptree *pt, uint32_t before);
+
 fs_ptree_it *fs_ptree_search(fs_ptree *pt, fs_rid pk, fs_rid pair[2]);
+/* true if pk has exactly this pair, a writer sees its own changes */
+int fs_ptree_pair_exists(fs_ptree *pt, fs_rid pk, fs_rid pair[2]);
 int fs_ptree_it_get_length(fs_ptree_it *it);
 int fs_ptree_it_next(fs_ptree_it *it, fs_rid pair[2]);
 int fs_ptree_it_next_quad(fs_ptree_it *it, fs_rid quad[4]);
@@ -36,6 +55,13 @@ int fs_ptree_close(fs_ptree *pt);
 
 int fs_ptree_count(fs_ptree *pt);
 
+/* 2 if there are iterators open on the tree, so it can't be closed, 1 if it
+ * has unpublished changes, otherwise 0 */
+int fs_ptree_busy(fs_ptree *pt);
+
+/* bytes of the file currently mapped */
+size_t fs_ptree_mapped_size(fs_ptree *pt);
+
 /* vi:set expandtab sts=4 sw=4: */
 
 #endif
@@ -29,6 +29,7 @@
 
 #include "../common/timing.h"
 #include "../common/error.h"
+#include "../common/server.h"
 #include "tlist.h"
 #include "backend.h"
 #include "backend-intl.h"
@@ -36,6 +37,9 @@
 
 #define TMP_SIZE 512
 
+/* keep binding until the limit, or until the frontend no longer wants it */
+#define bind_more(count, limit) ((count) < (limit) && !fsp_bind_abandoned())
+
 //#define DEBUG_BRANCH 1
 
 static int slot_bits[4] = {
@@ -272,7 +276,7 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 	    fs_rid quad[4] = { FS_RID_NULL, FS_RID_NULL, pv->data[0],
 			       FS_RID_NULL };
 	    fs_ptree_it *it = fs_ptree_traverse(pt, FS_RID_NULL);
-	    while (it && fs_ptree_traverse_next(it, quad) && count<limit) {
+	    while (it && fs_ptree_traverse_next(it, quad) && bind_more(count, limit)) {
 		if (!bind_same(quad, tobind)) continue;
 		if (!graph_ok(quad, tobind)) continue;
 		count++;
@@ -304,7 +308,7 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 		if (!tl) continue;
 		fs_rid triple[3];
 		fs_tlist_rewind(tl);
-		while (fs_tlist_next_value(tl, triple) && count < limit) {
+		while (fs_tlist_next_value(tl, triple) && bind_more(count, limit)) {
 		    const fs_rid quad[4] =
 				    { model, triple[0], triple[1], triple[2] };
 		    if (!bind_same(quad, tobind)) continue;
@@ -318,7 +322,7 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 		fs_tbchain_it *it =
 		    fs_tbchain_new_iterator(be->model_list, model, mnode);
 		fs_rid triple[3];
-		while (fs_tbchain_it_next(it, triple) && count < limit) {
+		while (fs_tbchain_it_next(it, triple) && bind_more(count, limit)) {
 		    const fs_rid quad[4] =
 				    { model, triple[0], triple[1], triple[2] };
 		    if (!bind_same(quad, tobind)) continue;
@@ -343,17 +347,17 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 fs_error(LOG_INFO, "bind() branch");
 #endif
 	    const int ml = mvl ? mvl : 1;
-	    for (int p=0; p<pvl && count<limit; p++) {
+	    for (int p=0; p<pvl && bind_more(count, limit); p++) {
 		fs_ptree *pt = fs_backend_get_ptree(be, pv->data[p], 0);
 		if (!pt) continue;
-		for (int m=0; m<ml && count<limit; m++) {
+		for (int m=0; m<ml && bind_more(count, limit); m++) {
 		    fs_rid quad[4] = { FS_RID_NULL, FS_RID_NULL, pv->data[p],
 				       FS_RID_NULL };
 		    fs_rid mrid;
 		    if (mvl) mrid = mv->data[m];
 		    else mrid = FS_RID_NULL;
 		    fs_ptree_it *it = fs_ptree_traverse(pt, mrid);
-		    while (it && fs_ptree_traverse_next(it, quad) && count<limit) {
+		    while (it && fs_ptree_traverse_next(it, quad) && bind_more(count, limit)) {
 			if (!bind_same(quad, tobind)) continue;
 			if (!graph_ok(quad, tobind)) continue;
 			count++;
@@ -367,7 +371,7 @@ fs_error(LOG_INFO, "bind() branch");
 fs_error(LOG_INFO, "bind() branch");
 #endif
 	    const int ml = mvl ? mvl : 1;
-	    for (int p=0; p<be->ptree_length && count<limit; p++) {
+	    for (int p=0; p<be->ptree_length && bind_more(count, limit); p++) {
 		fs_backend_ptree_limited_open(be, p); 
 		fs_ptree *pt = be->ptrees_priv[p].ptree_s;
 		if (!pt) continue;
@@ -378,7 +382,7 @@ fs_error(LOG_INFO, "bind() branch");
 		    if (mvl) mrid = mv->data[m];
 		    else mrid = FS_RID_NULL;
 		    fs_ptree_it *it = fs_ptree_traverse(pt, mrid);
-		    while (it && fs_ptree_traverse_next(it, quad) && count<limit) {
+		    while (it && fs_ptree_traverse_next(it, quad) && bind_more(count, limit)) {
 			if (!bind_same(quad, tobind)) continue;
 			if (!graph_ok(quad, tobind)) continue;
 			count++;
@@ -396,18 +400,18 @@ fs_error(LOG_INFO, "bind() branch");
 #endif
 	    const int ml = mvl ? mvl : 1;
 	    const int ol = ovl ? ovl : 1;
-            for (int p=0; p<pvl && count<limit; p++) {
+            for (int p=0; p<pvl && bind_more(count, limit); p++) {
 	    fs_ptree *pt = fs_backend_get_ptree(be, pv->data[p], 0);
 	    if (pt) {
-		for (int s=0; s<svl && count<limit; s++) {
+		for (int s=0; s<svl && bind_more(count, limit); s++) {
 		    fs_rid pk = sv->data[s];
-		    for (int m=0; m<ml && count<limit; m++) {
+		    for (int m=0; m<ml && bind_more(count, limit); m++) {
 			for (int o=0; o<ol; o++) {
 			    fs_rid pair[2] = { FS_RID_NULL, FS_RID_NULL };
 			    if (mvl) pair[0] = mv->data[m];
 			    if (ovl) pair[1] = ov->data[o];
 			    fs_ptree_it *it = fs_ptree_search(pt, pk, pair);
-			    while (it && fs_ptree_it_next(it, pair) && count<limit) {
+			    while (it && fs_ptree_it_next(it, pair) && bind_more(count, limit)) {
 				const fs_rid quad[4] =
 				    { pair[0], pk, pv->data[p], pair[1] };
 				if (!bind_same(quad, tobind)) continue;
@@ -427,18 +431,18 @@ fs_error(LOG_INFO, "bind() branch");
 #endif
 	    const int ml = mvl ? mvl : 1;
 	    const int ol = ovl ? ovl : 1;
-	    for (int p=0; p<pvl && count<limit; p++) {
+	    for (int p=0; p<pvl && bind_more(count, limit); p++) {
 		fs_ptree *pt = fs_backend_get_ptree(be, pv->data[p], 0);
 		if (!pt) continue;
 		/* we have to use values from s and p for same row */
 		fs_rid pk = sv->data[p];
-		for (int m=0; m<ml && count<limit; m++) {
+		for (int m=0; m<ml && bind_more(count, limit); m++) {
 		    for (int o=0; o<ol; o++) {
 			fs_rid pair[2] = { FS_RID_NULL, FS_RID_NULL };
 			if (mvl) pair[0] = mv->data[m];
 			if (ovl) pair[1] = ov->data[o];
 			fs_ptree_it *it = fs_ptree_search(pt, pk, pair);
-			while (it && fs_ptree_it_next(it, pair) && count<limit) {
+			while (it && fs_ptree_it_next(it, pair) && bind_more(count, limit)) {
 			    const fs_rid quad[4] =
 				{ pair[0], pk, pv->data[p], pair[1] };
 			    if (!bind_same(quad, tobind)) continue;
@@ -459,18 +463,18 @@ fs_error(LOG_INFO, "bind() branch");
 	if (!conjuctive) {
 	    const int ml = mvl ? mvl : 1;
 	    const int sl = svl ? svl : 1;
-            for (int p=0; p<pvl && count<limit; p++) {
+            for (int p=0; p<pvl && bind_more(count, limit); p++) {
 	    fs_ptree *pt = fs_backend_get_ptree(be, pv->data[p], 1);
 	    if (pt) {
-		for (int o=0; o<ovl && count<limit; o++) {
+		for (int o=0; o<ovl && bind_more(count, limit); o++) {
 		    fs_rid pk = ov->data[o];
-		    for (int m=0; m<ml && count<limit; m++) {
-			for (int s=0; s<sl && count<limit; s++) {
+		    for (int m=0; m<ml && bind_more(count, limit); m++) {
+			for (int s=0; s<sl && bind_more(count, limit); s++) {
 			    fs_rid pair[2] = { FS_RID_NULL, FS_RID_NULL };
 			    if (mvl) pair[0] = mv->data[m];
 			    if (svl) pair[1] = sv->data[s];
 			    fs_ptree_it *it = fs_ptree_search(pt, pk, pair);
-			    while (it && fs_ptree_it_next(it, pair) && count<limit) {
+			    while (it && fs_ptree_it_next(it, pair) && bind_more(count, limit)) {
 				const fs_rid quad[4] = {
 				    pair[0], pair[1], pv->data[p], pk
 				};
@@ -488,18 +492,18 @@ fs_error(LOG_INFO, "bind() branch");
 	} else {
 	    const int ml = mvl ? mvl : 1;
 	    const int sl = svl ? svl : 1;
-	    for (int p=0; p<pvl && count<limit; p++) {
+	    for (int p=0; p<pvl && bind_more(count, limit); p++) {
 		fs_ptree *pt = fs_backend_get_ptree(be, pv->data[p], 1);
 		if (!pt) continue;
 		/* we need values from teh same row for o and p */
 		fs_rid pk = ov->data[p];
 		for (int m=0; m<ml; m++) {
-		    for (int s=0; s<sl && count<limit; s++) {
+		    for (int s=0; s<sl && bind_more(count, limit); s++) {
 			fs_rid pair[2] = { FS_RID_NULL, FS_RID_NULL };
 			if (mvl) pair[0] = mv->data[m];
 			if (svl) pair[1] = sv->data[s];
 			fs_ptree_it *it = fs_ptree_search(pt, pk, pair);
-			while (it && fs_ptree_it_next(it, pair) && count<limit) {
+			while (it && fs_ptree_it_next(it, pair) && bind_more(count, limit)) {
 			    const fs_rid quad[4] = {
 				pair[0], pair[1], pv->data[p], pk
 			    };
@@ -520,19 +524,19 @@ fs_error(LOG_INFO, "bind() branch");
 #endif
 	    const int ml = mvl ? mvl : 1;
 	    const int ol = ovl ? ovl : 1;
-	    for (int p=0; p<be->ptree_length && count<limit; p++) {
+	    for (int p=0; p<be->ptree_length && bind_more(count, limit); p++) {
                 fs_backend_ptree_limited_open(be, p);
 		fs_ptree *pt = be->ptrees_priv[p].ptree_s;
 		if (!pt) continue;
-		for (int s=0; s<svl && count<limit; s++) {
+		for (int s=0; s<svl && bind_more(count, limit); s++) {
 		    fs_rid pk = sv->data[s];
 		    fs_rid pair[2] = { FS_RID_NULL, FS_RID_NULL };
-		    for (int m=0; m<ml && count<limit; m++) {
-			for (int o=0; o<ol && count<limit; o++) {
+		    for (int m=0; m<ml && bind_more(count, limit); m++) {
+			for (int o=0; o<ol && bind_more(count, limit); o++) {
 			    if (mvl) pair[0] = mv->data[m];
 			    if (ovl) pair[1] = ov->data[o];
 			    fs_ptree_it *it = fs_ptree_search(pt, pk, pair);
-			    while (it && fs_ptree_it_next(it, pair) && count<limit) {
+			    while (it && fs_ptree_it_next(it, pair) && bind_more(count, limit)) {
 				const fs_rid quad[4] =
 				    { pair[0], pk, be->ptrees_priv[p].pred, pair[1] };
 				if (!bind_same(quad, tobind)) continue;
@@ -551,19 +555,19 @@ fs_error(LOG_INFO, "bind() branch");
 #endif
 	    const int ml = mvl ? mvl : 1;
 	    const int sl = svl ? svl : 1;
-	    for (int p=0; p<be->ptree_length && count<limit; p++) {
+	    for (int p=0; p<be->ptree_length && bind_more(count, limit); p++) {
                 fs_backend_ptree_limited_open(be, p);
 		fs_ptree *pt = be->ptrees_priv[p].ptree_o;
 		if (!pt) continue;
-		for (int o=0; o<ovl && count<limit; o++) {
+		for (int o=0; o<ovl && bind_more(count, limit); o++) {
 		    fs_rid pk = ov->data[o];
 		    fs_rid pair[2] = { FS_RID_NULL, FS_RID_NULL };
-		    for (int m=0; m<ml && count<limit; m++) {
-			for (int s=0; s<sl && count<limit; s++) {
+		    for (int m=0; m<ml && bind_more(count, limit); m++) {
+			for (int s=0; s<sl && bind_more(count, limit); s++) {
 			    if (mvl) pair[0] = mv->data[m];
 			    if (svl) pair[1] = sv->data[s];
 			    fs_ptree_it *it = fs_ptree_search(pt, pk, pair);
-			    while (it && fs_ptree_it_next(it, pair) && count<limit) {
+			    while (it && fs_ptree_it_next(it, pair) && bind_more(count, limit)) {
 				const fs_rid quad[4] =
 				    { pair[0], pair[1], be->ptrees_priv[p].pred, pk };
 				if (!bind_same(quad, tobind)) continue;
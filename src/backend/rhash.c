@@ -108,6 +108,12 @@ struct _fs_rhash {
     int z_buffer_size;
 };
 
+struct _fs_rhash_it {
+    fs_rhash *rh;
+    uint32_t entry;
+    uint32_t length;
+};
+
 /* this is much wider than it needs to be to match fs_list requirements */
 struct prefix_file_line {
     uint32_t code;
@@ -748,6 +754,48 @@ int fs_rhash_get_multi(fs_rhash *rh, fs_resource *res, int count)
     return ret;
 }
 
+fs_rhash_it *fs_rhash_scan(fs_rhash *rh)
+{
+    fs_rhash_it *it = calloc(1, sizeof(fs_rhash_it));
+    it->rh = rh;
+    it->length = rh->size * rh->bucket_size;
+    if (!rh->locked) flock(rh->fd, LOCK_SH);
+
+    /* the table is read front to back, let the kernel read ahead */
+    const size_t len = sizeof(struct rhash_header) + ((size_t) it->length) * sizeof(fs_rhash_entry);
+    posix_madvise((char *)rh->entries - sizeof(struct rhash_header), len, POSIX_MADV_SEQUENTIAL);
+
+    return it;
+}
+
+int fs_rhash_scan_next(fs_rhash_it *it, fs_resource *res)
+{
+    while (it->entry < it->length) {
+        fs_rhash_entry *e = it->rh->entries + it->entry++;
+        if (!e->rid) continue;
+
+        res->rid = e->rid;
+        res->lex = NULL;
+        if (get_entry(it->rh, e, res)) {
+            fs_error(LOG_ERR, "failed to get entry for %016llx", e->rid);
+            free(res->lex);
+
+            continue;
+        }
+
+        return 1;
+    }
+
+    return 0;
+}
+
+void fs_rhash_it_free(fs_rhash_it *it)
+{
+    if (!it) return;
+    if (!it->rh->locked) flock(it->rh->fd, LOCK_UN);
+    free(it);
+}
+
 void fs_rhash_print(fs_rhash *rh, FILE *out, int verbosity)
 {
     if (!rh) {
@@ -4,6 +4,7 @@
 #include "backend.h"
 
 typedef struct _fs_rhash fs_rhash;
+typedef struct _fs_rhash_it fs_rhash_it;
 
 fs_rhash *fs_rhash_open(fs_backend *be, const char *label, int flags);
 fs_rhash *fs_rhash_open_filename(const char *filename, int flags);
@@ -16,6 +17,11 @@ int fs_rhash_put(fs_rhash *rh, fs_resource *res);
 int fs_rhash_get_multi(fs_rhash *rh, fs_resource *res, int count);
 int fs_rhash_put_multi(fs_rhash *rh, fs_resource *res, int count);
 
+/* walk every stored resource in table order, caller frees res->lex */
+fs_rhash_it *fs_rhash_scan(fs_rhash *rh);
+int fs_rhash_scan_next(fs_rhash_it *it, fs_resource *res);
+void fs_rhash_it_free(fs_rhash_it *it);
+
 void fs_rhash_print(fs_rhash *rh, FILE *out, int verbosity);
 
 /* return number of unique resources stored */
@@ -28,6 +28,8 @@
 #include "query-backend.h"
 #include "import-backend.h"
 #include "disk-space.h"
+#include "transaction.h"
+#include "textindex.h"
 
 #include <stdlib.h>
 #include <unistd.h>
@@ -80,7 +82,11 @@ static unsigned char *handle_insert_resource(fs_backend *be, fs_segment segment,
     length -= offset;
   }
 
-  fs_res_import(be, segment, count, resources);
+  if (fs_trans_check(be)) {
+    fs_trans_log_resources(be, segment, k, resources);
+  } else if (!fs_redo_resources(be, segment, k, resources)) {
+    fs_res_import(be, segment, count, resources);
+  }
   free(resources);
 
   return NULL; /* no reply - semi-async */
@@ -100,7 +106,9 @@ static unsigned char * handle_commit_resource (fs_backend *be, fs_segment segmen
     return fsp_error_new(segment, "extraneous content");
   }
 
-  fs_res_import_commit(be, segment, 1);
+  if (!fs_trans_check(be) && !fs_redo_deferring(be)) {
+    fs_res_import_commit(be, segment, 1);
+  }
 
   return message_new(FS_DONE_OK, segment, 0);
 }
@@ -125,7 +133,14 @@ static unsigned char * handle_insert_quad (fs_backend *be, fs_segment segment,
   fs_rid (*buffer)[4] = (fs_rid (*)[4]) (content + 8);
 
   memcpy(&flags, content, sizeof (flags));
-  int ret = fs_quad_import(be, segment, flags, count, buffer);
+  int ret;
+  if (fs_trans_check(be)) {
+    ret = fs_trans_log_quads(be, segment, flags, count, buffer);
+  } else if (fs_redo_quads(be, segment, flags, count, buffer)) {
+    ret = 0;
+  } else {
+    ret = fs_quad_import(be, segment, flags, count, buffer);
+  }
   if (ret) {
     fs_error(LOG_ERR, "insert_quad(%d) failed", segment);
     return fsp_error_new(segment, "quad insert failed");
@@ -151,11 +166,25 @@ static unsigned char * handle_commit_quad (fs_backend *be, fs_segment segment,
   int flags;
 
   memcpy(&flags, content, sizeof (flags));
+  if (fs_trans_check(be)) {
+    if (fs_trans_log_quad_commit(be, segment, flags)) {
+      return fsp_error_new(segment, "transaction log write failed");
+    }
+
+    return message_new(FS_DONE_OK, segment, 0);
+  }
+  if (fs_redo_deferring(be)) {
+    /* the quads are logged when the import stops */
+    return message_new(FS_DONE_OK, segment, 0);
+  }
   int ret = fs_quad_import_commit(be, segment, flags, 1);
   if (ret) {
     fs_error(LOG_ERR, "commit_quad(%d) failed", segment);
     return fsp_error_new(segment, "quad commit failed");
   }
+  if (fs_backend_publish(be)) {
+    return fsp_error_new(segment, "publish failed");
+  }
 
   return message_new(FS_DONE_OK, segment, 0);
 }
@@ -169,6 +198,9 @@ static unsigned char * handle_price (fs_backend *be, fs_segment segment,
     return fsp_error_new(segment, "invalid segment number");
   }
 
+  /* updates in the redo log have to be in the indexes before we read */
+  fs_redo_apply(be, 1);
+
   if (length < 24) {
     fs_error(LOG_ERR, "price(%d) much too short", segment);
     return fsp_error_new(segment, "much too short");
@@ -231,7 +263,18 @@ static unsigned char * handle_delete_models (fs_backend *be, fs_segment segment,
   models.size = models.length  = length / sizeof(fs_rid);
   models.data = (fs_rid *) content;
 
+  if (fs_trans_check(be)) {
+    if (fs_trans_log_delete_models(be, segment, &models)) {
+      return fsp_error_new(segment, "transaction log write failed");
+    }
+
+    return message_new(FS_DONE_OK, segment, 0);
+  }
+  fs_redo_apply(be, 1);
   fs_delete_models(be, segment, &models);
+  if (fs_backend_publish(be)) {
+    return fsp_error_new(segment, "publish failed");
+  }
 
   return message_new(FS_DONE_OK, segment, 0);
 }
@@ -251,16 +294,27 @@ static unsigned char * handle_new_models (fs_backend *be, fs_segment segment,
   }
 
   fs_rid *models = (fs_rid *) content;
+  const int in_trans = fs_trans_check(be);
+  if (!in_trans) fs_redo_apply(be, 1);
 
   int invalid_count = 0;
   for (int k= 0; k < (length / sizeof(fs_rid)); ++k) {
-    if (FS_IS_URI(models[k])) {
-      fs_backend_model_set_usage(be, segment, models[k], 0);
-    } else {
+    if (!FS_IS_URI(models[k])) {
       invalid_count++;
+    } else if (!in_trans) {
+      fs_backend_model_set_usage(be, segment, models[k], 0);
+    }
+  }
+  if (in_trans) {
+    if (fs_trans_log_new_models(be, segment, length / sizeof(fs_rid), models)) {
+      return fsp_error_new(segment, "transaction log write failed");
+    }
+  } else {
+    fs_mhash_flush(be->models);
+    if (fs_backend_publish(be)) {
+      return fsp_error_new(segment, "publish failed");
     }
   }
-  fs_mhash_flush(be->models);
 
   if (invalid_count > 0) {
     return fsp_error_new(segment, "one or more model RIDs is not a URI");
@@ -289,6 +343,7 @@ static unsigned char * handle_start_import (fs_backend *be, fs_segment segment,
   }
 
   fs_start_import(be, segment);
+  fs_redo_start(be);
 
   return message_new(FS_DONE_OK, segment, 0);
 }
@@ -307,7 +362,15 @@ static unsigned char * handle_stop_import (fs_backend *be, fs_segment segment,
     return fsp_error_new(segment, "extraneous content");
   }
 
-  int ret = fs_stop_import(be, segment);
+  int trans = fs_trans_check(be);
+  int ret = fs_redo_stop(be, segment);
+  if (ret == -1) {
+    ret = fs_stop_import(be, segment);
+    if (fs_backend_publish(be)) ret = 1;
+  }
+  if (!ret && !trans) {
+    fs_textindex_commit(be->text);
+  }
 
   if (ret) {
     return fsp_error_new(segment, "insert failed");
@@ -355,8 +418,19 @@ static unsigned char * handle_delete_quads (fs_backend *be, fs_segment segment,
   objects.data = (fs_rid *) content;
 
   fs_rid_vector *args[4] = { &models, &subjects, &predicates, &objects };
+  if (fs_trans_check(be)) {
+    if (fs_trans_log_delete_quads(be, args)) {
+      return fsp_error_new(segment, "transaction log write failed");
+    }
+
+    return message_new(FS_DONE_OK, 0, 0);
+  }
+  fs_redo_apply(be, 1);
   fs_delete_quads(be, args);
   /* FIXME, should check return value */
+  if (fs_backend_publish(be)) {
+    return fsp_error_new(segment, "publish failed");
+  }
 
   return message_new(FS_DONE_OK, 0, 0);
 }
@@ -381,6 +455,104 @@ static unsigned char * handle_get_uuid (fs_backend *be, fs_segment segment,
   return reply;
 }
 
+static unsigned char * handle_get_generation (fs_backend *be, fs_segment segment,
+                                              unsigned int length,
+                                              unsigned char *content)
+{
+  if (segment > be->segments) {
+    fs_error(LOG_ERR, "invalid segment number: %d", segment);
+    return fsp_error_new(segment, "invalid segment number");
+  }
+
+  if (length > 0) {
+    fs_error(LOG_ERR, "get_generation(%d) extraneous content", segment);
+    return fsp_error_new(segment, "extraneous content");
+  }
+
+  unsigned long long generation;
+  if (fs_backend_get_generation(be, &generation)) {
+    return fsp_error_new(segment, "generation unavailable");
+  }
+
+  unsigned char *reply = message_new(FS_GENERATION, segment, sizeof(generation));
+  memcpy(reply + FS_HEADER, &generation, sizeof(generation));
+
+  return reply;
+}
+
+static unsigned char * handle_text_insert (fs_backend *be, fs_segment segment,
+                                           unsigned int length,
+                                           unsigned char *content)
+{
+  if (segment > be->segments) {
+    fs_error(LOG_ERR, "invalid segment number: %d", segment);
+  }
+
+  if (length < 8) {
+    fs_error(LOG_ERR, "text_insert(%d) too short", segment);
+    /* can't reply - semi-async */
+    return NULL;
+  }
+
+  int k, count;
+  unsigned char *record = content + 8;
+
+  memcpy(&count, content, sizeof (count));
+  fs_resource *resources = calloc(count, sizeof(fs_resource));
+
+  for (k = 0; k < count; ++k) {
+    unsigned int offset;
+    memcpy(&resources[k].rid, record, sizeof(fs_rid));
+    memcpy(&resources[k].attr, record + 8, sizeof(fs_rid));
+    memcpy(&offset, record + 16, sizeof(offset));
+    resources[k].lex = (char *) record + 20;
+    if (offset > length) {
+      fs_error(LOG_ERR, "text_insert(%d) recv'd invalid offset", segment);
+      break;
+    }
+    record += offset;
+    length -= offset;
+  }
+
+  /* indexed when the import stops, or the transaction commits */
+  fs_textindex_add(be->text, k, resources);
+  free(resources);
+
+  return NULL; /* no reply - semi-async */
+}
+
+static unsigned char * handle_text_search (fs_backend *be, fs_segment segment,
+                                           unsigned int length,
+                                           unsigned char *content)
+{
+  if (segment > be->segments) {
+    fs_error(LOG_ERR, "invalid segment number: %d", segment);
+    return fsp_error_new(segment, "invalid segment number");
+  }
+
+  fs_redo_apply(be, 1);
+
+  if (length < 9 || content[length - 1] != '\0') {
+    fs_error(LOG_ERR, "text_search(%d) malformed query", segment);
+    return fsp_error_new(segment, "malformed query");
+  }
+
+  int limit;
+  memcpy(&limit, content, sizeof(int));
+
+  fs_text_match *matches = NULL;
+  int count = fs_textindex_search(be->text, (char *) content + 8, limit, &matches);
+  if (count < 0) {
+    return fsp_error_new(segment, "text search failed");
+  }
+
+  unsigned char *reply = message_new(FS_TEXT_MATCHES, segment, count * sizeof(fs_text_match));
+  memcpy(reply + FS_HEADER, matches, count * sizeof(fs_text_match));
+  free(matches);
+
+  return reply;
+}
+
 static unsigned char * handle_get_size_reverse (fs_backend *be, fs_segment segment,
                                              unsigned int length,
                                              unsigned char *content)
@@ -390,6 +562,8 @@ static unsigned char * handle_get_size_reverse (fs_backend *be, fs_segment segme
     return fsp_error_new(segment, "invalid segment number");
   }
 
+  fs_redo_apply(be, 1);
+
   if (length > 0) {
     fs_error(LOG_ERR, "get_data_size(%d) extraneous content", segment);
     return fsp_error_new(segment, "extraneous content");
@@ -411,6 +585,8 @@ static unsigned char * handle_get_quad_freq (fs_backend *be, fs_segment segment,
     return fsp_error_new(segment, "invalid segment number");
   }
 
+  fs_redo_apply(be, 1);
+
   if (length != 8) {
     fs_error(LOG_ERR, "get_quad_freq(%d) wrong length %u", segment, length);
     return fsp_error_new(segment, "wrong length");
@@ -445,6 +621,8 @@ static unsigned char * handle_choose_segment (fs_backend *be, fs_segment segment
 
     return fsp_error_new(segment, "cannot open indexes");
   }
+  fs_trans_recover(be, segment);
+  fs_redo_apply(be, 1);
 
   return message_new(FS_DONE_OK, 0, 0);
 }
@@ -458,6 +636,8 @@ static unsigned char * handle_get_data_size (fs_backend *be, fs_segment segment,
     return fsp_error_new(segment, "invalid segment number");
   }
 
+  fs_redo_apply(be, 1);
+
   if (length > 0) {
     fs_error(LOG_ERR, "get_data_size(%d) extraneous content", segment);
     return fsp_error_new(segment, "extraneous content");
@@ -578,6 +758,8 @@ static unsigned char * handle_bind_limit (fs_backend *be, fs_segment segment,
     return fsp_error_new(segment, "invalid segment number");
   }
 
+  fs_redo_apply(be, 1);
+
   if (length < 32) {
     fs_error(LOG_ERR, "bind_limit(%d) much too short", segment);
     return fsp_error_new(segment, "much too short");
@@ -631,6 +813,9 @@ static unsigned char * handle_bind_limit (fs_backend *be, fs_segment segment,
     /* NULL => no match */
     reply = message_new(FS_NO_MATCH, segment, 0);
     cols = 0;
+  } else if (fsp_bind_abandoned()) {
+    /* out of time or cancelled, the frontend won't use a partial answer */
+    reply = message_new(FS_NO_MATCH, segment, 0);
   } else if (cols == 0) {
     /* Zero columns => match with no binding */
     reply = message_new(FS_BIND_LIST, segment, 0);
@@ -664,6 +849,8 @@ static unsigned char * handle_reverse_bind (fs_backend *be, fs_segment segment,
     return fsp_error_new(segment, "invalid segment number");
   }
 
+  fs_redo_apply(be, 1);
+
   if (length < 32) {
     fs_error(LOG_ERR, "reverse_bind(%d) much too short", segment);
     return fsp_error_new(segment, "much too short");
@@ -752,6 +939,8 @@ static unsigned char * handle_bind_first (fs_backend *be, fs_segment segment,
     return fsp_error_new(segment, "invalid segment number");
   }
 
+  fs_redo_apply(be, 1);
+
   if (length < 32) {
     fs_error(LOG_ERR, "bind_first(%d) much too short", segment);
     return fsp_error_new(segment, "much too short");
@@ -910,6 +1099,8 @@ static unsigned char * handle_resolve_attr (fs_backend *be, fs_segment segment,
     return fsp_error_new(segment, "invalid segment number");
   }
 
+  fs_redo_apply(be, 1);
+
   if (length < sizeof(fs_rid)) {
     fs_error(LOG_ERR, "resolve_attr(%d) too short", segment);
     return fsp_error_new(segment, "too short");
@@ -1048,6 +1239,14 @@ static unsigned char * handle_transaction (fs_backend *be,
   } else if (ret) {
     return fsp_error_new(segment, "transaction error");
   }
+  if (*content == FS_TRANS_COMMIT) {
+    fs_textindex_commit(be->text);
+    if (fs_backend_publish(be)) {
+      return fsp_error_new(segment, "publish failed");
+    }
+  } else if (*content == FS_TRANS_ROLLBACK) {
+    fs_textindex_discard(be->text);
+  }
 
   return message_new(FS_DONE_OK, 0, 0);
 }
@@ -1057,7 +1256,11 @@ static unsigned char * handle_lock (fs_backend *be,
                                     unsigned int length,
                                     unsigned char *content)
 {
-  return fsp_error_new(segment, "radix backend does not support/require locking");
+  if (fs_trans_lock(be)) {
+    return fsp_error_new(segment, "another commit is in progress");
+  }
+
+  return message_new(FS_DONE_OK, 0, 0);
 }
 
 static unsigned char * handle_unlock (fs_backend *be,
@@ -1065,8 +1268,9 @@ static unsigned char * handle_unlock (fs_backend *be,
                                       unsigned int length,
                                       unsigned char *content)
 {
-  /* this is currently a NOOP, the COMMIT phase closes the lock implicitly, so
-   * theres no need to here */
+  /* the COMMIT and ROLLBACK phases release the lock implicitly, this is only
+   * needed by frontends that give up before either */
+  fs_trans_unlock(be);
 
   return message_new(FS_DONE_OK, 0, 0);
 }
@@ -1100,6 +1304,7 @@ fsp_backend native_backend = {
   .bind_done = handle_bind_done,
   .open = fs_backend_init,
   .close = fs_backend_fini,
+  .idle = fs_redo_idle,
   .segment_count = segment_count,
   .transaction = handle_transaction,
   .node_segments = handle_node_segments,
@@ -1110,6 +1315,9 @@ fsp_backend native_backend = {
   .get_quad_freq = handle_get_quad_freq,
   .choose_segment = handle_choose_segment,
   .get_uuid = handle_get_uuid,
+  .get_generation = handle_get_generation,
+  .text_insert = handle_text_insert,
+  .text_search = handle_text_search,
 };
 
 
@@ -0,0 +1,1250 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <math.h>
+#include <glib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "backend.h"
+#include "textindex.h"
+#include "../common/params.h"
+#include "../common/4s-store-root.h"
+#include "../common/error.h"
+
+#define RUN_ID 0x4a585430  /* JXT0 */
+#define RUNS_ID 0x4a585230 /* JXR0 */
+#define RUN_REVISION 1
+
+/* characters that separate tokens, the same as for fs:token */
+#define TEXT_BOUNDARY " \n\t\r!@$%^&*()-_=+[]{};:\"\\|<>,./?#"
+#define TEXT_MAX_TOKEN 64  /* longer tokens aren't indexed */
+#define TEXT_MAX_CLAUSES 32
+#define TEXT_MAX_PHRASE 16
+
+/* BM25 parameters */
+#define BM25_K1 1.2
+#define BM25_B 0.75
+
+#define PAD8(l) (((l) + 7) & ~7)
+
+/* a run file is the header, then the doc, term, lex, posting and position
+ * sections at the offsets it gives */
+struct run_header {
+    int32_t id;
+    int32_t revision;
+    int64_t docs;
+    int64_t tokens;      /* in all the docs, for the average length */
+    int64_t terms;
+    int64_t doc_offset;
+    int64_t term_offset;
+    int64_t lex_offset;
+    int64_t post_offset;
+    int64_t pos_offset;
+    int64_t length;      /* of the whole file */
+    char padding[48];
+};
+
+/* sorted by rid */
+struct text_doc {
+    fs_rid rid;
+    uint32_t length;     /* in tokens */
+    uint32_t padding;
+};
+
+/* sorted by lex, bytewise, so terms with a common prefix are together */
+struct text_term {
+    uint64_t lex;        /* offset into the lex section */
+    uint64_t postings;   /* index of the first posting */
+    uint32_t lex_len;
+    uint32_t df;         /* number of postings */
+    uint32_t max_tf;     /* for the upper bound of the term's score */
+    uint32_t min_length;
+};
+
+/* a term's postings are sorted by rid */
+struct text_posting {
+    fs_rid rid;
+    uint32_t tf;
+    uint32_t length;     /* of the doc, so scoring doesn't need a lookup */
+    uint64_t pos;        /* index of the first of tf positions */
+};
+
+/* text.runs, followed by count run numbers, oldest first */
+struct runs_header {
+    int32_t id;
+    int32_t revision;
+    uint32_t next;       /* number for the next new run */
+    uint32_t count;
+};
+
+struct text_run {
+    uint32_t number;
+    void *map;
+    size_t size;
+    const struct run_header *header;
+    const struct text_doc *docs;
+    const struct text_term *terms;
+    const char *lex;
+    const struct text_posting *postings;
+    const uint32_t *positions;
+};
+
+struct pending_doc {
+    fs_rid rid;
+    char lex[];
+};
+
+struct _fs_textindex {
+    fs_backend *be;
+    int flags;
+    GPtrArray *pending;  /* struct pending_doc, waiting for a commit */
+    struct text_run **runs;
+    int run_count;
+    uint32_t next_run;
+    int lock_fd;
+};
+
+static char *runs_filename(fs_textindex *ti)
+{
+    return g_strdup_printf(fs_get_text_runs_format(), fs_backend_get_kb(ti->be),
+                           fs_backend_get_segment(ti->be));
+}
+
+static char *run_filename(fs_textindex *ti, uint32_t number)
+{
+    return g_strdup_printf(fs_get_text_run_format(), fs_backend_get_kb(ti->be),
+                           fs_backend_get_segment(ti->be), number);
+}
+
+fs_textindex *fs_textindex_open(fs_backend *be, int flags)
+{
+    fs_textindex *ti = calloc(1, sizeof(fs_textindex));
+    ti->be = be;
+    ti->flags = flags;
+    ti->pending = g_ptr_array_new();
+    ti->lock_fd = -1;
+
+    return ti;
+}
+
+static void run_unmap(struct text_run *run)
+{
+    munmap(run->map, run->size);
+    free(run);
+}
+
+/* sets errno to ENOENT if the run has been merged away */
+static struct text_run *run_map(fs_textindex *ti, uint32_t number)
+{
+    char *fn = run_filename(ti, number);
+    int fd = open(fn, FS_O_NOATIME | O_RDONLY);
+    if (fd == -1) {
+        int err = errno;
+        if (err != ENOENT) {
+            fs_error(LOG_ERR, "failed to open %s: %s", fn, strerror(err));
+        }
+        g_free(fn);
+        errno = err;
+
+        return NULL;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    void *map = NULL;
+    if (st.st_size >= sizeof(struct run_header)) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (!map || map == MAP_FAILED) {
+        fs_error(LOG_ERR, "failed to map %s", fn);
+        g_free(fn);
+        errno = EINVAL;
+
+        return NULL;
+    }
+
+    const struct run_header *h = map;
+    if (h->id != RUN_ID || h->revision != RUN_REVISION ||
+        h->length != st.st_size || h->pos_offset > h->length) {
+        fs_error(LOG_ERR, "%s is not a valid text index run", fn);
+        munmap(map, st.st_size);
+        g_free(fn);
+        errno = EINVAL;
+
+        return NULL;
+    }
+    g_free(fn);
+
+    struct text_run *run = calloc(1, sizeof(struct text_run));
+    run->number = number;
+    run->map = map;
+    run->size = st.st_size;
+    run->header = h;
+    run->docs = (const struct text_doc *)((char *)map + h->doc_offset);
+    run->terms = (const struct text_term *)((char *)map + h->term_offset);
+    run->lex = (const char *)map + h->lex_offset;
+    run->postings = (const struct text_posting *)((char *)map + h->post_offset);
+    run->positions = (const uint32_t *)((char *)map + h->pos_offset);
+
+    return run;
+}
+
+static int run_listed(struct text_run **runs, int count, struct text_run *run)
+{
+    for (int i=0; i<count; i++) {
+        if (runs[i] == run) return 1;
+    }
+
+    return 0;
+}
+
+/* bring our mapped runs in line with text.runs, keeping those we already
+ * have as runs never change once they're written */
+static int load_runs(fs_textindex *ti)
+{
+    for (int attempt = 0; attempt < 3; attempt++) {
+        char *fn = runs_filename(ti);
+        int fd = open(fn, FS_O_NOATIME | O_RDONLY);
+        struct runs_header h = { RUNS_ID, RUN_REVISION, 0, 0 };
+        uint32_t *numbers = NULL;
+        if (fd == -1) {
+            if (errno != ENOENT) {
+                fs_error(LOG_ERR, "failed to open %s: %s", fn, strerror(errno));
+                g_free(fn);
+
+                return 1;
+            }
+        } else {
+            if (read(fd, &h, sizeof(h)) != sizeof(h) || h.id != RUNS_ID ||
+                h.revision != RUN_REVISION) {
+                fs_error(LOG_ERR, "%s is not a valid text index", fn);
+                close(fd);
+                g_free(fn);
+
+                return 1;
+            }
+            numbers = malloc(h.count * sizeof(uint32_t) + 1);
+            if (read(fd, numbers, h.count * sizeof(uint32_t)) !=
+                h.count * sizeof(uint32_t)) {
+                fs_error(LOG_ERR, "%s is truncated", fn);
+                free(numbers);
+                close(fd);
+                g_free(fn);
+
+                return 1;
+            }
+            close(fd);
+        }
+        g_free(fn);
+
+        struct text_run **runs = calloc(h.count + 1, sizeof(struct text_run *));
+        int failed = 0;
+        for (int i=0; i<h.count && !failed; i++) {
+            for (int j=0; j<ti->run_count; j++) {
+                if (ti->runs[j]->number == numbers[i]) {
+                    runs[i] = ti->runs[j];
+                    break;
+                }
+            }
+            if (!runs[i]) {
+                runs[i] = run_map(ti, numbers[i]);
+                if (!runs[i]) failed = errno == ENOENT ? 1 : 2;
+            }
+        }
+        free(numbers);
+
+        if (failed) {
+            for (int i=0; i<h.count; i++) {
+                if (runs[i] && !run_listed(ti->runs, ti->run_count, runs[i])) {
+                    run_unmap(runs[i]);
+                }
+            }
+            free(runs);
+            /* a commit merged it away while we were reading */
+            if (failed == 1) continue;
+
+            return 1;
+        }
+
+        for (int j=0; j<ti->run_count; j++) {
+            if (!run_listed(runs, h.count, ti->runs[j])) {
+                run_unmap(ti->runs[j]);
+            }
+        }
+        free(ti->runs);
+        ti->runs = runs;
+        ti->run_count = h.count;
+        ti->next_run = h.next;
+
+        return 0;
+    }
+    fs_error(LOG_ERR, "text index runs for segment %d keep changing",
+             fs_backend_get_segment(ti->be));
+
+    return 1;
+}
+
+static int write_runs(fs_textindex *ti, uint32_t next, int count,
+                      uint32_t numbers[])
+{
+    char *fn = runs_filename(ti);
+    char *tmp = g_strconcat(fn, ".tmp", NULL);
+    int fd = open(tmp, FS_O_NOATIME | O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        fs_error(LOG_ERR, "failed to create %s: %s", tmp, strerror(errno));
+        g_free(tmp);
+        g_free(fn);
+
+        return 1;
+    }
+    struct runs_header h = { RUNS_ID, RUN_REVISION, next, count };
+    int ret = 0;
+    if (write(fd, &h, sizeof(h)) != sizeof(h) ||
+        write(fd, numbers, count * sizeof(uint32_t)) != count * sizeof(uint32_t) ||
+        fdatasync(fd)) {
+        fs_error(LOG_ERR, "failed to write %s: %s", tmp, strerror(errno));
+        ret = 1;
+    }
+    close(fd);
+    if (!ret && rename(tmp, fn)) {
+        fs_error(LOG_ERR, "failed to rename %s: %s", tmp, strerror(errno));
+        ret = 1;
+    }
+    if (ret) unlink(tmp);
+    g_free(tmp);
+    g_free(fn);
+
+    return ret;
+}
+
+static int text_lock(fs_textindex *ti, int op)
+{
+    if (ti->lock_fd == -1) {
+        char *fn = g_strdup_printf(fs_get_file_lock_format(),
+                                   fs_backend_get_kb(ti->be),
+                                   fs_backend_get_segment(ti->be), "text");
+        ti->lock_fd = open(fn, FS_O_NOATIME | O_RDWR | O_CREAT, 0600);
+        if (ti->lock_fd == -1) {
+            fs_error(LOG_ERR, "failed to open %s: %s", fn, strerror(errno));
+            g_free(fn);
+
+            return 1;
+        }
+        g_free(fn);
+    }
+    while (flock(ti->lock_fd, op) == -1) {
+        if (errno != EINTR) {
+            fs_error(LOG_ERR, "failed to lock text index: %s", strerror(errno));
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* tokens point into a lower cased string */
+struct token {
+    const char *str;
+    int len;
+    uint32_t pos;
+};
+
+static inline int boundary(char c)
+{
+    return !(c & 0x80) && strchr(TEXT_BOUNDARY, c);
+}
+
+/* appends the tokens of str to tokens, returns the number of tokens,
+ * including those too long to be indexed */
+static uint32_t tokenise(const char *str, GArray *tokens)
+{
+    uint32_t pos = 0;
+    const char *p = str;
+
+    while (*p) {
+        while (*p && boundary(*p)) p++;
+        if (!*p) break;
+        const char *start = p;
+        while (*p && !boundary(*p)) p++;
+        if (p - start <= TEXT_MAX_TOKEN) {
+            struct token t = { start, p - start, pos };
+            g_array_append_val(tokens, t);
+        }
+        pos++;
+    }
+
+    return pos;
+}
+
+static int lex_cmp(const char *a, int alen, const char *b, int blen)
+{
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    if (c) return c;
+
+    return alen - blen;
+}
+
+static int token_cmp(const void *va, const void *vb)
+{
+    const struct token *a = va;
+    const struct token *b = vb;
+    int c = lex_cmp(a->str, a->len, b->str, b->len);
+    if (c) return c;
+
+    return a->pos < b->pos ? -1 : a->pos > b->pos;
+}
+
+/* builds a run in memory, from new docs and the runs it replaces */
+struct build_term {
+    const char *lex;
+    int len;
+    GArray *postings;    /* pos indexes build->positions */
+    uint32_t max_tf;
+    uint32_t min_length;
+};
+
+struct build {
+    GHashTable *terms;
+    GStringChunk *strings;
+    GArray *docs;
+    GArray *positions;
+    int64_t tokens;
+};
+
+static void build_term_free(gpointer data)
+{
+    struct build_term *t = data;
+    g_array_free(t->postings, TRUE);
+    free(t);
+}
+
+static struct build *build_new(void)
+{
+    struct build *b = calloc(1, sizeof(struct build));
+    b->terms = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                     build_term_free);
+    b->strings = g_string_chunk_new(65536);
+    b->docs = g_array_new(FALSE, FALSE, sizeof(struct text_doc));
+    b->positions = g_array_new(FALSE, FALSE, sizeof(uint32_t));
+
+    return b;
+}
+
+static void build_free(struct build *b)
+{
+    g_hash_table_destroy(b->terms);
+    g_string_chunk_free(b->strings);
+    g_array_free(b->docs, TRUE);
+    g_array_free(b->positions, TRUE);
+    free(b);
+}
+
+static void build_posting(struct build *b, const char *lex, int len, fs_rid rid,
+                          uint32_t tf, uint32_t length, const uint32_t *pos)
+{
+    char key[TEXT_MAX_TOKEN + 1];
+    memcpy(key, lex, len);
+    key[len] = '\0';
+
+    struct build_term *t = g_hash_table_lookup(b->terms, key);
+    if (!t) {
+        t = calloc(1, sizeof(struct build_term));
+        t->lex = g_string_chunk_insert(b->strings, key);
+        t->len = len;
+        t->postings = g_array_new(FALSE, FALSE, sizeof(struct text_posting));
+        t->min_length = UINT32_MAX;
+        g_hash_table_insert(b->terms, (gpointer)t->lex, t);
+    }
+    struct text_posting p = { rid, tf, length, b->positions->len };
+    g_array_append_vals(b->positions, pos, tf);
+    g_array_append_val(t->postings, p);
+    if (tf > t->max_tf) t->max_tf = tf;
+    if (length < t->min_length) t->min_length = length;
+}
+
+static void build_doc(struct build *b, fs_rid rid, const char *text)
+{
+    gchar *lower = g_utf8_strdown(text, -1);
+    GArray *tokens = g_array_new(FALSE, FALSE, sizeof(struct token));
+    uint32_t length = tokenise(lower, tokens);
+
+    /* group each term's positions together, in order */
+    g_array_sort(tokens, token_cmp);
+    uint32_t *pos = malloc((tokens->len + 1) * sizeof(uint32_t));
+    struct token *tok = (struct token *)tokens->data;
+    for (int i=0; i<tokens->len; ) {
+        int tf = 0;
+        int j = i;
+        while (j < tokens->len && tok[j].len == tok[i].len &&
+               !memcmp(tok[j].str, tok[i].str, tok[i].len)) {
+            pos[tf++] = tok[j].pos;
+            j++;
+        }
+        build_posting(b, tok[i].str, tok[i].len, rid, tf, length, pos);
+        i = j;
+    }
+
+    struct text_doc doc = { rid, length, 0 };
+    g_array_append_val(b->docs, doc);
+    b->tokens += length;
+    free(pos);
+    g_array_free(tokens, TRUE);
+    g_free(lower);
+}
+
+static void build_run(struct build *b, const struct text_run *run)
+{
+    g_array_append_vals(b->docs, run->docs, run->header->docs);
+    b->tokens += run->header->tokens;
+    for (int64_t i=0; i<run->header->terms; i++) {
+        const struct text_term *t = &run->terms[i];
+        for (uint32_t j=0; j<t->df; j++) {
+            const struct text_posting *p = &run->postings[t->postings + j];
+            build_posting(b, run->lex + t->lex, t->lex_len, p->rid, p->tf,
+                          p->length, &run->positions[p->pos]);
+        }
+    }
+}
+
+static gint build_term_cmp(gconstpointer va, gconstpointer vb)
+{
+    const struct build_term *a = *(struct build_term * const *)va;
+    const struct build_term *b = *(struct build_term * const *)vb;
+
+    return lex_cmp(a->lex, a->len, b->lex, b->len);
+}
+
+static gint doc_cmp(gconstpointer va, gconstpointer vb)
+{
+    const struct text_doc *a = va;
+    const struct text_doc *b = vb;
+
+    return a->rid < b->rid ? -1 : a->rid > b->rid;
+}
+
+static gint posting_cmp(gconstpointer va, gconstpointer vb)
+{
+    const struct text_posting *a = va;
+    const struct text_posting *b = vb;
+
+    return a->rid < b->rid ? -1 : a->rid > b->rid;
+}
+
+static void collect_term(gpointer key, gpointer value, gpointer data)
+{
+    g_ptr_array_add(data, value);
+}
+
+static int build_write(fs_textindex *ti, struct build *b, uint32_t number)
+{
+    GPtrArray *terms = g_ptr_array_sized_new(g_hash_table_size(b->terms));
+    g_hash_table_foreach(b->terms, collect_term, terms);
+    g_ptr_array_sort(terms, build_term_cmp);
+    g_array_sort(b->docs, doc_cmp);
+
+    int64_t lex_size = 0, postings = 0;
+    for (int i=0; i<terms->len; i++) {
+        struct build_term *t = g_ptr_array_index(terms, i);
+        g_array_sort(t->postings, posting_cmp);
+        lex_size += t->len;
+        postings += t->postings->len;
+    }
+
+    struct run_header h;
+    memset(&h, 0, sizeof(h));
+    h.id = RUN_ID;
+    h.revision = RUN_REVISION;
+    h.docs = b->docs->len;
+    h.tokens = b->tokens;
+    h.terms = terms->len;
+    h.doc_offset = sizeof(h);
+    h.term_offset = h.doc_offset + h.docs * sizeof(struct text_doc);
+    h.lex_offset = h.term_offset + h.terms * sizeof(struct text_term);
+    h.post_offset = h.lex_offset + PAD8(lex_size);
+    h.pos_offset = h.post_offset + postings * sizeof(struct text_posting);
+    h.length = h.pos_offset + (int64_t)b->positions->len * sizeof(uint32_t);
+
+    char *fn = run_filename(ti, number);
+    FILE *f = fopen(fn, "w");
+    if (!f) {
+        fs_error(LOG_ERR, "failed to create %s: %s", fn, strerror(errno));
+        g_ptr_array_free(terms, TRUE);
+        g_free(fn);
+
+        return 1;
+    }
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(b->docs->data, sizeof(struct text_doc), b->docs->len, f);
+
+    uint64_t lex = 0, first = 0;
+    for (int i=0; i<terms->len; i++) {
+        struct build_term *t = g_ptr_array_index(terms, i);
+        struct text_term tt = { lex, first, t->len, t->postings->len,
+                                t->max_tf, t->min_length };
+        fwrite(&tt, sizeof(tt), 1, f);
+        lex += t->len;
+        first += t->postings->len;
+    }
+    for (int i=0; i<terms->len; i++) {
+        struct build_term *t = g_ptr_array_index(terms, i);
+        fwrite(t->lex, 1, t->len, f);
+    }
+    const char zeros[8] = { 0 };
+    fwrite(zeros, 1, PAD8(lex_size) - lex_size, f);
+
+    /* positions go in the same order as the postings that point to them */
+    uint64_t pos = 0;
+    for (int i=0; i<terms->len; i++) {
+        struct build_term *t = g_ptr_array_index(terms, i);
+        for (int j=0; j<t->postings->len; j++) {
+            struct text_posting p = g_array_index(t->postings, struct text_posting, j);
+            uint64_t from = p.pos;
+            p.pos = pos;
+            fwrite(&p, sizeof(p), 1, f);
+            pos += p.tf;
+            /* stash where they are now, for the next loop */
+            g_array_index(t->postings, struct text_posting, j).pos = from;
+        }
+    }
+    const uint32_t *positions = (const uint32_t *)b->positions->data;
+    for (int i=0; i<terms->len; i++) {
+        struct build_term *t = g_ptr_array_index(terms, i);
+        for (int j=0; j<t->postings->len; j++) {
+            struct text_posting *p = &g_array_index(t->postings, struct text_posting, j);
+            fwrite(positions + p->pos, sizeof(uint32_t), p->tf, f);
+        }
+    }
+    g_ptr_array_free(terms, TRUE);
+
+    int ret = 0;
+    if (fflush(f) || ferror(f) || fdatasync(fileno(f))) {
+        fs_error(LOG_ERR, "failed to write %s: %s", fn, strerror(errno));
+        ret = 1;
+    }
+    fclose(f);
+    if (ret) unlink(fn);
+    g_free(fn);
+
+    return ret;
+}
+
+static int indexed(fs_textindex *ti, fs_rid rid)
+{
+    for (int r=0; r<ti->run_count; r++) {
+        const struct text_doc *docs = ti->runs[r]->docs;
+        int64_t lo = 0, hi = ti->runs[r]->header->docs;
+        while (lo < hi) {
+            int64_t mid = lo + (hi - lo) / 2;
+            if (docs[mid].rid < rid) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo < ti->runs[r]->header->docs && docs[lo].rid == rid) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int fs_textindex_add(fs_textindex *ti, int count, fs_resource res[])
+{
+    if (!ti) return 1;
+
+    for (int i=0; i<count; i++) {
+        if (!res[i].lex) continue;
+        size_t len = strlen(res[i].lex);
+        struct pending_doc *d = malloc(sizeof(struct pending_doc) + len + 1);
+        d->rid = res[i].rid;
+        memcpy(d->lex, res[i].lex, len + 1);
+        g_ptr_array_add(ti->pending, d);
+    }
+
+    return 0;
+}
+
+static gint pending_cmp(gconstpointer va, gconstpointer vb)
+{
+    const struct pending_doc *a = *(struct pending_doc * const *)va;
+    const struct pending_doc *b = *(struct pending_doc * const *)vb;
+
+    return a->rid < b->rid ? -1 : a->rid > b->rid;
+}
+
+int fs_textindex_commit(fs_textindex *ti)
+{
+    if (!ti || ti->pending->len == 0) {
+        return 0;
+    }
+    if (text_lock(ti, LOCK_EX)) {
+        fs_textindex_discard(ti);
+
+        return 1;
+    }
+    int ret = 1;
+    struct build *b = NULL;
+    if (load_runs(ti)) goto done;
+
+    b = build_new();
+    g_ptr_array_sort(ti->pending, pending_cmp);
+    fs_rid last = FS_RID_NULL;
+    for (int i=0; i<ti->pending->len; i++) {
+        struct pending_doc *d = g_ptr_array_index(ti->pending, i);
+        if (d->rid == last || indexed(ti, d->rid)) continue;
+        last = d->rid;
+        build_doc(b, d->rid, d->lex);
+    }
+    if (b->docs->len == 0) {
+        ret = 0;
+        goto done;
+    }
+
+    int64_t docs = b->docs->len;
+    int keep = ti->run_count;
+    while (keep > 0 && ti->runs[keep-1]->header->docs <= docs * 2) {
+        keep--;
+        build_run(b, ti->runs[keep]);
+        docs += ti->runs[keep]->header->docs;
+    }
+
+    uint32_t number = ti->next_run;
+    if (build_write(ti, b, number)) goto done;
+    uint32_t *numbers = malloc((keep + 1) * sizeof(uint32_t));
+    for (int i=0; i<keep; i++) {
+        numbers[i] = ti->runs[i]->number;
+    }
+    numbers[keep] = number;
+    int failed = write_runs(ti, number + 1, keep + 1, numbers);
+    free(numbers);
+    if (failed) {
+        char *fn = run_filename(ti, number);
+        unlink(fn);
+        g_free(fn);
+        goto done;
+    }
+    /* processes that have the merged runs mapped can carry on using them,
+     * anyone that looks again will see the new list */
+    for (int i=keep; i<ti->run_count; i++) {
+        char *fn = run_filename(ti, ti->runs[i]->number);
+        unlink(fn);
+        g_free(fn);
+    }
+    load_runs(ti);
+    ret = 0;
+
+done:
+    if (b) build_free(b);
+    text_lock(ti, LOCK_UN);
+    fs_textindex_discard(ti);
+
+    return ret;
+}
+
+void fs_textindex_discard(fs_textindex *ti)
+{
+    if (!ti) return;
+
+    for (int i=0; i<ti->pending->len; i++) {
+        free(g_ptr_array_index(ti->pending, i));
+    }
+    g_ptr_array_set_size(ti->pending, 0);
+}
+
+/* searching */
+
+enum clause_type {
+    CLAUSE_TERM,
+    CLAUSE_PREFIX,
+    CLAUSE_PHRASE
+};
+
+/* one clause's postings in one run, sorted by rid */
+struct plist {
+    const struct text_posting *p;
+    size_t n;
+    size_t at;
+    struct text_posting *owned;
+};
+
+struct clause {
+    enum clause_type type;
+    int terms;
+    char term[TEXT_MAX_PHRASE][TEXT_MAX_TOKEN + 1];
+    int len[TEXT_MAX_PHRASE];
+    uint32_t offset[TEXT_MAX_PHRASE]; /* of each phrase term from the first */
+    int64_t df;
+    uint32_t max_tf;
+    uint32_t min_length;
+    double idf;
+    double bound;        /* highest score it can give any doc */
+    struct plist *lists; /* one per run */
+};
+
+static void clause_add(struct clause *c, const struct token *t, uint32_t first)
+{
+    if (c->terms == TEXT_MAX_PHRASE) return;
+    memcpy(c->term[c->terms], t->str, t->len);
+    c->term[c->terms][t->len] = '\0';
+    c->len[c->terms] = t->len;
+    c->offset[c->terms] = t->pos - first;
+    c->terms++;
+}
+
+static int parse_query(const char *query, struct clause clauses[])
+{
+    gchar *lower = g_utf8_strdown(query, -1);
+    GArray *tokens = g_array_new(FALSE, FALSE, sizeof(struct token));
+    int n = 0;
+    char *p = lower;
+
+    while (*p && n < TEXT_MAX_CLAUSES) {
+        while (*p && g_ascii_isspace(*p)) p++;
+        if (!*p) break;
+        char *start, *end;
+        int prefix = 0;
+        if (*p == '"') {
+            start = ++p;
+            while (*p && *p != '"') p++;
+            end = p;
+            if (*p) p++;
+        } else {
+            start = p;
+            while (*p && !g_ascii_isspace(*p)) p++;
+            end = p;
+            prefix = end[-1] == '*';
+        }
+        char save = *end;
+        *end = '\0';
+        g_array_set_size(tokens, 0);
+        tokenise(start, tokens);
+        *end = save;
+
+        struct token *tok = (struct token *)tokens->data;
+        int count = tokens->len;
+        if (count == 0) continue;
+        if (prefix) {
+            /* foo-ba* is foo AND ba* */
+            for (int i=0; i<count && n < TEXT_MAX_CLAUSES; i++) {
+                memset(&clauses[n], 0, sizeof(struct clause));
+                clauses[n].type = i == count - 1 ? CLAUSE_PREFIX : CLAUSE_TERM;
+                clause_add(&clauses[n], &tok[i], tok[i].pos);
+                n++;
+            }
+        } else {
+            /* a word that splits into several tokens is a phrase too */
+            memset(&clauses[n], 0, sizeof(struct clause));
+            clauses[n].type = count == 1 ? CLAUSE_TERM : CLAUSE_PHRASE;
+            for (int i=0; i<count; i++) {
+                clause_add(&clauses[n], &tok[i], tok[0].pos);
+            }
+            n++;
+        }
+    }
+    g_array_free(tokens, TRUE);
+    g_free(lower);
+
+    return n;
+}
+
+/* index of the first term >= lex */
+static int64_t term_lower(const struct text_run *run, const char *lex, int len)
+{
+    int64_t lo = 0, hi = run->header->terms;
+    while (lo < hi) {
+        int64_t mid = lo + (hi - lo) / 2;
+        const struct text_term *t = &run->terms[mid];
+        if (lex_cmp(run->lex + t->lex, t->lex_len, lex, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+static const struct text_term *term_find(const struct text_run *run,
+                                         const char *lex, int len)
+{
+    int64_t i = term_lower(run, lex, len);
+    if (i < run->header->terms) {
+        const struct text_term *t = &run->terms[i];
+        if (!lex_cmp(run->lex + t->lex, t->lex_len, lex, len)) {
+            return t;
+        }
+    }
+
+    return NULL;
+}
+
+static void plist_term(struct plist *l, const struct text_run *run,
+                       const struct text_term *t)
+{
+    l->p = &run->postings[t->postings];
+    l->n = t->df;
+    l->at = 0;
+}
+
+/* moves the cursor to the first posting >= rid, galloping then binary
+ * searching, and returns true if it's for rid */
+static int skip_to(struct plist *l, fs_rid rid)
+{
+    size_t lo = l->at;
+    if (lo >= l->n) return 0;
+    if (l->p[lo].rid >= rid) return l->p[lo].rid == rid;
+
+    size_t step = 1, hi = lo + 1;
+    while (hi < l->n && l->p[hi].rid < rid) {
+        lo = hi;
+        step *= 2;
+        hi = lo + step;
+    }
+    if (hi > l->n) hi = l->n;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (l->p[mid].rid < rid) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    l->at = hi;
+
+    return hi < l->n && l->p[hi].rid == rid;
+}
+
+static int has_position(const uint32_t *pos, uint32_t n, uint32_t want)
+{
+    uint32_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (pos[mid] < want) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo < n && pos[lo] == want;
+}
+
+static void plist_phrase(struct plist *l, const struct text_run *run,
+                         struct clause *c)
+{
+    struct plist terms[TEXT_MAX_PHRASE];
+    int rarest = 0;
+    for (int i=0; i<c->terms; i++) {
+        const struct text_term *t = term_find(run, c->term[i], c->len[i]);
+        if (!t) return;
+        plist_term(&terms[i], run, t);
+        if (terms[i].n < terms[rarest].n) rarest = i;
+    }
+
+    GArray *out = g_array_new(FALSE, FALSE, sizeof(struct text_posting));
+    for (size_t d=0; d<terms[rarest].n; d++) {
+        fs_rid rid = terms[rarest].p[d].rid;
+        int all = 1;
+        for (int i=0; i<c->terms && all; i++) {
+            if (i != rarest) all = skip_to(&terms[i], rid);
+        }
+        if (!all) continue;
+
+        const struct text_posting *first = &terms[0].p[rarest ? terms[0].at : d];
+        const uint32_t *fpos = run->positions + first->pos;
+        uint32_t tf = 0;
+        for (uint32_t k=0; k<first->tf; k++) {
+            int match = 1;
+            for (int i=1; i<c->terms && match; i++) {
+                const struct text_posting *p = &terms[i].p[i == rarest ? d : terms[i].at];
+                match = has_position(run->positions + p->pos, p->tf,
+                                     fpos[k] + c->offset[i]);
+            }
+            if (match) tf++;
+        }
+        if (tf) {
+            struct text_posting p = { rid, tf, first->length, 0 };
+            g_array_append_val(out, p);
+        }
+    }
+    l->n = out->len;
+    l->owned = (struct text_posting *)g_array_free(out, FALSE);
+    l->p = l->owned;
+}
+
+static void plist_prefix(struct plist *l, const struct text_run *run,
+                         struct clause *c)
+{
+    GArray *out = g_array_new(FALSE, FALSE, sizeof(struct text_posting));
+    int expanded = 0;
+    for (int64_t i = term_lower(run, c->term[0], c->len[0]);
+         i < run->header->terms && expanded < FS_TEXT_PREFIX_MAX; i++) {
+        const struct text_term *t = &run->terms[i];
+        if (t->lex_len < c->len[0] ||
+            memcmp(run->lex + t->lex, c->term[0], c->len[0])) {
+            break;
+        }
+        g_array_append_vals(out, &run->postings[t->postings], t->df);
+        expanded++;
+    }
+
+    /* a doc matching more than one expansion gets their tfs summed */
+    g_array_sort(out, posting_cmp);
+    struct text_posting *p = (struct text_posting *)out->data;
+    size_t n = 0;
+    for (size_t i=0; i<out->len; i++) {
+        if (n > 0 && p[n-1].rid == p[i].rid) {
+            p[n-1].tf += p[i].tf;
+        } else {
+            p[n++] = p[i];
+        }
+    }
+    l->n = n;
+    l->owned = (struct text_posting *)g_array_free(out, FALSE);
+    l->p = l->owned;
+}
+
+static void clause_lists(struct clause *c, struct text_run **runs, int count)
+{
+    c->lists = calloc(count, sizeof(struct plist));
+    c->min_length = UINT32_MAX;
+    for (int r=0; r<count; r++) {
+        struct plist *l = &c->lists[r];
+        if (c->type == CLAUSE_TERM) {
+            const struct text_term *t = term_find(runs[r], c->term[0], c->len[0]);
+            if (t) {
+                plist_term(l, runs[r], t);
+                if (t->max_tf > c->max_tf) c->max_tf = t->max_tf;
+                if (t->min_length < c->min_length) c->min_length = t->min_length;
+            }
+        } else {
+            if (c->type == CLAUSE_PHRASE) {
+                plist_phrase(l, runs[r], c);
+            } else {
+                plist_prefix(l, runs[r], c);
+            }
+            for (size_t i=0; i<l->n; i++) {
+                if (l->p[i].tf > c->max_tf) c->max_tf = l->p[i].tf;
+                if (l->p[i].length < c->min_length) c->min_length = l->p[i].length;
+            }
+        }
+        c->df += l->n;
+    }
+}
+
+static inline double bm25(double idf, uint32_t tf, uint32_t length,
+                          double avgdl)
+{
+    return idf * (tf * (BM25_K1 + 1.0)) /
+           (tf + BM25_K1 * (1.0 - BM25_B + BM25_B * length / avgdl));
+}
+
+/* the best limit matches so far, in a heap with the worst at the top */
+struct heap {
+    fs_text_match *m;
+    int n;
+    int size;
+};
+
+static inline int worse(const fs_text_match *a, const fs_text_match *b)
+{
+    if (a->score != b->score) return a->score < b->score;
+
+    return a->rid > b->rid;
+}
+
+static void heap_offer(struct heap *h, fs_rid rid, double score)
+{
+    fs_text_match m = { rid, score };
+    int i;
+
+    if (h->n < h->size) {
+        i = h->n++;
+        while (i > 0 && worse(&m, &h->m[(i - 1) / 2])) {
+            h->m[i] = h->m[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        h->m[i] = m;
+
+        return;
+    }
+    if (!worse(&h->m[0], &m)) return;
+    i = 0;
+    for (;;) {
+        int c = 2 * i + 1;
+        if (c >= h->n) break;
+        if (c + 1 < h->n && worse(&h->m[c + 1], &h->m[c])) c++;
+        if (!worse(&h->m[c], &m)) break;
+        h->m[i] = h->m[c];
+        i = c;
+    }
+    h->m[i] = m;
+}
+
+static int match_cmp(const void *va, const void *vb)
+{
+    const fs_text_match *a = va;
+    const fs_text_match *b = vb;
+
+    return worse(a, b) ? 1 : worse(b, a) ? -1 : 0;
+}
+
+static int clause_cmp(const void *va, const void *vb)
+{
+    const struct clause *a = *(struct clause * const *)va;
+    const struct clause *b = *(struct clause * const *)vb;
+
+    return a->df < b->df ? -1 : a->df > b->df;
+}
+
+int fs_textindex_search(fs_textindex *ti, const char *query, int limit,
+                        fs_text_match **matches)
+{
+    *matches = NULL;
+    if (!ti) return -1;
+    if (limit <= 0 || limit > FS_TEXT_MAX_MATCHES) {
+        limit = FS_TEXT_MAX_MATCHES;
+    }
+    if (load_runs(ti)) {
+        return -1;
+    }
+
+    int64_t docs = 0, tokens = 0;
+    for (int r=0; r<ti->run_count; r++) {
+        docs += ti->runs[r]->header->docs;
+        tokens += ti->runs[r]->header->tokens;
+    }
+    struct clause *clauses = calloc(TEXT_MAX_CLAUSES, sizeof(struct clause));
+    int n = parse_query(query, clauses);
+    if (n == 0 || docs == 0) {
+        free(clauses);
+
+        return 0;
+    }
+    double avgdl = tokens ? (double)tokens / docs : 1.0;
+
+    /* every clause has to match, so start from the one with fewest docs */
+    struct clause *order[TEXT_MAX_CLAUSES];
+    int empty = 0;
+    for (int i=0; i<n; i++) {
+        struct clause *c = &clauses[i];
+        clause_lists(c, ti->runs, ti->run_count);
+        if (c->df == 0) empty = 1;
+        c->idf = log(1.0 + (docs - c->df + 0.5) / (c->df + 0.5));
+        c->bound = bm25(c->idf, c->max_tf, c->min_length, avgdl);
+        order[i] = c;
+    }
+    qsort(order, n, sizeof(struct clause *), clause_cmp);
+
+    /* rest[j] is the most clauses j onwards can add to a doc's score */
+    double rest[TEXT_MAX_CLAUSES + 1];
+    rest[n] = 0.0;
+    for (int j=n-1; j>=0; j--) {
+        rest[j] = rest[j+1] + order[j]->bound;
+    }
+
+    struct heap h = { calloc(limit, sizeof(fs_text_match)), 0, limit };
+    for (int r=0; r<ti->run_count && !empty; r++) {
+        const struct plist *lead = &order[0]->lists[r];
+        for (size_t i=0; i<lead->n; i++) {
+            /* nothing left can get into the top limit */
+            if (h.n == h.size && rest[0] < h.m[0].score) goto finished;
+            const struct text_posting *p = &lead->p[i];
+            double score = bm25(order[0]->idf, p->tf, p->length, avgdl);
+            int j;
+            for (j=1; j<n; j++) {
+                if (h.n == h.size && score + rest[j] < h.m[0].score) break;
+                struct plist *l = &order[j]->lists[r];
+                if (!skip_to(l, p->rid)) break;
+                score += bm25(order[j]->idf, l->p[l->at].tf, l->p[l->at].length,
+                              avgdl);
+            }
+            if (j == n) heap_offer(&h, p->rid, score);
+        }
+    }
+
+finished:
+    for (int i=0; i<n; i++) {
+        for (int r=0; r<ti->run_count; r++) {
+            free(clauses[i].lists[r].owned);
+        }
+        free(clauses[i].lists);
+    }
+    free(clauses);
+
+    qsort(h.m, h.n, sizeof(fs_text_match), match_cmp);
+    if (h.n == 0) {
+        free(h.m);
+        h.m = NULL;
+    }
+    *matches = h.m;
+
+    return h.n;
+}
+
+int fs_textindex_unlink(fs_textindex *ti)
+{
+    if (text_lock(ti, LOCK_EX)) {
+        return 1;
+    }
+    load_runs(ti);
+    for (int r=0; r<ti->run_count; r++) {
+        char *fn = run_filename(ti, ti->runs[r]->number);
+        unlink(fn);
+        g_free(fn);
+        run_unmap(ti->runs[r]);
+    }
+    free(ti->runs);
+    ti->runs = NULL;
+    ti->run_count = 0;
+    char *fn = runs_filename(ti);
+    unlink(fn);
+    g_free(fn);
+    fs_textindex_discard(ti);
+    text_lock(ti, LOCK_UN);
+
+    return 0;
+}
+
+void fs_textindex_close(fs_textindex *ti)
+{
+    if (!ti) return;
+
+    for (int r=0; r<ti->run_count; r++) {
+        run_unmap(ti->runs[r]);
+    }
+    free(ti->runs);
+    fs_textindex_discard(ti);
+    g_ptr_array_free(ti->pending, TRUE);
+    if (ti->lock_fd != -1) {
+        close(ti->lock_fd);
+    }
+    free(ti);
+}
+
+/* vi:set expandtab sts=4 sw=4: */
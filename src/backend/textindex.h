@@ -0,0 +1,38 @@
+#ifndef TEXTINDEX_H
+#define TEXTINDEX_H
+
+#include "backend.h"
+#include "../common/4s-datatypes.h"
+
+/* full text index of a segment's literals, an inverted index from lower
+ * cased tokens to the literals they appear in, with their positions.
+ *
+ * The index is a list of immutable run files named in text.runs. Each commit
+ * writes the literals added since the last one as a new run, merging in the
+ * newest existing runs while they're no more than twice its size, so there
+ * are O(log n) runs. Readers don't lock, runs are replaced by renaming the
+ * list */
+
+typedef struct _fs_textindex fs_textindex;
+
+fs_textindex *fs_textindex_open(fs_backend *be, int flags);
+void fs_textindex_close(fs_textindex *ti);
+
+/* queue literals to be indexed by the next commit, rids already in the
+ * index are skipped */
+int fs_textindex_add(fs_textindex *ti, int count, fs_resource res[]);
+int fs_textindex_commit(fs_textindex *ti);
+void fs_textindex_discard(fs_textindex *ti);
+
+/* query is a list of words that must all match, word* matches words
+ * starting with word and "two words" matches a phrase. Sets *matches to at
+ * most limit matches in descending score order, and returns the number
+ * found, or -1 on error */
+int fs_textindex_search(fs_textindex *ti, const char *query, int limit,
+                        fs_text_match **matches);
+
+int fs_textindex_unlink(fs_textindex *ti);
+
+#endif
+
+/* vi:set expandtab sts=4 sw=4: */
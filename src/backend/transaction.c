@@ -0,0 +1,666 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Transactions span every segment, and are driven by the frontend:
+
+     BEGIN       take the segment's "trans" lock, start a fresh log
+     (writes)    appended to the log by whichever backend process gets them
+     PRE_COMMIT  append a PREPARE record, sync the log
+     COMMIT      append a COMMIT record, sync, replay the log into the
+                 indexes, then truncate it and drop the lock
+     ROLLBACK    truncate the log and drop the lock
+
+   Once a segment has synced its COMMIT record the changes will be applied,
+   if the process dies part way through replay the next one to open the
+   segment finishes it. The log records how far replay got, and the quads
+   an earlier attempt reached are checked against the indexes before they
+   are added again, so a retried replay doesn't duplicate them.
+   Readers see none of the transaction's changes until its commit.
+
+   Outside transactions, an import that stays small is held in memory until
+   it stops, then appended to the segment's redo log as a single record and
+   synced, which is all the frontend waits for. Imports that overlap share
+   fsyncs. Logged updates are applied to the indexes in batches, by a backend
+   process that's gone idle, or by one that's about to read the indexes or
+   change them some other way. */
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glib.h>
+#include <string.h>
+#include <sys/file.h>
+
+#include "backend.h"
+#include "backend-intl.h"
+#include "import-backend.h"
+#include "transaction.h"
+#include "lock.h"
+#include "mhash.h"
+#include "wal.h"
+#include "../common/4store.h"
+#include "../common/4s-store-root.h"
+#include "../common/error.h"
+#include "../common/params.h"
+
+static fs_wal *trans_log(fs_backend *be)
+{
+    if (!be->trans_log) {
+        be->trans_log = fs_wal_open(be, "trans", O_CREAT | O_RDWR);
+    }
+
+    return be->trans_log;
+}
+
+static fs_wal *redo_log(fs_backend *be)
+{
+    if (!be->redo_log && be->segment != -1) {
+        be->redo_log = fs_wal_open(be, "redo", O_CREAT | O_RDWR);
+    }
+
+    return be->redo_log;
+}
+
+/* resources are logged as rid, attr, lex length, then the lex, padded to 8
+ * bytes */
+static void encode_resources(GByteArray *buf, long count, fs_resource res[])
+{
+    static const guint8 pad[8];
+
+    for (long i=0; i<count; i++) {
+        const int64_t lexlen = res[i].lex ? strlen(res[i].lex) : 0;
+        g_byte_array_append(buf, (guint8 *)&res[i].rid, sizeof(fs_rid));
+        g_byte_array_append(buf, (guint8 *)&res[i].attr, sizeof(fs_rid));
+        g_byte_array_append(buf, (guint8 *)&lexlen, sizeof(lexlen));
+        if (lexlen) g_byte_array_append(buf, (guint8 *)res[i].lex, lexlen);
+        g_byte_array_append(buf, pad, ((lexlen + 7) & ~7) - lexlen);
+    }
+}
+
+static int commit_lock(fs_backend *be, int block)
+{
+    if (be->commit_lock != -1) return 0;
+
+    char *fn = g_strdup_printf(fs_get_file_lock_format(), fs_backend_get_kb(be),
+                               fs_backend_get_segment(be), "commit");
+    int fd = open(fn, FS_O_NOATIME | O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        fs_error(LOG_ERR, "failed to open %s: %s", fn, strerror(errno));
+        g_free(fn);
+
+        return 1;
+    }
+    g_free(fn);
+    if (flock(fd, LOCK_EX | (block ? 0 : LOCK_NB)) == -1) {
+        close(fd);
+
+        return 1;
+    }
+    be->commit_lock = fd;
+
+    return 0;
+}
+
+static void commit_unlock(fs_backend *be)
+{
+    if (be->commit_lock == -1) return;
+
+    flock(be->commit_lock, LOCK_UN);
+    close(be->commit_lock);
+    be->commit_lock = -1;
+}
+
+int fs_trans_check(fs_backend *be)
+{
+    be->transaction = fs_lock_taken(be, "trans");
+    be->checked_transaction = 1;
+
+    return be->transaction;
+}
+
+int fs_trans_lock(fs_backend *be)
+{
+    return commit_lock(be, 0);
+}
+
+int fs_trans_unlock(fs_backend *be)
+{
+    commit_unlock(be);
+
+    return 0;
+}
+
+int fs_trans_log_resources(fs_backend *be, fs_segment seg, long count,
+                           fs_resource res[])
+{
+    fs_wal *w = trans_log(be);
+    if (!w) return 1;
+
+    GByteArray *buf = g_byte_array_new();
+    encode_resources(buf, count, res);
+    int ret = fs_wal_append(w, FS_WAL_RESOURCES, 0, buf->data, buf->len);
+    g_byte_array_free(buf, TRUE);
+
+    return ret;
+}
+
+int fs_trans_log_quads(fs_backend *be, fs_segment seg, int flags, int count,
+                       fs_rid quads[][4])
+{
+    fs_wal *w = trans_log(be);
+    if (!w) return 1;
+
+    return fs_wal_append(w, FS_WAL_QUADS, flags, quads,
+                         sizeof(fs_rid) * 4 * count);
+}
+
+int fs_trans_log_quad_commit(fs_backend *be, fs_segment seg, int flags)
+{
+    fs_wal *w = trans_log(be);
+    if (!w) return 1;
+
+    return fs_wal_append(w, FS_WAL_QUAD_COMMIT, flags, NULL, 0);
+}
+
+/* logged column by column, the same as the DELETE_QUADS message */
+int fs_trans_log_delete_quads(fs_backend *be, fs_rid_vector *quads[4])
+{
+    fs_wal *w = trans_log(be);
+    if (!w) return 1;
+
+    const int count = quads[0]->length;
+    fs_rid *buf = malloc(sizeof(fs_rid) * 4 * (count ? count : 1));
+    for (int i=0; i<4; i++) {
+        memcpy(buf + i * count, quads[i]->data, sizeof(fs_rid) * count);
+    }
+    int ret = fs_wal_append(w, FS_WAL_DELETE_QUADS, 0, buf,
+                            sizeof(fs_rid) * 4 * count);
+    free(buf);
+
+    return ret;
+}
+
+int fs_trans_log_delete_models(fs_backend *be, fs_segment seg,
+                               fs_rid_vector *models)
+{
+    fs_wal *w = trans_log(be);
+    if (!w) return 1;
+
+    return fs_wal_append(w, FS_WAL_DELETE_MODELS, 0, models->data,
+                         sizeof(fs_rid) * models->length);
+}
+
+int fs_trans_log_new_models(fs_backend *be, fs_segment seg, int count,
+                            fs_rid models[])
+{
+    fs_wal *w = trans_log(be);
+    if (!w) return 1;
+
+    return fs_wal_append(w, FS_WAL_NEW_MODELS, 0, models,
+                         sizeof(fs_rid) * count);
+}
+
+struct replay {
+    fs_backend *be;
+    fs_segment seg;
+    int quad_flags;
+    int res_pending;
+    int quads_pending;
+    int errors;
+};
+
+/* imports are buffered, so they have to be pushed through before anything
+ * that could depend on them */
+static void replay_flush(struct replay *r)
+{
+    if (r->res_pending) {
+        fs_res_import_commit(r->be, r->seg, 1);
+        r->res_pending = 0;
+    }
+    if (r->quads_pending) {
+        if (fs_quad_import_commit(r->be, r->seg, r->quad_flags, 1)) {
+            r->errors++;
+        }
+        r->quads_pending = 0;
+    }
+}
+
+static int replay_resources(struct replay *r, const char *payload,
+                            size_t length)
+{
+    long count = 0;
+    for (size_t pos = 0; pos + 24 <= length; count++) {
+        int64_t lexlen;
+        memcpy(&lexlen, payload + pos + 16, sizeof(lexlen));
+        pos += (24 + lexlen + 7) & ~7;
+    }
+
+    fs_resource *res = calloc(count ? count : 1, sizeof(fs_resource));
+    const char *pos = payload;
+    for (long i=0; i<count; i++) {
+        int64_t lexlen;
+        memcpy(&res[i].rid, pos, sizeof(fs_rid));
+        memcpy(&res[i].attr, pos + 8, sizeof(fs_rid));
+        memcpy(&lexlen, pos + 16, sizeof(lexlen));
+        res[i].lex = g_strndup(pos + 24, lexlen);
+        pos += (24 + lexlen + 7) & ~7;
+    }
+    fs_res_import(r->be, r->seg, count, res);
+    for (long i=0; i<count; i++) {
+        g_free(res[i].lex);
+    }
+    free(res);
+    r->res_pending = 1;
+
+    return 0;
+}
+
+static int replay_record(void *data, int type, int flags, const void *payload,
+                         size_t length)
+{
+    struct replay *r = data;
+    fs_backend *be = r->be;
+    fs_rid *rids = (fs_rid *)payload;
+    const int nrids = length / sizeof(fs_rid);
+
+    /* the records an earlier attempt reached come first, so checking from
+     * here to the end of the replay covers them */
+    if (flags & FS_WAL_AGAIN) {
+        be->replay_again = 1;
+        flags &= ~FS_WAL_AGAIN;
+    }
+
+    switch (type) {
+    case FS_WAL_RESOURCES:
+        return replay_resources(r, payload, length);
+
+    case FS_WAL_QUADS:
+        if (r->quads_pending && flags != r->quad_flags) replay_flush(r);
+        if (fs_quad_import(be, r->seg, flags, nrids / 4,
+                           (fs_rid (*)[4])payload)) {
+            r->errors++;
+        }
+        r->quad_flags = flags;
+        r->quads_pending = 1;
+        break;
+
+    case FS_WAL_QUAD_COMMIT:
+        r->quad_flags = flags;
+        replay_flush(r);
+        break;
+
+    case FS_WAL_UPDATE: {
+        /* resource length, resources, then quads */
+        int64_t reslen;
+        memcpy(&reslen, payload, sizeof(reslen));
+        const char *quads = (const char *)payload + sizeof(reslen) + reslen;
+        const int count = (length - sizeof(reslen) - reslen) /
+                          (sizeof(fs_rid) * 4);
+        replay_resources(r, (const char *)payload + sizeof(reslen), reslen);
+        if (count) {
+            if (r->quads_pending && flags != r->quad_flags) replay_flush(r);
+            if (fs_quad_import(be, r->seg, flags, count,
+                               (fs_rid (*)[4])quads)) {
+                r->errors++;
+            }
+            r->quad_flags = flags;
+            r->quads_pending = 1;
+        }
+        break;
+    }
+
+    case FS_WAL_DELETE_QUADS: {
+        replay_flush(r);
+        const int count = nrids / 4;
+        fs_rid_vector cols[4];
+        fs_rid_vector *args[4];
+        for (int i=0; i<4; i++) {
+            cols[i].size = cols[i].length = count;
+            cols[i].data = rids + i * count;
+            args[i] = &cols[i];
+        }
+        r->errors += fs_delete_quads(be, args);
+        break;
+    }
+
+    case FS_WAL_DELETE_MODELS: {
+        replay_flush(r);
+        fs_rid_vector models;
+        models.size = models.length = nrids;
+        models.data = rids;
+        r->errors += fs_delete_models(be, r->seg, &models);
+        break;
+    }
+
+    case FS_WAL_NEW_MODELS:
+        replay_flush(r);
+        for (int i=0; i<nrids; i++) {
+            if (FS_IS_URI(rids[i])) {
+                fs_backend_model_set_usage(be, r->seg, rids[i], 0);
+            }
+        }
+        fs_mhash_flush(be->models);
+        break;
+    }
+
+    return 0;
+}
+
+static int replay_done(void *data)
+{
+    struct replay *r = data;
+
+    replay_flush(r);
+    r->errors += fs_stop_import(r->be, r->seg);
+    r->be->replay_again = 0;
+
+    return r->errors;
+}
+
+/* replay a committed log into the indexes, and end the transaction */
+static int apply_log(fs_backend *be, fs_segment seg, fs_wal *w)
+{
+    struct replay r = { be, seg, FS_BIND_BY_SUBJECT, 0, 0, 0 };
+
+    /* the import functions have to see the transaction as closed, or they
+     * would just defer to it */
+    be->transaction = 0;
+    if (fs_wal_apply(w, replay_record, replay_done, &r, 1) <= 0) {
+        r.errors++;
+    }
+    be->replay_again = 0;
+    if (r.errors) {
+        /* leave the log and the lock, the next open will try again */
+        fs_error(LOG_CRIT, "%d errors applying transaction to segment %d",
+                 r.errors, seg);
+        be->transaction = 1;
+        commit_unlock(be);
+
+        return 1;
+    }
+
+    fs_wal_truncate(w);
+    fs_lock(be, "trans", FS_LOCK_RELEASE, 0);
+    commit_unlock(be);
+
+    return 0;
+}
+
+int fs_backend_transaction(fs_backend *be, fs_segment seg, int op)
+{
+    fs_wal *w = trans_log(be);
+    if (!w) {
+        fs_error(LOG_ERR, "cannot open transaction log for segment %d", seg);
+
+        return 1;
+    }
+
+    switch (op) {
+    case FS_TRANS_BEGIN:
+        if (fs_lock(be, "trans", FS_LOCK_EXCLUSIVE, 0)) {
+            return 2;
+        }
+        be->transaction = 1;
+        /* anything left over is from a transaction that never committed */
+        fs_wal_truncate(w);
+
+        return fs_wal_append(w, FS_WAL_BEGIN, 0, NULL, 0);
+
+    case FS_TRANS_ROLLBACK:
+        if (!fs_trans_check(be)) {
+            return 2;
+        }
+        fs_wal_truncate(w);
+        fs_lock(be, "trans", FS_LOCK_RELEASE, 0);
+        be->transaction = 0;
+        commit_unlock(be);
+
+        return 0;
+
+    case FS_TRANS_PRE_COMMIT:
+        if (!fs_trans_check(be)) {
+            return 2;
+        }
+        if (fs_wal_append(w, FS_WAL_PREPARE, 0, NULL, 0)) {
+            return 1;
+        }
+
+        return fs_wal_sync(w);
+
+    case FS_TRANS_COMMIT:
+        if (!fs_trans_check(be)) {
+            return 2;
+        }
+        /* updates logged before the transaction began go in first */
+        fs_redo_apply(be, 1);
+        if (commit_lock(be, 1)) {
+            fs_error(LOG_ERR, "failed to get commit lock for segment %d", seg);
+
+            return 1;
+        }
+        if (fs_wal_scan(w, NULL, NULL) != FS_WAL_PREPARE) {
+            fs_error(LOG_ERR, "commit on segment %d without pre-commit", seg);
+            commit_unlock(be);
+
+            return 1;
+        }
+        if (fs_wal_append(w, FS_WAL_COMMIT, 0, NULL, 0) || fs_wal_sync(w)) {
+            commit_unlock(be);
+
+            return 1;
+        }
+
+        return apply_log(be, seg, w);
+    }
+
+    fs_error(LOG_ERR, "unknown transaction operation '%c'", op);
+
+    return 1;
+}
+
+int fs_trans_recover(fs_backend *be, fs_segment seg)
+{
+    if (!fs_trans_check(be)) {
+        return 0;
+    }
+    fs_wal *w = trans_log(be);
+    if (!w) {
+        return 1;
+    }
+
+    /* if another process holds the lock it's committing now, or a frontend
+     * is about to */
+    if (commit_lock(be, 0)) {
+        return 0;
+    }
+    if (fs_wal_scan(w, NULL, NULL) != FS_WAL_COMMIT) {
+        /* still open, or prepared and waiting for the frontend */
+        commit_unlock(be);
+
+        return 0;
+    }
+    fs_error(LOG_INFO, "finishing interrupted commit on segment %d", seg);
+    int ret = apply_log(be, seg, w);
+    if (fs_backend_publish(be)) ret = 1;
+
+    return ret;
+}
+
+static struct {
+    int importing;      /* between start and stop import */
+    int deferring;      /* the import is still small enough to log */
+    int flags;
+    GByteArray *res;
+    GByteArray *quads;
+} redo;
+
+#define REDO_QUADS() (redo.quads->len / (sizeof(fs_rid) * 4))
+
+void fs_redo_start(fs_backend *be)
+{
+    if (!redo.res) {
+        redo.res = g_byte_array_new();
+        redo.quads = g_byte_array_new();
+    }
+    g_byte_array_set_size(redo.res, 0);
+    g_byte_array_set_size(redo.quads, 0);
+    redo.importing = 1;
+    redo.deferring = !fs_trans_check(be);
+    redo.flags = FS_BIND_BY_SUBJECT;
+}
+
+/* the import has got too big to be worth logging, so what's been held so
+ * far goes down the normal import path, and so does the rest */
+static void redo_spill(fs_backend *be, fs_segment seg)
+{
+    struct replay r = { be, seg, redo.flags, 0, 0, 0 };
+
+    redo.deferring = 0;
+    replay_resources(&r, (const char *)redo.res->data, redo.res->len);
+    if (REDO_QUADS()) {
+        fs_quad_import(be, seg, redo.flags, REDO_QUADS(),
+                       (fs_rid (*)[4])redo.quads->data);
+    }
+    g_byte_array_set_size(redo.res, 0);
+    g_byte_array_set_size(redo.quads, 0);
+}
+
+int fs_redo_deferring(fs_backend *be)
+{
+    return redo.deferring;
+}
+
+int fs_redo_resources(fs_backend *be, fs_segment seg, long count,
+                      fs_resource res[])
+{
+    if (!redo.deferring) return 0;
+
+    encode_resources(redo.res, count, res);
+    if (redo.res->len > FS_REDO_MAX_BYTES) {
+        redo_spill(be, seg);
+    }
+
+    return 1;
+}
+
+int fs_redo_quads(fs_backend *be, fs_segment seg, int flags, int count,
+                  fs_rid quads[][4])
+{
+    if (!redo.deferring) return 0;
+    if (flags != FS_BIND_BY_SUBJECT) {
+        /* let the normal path deal with it */
+        redo_spill(be, seg);
+
+        return 0;
+    }
+
+    g_byte_array_append(redo.quads, (guint8 *)quads,
+                        sizeof(fs_rid) * 4 * count);
+    redo.flags = flags;
+    if (REDO_QUADS() > FS_REDO_MAX_QUADS) {
+        redo_spill(be, seg);
+    }
+
+    return 1;
+}
+
+int fs_redo_stop(fs_backend *be, fs_segment seg)
+{
+    const int deferred = redo.deferring;
+    redo.importing = 0;
+    if (!deferred) {
+        return -1;
+    }
+    if (!redo.res->len && !redo.quads->len) {
+        redo.deferring = 0;
+
+        return 0;
+    }
+
+    fs_wal *w = redo_log(be);
+    int ret = 1;
+    if (w) {
+        const int64_t reslen = redo.res->len;
+        GByteArray *buf = g_byte_array_sized_new(sizeof(reslen) +
+                              redo.res->len + redo.quads->len);
+        g_byte_array_append(buf, (guint8 *)&reslen, sizeof(reslen));
+        g_byte_array_append(buf, redo.res->data, redo.res->len);
+        g_byte_array_append(buf, redo.quads->data, redo.quads->len);
+        ret = fs_wal_append(w, FS_WAL_UPDATE, redo.flags, buf->data, buf->len);
+        g_byte_array_free(buf, TRUE);
+        if (!ret) ret = fs_wal_sync(w);
+    }
+    if (ret) {
+        fs_error(LOG_ERR, "failed to log update to segment %d, applying it "
+                 "directly", seg);
+        redo_spill(be, seg);
+        fs_res_import_commit(be, seg, 1);
+        fs_quad_import_commit(be, seg, redo.flags, 1);
+
+        return -1;
+    }
+    redo.deferring = 0;
+    g_byte_array_set_size(redo.res, 0);
+    g_byte_array_set_size(redo.quads, 0);
+    /* it's not in the indexes yet, but anything that reads them will apply
+     * it first, so cached results are stale already */
+    fs_backend_bump_generation(be);
+
+    return 0;
+}
+
+int fs_redo_apply(fs_backend *be, int block)
+{
+    fs_wal *w = redo_log(be);
+    if (!w || !fs_wal_pending(w)) {
+        return 0;
+    }
+
+    /* taken before the log's apply lock, as every other writer does, an
+     * idle apply leaves it to whoever is writing the indexes now */
+    const int had_lock = be->write_lock != -1;
+    if (fs_backend_write_lock(be, block)) {
+        return block;
+    }
+
+    struct replay r = { be, be->segment, FS_BIND_BY_SUBJECT, 0, 0, 0 };
+    const int transaction = be->transaction;
+    be->transaction = 0;
+    const int count = fs_wal_apply(w, replay_record, replay_done, &r, block);
+    be->transaction = transaction;
+    be->replay_again = 0;
+    if (count > 0) {
+        return fs_backend_publish(be);
+    }
+    if (!had_lock) {
+        fs_backend_write_unlock(be);
+    }
+
+    return count < 0;
+}
+
+void fs_redo_idle(fs_backend *be)
+{
+    /* leave the indexes alone while this process is importing, other
+     * processes' imports hold the writer lock */
+    if (redo.importing) return;
+
+    fs_redo_apply(be, 0);
+}
+
+/* vi:set expandtab sts=4 sw=4: */
@@ -0,0 +1,57 @@
+#ifndef TRANSACTION_H
+#define TRANSACTION_H
+
+#include "backend.h"
+#include "../common/4s-datatypes.h"
+
+/* re-read whether a transaction is open on the segment, any backend process
+ * may have begun or finished one since we last looked */
+int fs_trans_check(fs_backend *be);
+
+/* while a transaction is open writes go to the segment's log instead of the
+ * indexes, and get applied in order when it commits */
+int fs_trans_log_resources(fs_backend *be, fs_segment seg, long count,
+                           fs_resource res[]);
+int fs_trans_log_quads(fs_backend *be, fs_segment seg, int flags, int count,
+                       fs_rid quads[][4]);
+int fs_trans_log_quad_commit(fs_backend *be, fs_segment seg, int flags);
+int fs_trans_log_delete_quads(fs_backend *be, fs_rid_vector *quads[4]);
+int fs_trans_log_delete_models(fs_backend *be, fs_segment seg,
+                               fs_rid_vector *models);
+int fs_trans_log_new_models(fs_backend *be, fs_segment seg, int count,
+                            fs_rid models[]);
+
+/* the commit lock keeps two frontends from committing at once, it's held
+ * until commit, rollback, or the connection closes. Returns non 0 if another
+ * process has it */
+int fs_trans_lock(fs_backend *be);
+int fs_trans_unlock(fs_backend *be);
+
+/* finish a commit that was cut short by a crash, called once the segment's
+ * files are open */
+int fs_trans_recover(fs_backend *be, fs_segment seg);
+
+/* redo log for small imports outside transactions. Between start and stop
+ * the import's resources and quads are held back while it stays under
+ * FS_REDO_MAX_QUADS, the functions return 1 if they took the data. Stop logs
+ * and syncs them as one record, it returns -1 if the import wasn't held back
+ * and has to be committed normally */
+void fs_redo_start(fs_backend *be);
+int fs_redo_deferring(fs_backend *be);
+int fs_redo_resources(fs_backend *be, fs_segment seg, long count,
+                      fs_resource res[]);
+int fs_redo_quads(fs_backend *be, fs_segment seg, int flags, int count,
+                  fs_rid quads[][4]);
+int fs_redo_stop(fs_backend *be, fs_segment seg);
+
+/* apply logged updates to the indexes, anything that reads or changes them
+ * directly must call this first. If block is 0 and another process is
+ * applying it returns straight away */
+int fs_redo_apply(fs_backend *be, int block);
+
+/* called when the connection has been quiet for FS_BACKEND_IDLE_MS */
+void fs_redo_idle(fs_backend *be);
+
+#endif
+
+/* vi:set expandtab sts=4 sw=4: */
@@ -0,0 +1,420 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <glib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+
+#include "backend.h"
+#include "wal.h"
+#include "../common/params.h"
+#include "../common/4s-store-root.h"
+#include "../common/error.h"
+
+#define WAL_ID 0x4a584c30 /* JXL0 */
+#define WAL_REVISION 1
+
+struct wal_header {
+    int32_t id;
+    int32_t revision;
+    int64_t synced;     /* the log is on disk up to this offset */
+    int64_t generation; /* bumped each time the log is truncated */
+    int64_t applied;    /* records before this offset are in the indexes */
+    int64_t applying;   /* an apply of the records up to here was started */
+    char padding[472];
+};
+
+struct wal_record {
+    int32_t type;
+    int32_t flags;
+    int64_t length;     /* of the payload, which is padded to 8 bytes */
+    uint32_t check;
+    int32_t padding;
+};
+
+struct _fs_wal {
+    struct wal_header *header; /* mapped shared */
+    char *filename;
+    int fd;
+    int flags;
+    off_t written;      /* end of the last record this process appended */
+    int64_t generation; /* header generation when it was appended */
+};
+
+#define PAD8(l) (((l) + 7) & ~7)
+
+/* byte range locks on the header, independent of the flock() used for
+ * syncing. Appenders share APPEND, emptying the log needs it exclusively,
+ * and only one process at a time holds APPLY */
+#define LOCK_APPEND 0
+#define LOCK_APPLY  1
+
+static int range_lock(fs_wal *w, int byte, short type, int block)
+{
+    struct flock fl = {
+        .l_type = type,
+        .l_whence = SEEK_SET,
+        .l_start = byte,
+        .l_len = 1
+    };
+
+    while (fcntl(w->fd, block ? F_SETLKW : F_SETLK, &fl) == -1) {
+        if (errno != EINTR) return 1;
+    }
+
+    return 0;
+}
+
+/* FNV-1a over the record header and payload, enough to spot a torn write */
+static uint32_t wal_check(const struct wal_record *rec, const void *payload)
+{
+    uint32_t h = 2166136261u;
+    const unsigned char *p = (const unsigned char *)rec;
+
+    for (int i=0; i<16; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    p = payload;
+    for (int64_t i=0; i<rec->length; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+
+    return h;
+}
+
+fs_wal *fs_wal_open(fs_backend *be, const char *label, int flags)
+{
+    char *fn = g_strdup_printf(fs_get_wal_format(), fs_backend_get_kb(be),
+                               fs_backend_get_segment(be), label);
+    fs_wal *w = fs_wal_open_filename(fn, flags);
+    g_free(fn);
+
+    return w;
+}
+
+fs_wal *fs_wal_open_filename(const char *filename, int flags)
+{
+    fs_wal *w = calloc(1, sizeof(fs_wal));
+    w->filename = g_strdup(filename);
+    w->flags = flags;
+    w->fd = open(filename, FS_O_NOATIME | O_RDWR | O_APPEND | (flags & O_CREAT), 0600);
+    if (w->fd == -1) {
+        fs_error(LOG_ERR, "failed to open %s: %s", filename, strerror(errno));
+        g_free(w->filename);
+        free(w);
+
+        return NULL;
+    }
+
+    flock(w->fd, LOCK_EX);
+    struct stat st;
+    fstat(w->fd, &st);
+    if (st.st_size < sizeof(struct wal_header)) {
+        struct wal_header header;
+        memset(&header, 0, sizeof(header));
+        header.id = WAL_ID;
+        header.revision = WAL_REVISION;
+        header.synced = sizeof(header);
+        header.applied = sizeof(header);
+        if (ftruncate(w->fd, 0) ||
+            write(w->fd, &header, sizeof(header)) != sizeof(header)) {
+            fs_error(LOG_ERR, "failed to initialise %s: %s", filename,
+                     strerror(errno));
+        }
+    }
+    flock(w->fd, LOCK_UN);
+
+    w->header = mmap(NULL, sizeof(struct wal_header), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, w->fd, 0);
+    if (w->header == MAP_FAILED) {
+        fs_error(LOG_ERR, "failed to map %s: %s", filename, strerror(errno));
+        close(w->fd);
+        g_free(w->filename);
+        free(w);
+
+        return NULL;
+    }
+    if (w->header->id != WAL_ID) {
+        fs_error(LOG_ERR, "%s does not appear to be a log file", filename);
+        fs_wal_close(w);
+
+        return NULL;
+    }
+    if (w->header->revision != WAL_REVISION) {
+        fs_error(LOG_ERR, "%s has revision %d, expected %d", filename,
+                 w->header->revision, WAL_REVISION);
+        fs_wal_close(w);
+
+        return NULL;
+    }
+
+    return w;
+}
+
+void fs_wal_close(fs_wal *w)
+{
+    if (!w) return;
+
+    munmap(w->header, sizeof(struct wal_header));
+    close(w->fd);
+    g_free(w->filename);
+    free(w);
+}
+
+int fs_wal_append(fs_wal *w, int type, int flags, const void *payload,
+                  size_t length)
+{
+    const size_t total = sizeof(struct wal_record) + PAD8(length);
+    char *buf = calloc(1, total);
+    struct wal_record *rec = (struct wal_record *)buf;
+
+    rec->type = type;
+    rec->flags = flags;
+    rec->length = length;
+    if (length) memcpy(buf + sizeof(struct wal_record), payload, length);
+    rec->check = wal_check(rec, buf + sizeof(struct wal_record));
+
+    /* one write with O_APPEND, so records from different processes never
+     * interleave */
+    range_lock(w, LOCK_APPEND, F_RDLCK, 1);
+    ssize_t ret = write(w->fd, buf, total);
+    w->written = lseek(w->fd, 0, SEEK_CUR);
+    w->generation = w->header->generation;
+    range_lock(w, LOCK_APPEND, F_UNLCK, 0);
+    free(buf);
+    if (ret != total) {
+        fs_error(LOG_ERR, "failed to append to %s: %s", w->filename,
+                 ret == -1 ? strerror(errno) : "short write");
+
+        return 1;
+    }
+
+    return 0;
+}
+
+static int covered(fs_wal *w)
+{
+    return w->header->generation != w->generation ||
+           w->header->synced >= w->written;
+}
+
+int fs_wal_sync(fs_wal *w)
+{
+    if (w->written == 0 || covered(w)) return 0;
+
+    /* whoever gets the lock first syncs everything appended so far, the
+     * processes queued behind it usually find their records covered */
+    flock(w->fd, LOCK_EX);
+    if (covered(w)) {
+        flock(w->fd, LOCK_UN);
+
+        return 0;
+    }
+    const off_t end = lseek(w->fd, 0, SEEK_END);
+    if (fdatasync(w->fd)) {
+        fs_error(LOG_ERR, "failed to sync %s: %s", w->filename,
+                 strerror(errno));
+        flock(w->fd, LOCK_UN);
+
+        return 1;
+    }
+    w->header->synced = end;
+    flock(w->fd, LOCK_UN);
+
+    return 0;
+}
+
+/* returns the payload of the record at pos, to be freed, or NULL if there
+ * isn't a whole valid record there */
+static char *read_record(fs_wal *w, off_t pos, off_t end,
+                         struct wal_record *rec)
+{
+    if (pos + (off_t)sizeof(*rec) > end ||
+        pread(w->fd, rec, sizeof(*rec), pos) != sizeof(*rec)) {
+        return NULL;
+    }
+    if (rec->type < FS_WAL_BEGIN || rec->type > FS_WAL_UPDATE ||
+        rec->length < 0 ||
+        pos + (off_t)sizeof(*rec) + PAD8(rec->length) > end) {
+        return NULL;
+    }
+    char *payload = malloc(rec->length ? rec->length : 1);
+    if (pread(w->fd, payload, rec->length, pos + sizeof(*rec)) != rec->length ||
+        wal_check(rec, payload) != rec->check) {
+        free(payload);
+
+        return NULL;
+    }
+
+    return payload;
+}
+
+int fs_wal_scan(fs_wal *w, fs_wal_apply_fn fn, void *data)
+{
+    const off_t end = lseek(w->fd, 0, SEEK_END);
+    off_t pos = sizeof(struct wal_header);
+    int last = 0;
+    int stopped = 0;
+    struct wal_record rec;
+    char *payload;
+
+    while ((payload = read_record(w, pos, end, &rec))) {
+        if (rec.type == FS_WAL_BEGIN || rec.type == FS_WAL_PREPARE ||
+            rec.type == FS_WAL_COMMIT) {
+            last = rec.type;
+        }
+        if (fn && fn(data, rec.type, rec.flags, payload, rec.length)) {
+            free(payload);
+            stopped = 1;
+
+            break;
+        }
+        free(payload);
+        pos += sizeof(rec) + PAD8(rec.length);
+    }
+
+    if (stopped) {
+        return -1;
+    }
+    if (pos < end) {
+        fs_error(LOG_WARNING, "discarding %lld bytes of incomplete log "
+                 "record from %s", (long long)(end - pos), w->filename);
+        flock(w->fd, LOCK_EX);
+        if (ftruncate(w->fd, pos)) {
+            fs_error(LOG_ERR, "failed to truncate %s: %s", w->filename,
+                     strerror(errno));
+        }
+        if (w->header->synced > pos) w->header->synced = pos;
+        flock(w->fd, LOCK_UN);
+    }
+
+    return last;
+}
+
+int fs_wal_truncate(fs_wal *w)
+{
+    int ret = 0;
+
+    flock(w->fd, LOCK_EX);
+    if (ftruncate(w->fd, sizeof(struct wal_header))) {
+        fs_error(LOG_ERR, "failed to truncate %s: %s", w->filename,
+                 strerror(errno));
+        ret = 1;
+    }
+    w->header->synced = sizeof(struct wal_header);
+    w->header->applied = sizeof(struct wal_header);
+    w->header->applying = 0;
+    w->header->generation++;
+    flock(w->fd, LOCK_UN);
+    w->written = 0;
+
+    return ret;
+}
+
+int fs_wal_apply(fs_wal *w, fs_wal_apply_fn fn, int (*done)(void *data),
+                 void *data, int block)
+{
+    if (range_lock(w, LOCK_APPLY, F_WRLCK, block)) {
+        return 0;
+    }
+
+    off_t end = lseek(w->fd, 0, SEEK_END);
+    off_t pos = w->header->applied;
+    if (pos < (off_t)sizeof(struct wal_header)) {
+        pos = sizeof(struct wal_header);
+    }
+    int count = 0;
+    int errors = 0;
+    struct wal_record rec;
+    char *payload;
+
+    /* if the last apply failed, or its process died, some of the records
+     * it got to may be in the indexes already */
+    const off_t again = w->header->applying;
+    w->header->applying = end;
+
+    while ((payload = read_record(w, pos, end, &rec))) {
+        const int flags = rec.flags | (pos < again ? FS_WAL_AGAIN : 0);
+        errors += fn(data, rec.type, flags, payload, rec.length) != 0;
+        free(payload);
+        pos += sizeof(rec) + PAD8(rec.length);
+        count++;
+    }
+    if (count) {
+        errors += done(data) != 0;
+    }
+    if (errors) {
+        /* leave them unapplied, so that the next attempt redoes them */
+        fs_error(LOG_ERR, "%d errors applying %s", errors, w->filename);
+        range_lock(w, LOCK_APPLY, F_UNLCK, 0);
+
+        return -1;
+    }
+    w->header->applied = pos;
+    w->header->applying = 0;
+
+    /* with appenders shut out, anything here that isn't a whole record is
+     * left over from a crash. The log can only be emptied once all of it
+     * is on disk, or an acknowledged update could be lost */
+    if (!range_lock(w, LOCK_APPEND, F_WRLCK, 0)) {
+        end = lseek(w->fd, 0, SEEK_END);
+        if (pos < end) {
+            if ((payload = read_record(w, pos, end, &rec))) {
+                free(payload);
+            } else {
+                fs_error(LOG_WARNING, "discarding %lld bytes of incomplete "
+                         "log record from %s", (long long)(end - pos),
+                         w->filename);
+                if (ftruncate(w->fd, pos) == 0) end = pos;
+                if (w->header->synced > pos) w->header->synced = pos;
+            }
+        }
+        if (pos == end && w->header->synced >= end) {
+            flock(w->fd, LOCK_EX);
+            if (ftruncate(w->fd, sizeof(struct wal_header)) == 0) {
+                w->header->synced = sizeof(struct wal_header);
+                w->header->applied = sizeof(struct wal_header);
+                w->header->generation++;
+            }
+            flock(w->fd, LOCK_UN);
+        }
+        range_lock(w, LOCK_APPEND, F_UNLCK, 0);
+    }
+    range_lock(w, LOCK_APPLY, F_UNLCK, 0);
+
+    return count;
+}
+
+int fs_wal_pending(fs_wal *w)
+{
+    return lseek(w->fd, 0, SEEK_END) > w->header->applied &&
+           lseek(w->fd, 0, SEEK_END) > (off_t)sizeof(struct wal_header);
+}
+
+long long fs_wal_length(fs_wal *w)
+{
+    return lseek(w->fd, 0, SEEK_END) - sizeof(struct wal_header);
+}
+
+/* vi:set expandtab sts=4 sw=4: */
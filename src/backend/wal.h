@@ -0,0 +1,71 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include "backend.h"
+
+/* write-ahead log, an append-only file of typed records, shared between
+ * all the backend processes of a segment */
+
+typedef struct _fs_wal fs_wal;
+
+typedef enum {
+    FS_WAL_BEGIN = 1,
+    FS_WAL_RESOURCES,
+    FS_WAL_QUADS,
+    FS_WAL_QUAD_COMMIT,
+    FS_WAL_DELETE_QUADS,
+    FS_WAL_DELETE_MODELS,
+    FS_WAL_NEW_MODELS,
+    FS_WAL_PREPARE,
+    FS_WAL_COMMIT,
+    FS_WAL_UPDATE
+} fs_wal_record_type;
+
+/* set in the flags passed to fs_wal_apply()'s fn for records that an
+ * earlier apply got to without finishing */
+#define FS_WAL_AGAIN 0x40000000
+
+/* called once per record by fs_wal_scan(), returning non 0 stops the scan */
+typedef int (*fs_wal_apply_fn)(void *data, int type, int flags,
+                               const void *payload, size_t length);
+
+fs_wal *fs_wal_open(fs_backend *be, const char *label, int flags);
+fs_wal *fs_wal_open_filename(const char *filename, int flags);
+void fs_wal_close(fs_wal *w);
+
+/* append one record, it's not durable until a following fs_wal_sync() */
+int fs_wal_append(fs_wal *w, int type, int flags, const void *payload,
+                  size_t length);
+
+/* make everything this process has appended durable. Concurrent callers in
+ * any process share one fdatasync() where they can */
+int fs_wal_sync(fs_wal *w);
+
+/* walk the valid records in order, passing each to fn if it's not NULL. A
+ * torn record at the tail, left by a crash, ends the log and is cut off.
+ * Returns the type of the last BEGIN, PREPARE or COMMIT record, 0 if there
+ * isn't one, or -1 on error */
+int fs_wal_scan(fs_wal *w, fs_wal_apply_fn fn, void *data);
+
+/* throw away all the records */
+int fs_wal_truncate(fs_wal *w);
+
+/* pass each record added since the last apply to fn, then call done, and
+ * only if neither failed mark them applied. Records that a failed or
+ * interrupted apply had reached are passed again, with FS_WAL_AGAIN set in
+ * their flags, as some of their changes may already have been made. The
+ * log is emptied when it's all applied and synced. One process applies at a
+ * time, if block is 0 and another is busy this returns straight away.
+ * Returns the number of records applied, or -1 on error */
+int fs_wal_apply(fs_wal *w, fs_wal_apply_fn fn, int (*done)(void *data),
+                 void *data, int block);
+
+/* true if there are records that haven't been applied yet */
+int fs_wal_pending(fs_wal *w);
+
+/* number of bytes of records in the log */
+long long fs_wal_length(fs_wal *w);
+
+#endif
+
+/* vi:set expandtab sts=4 sw=4: */
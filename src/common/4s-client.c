@@ -462,6 +462,88 @@ static int fsp_write(fsp_link* link, const void *data, size_t size)
   return sock;
 }
 
+typedef struct {
+  unsigned int id;
+  double deadline;
+} bind_context;
+
+static GStaticPrivate bind_context_key = G_STATIC_PRIVATE_INIT;
+
+void fsp_bind_context (unsigned int id, double deadline)
+{
+  bind_context *bc = g_static_private_get(&bind_context_key);
+
+  if (!bc) {
+    if (!id && deadline == 0.0) return;
+    bc = g_new0(bind_context, 1);
+    g_static_private_set(&bind_context_key, bc, g_free);
+  }
+  bc->id = id;
+  bc->deadline = deadline;
+}
+
+/* fill in the id and remaining time of an FS_BIND_LIMIT message from the
+ * calling thread's context, returns the id */
+static unsigned int bind_stamp(unsigned char *out)
+{
+  bind_context *bc = g_static_private_get(&bind_context_key);
+
+  if (!bc) return 0;
+
+  if (bc->deadline > 0.0) {
+    double left = bc->deadline - fs_time();
+    unsigned int ms;
+
+    /* zero means no deadline, so one that has passed gets a millisecond.
+     * Rounding up means the backend never gives up before we do */
+    if (left < 0.001) {
+      ms = 1;
+    } else if (left > 4000000.0) {
+      ms = 4000000000u;
+    } else {
+      ms = left * 1000.0 + 1;
+    }
+    memcpy(out + FS_HEADER + 28, &ms, sizeof(ms));
+  }
+  memcpy(out + 12, &bc->id, sizeof(bc->id));
+
+  return bc->id;
+}
+
+/* record which bind is waiting on segment, for fsp_cancel(), the caller
+ * holds link->mutex[segment] */
+static void bind_inflight(fsp_link *link, fs_segment segment, unsigned int id)
+{
+  if (!id && !link->inflight[segment]) return;
+
+  g_static_mutex_lock(&link->cancel_mutex);
+  link->inflight[segment] = id;
+  g_static_mutex_unlock(&link->cancel_mutex);
+}
+
+void fsp_cancel (fsp_link *link, unsigned int id)
+{
+  if (!id) return;
+
+  unsigned char *out = message_new(FS_CANCEL, 0, 0);
+  unsigned int * const s = (unsigned int *) (out + 8);
+  memcpy(out + 12, &id, sizeof(id));
+
+  /* the bind's own request has already been written, and its thread is
+   * only reading, so the cancel can't interleave with another message */
+  g_static_mutex_lock(&link->cancel_mutex);
+  for (fs_segment segment = 0; segment < link->segments; ++segment) {
+    if (link->inflight[segment] != id) continue;
+    *s = segment;
+    if (write(link->socks[segment], out, FS_HEADER) != FS_HEADER) {
+      link_error(LOG_WARNING, "cancel for segment %d failed: %s", segment, strerror(errno));
+    }
+  }
+  g_static_mutex_unlock(&link->cancel_mutex);
+
+  free(out);
+}
+
 static void fsp_write_replica(fsp_link* link, const void *data, size_t size)
 {
   unsigned int * const s = (unsigned int *) (data + 8);
@@ -629,6 +711,7 @@ fsp_link* fsp_open_link (const char *name, char *password, int readonly)
     link->groups[s] = link->socks[s] = link->socks1[s] = link->socks2[s] = -1;
     g_static_mutex_init(&link->mutex[s]);
   }
+  g_static_mutex_init(&link->cancel_mutex);
 
   if (password) {
     md5_state_t md5;
@@ -781,10 +864,13 @@ int fsp_bind_limit (fsp_link *link,
   memcpy(content, orids->data, orids->length * 8);
   content += orids->length * 8;
   
+  unsigned int id = bind_stamp(out);
   int sock = fsp_write(link, out, length);
+  bind_inflight(link, segment, id);
   free(out);
 
   unsigned char *in = message_recv(sock, &segment, &length);
+  bind_inflight(link, segment, 0);
   g_static_mutex_unlock (&link->mutex[segment]);
   content = in + FS_HEADER;
 
@@ -988,10 +1074,12 @@ int fsp_bind_limit_all (fsp_link *link,
   memcpy(content, orids->data, orids->length * 8);
   content += orids->length * 8;
 
+  unsigned int id = bind_stamp(out);
   for (segment = 0; segment < link->segments; ++segment) {
     unsigned int * const s = (unsigned int *) (out + 8);
     *s = segment;
     sock[segment] = fsp_write(link, out, length);
+    bind_inflight(link, segment, id);
   }
 
   fs_rid_vector **vectors;
@@ -1008,6 +1096,7 @@ int fsp_bind_limit_all (fsp_link *link,
 
   for (segment = 0; segment < link->segments; ++segment) {
     unsigned char *in = message_recv(sock[segment], &segment, &length);
+    bind_inflight(link, segment, 0);
     g_static_mutex_unlock (&link->mutex[segment]);
     content = in + FS_HEADER;
 
@@ -1344,19 +1433,44 @@ int fsp_delete_model_all (fsp_link *link, fs_rid_vector *models)
 
 int fsp_delete_quads_all (fsp_link *link, fs_rid_vector *vec[4])
 {
-  unsigned int length = sizeof(fs_rid) * vec[0]->length;
+  /* quads live in the segment of their subject, so each segment is only
+     sent its own share */
+  const int count = vec[0]->length;
+  int share[link->segments];
+  int pos[link->segments];
+  unsigned char *out[link->segments];
   int errors = 0;
 
+  memset(share, 0, sizeof(share));
+  for (int i = 0; i < count; ++i) {
+    share[FS_RID_SEGMENT(vec[1]->data[i], link->segments)]++;
+  }
+
   for (fs_segment segment = 0; segment < link->segments; ++segment) {
-    unsigned char *out = message_new(FS_DELETE_QUADS, segment, length * 4);
-    for (int s=0; s<4; s++) {
-      memcpy(out + FS_HEADER + s * length, vec[s]->data, length);
+    pos[segment] = 0;
+    out[segment] = NULL;
+    if (share[segment]) {
+      out[segment] = message_new(FS_DELETE_QUADS, segment,
+                                 sizeof(fs_rid) * share[segment] * 4);
     }
-    fsp_write_replica(link, out, length * 4);
-    free(out);
+  }
+  for (int i = 0; i < count; ++i) {
+    const fs_segment segment = FS_RID_SEGMENT(vec[1]->data[i], link->segments);
+    fs_rid *dest = (fs_rid *) (out[segment] + FS_HEADER);
+    for (int s = 0; s < 4; s++) {
+      dest[s * share[segment] + pos[segment]] = vec[s]->data[i];
+    }
+    pos[segment]++;
   }
 
   for (fs_segment segment = 0; segment < link->segments; ++segment) {
+    if (!out[segment]) continue;
+    fsp_write_replica(link, out[segment], sizeof(fs_rid) * share[segment] * 4);
+    free(out[segment]);
+  }
+
+  for (fs_segment segment = 0; segment < link->segments; ++segment) {
+    if (!share[segment]) continue;
     errors += check_message_replica(link, segment, "delete_quads(%d) failed: %s");
   }
 
@@ -1558,7 +1672,9 @@ int fsp_bind_limit_many (fsp_link *link,
         memcpy(content, orids->data, orids->length * 8);
         content += orids->length * 8;
 
+        unsigned int id = bind_stamp(out);
         sock[segment] = fsp_write(link, out, length);
+        bind_inflight(link, segment, id);
         free(out);
       }
 
@@ -1602,7 +1718,9 @@ int fsp_bind_limit_many (fsp_link *link,
         memcpy(content, orids->data, orids->length * 8);
         content += orids->length * 8;
 
+        unsigned int id = bind_stamp(out);
         sock[segment] = fsp_write(link, out, length);
+        bind_inflight(link, segment, id);
         free(out);
       }
 
@@ -1632,6 +1750,7 @@ int fsp_bind_limit_many (fsp_link *link,
     if (sock[segment] == -1) continue;
 
     unsigned char *in = message_recv(sock[segment], &segment, &length);
+    bind_inflight(link, segment, 0);
     g_static_mutex_unlock (&link->mutex[segment]);
 
     if (!in) {
@@ -2207,3 +2326,132 @@ int fsp_get_quad_freq_all (fsp_link *link, int index, int count, fs_quad_freq **
   return 0;
 }
 
+int fsp_get_generation_all (fsp_link *link, unsigned long long *generation)
+{
+  int sock[link->segments];
+  unsigned char *out = message_new(FS_GET_GENERATION, 0, 0);
+
+  for (fs_segment segment = 0; segment < link->segments; ++segment) {
+    unsigned int * const s = (unsigned int *) (out + 8);
+    *s = segment;
+    sock[segment] = fsp_write(link, out, 0);
+  }
+  free(out);
+
+  /* segments sharing a backend report the same counter, but any change
+     to any of them changes the combined value */
+  int errors = 0;
+  *generation = 0;
+  for (fs_segment segment = 0; segment < link->segments; ++segment) {
+    fs_segment ignore;
+    unsigned int length;
+    unsigned char *in = message_recv(sock[segment], &ignore, &length);
+    g_static_mutex_unlock (&link->mutex[segment]);
+
+    if (!in || in[3] != FS_GENERATION || length != sizeof(unsigned long long)) {
+      link_error(LOG_ERR, "get_generation(%d) failed: %s", segment, invalid_response(in));
+      errors++;
+    } else {
+      unsigned long long g;
+      memcpy(&g, in + FS_HEADER, sizeof(g));
+      *generation = (*generation ^ g) * 0x100000001b3ULL;
+    }
+    free(in);
+  }
+
+  return errors;
+}
+
+
+int fsp_text_insert (fsp_link *link, fs_segment segment,
+                     int count, fs_resource buffer[])
+{
+  unsigned int k, serial_length = 0;
+
+  for (k = 0; k < count; ++k) {
+    serial_length+= ((28 + strlen(buffer[k].lex)) / 8);
+  }
+
+  int length = 8 + (8 * serial_length);
+
+  /* same layout as FS_INSERT_RESOURCE */
+  unsigned char *out = message_new(FS_TEXT_INSERT, segment, length);
+  unsigned char *record = out + FS_HEADER;
+
+  memcpy(record, &count, sizeof(int));
+  record += 8;
+
+  for (k= 0; k < count; ++k) {
+    unsigned int one_length = ((28 + strlen(buffer[k].lex)) / 8) * 8;
+
+    memcpy(record, &buffer[k].rid, sizeof (fs_rid));
+    memcpy(record + 8, &buffer[k].attr, sizeof (fs_rid));
+    memcpy(record + 16, &one_length, sizeof(int));
+    strcpy((char *) record + 20, buffer[k].lex);
+    record += one_length;
+  }
+
+  fsp_write_replica(link, out, length);
+  g_static_mutex_unlock (&link->mutex[segment]);
+
+  free(out);
+  return 0;
+}
+
+static int text_match_cmp (const void *va, const void *vb)
+{
+  const fs_text_match *a = va;
+  const fs_text_match *b = vb;
+
+  if (a->score != b->score) return a->score < b->score ? 1 : -1;
+
+  return a->rid < b->rid ? -1 : a->rid > b->rid;
+}
+
+int fsp_text_search_all (fsp_link *link, const char *query, int limit,
+                         fs_text_match **matches, int *count)
+{
+  int sock[link->segments];
+  unsigned int length = 8 + strlen(query) + 1;
+  unsigned char *out = message_new(FS_TEXT_SEARCH, 0, length);
+  memcpy(out + FS_HEADER, &limit, sizeof(int));
+  strcpy((char *) out + FS_HEADER + 8, query);
+
+  for (fs_segment segment = 0; segment < link->segments; ++segment) {
+    unsigned int * const s = (unsigned int *) (out + 8);
+    *s = segment;
+    sock[segment] = fsp_write(link, out, length);
+  }
+  free(out);
+
+  *matches = NULL;
+  *count = 0;
+  int errors = 0;
+  for (fs_segment segment = 0; segment < link->segments; ++segment) {
+    fs_segment ignore;
+    unsigned int length;
+    unsigned char *in = message_recv(sock[segment], &ignore, &length);
+    g_static_mutex_unlock (&link->mutex[segment]);
+
+    if (!in || in[3] != FS_TEXT_MATCHES || length % sizeof(fs_text_match)) {
+      link_error(LOG_ERR, "text_search(%d) failed: %s", segment, invalid_response(in));
+      errors++;
+      free(in);
+      continue;
+    }
+
+    int found = length / sizeof(fs_text_match);
+    *matches = realloc(*matches, (*count + found + 1) * sizeof(fs_text_match));
+    memcpy(*matches + *count, in + FS_HEADER, length);
+    *count += found;
+    free(in);
+  }
+
+  /* each segment sends its best, so the best overall are among them */
+  if (*count > 0) {
+    qsort(*matches, *count, sizeof(fs_text_match), text_match_cmp);
+    if (limit > 0 && *count > limit) *count = limit;
+  }
+
+  return errors;
+}
@@ -37,6 +37,7 @@
 #define FS_BIND_SAME_ABAB        0xd000
 #define FS_BIND_SAME_ABBA        0xe000
 
+#define FS_QUERY_DESCRIBE_CBD      0x400000
 #define FS_QUERY_RESTRICTED        0x800000
 
 #define FS_BIND_BY_SUBJECT        0x1000000
@@ -126,6 +127,11 @@ typedef struct _fs_quad_freq {
     long long freq;	/* approximate quantity of entries */
 } fs_quad_freq;
 
+typedef struct _fs_text_match {
+    fs_rid rid;		/* of the literal */
+    double score;
+} fs_text_match;
+
 typedef enum {
   FS_HASH_UNKNOWN,
   FS_HASH_MD5,
@@ -54,6 +54,7 @@ struct fs_globals {
 	fs_rid fs_token;
 	fs_rid fs_dmetaphone;
 	fs_rid fs_stem;
+	fs_rid fs_inverted;
 	fs_rid fs_acl_admin;
 	fs_rid fs_acl_access_by;
     fs_rid fs_acl_default_admin;
@@ -68,6 +69,10 @@ void fs_hash_fini(void);
 fs_rid fs_hash_uri(const char *str);
 fs_rid fs_hash_uri_ignore_bnode(const char *str);
 fs_rid fs_hash_literal(const char *str, fs_rid attr);
+
+/* hash count strings at once, rids are identical to the functions above */
+void fs_hash_uri_multi(const char *str[], fs_rid rid[], int count);
+void fs_hash_literal_multi(const char *str[], const fs_rid attr[], fs_rid rid[], int count);
 struct fs_globals fs_global_constants(void);
 
 void umac_crypto_hash(const char *str, char *result);
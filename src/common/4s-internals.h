@@ -52,6 +52,8 @@ struct fsp_link_struct {
   int socks2[FS_MAX_SEGMENTS]; /* for failover */
   long long tics[FS_MAX_SEGMENTS];
   GStaticMutex mutex[FS_MAX_SEGMENTS];
+  GStaticMutex cancel_mutex;
+  unsigned int inflight[FS_MAX_SEGMENTS]; /* id of the bind on each segment */
   const char *features;
   int hit_limits;
 #if defined(USE_AVAHI)
@@ -39,6 +39,7 @@
 #include <glib.h>
 #include <netinet/in.h>
 #include <sys/stat.h>
+#include <poll.h>
 
 static char *global_kb_name = NULL;
 static float global_disk_limit = 0.0f;
@@ -72,6 +73,61 @@ static unsigned char * handle_or_fail(const char *name,
 #define handle(fn, be, segment, length, content) \
          handle_or_fail(#fn, fn, be, segment, length, content)
 
+/* the FS_BIND_LIMIT being handled, the backend is single threaded */
+static struct {
+  int conn;
+  unsigned int id;
+  double deadline;
+  unsigned int calls;
+  int abandoned;
+} bind_watch = { .conn = -1 };
+
+static void bind_watch_start(int conn, unsigned char *msg, unsigned int length)
+{
+  unsigned int ms = 0;
+
+  if (length >= 32) {
+    memcpy(&ms, msg + FS_HEADER + 28, sizeof(ms));
+  }
+  memcpy(&bind_watch.id, msg + 12, sizeof(bind_watch.id));
+  bind_watch.deadline = ms ? fs_time() + ms * 0.001 : 0.0;
+  bind_watch.calls = 0;
+  bind_watch.abandoned = 0;
+  bind_watch.conn = (ms || bind_watch.id) ? conn : -1;
+}
+
+int fsp_bind_abandoned (void)
+{
+  if (bind_watch.conn == -1) return 0;
+  if (bind_watch.abandoned) return 1;
+  if (++bind_watch.calls % FS_ABANDON_CHECK_INTERVAL) return 0;
+
+  if (bind_watch.deadline > 0.0 && fs_time() > bind_watch.deadline) {
+    bind_watch.abandoned = 1;
+    return 1;
+  }
+
+  /* while a bind runs the only thing the frontend can send is a cancel */
+  unsigned char header[FS_HEADER];
+  while (bind_watch.id &&
+         recv(bind_watch.conn, header, FS_HEADER, MSG_PEEK | MSG_DONTWAIT) == FS_HEADER &&
+         header[3] == FS_CANCEL) {
+    fs_segment segment;
+    unsigned int length, id;
+    unsigned char *msg = message_recv(bind_watch.conn, &segment, &length);
+    if (!msg) break;
+    memcpy(&id, msg + 12, sizeof(id));
+    free(msg);
+    /* a stale cancel, for an earlier bind, is dropped */
+    if (id == bind_watch.id) {
+      bind_watch.abandoned = 1;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
 static void child (int conn, fsp_backend *backend, fs_backend *be)
 {
   int auth = 0;
@@ -79,6 +135,14 @@ static void child (int conn, fsp_backend *backend, fs_backend *be)
   while (1) {
     fs_segment segment;
     unsigned int length;
+
+    if (backend->idle) {
+      struct pollfd pfd = { .fd = conn, .events = POLLIN };
+      if (poll(&pfd, 1, FS_BACKEND_IDLE_MS) == 0) {
+        backend->idle(be);
+      }
+    }
+
     unsigned char *msg = message_recv(conn, &segment, &length);
     unsigned char *reply = NULL;
     unsigned char *content = msg + FS_HEADER;
@@ -143,7 +207,9 @@ static void child (int conn, fsp_backend *backend, fs_backend *be)
           reply = handle(backend->get_query_times, be, segment, length, content);
           break;
         case FS_BIND_LIMIT:
+          bind_watch_start(conn, msg, length);
           reply = handle(backend->bind_limit, be, segment, length, content);
+          bind_watch.conn = -1;
           break;
         case FS_BNODE_ALLOC:
           reply = handle(backend->bnode_alloc, be, segment, length, content);
@@ -196,6 +262,18 @@ static void child (int conn, fsp_backend *backend, fs_backend *be)
 	case FS_GET_UUID:
 	  reply = handle(backend->get_uuid, be, segment, length, content);
 	  break;
+        case FS_GET_GENERATION:
+          reply = handle(backend->get_generation, be, segment, length, content);
+          break;
+        case FS_TEXT_INSERT:
+          reply = handle(backend->text_insert, be, segment, length, content);
+          break;
+        case FS_TEXT_SEARCH:
+          reply = handle(backend->text_search, be, segment, length, content);
+          break;
+        case FS_CANCEL:
+          /* its bind had already finished, there's nothing to answer */
+          break;
         default:
           kb_error(LOG_WARNING, "unexpected message type (%d)", msg[3]);
           reply = fsp_error_new(segment, "unexpected message type");
@@ -33,6 +33,7 @@ const gchar * fs_get_store_root(void)
 SINGLETON_STRING_GET_FUNCTION(kb_dir_format,     KB_DIR_FORMAT)
 SINGLETON_STRING_GET_FUNCTION(chain_format,      CHAIN_FORMAT)
 SINGLETON_STRING_GET_FUNCTION(file_lock_format,  FILE_LOCK_FORMAT)
+SINGLETON_STRING_GET_FUNCTION(generation_format, GENERATION_FORMAT)
 SINGLETON_STRING_GET_FUNCTION(lex_format,        LEX_FORMAT)
 SINGLETON_STRING_GET_FUNCTION(list_format,       LIST_FORMAT)
 SINGLETON_STRING_GET_FUNCTION(md_file_format,    MD_FILE_FORMAT)
@@ -43,10 +44,15 @@ SINGLETON_STRING_GET_FUNCTION(qlist_format,      QLIST_FORMAT)
 SINGLETON_STRING_GET_FUNCTION(rhash_format,      RHASH_FORMAT)
 SINGLETON_STRING_GET_FUNCTION(ri_file_format,    RI_FILE_FORMAT)
 SINGLETON_STRING_GET_FUNCTION(seg_dir_format,    SEG_DIR_FORMAT)
+SINGLETON_STRING_GET_FUNCTION(shared_ptree_format, SHARED_PTREE_FORMAT)
 SINGLETON_STRING_GET_FUNCTION(slist_format,      SLIST_FORMAT)
+SINGLETON_STRING_GET_FUNCTION(stats_format,      STATS_FORMAT)
 SINGLETON_STRING_GET_FUNCTION(tbchain_format,    TBCHAIN_FORMAT)
+SINGLETON_STRING_GET_FUNCTION(text_run_format,   TEXT_RUN_FORMAT)
+SINGLETON_STRING_GET_FUNCTION(text_runs_format,  TEXT_RUNS_FORMAT)
 SINGLETON_STRING_GET_FUNCTION(tlist_all_format,  TLIST_ALL_FORMAT)
 SINGLETON_STRING_GET_FUNCTION(tlist_dir_format,  TLIST_DIR_FORMAT)
 SINGLETON_STRING_GET_FUNCTION(tlist_dird_format, TLIST_DIRD_FORMAT)
 SINGLETON_STRING_GET_FUNCTION(tlist_format,      TLIST_FORMAT)
 SINGLETON_STRING_GET_FUNCTION(tree_format,       TREE_FORMAT)
+SINGLETON_STRING_GET_FUNCTION(wal_format,        WAL_FORMAT)
@@ -73,6 +73,13 @@
 
 #define FS_GET_UUID 0x33
 
+#define FS_GET_GENERATION 0x34
+#define FS_GENERATION 0x35
+#define FS_TEXT_INSERT 0x36
+#define FS_TEXT_SEARCH 0x37
+#define FS_TEXT_MATCHES 0x38
+#define FS_CANCEL 0x39
+
 /* message header  = 16 bytes */
 #define FS_HEADER 16
 
@@ -156,6 +163,9 @@ int fsp_delete_model_all (fsp_link *link, fs_rid_vector *models);
 int fsp_new_model_all (fsp_link *link, fs_rid_vector *models);
 int fsp_delete_quads_all (fsp_link *link, fs_rid_vector *vec[4]);
 
+/* a value that changes whenever data on any backend changes */
+int fsp_get_generation_all (fsp_link *link, unsigned long long *generation);
+
 int fsp_bind_limit_many (fsp_link *link,
                          int flags,
                          fs_rid_vector *mrids,
@@ -175,6 +185,12 @@ int fsp_bind_limit_all (fsp_link *link,
                   int offset,
                   int limit);
 
+/* binds made by the calling thread carry this deadline (an fs_time(), or 0
+ * for none) and id, so backends can abandon them, see fsp_cancel() */
+void fsp_bind_context (unsigned int id, double deadline);
+/* ask backends to abandon binds in flight for id, from any thread */
+void fsp_cancel (fsp_link *link, unsigned int id);
+
 #define fsp_bind(link, segment, flags, mrids, srids, prids, orids, result) \
 	fsp_bind_limit(link, segment, flags, mrids, srids, prids, orids, result, -1, -1)
 
@@ -220,6 +236,15 @@ int fsp_unlock (fsp_link *link);
 int fsp_get_quad_freq_all (fsp_link *link, int index, int count,
                            fs_quad_freq **freq);
 
+/* full text index, literals are queued with the segment that holds them
+ * and indexed when the import stops or the transaction commits */
+int fsp_text_insert (fsp_link *link, fs_segment segment,
+                     int count, fs_resource buffer[]);
+/* sets *matches to at most limit matches from all segments, best first,
+ * and *count to the number */
+int fsp_text_search_all (fsp_link *link, const char *query, int limit,
+                         fs_text_match **matches, int *count);
+
 int fsp_res_import_commit_all (fsp_link *link);
 int fsp_quad_import_commit_all (fsp_link *link, int flags);
 
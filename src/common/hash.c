@@ -42,6 +42,10 @@ static GHashTable *bnids = NULL;
 
 static umac_ctx_t umac_data = NULL;
 
+/* scratch space for the batch functions, reused between strings */
+static char *multi_buffer = NULL;
+static size_t multi_buffer_size = 0;
+
 struct fs_globals fs_c;
 
 void bnhash_destroy(gpointer data)
@@ -104,6 +108,7 @@ void fs_hash_init(fsp_hash_enum type)
     fs_c.fs_token = fs_hash_uri(FS_TEXT_TOKEN);
     fs_c.fs_dmetaphone = fs_hash_uri(FS_TEXT_DMETAPHONE);
     fs_c.fs_stem = fs_hash_uri(FS_TEXT_STEM);
+    fs_c.fs_inverted = fs_hash_uri(FS_TEXT_INVERTED);
     fs_c.fs_acl_admin = fs_hash_uri(FS_ACL_ADMIN);
     fs_c.fs_acl_access_by = fs_hash_uri(FS_ACL_ONLY_ACCESS_BY);
     fs_c.fs_acl_default_admin = fs_hash_literal(FS_ACL_DEFAULT_ADMIN,0);
@@ -202,6 +207,9 @@ void fs_hash_fini()
 	umac_delete(umac_data);
 	umac_data = NULL;
     }
+    free(multi_buffer);
+    multi_buffer = NULL;
+    multi_buffer_size = 0;
 }
 
 fs_rid umac_wrapper(const char *str, fs_rid nonce_in)
@@ -243,36 +251,44 @@ fs_rid umac_wrapper(const char *str, fs_rid nonce_in)
     return data;
 }
 
-fs_rid fs_hash_uri(const char *str)
+/* bNodes, skolem URIs and junk don't get hashed, returns true if str was
+ * one of those and fills in rid */
+static int uri_special(const char *str, fs_rid *rid)
 {
-    uint64_t top;
-
-    if (!str) {
-        return 0;
-    }
     if (strncmp(str, "bnode:b", 7) == 0) {
 	fs_rid bnode_id = strtoll(str+7, NULL, 16);
-	if (!bnode_id) {
-	    return FS_RID_GONE;
-	}
+	*rid = bnode_id ? FS_NUM_BNODE(bnode_id) : FS_RID_GONE;
 
-	return FS_NUM_BNODE(bnode_id);
+	return 1;
     } else if (strncmp(str, "_:b", 3) == 0) {
 	fs_rid bnode_id = strtoll(str+3, NULL, 16);
-	if (!bnode_id) {
-	    return FS_RID_GONE;
-	}
+	*rid = bnode_id ? FS_NUM_BNODE(bnode_id) : FS_RID_GONE;
 
-	return FS_NUM_BNODE(bnode_id);
+	return 1;
     } else if (fs_global_skolem_prefix_len && strncmp(str, fs_global_skolem_prefix, fs_global_skolem_prefix_len) == 0) {
 	fs_rid bnode_id = strtoll(str + fs_global_skolem_prefix_len, NULL, 16);
-	if (!bnode_id) {
-	    return FS_RID_GONE;
-	}
+	*rid = bnode_id ? FS_NUM_BNODE(bnode_id) : FS_RID_GONE;
 
-	return FS_NUM_BNODE(bnode_id);
+	return 1;
     } else if (!isalpha(str[0])) {
-        return FS_RID_GONE;
+	*rid = FS_RID_GONE;
+
+	return 1;
+    }
+
+    return 0;
+}
+
+fs_rid fs_hash_uri(const char *str)
+{
+    uint64_t top;
+
+    if (!str) {
+        return 0;
+    }
+    fs_rid special;
+    if (uri_special(str, &special)) {
+        return special;
     }
 
     top = umac_wrapper(str, 0);
@@ -309,6 +325,61 @@ fs_rid fs_hash_literal(const char *str, fs_rid attr)
     return top;
 }
 
+/* same result as umac_wrapper(), but the copy is made into a buffer that
+ * lives across calls, which matters when hashing many short strings */
+static fs_rid umac_scratch(const char *str, fs_rid nonce_in)
+{
+    long long __attribute__((aligned(16))) data;
+    long long __attribute__((aligned(16))) nonce = nonce_in;
+
+    const size_t slen = strlen(str);
+    /* umac() zero pads up to the next 32 byte boundary */
+    const size_t need = (slen + 64) & ~31;
+    if (need > multi_buffer_size) {
+	free(multi_buffer);
+	multi_buffer = NULL;
+	if (posix_memalign((void **)&multi_buffer, 16, need)) {
+	    fs_error(LOG_CRIT, "posix_memalign: %s", strerror(errno));
+	    multi_buffer_size = 0;
+
+	    return umac_wrapper(str, nonce_in);
+	}
+	multi_buffer_size = need;
+    }
+    memcpy(multi_buffer, str, slen);
+    umac(umac_data, multi_buffer, slen, (char *)&data, (char *)&nonce);
+
+    return data;
+}
+
+void fs_hash_uri_multi(const char *str[], fs_rid rid[], int count)
+{
+    if (!umac_data) {
+	umac_data = umac_new("\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0");
+    }
+    for (int i = 0; i < count; i++) {
+	if (!str[i]) {
+	    rid[i] = 0;
+	} else if (!uri_special(str[i], &rid[i])) {
+	    rid[i] = umac_scratch(str[i], 0) | 0xC000000000000000LL;
+	}
+    }
+}
+
+void fs_hash_literal_multi(const char *str[], const fs_rid attr[], fs_rid rid[], int count)
+{
+    if (!umac_data) {
+	umac_data = umac_new("\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0");
+    }
+    for (int i = 0; i < count; i++) {
+	if (!str[i]) {
+	    rid[i] = 0;
+	} else {
+	    rid[i] = umac_scratch(str[i], attr[i]) & 0x7FFFFFFFFFFFFFFFLL;
+	}
+    }
+}
+
 guint fs_rid_hash(gconstpointer p)
 {
     const fs_rid *r = p;
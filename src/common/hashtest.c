@@ -117,6 +117,36 @@ int main()
 	double now = fs_time();
 
 	printf("%f us/hash\n", 1000000 * (now-then) / (double)ITS);
+	printf("fs_hash_uri:       %.0f strings/s\n", ITS / (now-then));
+
+	/* the batch functions must give the same rids */
+	fs_rid rids[80];
+	fs_hash_uri_multi((const char **)teststr, rids, 80);
+	for (int i=0; i<80; i++) {
+		if (rids[i] != fs_hash_uri(teststr[i])) {
+			printf("FAIL: fs_hash_uri_multi(<%s>) = %016llx, expected %016llx\n", teststr[i], rids[i], fs_hash_uri(teststr[i]));
+			return 1;
+		}
+	}
+	fs_rid attrs[80];
+	for (int i=0; i<80; i++) {
+		attrs[i] = i % 3 ? fs_c.lang_en : fs_c.xsd_string;
+	}
+	fs_hash_literal_multi((const char **)teststr, attrs, rids, 80);
+	for (int i=0; i<80; i++) {
+		if (rids[i] != fs_hash_literal(teststr[i], attrs[i])) {
+			printf("FAIL: fs_hash_literal_multi('%s') = %016llx, expected %016llx\n", teststr[i], rids[i], fs_hash_literal(teststr[i], attrs[i]));
+			return 1;
+		}
+	}
+
+	then = fs_time();
+	for (int i=0; i<ITS; i+=80) {
+		fs_hash_uri_multi((const char **)teststr, rids, 80);
+	}
+	now = fs_time();
+
+	printf("fs_hash_uri_multi: %.0f strings/s\n", ITS / (now-then));
 
 	return 0;
 }
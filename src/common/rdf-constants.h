@@ -48,6 +48,8 @@
 #define FS_TEXT_TOKEN      FS_TEXT "token"
 #define FS_TEXT_DMETAPHONE FS_TEXT "dmetaphone"
 #define FS_TEXT_STEM       FS_TEXT "stem"
+#define FS_TEXT_INVERTED   FS_TEXT "inverted"
+#define FS_TEXT_MATCH      FS_TEXT "match"
 
 #define FS_ACL            "http://4store.org/acl#"
 #define FS_ACL_ADMIN      FS_ACL "admin"
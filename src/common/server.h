@@ -58,10 +58,19 @@ typedef struct {
   fsp_backend_fn choose_segment;
 
   fsp_backend_fn get_uuid;
+  fsp_backend_fn get_generation;
+  fsp_backend_fn text_insert;
+  fsp_backend_fn text_search;
 
   fs_backend * (* open) (const char *kb_name, int flags);
   void (* close) (fs_backend *backend);
+  /* optional, called once the connection has been quiet for a moment */
+  void (* idle) (fs_backend *backend);
   int (* segment_count) (fs_backend *backend);
 } fsp_backend;
 
 void fsp_serve (const char *kb_name, fsp_backend *implementation, int daemon, float free_disk);
+
+/* true once the FS_BIND_LIMIT being handled has passed its deadline or
+ * been cancelled by the frontend, cheap enough to call per quad */
+int fsp_bind_abandoned (void);
@@ -54,6 +54,8 @@ int main(int argc, char *argv[])
     char *kb_name = NULL;
     char *model[argc], *uri[argc];
     char *model_default = NULL;
+    long cache_size = 0;
+    int cache_seed = 0;
 
     password = fsp_argv_password(&argc, argv);
 
@@ -66,6 +68,8 @@ int main(int argc, char *argv[])
         { "dryrun", 0, 0, 'n' },
         { "no-resources", 0, 0, 'R' },
         { "no-quads", 0, 0, 'Q' },
+        { "cache-size", 1, 0, 'C' },
+        { "cache-seed", 0, 0, 'S' },
         { "format", 1, 0, 'f' },
         { "help", 0, 0, 'h' },
         { "version", 0, 0, 'V' },
@@ -95,6 +99,10 @@ int main(int argc, char *argv[])
             dryrun |= FS_DRYRUN_RESOURCES;
         } else if (c == 'Q') {
             dryrun |= FS_DRYRUN_QUADS;
+        } else if (c == 'C') {
+            cache_size = atol(optarg);
+        } else if (c == 'S') {
+            cache_seed = 1;
         } else if (c == 'f') {
             format = optarg;
         } else if (c == 'h') {
@@ -150,6 +158,8 @@ int main(int argc, char *argv[])
         fprintf(stdout, " -m --model     specify a model URI for the next RDF file\n");
         fprintf(stdout, " -M --model-default specify a model URI for all RDF files\n");
         fprintf(stdout, " -f --format    specify an RDF syntax for the import\n");
+        fprintf(stdout, "    --cache-size number of resources remembered as already sent\n");
+        fprintf(stdout, "    --cache-seed preload the resource cache with frequent resources\n");
         fprintf(stdout, "\n   available formats are:\n");
 
         for (unsigned int i=0; 1; i++) {
@@ -160,6 +170,7 @@ int main(int argc, char *argv[])
             }
             fprintf(stdout, "    %12s - %s\n", desc->names[0], desc->label);
         }
+        fprintf(stdout, "    %12s - %s\n", "4s-binary", "4store pre-hashed binary (.4sb)");
         exit(help_return);
     }
 
@@ -220,6 +231,8 @@ int main(int argc, char *argv[])
 
     fs_rid_vector_free(mvec);
 
+    fs_import_cache_config(cache_size, cache_seed);
+
     gettimeofday(&then_last, 0);
     for (int f = 0; f < files; ++f) {
 	if (verbosity) {
@@ -238,6 +251,12 @@ int main(int argc, char *argv[])
     double sthen = fs_time();
     int ret = fs_import_commit(fsplink, verbosity, dryrun, has_o_index, msg, &total_triples);
 
+    if (verbosity > 0) {
+        long long hits, misses, saved;
+        fs_import_cache_stats(&hits, &misses, &saved);
+        printf("Resource cache: %lld hits, %lld misses, saved %lld bytes of resource traffic\n", hits, misses, saved);
+    }
+
     if (verbosity > 0) {
 	printf("Updating index\n");
         fflush(stdout);
@@ -150,7 +150,7 @@ int main(int argc, char *argv[])
       fprintf(stdout, "   or: %s <kbname> -P\n", basename(argv[0]));
       fprintf(stdout, " query is a SPARQL%s query, remember to use"
                       " shell quoting if necessary\n", langs);
-      fprintf(stdout, " -f              Output format one of, sparql, text, json, or testcase\n");
+      fprintf(stdout, " -f              Output format one of, sparql, text, csv, json, binary, or testcase\n");
       fprintf(stdout, " -O, --opt-level Set optimisation level, range 0-3\n");
       fprintf(stdout, " -I, --insert    Interpret CONSTRUCT statements as inserts\n");
       fprintf(stdout, " -r, --restricted  Enable query complexity restriction\n");
@@ -227,7 +227,7 @@ int main(int argc, char *argv[])
         fsp_init_acl_system(link);
 
     qs->verbosity = verbosity;
-    fs_query *qr = fs_query_execute(qs, link, bu, query, flags, opt_level, soft_limit, apikey, explain);
+    fs_query *qr = fs_query_execute(qs, link, bu, query, flags, opt_level, soft_limit, apikey, explain, NULL);
     if (fs_query_errors(qr)) {
         ret = 1;
     }
@@ -266,6 +266,70 @@ int main(int argc, char *argv[])
 
 #define MAX_Q_SIZE 1000000
 
+static void end_of_results(const char *result_format)
+{
+    if (result_format && !strcmp(result_format, "sparql")) {
+        printf("<!-- EOR -->\n");
+    } else {
+        printf("#EOR\n");
+    }
+    fflush(stdout);
+}
+
+/* "#PREPARE name" followed by a query registers it, "#EXECUTE name" followed
+ * by lines of "?var term" runs it, returns the query to output, or NULL if
+ * there's nothing more to say */
+static fs_query *programatic_prepared(fs_query_state *qs, fsp_link *link, raptor_uri *bu, GHashTable *prepared, char *request, int opt_level, unsigned int result_flags, int soft_limit)
+{
+    char *body = strchr(request, '\n');
+    if (body) *body++ = '\0';
+    char *name = g_strstrip(request + 9);
+
+    if (!strncmp(request, "#PREPARE ", 9)) {
+        char *error = NULL;
+        fs_prepared *p = fs_query_prepare(qs, link, bu, body ? body : "", &error);
+        if (p) {
+            g_hash_table_replace(prepared, g_strdup(name), p);
+        } else {
+            char **lines = g_strsplit(error, "\n", 0);
+            for (int i=0; lines[i]; i++) {
+                printf("# %s\n", lines[i]);
+            }
+            g_strfreev(lines);
+            g_free(error);
+        }
+
+        return NULL;
+    }
+
+    fs_prepared *p = g_hash_table_lookup(prepared, name);
+    if (!p) {
+        printf("# no prepared query called %s\n", name);
+
+        return NULL;
+    }
+
+    GArray *params = g_array_new(FALSE, FALSE, sizeof(fs_query_param));
+    char **lines = g_strsplit(body ? body : "", "\n", 0);
+    for (int i=0; lines[i]; i++) {
+        char *line = g_strstrip(lines[i]);
+        if (!*line || *line == '#') continue;
+        fs_query_param param;
+        param.name = line;
+        for (; *line && !g_ascii_isspace(*line); line++);
+        if (*line) *line++ = '\0';
+        param.value = g_strstrip(line);
+        g_array_append_val(params, param);
+    }
+    fs_query *tq = fs_query_execute_prepared(qs, link, p,
+            (fs_query_param *)params->data, params->len, result_flags,
+            opt_level, soft_limit, apikey, 0, NULL);
+    g_array_free(params, TRUE);
+    g_strfreev(lines);
+
+    return tq;
+}
+
 static void programatic_io(fsp_link *link, raptor_uri *bu, const char *query_lang, const char *result_format, fs_query_timing *timing, int verbosity, int opt_level, unsigned int result_flags, int soft_limit, raptor_world *rw)
 {
     char query[MAX_Q_SIZE];
@@ -278,6 +342,9 @@ static void programatic_io(fsp_link *link, raptor_uri *bu, const char *query_lan
         fsp_init_acl_system(link);
     qs->verbosity = verbosity;
 
+    GHashTable *prepared = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                g_free, (GDestroyNotify) fs_prepared_free);
+
     do {
 	pos = query;
 	*query = '\0';
@@ -290,12 +357,20 @@ static void programatic_io(fsp_link *link, raptor_uri *bu, const char *query_lan
 	} while (newl && strcmp(newl, "#EOQ\n") && strcmp(newl, "#END\n"));
 
 	/* process query string */
-	if (*query && strcmp(query, "#EOQ\n") && strcmp(query, "#END\n")) {
+	if (!strncmp(query, "#PREPARE ", 9) || !strncmp(query, "#EXECUTE ", 9)) {
+	    fs_query *tq = programatic_prepared(qs, link, bu, prepared, query,
+		    opt_level, result_flags, soft_limit);
+	    if (tq) {
+		fs_query_results_output(tq, result_format, 0, stdout);
+		fs_query_free(tq);
+	    }
+	    end_of_results(result_format);
+	} else if (*query && strcmp(query, "#EOQ\n") && strcmp(query, "#END\n")) {
             if (show_timing) {
                 printf("Q: %s\n", query);
             }
 	    fs_query *tq = fs_query_execute(qs, link, bu, query,
-		    result_flags, opt_level, soft_limit, apikey, 0);
+		    result_flags, opt_level, soft_limit, apikey, 0, NULL);
 	    fs_query_results_output(tq, result_format, 0, stdout);
             if (show_timing) {
                 printf("# time: %f s\n", fs_time() - fs_query_start_time(tq));
@@ -329,15 +404,11 @@ static void programatic_io(fsp_link *link, raptor_uri *bu, const char *query_lan
                        total_time.resolve_count, total_time.resolve);
             }
 	    fs_query_free(tq);
-	    if (result_format && !strcmp(result_format, "sparql")) {
-                printf("<!-- EOR -->\n");
-	    } else {
-                printf("#EOR\n");
-	    }
-	    fflush(stdout);
+	    end_of_results(result_format);
 	}
     } while (newl && strcmp(newl, "#END\n"));
 
+    g_hash_table_destroy(prepared);
     raptor_free_uri(bu);
     fsp_close_link(link);
     raptor_free_world(rw);
@@ -419,7 +490,7 @@ static void interactive(fsp_link *link, raptor_uri *bu, const char *result_forma
                 then = fs_time();
             }
 	    fs_query *tq = fs_query_execute(qs, link, bu, query,
-		    result_flags, opt_level, soft_limit, apikey, 0);
+		    result_flags, opt_level, soft_limit, apikey, 0, NULL);
             if (show_timing) {
                 double now = fs_time();
                 printf("# bind time %.3fs\n", now-then);
@@ -24,13 +24,8 @@
 #include <libgen.h>
 #include <string.h>
 #include <glib.h>
-#include <rasqal.h>
 
-#include "query-datatypes.h"
 #include "../common/4store.h"
-#include "../common/datatypes.h"
-#include "../common/params.h"
-#include "../common/hash.h"
 #include "../common/error.h"
 
 int main(int argc, char *argv[])
@@ -77,7 +72,14 @@ int main(int argc, char *argv[])
 	if (ret) {
 	    fs_error(LOG_CRIT, "failed to get commit lock for '%s'", argv[1]);
 	}
-	if (!ret) ret = fsp_transaction_pre_commit_all(link);
+	if (!ret) {
+	    /* if any segment couldn't prepare none of them can commit */
+	    ret = fsp_transaction_pre_commit_all(link);
+	    if (ret) {
+		fs_error(LOG_ERR, "pre-commit failed for '%s', rolling back", argv[1]);
+		fsp_transaction_rollback_all(link);
+	    }
+	}
 	if (!ret) ret = fsp_transaction_commit_all(link);
     } else {
 	fprintf(stderr, "bad argument, expected “begin”, “rollback” or “commit”\n");
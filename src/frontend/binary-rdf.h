@@ -0,0 +1,22 @@
+#ifndef BINARY_RDF_H
+#define BINARY_RDF_H
+
+/* constants for the binary quad/resource stream, see docs/binary-import */
+
+#define FS_BINARY_MIME "application/x-4store-binary"
+#define FS_BINARY_FORMAT "4s-binary"
+#define FS_BINARY_SUFFIX ".4sb"
+
+#define FS_BINARY_MAGIC "4SBIN\0\0\1"
+#define FS_BINARY_MAGIC_LEN 8
+#define FS_BINARY_BOM 0x01020304
+#define FS_BINARY_HEADER 16
+
+#define FS_BINARY_RECORD_HEADER 8
+#define FS_BINARY_MAX_PAYLOAD (16 * 1024 * 1024)
+
+#define FS_BINARY_RESOURCE 'R'
+#define FS_BINARY_QUADS    'Q'
+#define FS_BINARY_END      'E'
+
+#endif
@@ -27,6 +27,7 @@
 #include "../common/4store.h"
 #include "../common/server.h"
 #include "../common/error.h"
+#include "binary-rdf.h"
 
 #define QUAD_LIMIT 2000
 
@@ -48,6 +49,61 @@ static double time_write_out = 0.0;
 
 static int segments = 0;
 
+/* set when writing the binary import format, see docs/binary-import */
+static FILE *binary = NULL;
+static fs_rid attr_written[ATTR_CACHE_SIZE];
+
+static void binary_record(int type, const void *payload, uint32_t length)
+{
+  unsigned char header[FS_BINARY_RECORD_HEADER] = { type, 0, 0, 0 };
+
+  memcpy(header + 4, &length, sizeof(length));
+  fwrite(header, sizeof(header), 1, binary);
+  if (length) fwrite(payload, length, 1, binary);
+}
+
+static void binary_resource(fs_resource *res)
+{
+  size_t len = strlen(res->lex);
+  unsigned char *payload = malloc(16 + len);
+
+  memcpy(payload, &res->rid, sizeof(fs_rid));
+  memcpy(payload + 8, &res->attr, sizeof(fs_rid));
+  memcpy(payload + 16, res->lex, len);
+  binary_record(FS_BINARY_RESOURCE, payload, 16 + len);
+  free(payload);
+}
+
+/* datatypes and languages, written once unless they collide */
+static void binary_attr(fsp_link *link, fs_rid attr)
+{
+  if (attr == FS_RID_NULL || attr == fs_c.empty ||
+      attr_written[attr & ATTR_CACHE_MASK] == attr) return;
+
+  fs_rid_vector onerid = { .length = 1, .size = 1, .data = &attr };
+  fs_resource resource;
+
+  fsp_resolve(link, FS_RID_SEGMENT(attr, segments), &onerid, &resource);
+  binary_resource(&resource);
+  free(resource.lex);
+  attr_written[attr & ATTR_CACHE_MASK] = attr;
+}
+
+static void binary_quads(fs_rid model, fs_rid_vector **rids)
+{
+  long length = rids[0]->length;
+  fs_rid *quads = malloc(length * 4 * sizeof(fs_rid));
+
+  for (long k = 0; k < length; ++k) {
+    quads[k * 4] = model;
+    for (int c = 0; c < 3; ++c) {
+      quads[k * 4 + c + 1] = rids[c]->data[k];
+    }
+  }
+  binary_record(FS_BINARY_QUADS, quads, length * 4 * sizeof(fs_rid));
+  free(quads);
+}
+
 xmlChar *get_uri(fsp_link *link, fs_rid rid)
 {
   if (cache[rid & CACHE_MASK].rid == rid) {
@@ -122,6 +178,10 @@ void resolve_triples(fsp_link *link, fs_rid_vector **rids)
   for (segment = 0; segment < segments; ++segment) {
     fs_resource *res = resources[segment];
     for (int k = 0; k < length[segment]; ++k) {
+      if (binary) {
+        binary_resource(&res[k]);
+        if (FS_IS_LITERAL(res[k].rid)) binary_attr(link, res[k].attr);
+      }
       free(cache[res[k].rid & CACHE_MASK].lex);
       memcpy(&cache[res[k].rid & CACHE_MASK], &res[k], sizeof(fs_resource));
     }
@@ -155,7 +215,8 @@ void dump_model(fsp_link *link, fs_rid model, xmlTextWriterPtr xml)
     time_resolving += (fs_time() - then);
 
     then = fs_time();
-    for (int k = 0; k < length; ++k) {
+    if (binary) binary_quads(model, results);
+    for (int k = 0; !binary && k < length; ++k) {
       xmlTextWriterStartElement(xml, (xmlChar *) "triple");
 
       for (int r = 0; r < 3; ++r) {
@@ -219,6 +280,16 @@ void dump_trix(fsp_link *link, xmlTextWriterPtr xml)
 
   for (int k = 0; k < length; ++k) {
     fs_rid model = models[0]->data[k];
+    if (binary) {
+      fs_rid_vector onerid = { .length = 1, .size = 1, .data = &model };
+      fs_resource resource;
+      fsp_resolve(link, FS_RID_SEGMENT(model, segments), &onerid, &resource);
+      binary_resource(&resource);
+      free(resource.lex);
+      dump_model(link, model, NULL);
+      printf("%5d/%ld: %4.5f %4.5f %4.5f %4.5f\n", k + 1, length, time_resolving, time_bind_first, time_bind_next, time_write_out);
+      continue;
+    }
     xmlChar *model_uri = get_uri(link, model);
     xmlTextWriterStartElement(xml, (xmlChar *) "graph");
     if (FS_IS_URI(model)) {
@@ -250,13 +321,49 @@ void dump_file(fsp_link *link, char *filename)
   xmlFreeTextWriter(xml);
 }
 
+void dump_binary(fsp_link *link, char *filename)
+{
+  binary = fopen(filename, "w");
+
+  if (!binary) {
+    fs_error(LOG_ERR, "Couldn't write output file, giving up");
+    exit(4);
+  }
+
+  unsigned char header[FS_BINARY_HEADER];
+  uint32_t bom = FS_BINARY_BOM;
+  uint32_t hash = fsp_hash_type(link);
+
+  memcpy(header, FS_BINARY_MAGIC, FS_BINARY_MAGIC_LEN);
+  memcpy(header + 8, &bom, sizeof(bom));
+  memcpy(header + 12, &hash, sizeof(hash));
+  fwrite(header, sizeof(header), 1, binary);
+
+  dump_trix(link, NULL);
+  binary_record(FS_BINARY_END, NULL, 0);
+
+  if (fclose(binary)) {
+    fs_error(LOG_ERR, "error writing output file");
+    exit(4);
+  }
+  binary = NULL;
+}
+
 int main(int argc, char *argv[])
 {
   char *password = fsp_argv_password(&argc, argv);
+  int use_binary = 0;
+
+  if (argc == 4 && (!strcmp(argv[1], "-b") || !strcmp(argv[1], "--binary"))) {
+    use_binary = 1;
+    argv[1] = argv[0];
+    argv++;
+    argc--;
+  }
 
   if (argc != 3) {
     fprintf(stderr, "%s revision %s\n", argv[0], FS_FRONTEND_VER);
-    fprintf(stderr, "Usage: %s <kbname> <uri>\n", argv[0]);
+    fprintf(stderr, "Usage: %s [--binary] <kbname> <uri>\n", argv[0]);
     exit(1);
   }
 
@@ -269,7 +376,11 @@ int main(int argc, char *argv[])
 
   fs_hash_init(fsp_hash_type(link));
   segments = fsp_link_segments(link);
-  dump_file(link, argv[2]);
+  if (use_binary) {
+    dump_binary(link, argv[2]);
+  } else {
+    dump_file(link, argv[2]);
+  }
 
   fsp_close_link(link);
 }
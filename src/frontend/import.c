@@ -31,6 +31,8 @@
 #include <errno.h>
 
 #include "import.h"
+#include "binary-rdf.h"
+#include "query-cache.h"
 #include "../common/error.h"
 #include "../common/params.h"
 #include "../common/4store.h"
@@ -41,6 +43,7 @@
 
 #define RES_BUF_SIZE 256
 #define QUAD_BUF_SIZE 10000
+#define QUAD_SEG_BUF_MIN 1024
 #define FS_CHUNK_SIZE 5000000
 
 #define MEMBER_PREFIX "http://www.w3.org/1999/02/22-rdf-syntax-ns#_"
@@ -65,18 +68,49 @@ typedef struct {
     char *quad_fn;
     int segments;
     int has_o_index;
+    int binary;
+    int binary_graph; /* put binary quads in model rather than their own */
+    fs_cache_touched *touched;
     raptor_world *world;
     raptor_uri *muri;
     raptor_parser *parser;
 } fs_parse_stuff;
 
+/* resource and quad buffers are double buffered per segment, the parser
+ * fills one side while the segment's sender thread writes the other to the
+ * backend */
 static long res_pos[FS_MAX_SEGMENTS];
+static int res_side[FS_MAX_SEGMENTS];
 
-static fs_resource res_buffer[FS_MAX_SEGMENTS][RES_BUF_SIZE];
-static char *lex_tmp[FS_MAX_SEGMENTS][RES_BUF_SIZE];
+static fs_resource res_buffer[2][FS_MAX_SEGMENTS][RES_BUF_SIZE];
+static char *lex_tmp[2][FS_MAX_SEGMENTS][RES_BUF_SIZE];
 
 static fs_rid quad_buf[QUAD_BUF_SIZE][4];
-static fs_rid quad_buf_s[QUAD_BUF_SIZE][4];
+
+static fs_rid (*quad_seg_buf[2][FS_MAX_SEGMENTS])[4];
+static int quad_pos[FS_MAX_SEGMENTS];
+static int quad_side[FS_MAX_SEGMENTS];
+static int quad_limit[FS_MAX_SEGMENTS];
+static int quad_cap = 0;
+
+typedef struct {
+    fsp_link *link;
+    fs_segment segment;
+    GThread *thread;
+    GMutex *mutex;
+    GCond *cond;
+    int quit;
+    int busy;           /* a batch is queued or being written */
+    int side;           /* buffer side the batch came from */
+    int res_count;
+    int quad_count;
+    fs_rid (*quads)[4];
+    int errors;
+    double wait;        /* seconds the parser spent blocked on us */
+} fs_import_sender;
+
+static fs_import_sender senders[FS_MAX_SEGMENTS];
+static int senders_running = 0;
 
 static int sent_token_pred = 0;
 static int sent_metaphone_pred = 0;
@@ -86,14 +120,385 @@ static int read_config = 0;
 static fs_rid_set *token_set = NULL;
 static fs_rid_set *metaphone_set = NULL;
 static fs_rid_set *stem_set = NULL;
+static fs_rid_set *inverted_set = NULL;
+
+/* literals for the backends' full text indexes */
+static fs_resource text_buffer[FS_MAX_SEGMENTS][RES_BUF_SIZE];
+static int text_pos[FS_MAX_SEGMENTS];
 
 static void store_stmt(void *user_data, raptor_statement *statement);
+static void buffer_quad(fs_parse_stuff *data, fs_rid quad[4]);
+static void count_quad(fs_parse_stuff *data);
 
 static int process_quads(fs_parse_stuff *data);
 
-#define CACHE_SIZE 32768
-#define CACHE_MASK (CACHE_SIZE-1)
-static fs_rid nodecache[CACHE_SIZE];
+/* set associative cache of resources we've already sent, replacement within
+ * a set is CLOCK ordered and new entries start unreferenced, so repeatedly
+ * used rids (types, predicates etc.) survive a stream of one-off literals */
+#define CACHE_WAYS 8
+#define CACHE_DEFAULT_SIZE (1 << 18)
+
+typedef struct {
+    fs_rid rid[CACHE_WAYS];
+    unsigned char ref;  /* referenced bit per way */
+    unsigned char hand;
+} fs_nodecache_set;
+
+static fs_nodecache_set *nodecache = NULL;
+static unsigned long nodecache_mask = 0;
+static long nodecache_size = CACHE_DEFAULT_SIZE;
+static int nodecache_seed = 0;
+
+static long long nodecache_hits = 0;
+static long long nodecache_misses = 0;
+static long long nodecache_saved = 0;
+
+static inline fs_nodecache_set *nodecache_set(fs_rid r)
+{
+    return &nodecache[(r ^ (r >> 32)) & nodecache_mask];
+}
+
+/* returns true if r was already in the cache, otherwise inserts it */
+static int nodecache_check(fs_rid r)
+{
+    fs_nodecache_set *set = nodecache_set(r);
+
+    for (int w=0; w<CACHE_WAYS; w++) {
+        if (set->rid[w] == r) {
+            set->ref |= (1 << w);
+
+            return 1;
+        }
+    }
+    while (set->ref & (1 << set->hand)) {
+        set->ref &= ~(1 << set->hand);
+        set->hand = (set->hand + 1) % CACHE_WAYS;
+    }
+    set->rid[set->hand] = r;
+    set->hand = (set->hand + 1) % CACHE_WAYS;
+
+    return 0;
+}
+
+static void nodecache_seed_freq(fsp_link *link, int index)
+{
+    fs_quad_freq *freq = NULL;
+
+    if (fsp_get_quad_freq_all(link, index, CACHE_WAYS * 1024, &freq)) {
+        fs_error(LOG_ERR, "failed to get quad freq data for resource cache");
+
+        return;
+    }
+    for (fs_quad_freq *pos = freq; pos->freq; pos++) {
+        /* pri is the S or O, sec the predicate */
+        if (!FS_IS_BNODE(pos->pri)) nodecache_check(pos->pri);
+        nodecache_check(pos->sec);
+    }
+    free(freq);
+}
+
+static void nodecache_reset(fsp_link *link)
+{
+    long sets = 1;
+    while (sets * CACHE_WAYS < nodecache_size) {
+        sets *= 2;
+    }
+    if (!nodecache || nodecache_mask != sets - 1) {
+        free(nodecache);
+        nodecache = malloc(sets * sizeof(fs_nodecache_set));
+        nodecache_mask = sets - 1;
+    }
+    /* FS_RID_NULL is never buffered, so is safe as an empty marker */
+    for (long i=0; i<sets; i++) {
+        for (int w=0; w<CACHE_WAYS; w++) {
+            nodecache[i].rid[w] = FS_RID_NULL;
+        }
+        nodecache[i].ref = 0;
+        nodecache[i].hand = 0;
+    }
+    nodecache_hits = 0;
+    nodecache_misses = 0;
+    nodecache_saved = 0;
+
+    if (nodecache_seed && strstr(fsp_link_features(link), " freq ")) {
+        nodecache_seed_freq(link, FS_BIND_BY_SUBJECT);
+        nodecache_seed_freq(link, FS_BIND_BY_OBJECT);
+    }
+}
+
+void fs_import_cache_config(long entries, int seed)
+{
+    if (entries > 0) {
+        nodecache_size = entries;
+    }
+    nodecache_seed = seed;
+}
+
+void fs_import_cache_stats(long long *hits, long long *misses, long long *bytes_saved)
+{
+    *hits = nodecache_hits;
+    *misses = nodecache_misses;
+    *bytes_saved = nodecache_saved;
+}
+
+static gpointer sender_thread(gpointer user_data)
+{
+    fs_import_sender *snd = user_data;
+    const fs_segment seg = snd->segment;
+
+    g_mutex_lock(snd->mutex);
+    while (1) {
+        while (!snd->busy && !snd->quit) {
+            g_cond_wait(snd->cond, snd->mutex);
+        }
+        if (!snd->busy) {
+            break;
+        }
+        g_mutex_unlock(snd->mutex);
+
+        /* the batch belongs to us until busy is cleared, so the network
+         * write can proceed without the lock */
+        const int side = snd->side;
+        if (snd->res_count) {
+            if (fsp_res_import(snd->link, seg, snd->res_count, res_buffer[side][seg])) {
+                fs_error(LOG_ERR, "resource import failed");
+                snd->errors++;
+            }
+            for (int i=0; i<snd->res_count; i++) {
+                if (res_buffer[side][seg][i].lex != lex_tmp[side][seg][i]) {
+                    free(res_buffer[side][seg][i].lex);
+                }
+                res_buffer[side][seg][i].lex = NULL;
+            }
+        }
+        if (snd->quad_count) {
+            if (fsp_quad_import(snd->link, seg, FS_BIND_BY_SUBJECT, snd->quad_count, snd->quads)) {
+                fs_error(LOG_ERR, "quad import failed");
+                snd->errors++;
+            }
+        }
+
+        g_mutex_lock(snd->mutex);
+        snd->res_count = 0;
+        snd->quad_count = 0;
+        snd->busy = 0;
+        g_cond_broadcast(snd->cond);
+    }
+    g_mutex_unlock(snd->mutex);
+
+    return NULL;
+}
+
+/* block until the sender has finished with its current batch, returns true
+ * if we had to wait */
+static int sender_wait(fs_import_sender *snd)
+{
+    int waited = 0;
+
+    g_mutex_lock(snd->mutex);
+    if (snd->busy) {
+        double then = fs_time();
+        while (snd->busy) {
+            g_cond_wait(snd->cond, snd->mutex);
+        }
+        snd->wait += fs_time() - then;
+        waited = 1;
+    }
+    g_mutex_unlock(snd->mutex);
+
+    return waited;
+}
+
+static void sender_post(fs_import_sender *snd, int side, int res_count,
+                        int quad_count, fs_rid (*quads)[4])
+{
+    g_mutex_lock(snd->mutex);
+    snd->side = side;
+    snd->res_count = res_count;
+    snd->quad_count = quad_count;
+    snd->quads = quads;
+    snd->busy = 1;
+    g_cond_signal(snd->cond);
+    g_mutex_unlock(snd->mutex);
+}
+
+/* allocates the import buffers and starts one sender thread per segment */
+static int sender_start_all(fsp_link *link, const int segments)
+{
+    if (senders_running) {
+        return 0;
+    }
+    if (!g_thread_supported()) {
+        g_thread_init(NULL);
+    }
+
+    /* with few segments each buffer fills quickly, so we can afford bigger
+     * batches, with many we keep the total buffered quads bounded */
+    quad_cap = QUAD_BUF_SIZE * 16 / segments;
+    if (quad_cap > QUAD_BUF_SIZE) quad_cap = QUAD_BUF_SIZE;
+    if (quad_cap < QUAD_SEG_BUF_MIN) quad_cap = QUAD_SEG_BUF_MIN;
+
+    for (int seg=0; seg<segments; seg++) {
+        for (int side=0; side<2; side++) {
+            for (int j=0; j<RES_BUF_SIZE; j++) {
+                lex_tmp[side][seg][j] = malloc(RES_BUF_SIZE);
+            }
+            quad_seg_buf[side][seg] = malloc(quad_cap * sizeof(fs_rid) * 4);
+        }
+        res_pos[seg] = 0;
+        res_side[seg] = 0;
+        quad_pos[seg] = 0;
+        quad_side[seg] = 0;
+        /* start small, grows when the backend can't keep up */
+        quad_limit[seg] = quad_cap / 4 > QUAD_SEG_BUF_MIN ? quad_cap / 4 : QUAD_SEG_BUF_MIN;
+        if (quad_limit[seg] > quad_cap) quad_limit[seg] = quad_cap;
+
+        fs_import_sender *snd = &senders[seg];
+        memset(snd, 0, sizeof(fs_import_sender));
+        snd->link = link;
+        snd->segment = seg;
+        snd->mutex = g_mutex_new();
+        snd->cond = g_cond_new();
+        GError *err = NULL;
+        snd->thread = g_thread_create(sender_thread, snd, TRUE, &err);
+        if (!snd->thread) {
+            fs_error(LOG_CRIT, "failed to start import sender for segment %d: %s", seg, err->message);
+            g_error_free(err);
+
+            return 1;
+        }
+    }
+    senders_running = segments;
+
+    return 0;
+}
+
+/* wait for all outstanding batches, returns number of failed sends */
+static int sender_drain_all(void)
+{
+    int errors = 0;
+
+    for (int seg=0; seg<senders_running; seg++) {
+        sender_wait(&senders[seg]);
+        errors += senders[seg].errors;
+        senders[seg].errors = 0;
+    }
+
+    return errors;
+}
+
+static double sender_wait_time(void)
+{
+    double wait = 0.0;
+
+    for (int seg=0; seg<senders_running; seg++) {
+        wait += senders[seg].wait;
+    }
+
+    return wait;
+}
+
+static void sender_stop_all(void)
+{
+    for (int seg=0; seg<senders_running; seg++) {
+        fs_import_sender *snd = &senders[seg];
+        g_mutex_lock(snd->mutex);
+        snd->quit = 1;
+        g_cond_signal(snd->cond);
+        g_mutex_unlock(snd->mutex);
+        g_thread_join(snd->thread);
+        g_cond_free(snd->cond);
+        g_mutex_free(snd->mutex);
+        snd->thread = NULL;
+
+        for (int side=0; side<2; side++) {
+            for (int j=0; j<RES_BUF_SIZE; j++) {
+                free(lex_tmp[side][seg][j]);
+                lex_tmp[side][seg][j] = NULL;
+            }
+            free(quad_seg_buf[side][seg]);
+            quad_seg_buf[side][seg] = NULL;
+        }
+    }
+    senders_running = 0;
+}
+
+static void flush_res(const int seg, int dryrun)
+{
+    if (res_pos[seg] == 0) {
+        return;
+    }
+    const int side = res_side[seg];
+    if (dryrun & FS_DRYRUN_RESOURCES) {
+        for (int i=0; i<res_pos[seg]; i++) {
+            if (res_buffer[side][seg][i].lex != lex_tmp[side][seg][i]) {
+                free(res_buffer[side][seg][i].lex);
+            }
+            res_buffer[side][seg][i].lex = NULL;
+        }
+        res_pos[seg] = 0;
+
+        return;
+    }
+
+    /* the other side must be free before we can start filling it */
+    sender_wait(&senders[seg]);
+    sender_post(&senders[seg], side, res_pos[seg], 0, NULL);
+    res_side[seg] = !side;
+    res_pos[seg] = 0;
+}
+
+static void flush_quads(const int seg, int dryrun)
+{
+    if (quad_pos[seg] == 0) {
+        return;
+    }
+    if (dryrun & FS_DRYRUN_QUADS) {
+        quad_pos[seg] = 0;
+
+        return;
+    }
+
+    const int side = quad_side[seg];
+    if (sender_wait(&senders[seg])) {
+        /* the backend is slower than we are, send bigger batches to cut
+         * the per message overhead */
+        quad_limit[seg] *= 2;
+        if (quad_limit[seg] > quad_cap) quad_limit[seg] = quad_cap;
+    }
+    sender_post(&senders[seg], side, 0, quad_pos[seg], quad_seg_buf[side][seg]);
+    quad_side[seg] = !side;
+    quad_pos[seg] = 0;
+}
+
+static void flush_text(fsp_link *link, const int seg, int dryrun)
+{
+    if (text_pos[seg] == 0) {
+        return;
+    }
+    if (!(dryrun & FS_DRYRUN_RESOURCES)) {
+        fsp_text_insert(link, seg, text_pos[seg], text_buffer[seg]);
+    }
+    for (int i=0; i<text_pos[seg]; i++) {
+        g_free(text_buffer[seg][i].lex);
+        text_buffer[seg][i].lex = NULL;
+    }
+    text_pos[seg] = 0;
+}
+
+/* the literal goes to the segment that holds it, which indexes it when the
+ * import stops */
+static void buffer_text(fs_parse_stuff *data, fs_rid r, const char *lex, fs_rid attr)
+{
+    int seg = FS_RID_SEGMENT(r, data->segments);
+    fs_resource *res = &text_buffer[seg][text_pos[seg]];
+    res->rid = r;
+    res->attr = attr;
+    res->lex = g_strdup(lex);
+    if (++text_pos[seg] == RES_BUF_SIZE) {
+        flush_text(data->link, seg, data->dryrun);
+    }
+}
 
 static int buffer_res(fsp_link *link, const int segments, fs_rid r, char *lex, fs_rid attr, int dryrun) {
     int seg = FS_RID_SEGMENT(r, segments);
@@ -101,34 +506,29 @@ static int buffer_res(fsp_link *link, const int segments, fs_rid r, char *lex, f
     if (FS_IS_BNODE(r)) {
 	return 1;
     }
-    if (nodecache[r & CACHE_MASK] == r) {
-	return 1;
-    }
     if (!lex) {
         return 1;
     }
-    nodecache[r & CACHE_MASK] = r;
-    res_buffer[seg][res_pos[seg]].rid = r;
-    res_buffer[seg][res_pos[seg]].attr = attr;
+    if (nodecache_check(r)) {
+        /* what fsp_res_import would have put on the wire for this one */
+        nodecache_saved += ((28 + strlen(lex)) / 8) * 8;
+        nodecache_hits++;
+
+	return 1;
+    }
+    nodecache_misses++;
+    const int side = res_side[seg];
+    fs_resource *res = &res_buffer[side][seg][res_pos[seg]];
+    res->rid = r;
+    res->attr = attr;
     if (strlen(lex) < RES_BUF_SIZE) {
-	strcpy(lex_tmp[seg][res_pos[seg]], lex);
-	res_buffer[seg][res_pos[seg]].lex = lex_tmp[seg][res_pos[seg]];
+	strcpy(lex_tmp[side][seg][res_pos[seg]], lex);
+	res->lex = lex_tmp[side][seg][res_pos[seg]];
     } else {
-	res_buffer[seg][res_pos[seg]].lex = g_strdup(lex);
+	res->lex = g_strdup(lex);
     }
     if (++res_pos[seg] == RES_BUF_SIZE) {
-	if (!(dryrun & FS_DRYRUN_RESOURCES) &&
-                fsp_res_import(link, seg, res_pos[seg], res_buffer[seg])) {
-	    fs_error(LOG_ERR, "resource import failed");
-	    return 1;
-	}
-	for (int i=0; i<res_pos[seg]; i++) {
-	    if (res_buffer[seg][i].lex != lex_tmp[seg][i]) {
-		free(res_buffer[seg][i].lex);
-		res_buffer[seg][i].lex = NULL;
-	    }
-	}
-	res_pos[seg] = 0;
+        flush_res(seg, dryrun);
     }
 
     return 0;
@@ -137,6 +537,195 @@ static int buffer_res(fsp_link *link, const int segments, fs_rid r, char *lex, f
 int total_triples_parsed = 0;
 static struct timeval then_last;
 
+/* decoder state for the binary stream format, see docs/binary-import */
+
+#define BINARY_HEADER 0
+#define BINARY_RECORDS 1
+#define BINARY_ENDED 2
+#define BINARY_FAILED 3
+
+static unsigned char *bin_buf = NULL;
+static size_t bin_len = 0;
+static size_t bin_size = 0;
+static int bin_state = BINARY_HEADER;
+
+static void binary_error(fs_parse_stuff *data, const char *msg)
+{
+    fs_error(LOG_ERR, "binary import: %s", msg);
+    data->count_err++;
+    bin_state = BINARY_FAILED;
+}
+
+static void binary_start(fs_parse_stuff *data)
+{
+    bin_len = 0;
+    bin_state = BINARY_HEADER;
+}
+
+static int binary_header(fs_parse_stuff *data, const unsigned char *header)
+{
+    uint32_t bom, hash;
+
+    memcpy(&bom, header + 8, sizeof(bom));
+    memcpy(&hash, header + 12, sizeof(hash));
+    if (memcmp(header, FS_BINARY_MAGIC, FS_BINARY_MAGIC_LEN)) {
+        binary_error(data, "bad magic number, not a 4store binary stream");
+
+        return 1;
+    }
+    if (bom != FS_BINARY_BOM) {
+        binary_error(data, "stream was written with a different byte order");
+
+        return 1;
+    }
+    if (hash != fsp_hash_type(data->link)) {
+        binary_error(data, "stream was hashed with a different hash function");
+
+        return 1;
+    }
+
+    return 0;
+}
+
+static void binary_record(fs_parse_stuff *data, int type,
+                          const unsigned char *payload, uint32_t length)
+{
+    switch (type) {
+    case FS_BINARY_RESOURCE: {
+        if (length < 16) {
+            binary_error(data, "short resource record");
+            break;
+        }
+        fs_rid rid, attr;
+        memcpy(&rid, payload, sizeof(fs_rid));
+        memcpy(&attr, payload + 8, sizeof(fs_rid));
+        char *lex = g_strndup((const char *)payload + 16, length - 16);
+        buffer_res(data->link, data->segments, rid, lex, attr, data->dryrun);
+        g_free(lex);
+        break;
+    }
+    case FS_BINARY_QUADS:
+        if (length % (sizeof(fs_rid) * 4)) {
+            binary_error(data, "quad record length not a multiple of 4 RIDs");
+            break;
+        }
+        for (const unsigned char *pos = payload; pos < payload + length;
+             pos += sizeof(fs_rid) * 4) {
+            fs_rid quad[4];
+            memcpy(quad, pos, sizeof(quad));
+            if (data->binary_graph) {
+                quad[0] = data->model_hash;
+            } else if (quad[0] == fs_c.system_config) {
+                data->model_hash = fs_c.system_config;
+            }
+            buffer_quad(data, quad);
+            count_quad(data);
+        }
+        break;
+    case FS_BINARY_END:
+        bin_state = BINARY_ENDED;
+        break;
+    default:
+        binary_error(data, "unknown record type");
+    }
+}
+
+static void binary_data(fs_parse_stuff *data, const unsigned char *in, size_t count)
+{
+    if (bin_state == BINARY_ENDED || bin_state == BINARY_FAILED) {
+        return;
+    }
+    if (bin_len + count > bin_size) {
+        bin_size = (bin_len + count) * 2;
+        bin_buf = realloc(bin_buf, bin_size);
+    }
+    memcpy(bin_buf + bin_len, in, count);
+    bin_len += count;
+
+    size_t pos = 0;
+    if (bin_state == BINARY_HEADER) {
+        if (bin_len < FS_BINARY_HEADER) {
+            return;
+        }
+        if (binary_header(data, bin_buf)) {
+            bin_len = 0;
+
+            return;
+        }
+        pos = FS_BINARY_HEADER;
+        bin_state = BINARY_RECORDS;
+    }
+
+    while (bin_state == BINARY_RECORDS && bin_len - pos >= FS_BINARY_RECORD_HEADER) {
+        uint32_t length;
+        memcpy(&length, bin_buf + pos + 4, sizeof(length));
+        if (length > FS_BINARY_MAX_PAYLOAD) {
+            binary_error(data, "record too large");
+            break;
+        }
+        if (bin_len - pos - FS_BINARY_RECORD_HEADER < length) {
+            /* wait for the rest of the record */
+            break;
+        }
+        binary_record(data, bin_buf[pos], bin_buf + pos + FS_BINARY_RECORD_HEADER, length);
+        pos += FS_BINARY_RECORD_HEADER + length;
+    }
+
+    if (bin_state != BINARY_RECORDS) {
+        bin_len = 0;
+    } else {
+        memmove(bin_buf, bin_buf + pos, bin_len - pos);
+        bin_len -= pos;
+    }
+}
+
+static void binary_finish(fs_parse_stuff *data)
+{
+    if (bin_state == BINARY_HEADER || bin_state == BINARY_RECORDS) {
+        binary_error(data, "truncated stream");
+    }
+    free(bin_buf);
+    bin_buf = NULL;
+    bin_len = bin_size = 0;
+}
+
+static int binary_parse_file(fs_parse_stuff *data, const char *resource_uri)
+{
+    char *filename = NULL;
+    if (strchr(resource_uri, ':')) {
+        filename = raptor_uri_uri_string_to_filename((const unsigned char *)resource_uri);
+        if (!filename) {
+            fs_error(LOG_ERR, "binary import only supports local files, not “%s”", resource_uri);
+
+            return 1;
+        }
+    } else {
+        filename = strdup(resource_uri);
+    }
+
+    FILE *in = fopen(filename, "r");
+    if (!in) {
+        fs_error(LOG_ERR, "cannot open “%s”: %s", filename, strerror(errno));
+        free(filename);
+
+        return 1;
+    }
+    free(filename);
+
+    const int errors = data->count_err;
+    unsigned char buffer[65536];
+    size_t len;
+
+    binary_start(data);
+    while ((len = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        binary_data(data, buffer, len);
+    }
+    binary_finish(data);
+    fclose(in);
+
+    return data->count_err != errors;
+}
+
 static int inited = 0;
 
 static fs_parse_stuff parse_data;
@@ -188,7 +777,7 @@ void graph_handler(void *user_data, raptor_uri *graph, int flags)
 
 /* ..._start and ..._finish share an int * count parameter
  * the same variable should be passed by reference both times */
-int fs_import_stream_start(fsp_link *link, const char *model_uri, const char *mimetype, int has_o_index, int *count)
+int fs_import_stream_start(fsp_link *link, const char *model_uri, const char *mimetype, int has_o_index, int *count, fs_cache_touched *touched)
 {
     if (inited == 0) {
         memset(&parse_data, 0, sizeof(parse_data));
@@ -204,14 +793,13 @@ int fs_import_stream_start(fsp_link *link, const char *model_uri, const char *mi
     parse_data.link = link;
     parse_data.segments = fsp_link_segments(link);
     parse_data.ext_count = count;
+    parse_data.touched = touched;
 
-    for (int i=0; i<parse_data.segments; i++) {
-        for (int j=0; j<RES_BUF_SIZE; j++) {
-            lex_tmp[i][j] = malloc(RES_BUF_SIZE);
-        }
+    if (sender_start_all(link, parse_data.segments)) {
+        return 1;
     }
 
-    memset(nodecache, 0, sizeof(nodecache));
+    nodecache_reset(link);
 
     parse_data.quad_fn = g_strdup(FS_TMP_PATH "/importXXXXXX");
     parse_data.quad_fd = mkstemp(parse_data.quad_fn);
@@ -235,6 +823,16 @@ int fs_import_stream_start(fsp_link *link, const char *model_uri, const char *mi
     /* store the model uri */
     buffer_res(link, parse_data.segments, parse_data.model_hash, parse_data.model, FS_RID_NULL, parse_data.dryrun);
 
+    parse_data.binary = mimetype && !strcmp(mimetype, FS_BINARY_MIME);
+    /* HTTP imports always name the graph they write */
+    parse_data.binary_graph = 1;
+    if (parse_data.binary) {
+        parse_data.parser = NULL;
+        binary_start(&parse_data);
+
+        return 0;
+    }
+
     parse_data.parser = raptor_new_parser_for_content(parse_data.world, NULL, mimetype, NULL, 0, (unsigned char *) parse_data.model);
     if (!parse_data.parser) {
         /* if you couldn't guess a parser, fall back to RDF/XML */
@@ -263,6 +861,11 @@ int fs_import_stream_start(fsp_link *link, const char *model_uri, const char *mi
 
 int fs_import_stream_data(fsp_link *link, unsigned char *data, size_t count)
 {
+    if (parse_data.binary) {
+        binary_data(&parse_data, data, count);
+
+        return 0;
+    }
     if (!parse_data.parser) {
         fs_error(LOG_CRIT, "No parser object found");
 
@@ -273,8 +876,14 @@ int fs_import_stream_data(fsp_link *link, unsigned char *data, size_t count)
 
 int fs_import_stream_finish(fsp_link *link, int *count, int *errors)
 {
-    raptor_parser_parse_chunk(parse_data.parser, NULL, 0, 1); /* finish */
-    raptor_free_parser(parse_data.parser);
+    if (parse_data.binary) {
+        binary_finish(&parse_data);
+        parse_data.binary = 0;
+    } else {
+        raptor_parser_parse_chunk(parse_data.parser, NULL, 0, 1); /* finish */
+        raptor_free_parser(parse_data.parser);
+        parse_data.parser = NULL;
+    }
     raptor_free_uri(parse_data.muri);
     g_free(parse_data.model);
 
@@ -290,35 +899,23 @@ int fs_import_stream_finish(fsp_link *link, int *count, int *errors)
 
     /* make sure buffers are flushed */
     for (int seg = 0; seg < segments; seg++) {
-        if (res_pos[seg] > 0 && fsp_res_import(link, seg, res_pos[seg], res_buffer[seg])) {
-	    fs_error(LOG_ERR, "resource import failed");
-            return 1;
-        }
+        flush_res(seg, 0);
+        flush_text(link, seg, 0);
+    }
+    int send_errors = sender_drain_all();
+    sender_stop_all();
+    if (send_errors) {
+        return 1;
     }
     if (fsp_res_import_commit_all(link)) {
         fs_error(LOG_ERR, "resource commit failed");
         return 2;
     }
-    for (int seg = 0; seg < segments; seg++) {
-        for (int i=0; i<res_pos[seg]; i++) {
-            if (res_buffer[seg][i].lex != lex_tmp[seg][i]) {
-                free(res_buffer[seg][i].lex);
-            }
-        }
-        res_pos[seg] = 0;
-    }
     if (fsp_quad_import_commit_all(link, FS_BIND_BY_SUBJECT)) {
         fs_error(LOG_ERR, "quad commit failed");
         return 3;
     }
 
-    for (int i=0; i<segments; i++) {
-        for (int j=0; j<RES_BUF_SIZE; j++) {
-            free(lex_tmp[i][j]);
-            lex_tmp[i][j] = NULL;
-        }
-    }
-
     if (parse_data.model_hash == fs_c.system_config) {
         fs_import_reread_config();
         fsp_reload_acl_system(link);
@@ -347,13 +944,11 @@ int fs_import(fsp_link *link, const char *model_uri, char *resource_uri,
         parse_data.link = link;
         parse_data.segments = fsp_link_segments(link);
 
-        for (int i=0; i<parse_data.segments; i++) {
-            for (int j=0; j<RES_BUF_SIZE; j++) {
-                lex_tmp[i][j] = malloc(RES_BUF_SIZE);
-            }
+        if (sender_start_all(link, parse_data.segments)) {
+            return 1;
         }
 
-        memset(nodecache, 0, sizeof(nodecache));
+        nodecache_reset(link);
 
         parse_data.quad_fn = g_strdup(FS_TMP_PATH "/importXXXXXX");
         parse_data.quad_fd = mkstemp(parse_data.quad_fn);
@@ -365,45 +960,58 @@ int fs_import(fsp_link *link, const char *model_uri, char *resource_uri,
     }
 
     parse_data.verbosity = verbosity;
+    parse_data.touched = NULL;
     parse_data.model = g_strdup(model_uri);
     parse_data.model_hash = fs_hash_uri(model_uri);
     parse_data.count_trip = 0;
     parse_data.last_count = 0;
     parse_data.dryrun = dryrun;
     parse_data.has_o_index = has_o_index;
+    /* a model other than the file's own was asked for */
+    parse_data.binary_graph = strcmp(model_uri, resource_uri) != 0;
 
     /* store the model uri */
     buffer_res(link, segments, parse_data.model_hash, parse_data.model, FS_RID_NULL, dryrun);
 
-    if (strcmp(format, "auto")) {
-        rdf_parser = raptor_new_parser(parse_data.world, format);
-    } else if (strstr(resource_uri, ".n3") || strstr(resource_uri, ".ttl")) {
-        rdf_parser = raptor_new_parser(parse_data.world, "turtle");
-    } else if (strstr(resource_uri, ".nt")) {
-        rdf_parser = raptor_new_parser(parse_data.world, "ntriples");
+    parse_data.muri = raptor_new_uri(parse_data.world, (unsigned char *) model_uri);
+
+    if (!strcmp(format, FS_BINARY_FORMAT) || (!strcmp(format, "auto") &&
+                g_str_has_suffix(resource_uri, FS_BINARY_SUFFIX))) {
+        if (binary_parse_file(&parse_data, resource_uri)) {
+            fs_error(LOG_ERR, "failed to import binary file “%s”", resource_uri);
+            ret++;
+        }
     } else {
-        rdf_parser = raptor_new_parser(parse_data.world, "rdfxml");
-    }
-    if (!rdf_parser) {
-        fs_error(LOG_ERR, "failed to create RDF parser");
-        return 1;
-    }
+        if (strcmp(format, "auto")) {
+            rdf_parser = raptor_new_parser(parse_data.world, format);
+        } else if (strstr(resource_uri, ".n3") || strstr(resource_uri, ".ttl")) {
+            rdf_parser = raptor_new_parser(parse_data.world, "turtle");
+        } else if (strstr(resource_uri, ".nt")) {
+            rdf_parser = raptor_new_parser(parse_data.world, "ntriples");
+        } else {
+            rdf_parser = raptor_new_parser(parse_data.world, "rdfxml");
+        }
+        if (!rdf_parser) {
+            fs_error(LOG_ERR, "failed to create RDF parser");
+            raptor_free_uri(parse_data.muri);
+            return 1;
+        }
 
-    raptor_parser_set_statement_handler(rdf_parser, &parse_data, store_stmt);
-    raptor_parser_set_graph_mark_handler(rdf_parser, &parse_data, graph_handler);
-    ruri = raptor_new_uri(parse_data.world, (unsigned char *) resource_uri);
-    parse_data.muri = raptor_new_uri(parse_data.world, (unsigned char *) model_uri);
+        raptor_parser_set_statement_handler(rdf_parser, &parse_data, store_stmt);
+        raptor_parser_set_graph_mark_handler(rdf_parser, &parse_data, graph_handler);
+        ruri = raptor_new_uri(parse_data.world, (unsigned char *) resource_uri);
 
-    if (raptor_parser_parse_uri(rdf_parser, ruri, parse_data.muri)) {
-        fs_error(LOG_ERR, "failed to parse file “%s”", resource_uri);
-        ret++;
+        if (raptor_parser_parse_uri(rdf_parser, ruri, parse_data.muri)) {
+            fs_error(LOG_ERR, "failed to parse file “%s”", resource_uri);
+            ret++;
+        }
+        raptor_free_parser(rdf_parser);
+        raptor_free_uri(ruri);
     }
     if (verbosity) {
         printf("Pass 1, processed %d triples (%d)\n", total_triples_parsed, parse_data.count_trip);
     }
 
-    raptor_free_parser(rdf_parser);
-    raptor_free_uri(ruri);
     raptor_free_uri(parse_data.muri);
     g_free(parse_data.model);
     fs_hash_freshen(); /* blank nodes are unique per file */
@@ -436,37 +1044,27 @@ int fs_import_commit(fsp_link *link, int verbosity, int dryrun, int has_o_index,
 
     /* make sure buffers are flushed */
     for (int seg = 0; seg < segments; seg++) {
-	if (!(dryrun & FS_DRYRUN_RESOURCES) && res_pos[seg] > 0 && fsp_res_import(link, seg, res_pos[seg], res_buffer[seg])) {
-	    fs_error(LOG_ERR, "resource import failed");
-
-	    return 1;
-	}
+        flush_res(seg, dryrun);
+        flush_text(link, seg, dryrun);
+    }
+    int send_errors = sender_drain_all();
+    if (verbosity > 1) {
+        printf("Waited %f seconds for backends\n", sender_wait_time());
+    }
+    sender_stop_all();
+    if (send_errors) {
+        return 1;
     }
     if (!(dryrun & FS_DRYRUN_RESOURCES) && fsp_res_import_commit_all(link)) {
         fs_error(LOG_ERR, "resource commit failed");
         return 2;
     }
-    for (int seg = 0; seg < segments; seg++) {
-	for (int i=0; i<res_pos[seg]; i++) {
-	    if (res_buffer[seg][i].lex != lex_tmp[seg][i]) {
-		free(res_buffer[seg][i].lex);
-	    }
-	}
-	res_pos[seg] = 0;
-    }
 
     if (!(dryrun & FS_DRYRUN_QUADS) && fsp_quad_import_commit_all(link, FS_BIND_BY_SUBJECT)) {
         fs_error(LOG_ERR, "quad commit failed");
         return 3;
     }
 
-    for (int i=0; i<segments; i++) {
-	for (int j=0; j<RES_BUF_SIZE; j++) {
-	    free(lex_tmp[i][j]);
-            lex_tmp[i][j] = NULL;
-	}
-    }
-
     if (parse_data.world) {
         raptor_free_world(parse_data.world);
         parse_data.world = NULL;
@@ -478,7 +1076,6 @@ int fs_import_commit(fsp_link *link, int verbosity, int dryrun, int has_o_index,
 
 static int process_quads(fs_parse_stuff *data)
 {
-    fsp_link *link = data->link;
     const int segments = data->segments;
     int tfd = data->quad_fd;
     int verbosity = data->verbosity;
@@ -504,26 +1101,24 @@ static int process_quads(fs_parse_stuff *data)
 	    return -1;
 	}
 	total += count;
-	for (int seg=0; seg < segments; seg++) {
-	    int i=0, scnt = 0;
-	    for (i=0; i<count; i++) {
-		if (FS_RID_SEGMENT(quad_buf[i][1], segments) == seg) {
-		    quad_buf_s[scnt][0] = quad_buf[i][0];
-		    quad_buf_s[scnt][1] = quad_buf[i][1];
-		    quad_buf_s[scnt][2] = quad_buf[i][2];
-		    quad_buf_s[scnt][3] = quad_buf[i][3];
-		    scnt++;
-		}
-            }
-	    if (!(dryrun & FS_DRYRUN_QUADS) && scnt > 0 && fsp_quad_import(link, seg, FS_BIND_BY_SUBJECT, scnt, quad_buf_s)) {
-		fs_error(LOG_ERR, "quad import failed");
-
-		return 1;
+	for (int i=0; i<count; i++) {
+	    const int seg = FS_RID_SEGMENT(quad_buf[i][1], segments);
+	    memcpy(quad_seg_buf[quad_side[seg]][seg][quad_pos[seg]], quad_buf[i], sizeof(fs_rid) * 4);
+	    if (++quad_pos[seg] >= quad_limit[seg]) {
+		flush_quads(seg, dryrun);
 	    }
 	}
 	if (verbosity) printf("Pass 2, processed %d triples\r", total);
 	fflush(stdout);
     } while (ret == sizeof(quad_buf));
+    for (int seg=0; seg < segments; seg++) {
+        flush_quads(seg, dryrun);
+    }
+    if (sender_drain_all()) {
+        fs_error(LOG_ERR, "quad import failed");
+
+        return -1;
+    }
     if (verbosity) {
         gettimeofday(&now, 0);
         double diff = (now.tv_sec - then_last.tv_sec) +
@@ -587,6 +1182,9 @@ fs_rid fs_bnode_id(fsp_link *link, raptor_term_blank_value blank)
 
 static void buffer_quad(fs_parse_stuff *data, fs_rid quad[4])
 {
+    if (data->touched) {
+        fs_cache_touched_add(data->touched, quad[0], quad[2]);
+    }
 retry_write:
     if (write(data->quad_fd, quad, sizeof(fs_rid) * 4) == -1) {
         fs_error(LOG_ERR, "failed to buffer quad to fd %d (0x%x): %s", data->quad_fd, data->quad_fd, strerror(errno));
@@ -600,6 +1198,98 @@ retry_write:
     }
 }
 
+/* walks the tokens of a literal, copying each one into a buffer that's
+ * reused between literals, optionally lower casing it the same way
+ * g_utf8_strdown() would */
+typedef struct {
+    const char *pos;
+} fs_token_iter;
+
+static char *token_buf = NULL;
+static size_t token_buf_size = 0;
+
+static inline int token_boundary(unsigned char c)
+{
+    return c < 0x80 && c && strchr(TOKEN_BOUNDARY, c);
+}
+
+/* lower cases the character at in into *out, advancing it, and returns the
+ * number of bytes of input used */
+static int lower_char(const char *in, const char *end, char **out)
+{
+    const unsigned char c = *in;
+    const int len = g_utf8_skip[c];
+    gunichar uc = len <= end - in ? g_utf8_get_char_validated(in, len) : (gunichar)-1;
+    if (uc == (gunichar)-1 || uc == (gunichar)-2) {
+        /* not valid UTF-8, pass it through */
+        *(*out)++ = c;
+
+        return 1;
+    }
+
+    if (uc == 0x130) {
+        /* capital I with dot above, lower cases to two characters */
+        *out += g_unichar_to_utf8('i', *out);
+        *out += g_unichar_to_utf8(0x307, *out);
+    } else if (uc == 0x3a3) {
+        /* capital sigma takes its final form at the end of a word */
+        const char *next = in + len;
+        if (next < end && g_unichar_isalpha(g_utf8_get_char(next))) {
+            *out += g_unichar_to_utf8(0x3c3, *out);
+        } else {
+            *out += g_unichar_to_utf8(0x3c2, *out);
+        }
+    } else {
+        *out += g_unichar_to_utf8(g_unichar_tolower(uc), *out);
+    }
+
+    return len;
+}
+
+/* returns the next token or NULL at the end of the literal, the token is
+ * overwritten by the next call */
+static const char *next_token(fs_token_iter *it, int lower)
+{
+    const char *p = it->pos;
+    while (token_boundary(*p)) p++;
+    if (!*p) {
+        it->pos = p;
+
+        return NULL;
+    }
+    const char *start = p;
+    while (*p && !token_boundary(*p)) p++;
+    it->pos = p;
+
+    /* lower casing grows a character by at most half again */
+    const size_t need = (p - start) * 2 + 1;
+    if (need > token_buf_size) {
+        token_buf_size = need < 256 ? 256 : need * 2;
+        token_buf = realloc(token_buf, token_buf_size);
+    }
+
+    if (!lower) {
+        memcpy(token_buf, start, p - start);
+        token_buf[p - start] = '\0';
+
+        return token_buf;
+    }
+
+    char *out = token_buf;
+    for (const char *in = start; in < p; ) {
+        const unsigned char c = *in;
+        if (c < 0x80) {
+            *out++ = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+            in++;
+        } else {
+            in += lower_char(in, p, &out);
+        }
+    }
+    *out = '\0';
+
+    return token_buf;
+}
+
 static void buffer_tokens(fs_parse_stuff *data, fs_rid quad[4], const char *str)
 {
     quad[2] = fs_c.fs_token;
@@ -609,18 +1299,13 @@ static void buffer_tokens(fs_parse_stuff *data, fs_rid quad[4], const char *str)
         sent_token_pred = 1;
     }
 
-    char **tokens = g_strsplit_set(str, TOKEN_BOUNDARY, -1);
-    for (int i=0; tokens[i]; i++) {
-        if (tokens[i][0] == '\0') {
-            continue;
-        }
-        gchar *ltok = g_utf8_strdown(tokens[i], strlen(tokens[i]));
+    fs_token_iter it = { str };
+    const char *ltok;
+    while ((ltok = next_token(&it, 1))) {
 	quad[3] = fs_hash_literal(ltok, fs_c.empty);
-        buffer_res(data->link, data->segments, quad[3], ltok, fs_c.empty, data->dryrun);
-        g_free(ltok);
+        buffer_res(data->link, data->segments, quad[3], (char *)ltok, fs_c.empty, data->dryrun);
         buffer_quad(data, quad);
     }
-    g_strfreev(tokens);
 }
 
 static void buffer_metaphones(fs_parse_stuff *data, fs_rid quad[4], const char *str)
@@ -632,13 +1317,11 @@ static void buffer_metaphones(fs_parse_stuff *data, fs_rid quad[4], const char *
         sent_metaphone_pred = 1;
     }
 
-    char **tokens = g_strsplit_set(str, TOKEN_BOUNDARY, -1);
-    for (int i=0; tokens[i]; i++) {
-        if (tokens[i][0] == '\0') {
-            continue;
-        }
+    fs_token_iter it = { str };
+    const char *tok;
+    while ((tok = next_token(&it, 0))) {
         char *phones[2];
-        DoubleMetaphone(tokens[i], phones);
+        DoubleMetaphone((char *)tok, phones);
         for (int p=0; p<2 && phones[p]; p++) {
             if (!phones[p][0]) {
                 break;
@@ -652,28 +1335,56 @@ static void buffer_metaphones(fs_parse_stuff *data, fs_rid quad[4], const char *
             free(phones[p]);
         }
     }
-    g_strfreev(tokens);
 }
 
-static void buffer_stems(fs_parse_stuff *data, fs_rid quad[4], const char *str, const char *langtag)
+/* stemmers by language, they're expensive to create and there are only a
+ * few dozen languages, so we keep them for the life of the process */
+static GHashTable *stemmers = NULL;
+
+static struct sb_stemmer *get_stemmer(const char *langtag)
 {
-    quad[2] = fs_c.fs_stem;
+    char lang[16];
+    int len = 0;
 
-    char *lang = NULL;
     if (!langtag) {
-        lang = g_strdup("en");
+        strcpy(lang, "en");
+        len = 2;
     } else {
-        lang = g_strdup(langtag);
-        for (char *pos = lang; *pos; pos++) {
-            *pos = tolower(*pos);
-            if (*pos < 'a' || *pos > 'z') {
-                *pos = '\0';
+        for (const char *pos = langtag; *pos; pos++) {
+            const char c = tolower(*pos);
+            if (c < 'a' || c > 'z') {
                 break;
             }
+            if (len == sizeof(lang) - 1) {
+                /* longer than any language libstemmer knows */
+                return NULL;
+            }
+            lang[len++] = c;
+        }
+        lang[len] = '\0';
+    }
+
+    if (!stemmers) {
+        stemmers = g_hash_table_new(g_str_hash, g_str_equal);
+    }
+    struct sb_stemmer *stemmer = g_hash_table_lookup(stemmers, lang);
+    if (!stemmer) {
+        /* not cached if there's no stemmer for the language, so the table
+         * stays small whatever tags the data uses */
+        stemmer = sb_stemmer_new(lang, NULL);
+        if (stemmer) {
+            g_hash_table_insert(stemmers, g_strdup(lang), stemmer);
         }
     }
-    /* TODO could cache stemmers in a hashtable or something for better efficiency */
-    struct sb_stemmer *stemmer = sb_stemmer_new(lang, NULL);
+
+    return stemmer;
+}
+
+static void buffer_stems(fs_parse_stuff *data, fs_rid quad[4], const char *str, const char *langtag)
+{
+    quad[2] = fs_c.fs_stem;
+
+    struct sb_stemmer *stemmer = get_stemmer(langtag);
     if (!stemmer) {
         return;
     }
@@ -683,20 +1394,14 @@ static void buffer_stems(fs_parse_stuff *data, fs_rid quad[4], const char *str,
         sent_stem_pred = 1;
     }
 
-    char **tokens = g_strsplit_set(str, TOKEN_BOUNDARY, -1);
-    for (int i=0; tokens[i]; i++) {
-        if (tokens[i][0] == '\0') {
-            continue;
-        }
-        gchar *ltok = g_utf8_strdown(tokens[i], strlen(tokens[i]));
+    fs_token_iter it = { str };
+    const char *ltok;
+    while ((ltok = next_token(&it, 1))) {
         char *symbol = (char *)sb_stemmer_stem(stemmer, (sb_symbol *)ltok, strlen(ltok));
-        g_free(ltok);
 	quad[3] = fs_hash_literal(symbol, fs_c.empty);
         buffer_res(data->link, data->segments, quad[3], symbol, fs_c.empty, data->dryrun);
         buffer_quad(data, quad);
     }
-    g_strfreev(tokens);
-    sb_stemmer_delete(stemmer);
 }
 
 static void store_stmt(void *user_data, raptor_statement *statement)
@@ -716,11 +1421,15 @@ static void store_stmt(void *user_data, raptor_statement *statement)
             fs_rid_set_free(stem_set);
         }
         stem_set = fs_rid_set_new();
+        if (inverted_set) {
+            fs_rid_set_free(inverted_set);
+        }
+        inverted_set = fs_rid_set_new();
         int flags = FS_BIND_SUBJECT | FS_BIND_OBJECT | FS_BIND_BY_OBJECT;
         fs_rid_vector *mrids = fs_rid_vector_new_from_args(1, fs_c.system_config);
         fs_rid_vector *srids = fs_rid_vector_new(0);
         fs_rid_vector *prids = fs_rid_vector_new_from_args(1, fs_c.fs_text_index);
-        fs_rid_vector *orids = fs_rid_vector_new_from_args(3, fs_c.fs_token, fs_c.fs_dmetaphone, fs_c.fs_stem);
+        fs_rid_vector *orids = fs_rid_vector_new_from_args(4, fs_c.fs_token, fs_c.fs_dmetaphone, fs_c.fs_stem, fs_c.fs_inverted);
         fs_rid_vector **result = NULL;
         fsp_bind_limit_all(data->link, flags, mrids, srids, prids, orids, &result, -1, -1);
         if (result && result[0]) {
@@ -733,6 +1442,8 @@ static void store_stmt(void *user_data, raptor_statement *statement)
                     fs_rid_set_add(metaphone_set, result[0]->data[row]);
                 } else if (result[1]->data[row] == fs_c.fs_stem) {
                     fs_rid_set_add(stem_set, result[0]->data[row]);
+                } else if (result[1]->data[row] == fs_c.fs_inverted) {
+                    fs_rid_set_add(inverted_set, result[0]->data[row]);
                 } else {
                     fs_error(LOG_ERR, "unexpected index type %016llx found in "
                                       "fulltext indexing config", result[1]->data[row]);
@@ -763,13 +1474,13 @@ static void store_stmt(void *user_data, raptor_statement *statement)
     }
     m = data->model_hash;
 
+    /* pull out the strings first, so the URIs can be hashed in one batch */
+    char *dt = NULL;
     if (statement->subject->type == RAPTOR_TERM_TYPE_BLANK) {
-        s = fs_bnode_id(data->link, statement->subject->value.blank);
         subj = (char *) statement->subject->value.blank.string;
     } else if (statement->subject->type == RAPTOR_TERM_TYPE_URI) {
         subj = (char *) raptor_uri_as_string((raptor_uri *)
 					       statement->subject->value.uri);
-	s = fs_hash_uri(subj);
     } else {
         fs_error(LOG_CRIT, "found non-URI/bNode subject");
 
@@ -778,16 +1489,46 @@ static void store_stmt(void *user_data, raptor_statement *statement)
 
     if (statement->predicate->type == RAPTOR_TERM_TYPE_URI) {
         pred = (char *) raptor_uri_as_string(statement->predicate->value.uri);
-        p = fs_hash_uri(pred);
     } else {
         fs_error(LOG_CRIT, "found non-URI predicate");
 
         return;
     }
 
-    fs_rid attr = fs_c.empty;
     if (statement->object->type == RAPTOR_TERM_TYPE_LITERAL) {
 	obj = (char *) statement->object->value.literal.string;
+	if (!statement->object->value.literal.language &&
+            statement->object->value.literal.datatype) {
+	    dt = (char *)raptor_uri_as_string(statement->object->value.literal.datatype);
+	}
+    } else if (statement->object->type == RAPTOR_TERM_TYPE_BLANK) {
+	obj = (char *) statement->object->value.blank.string;
+    } else if (statement->object->type == RAPTOR_TERM_TYPE_URI) {
+	obj = (char *) raptor_uri_as_string(statement->object->value.uri);
+    } else {
+        fs_error(LOG_CRIT, "found non-URI/bNode/Literal object");
+
+        return;
+    }
+
+    const char *uris[4] = {
+        statement->subject->type == RAPTOR_TERM_TYPE_URI ? subj : NULL,
+        pred,
+        dt,
+        statement->object->type == RAPTOR_TERM_TYPE_URI ? obj : NULL
+    };
+    fs_rid uri_rids[4];
+    fs_hash_uri_multi(uris, uri_rids, 4);
+
+    if (statement->subject->type == RAPTOR_TERM_TYPE_BLANK) {
+        s = fs_bnode_id(data->link, statement->subject->value.blank);
+    } else {
+	s = uri_rids[0];
+    }
+    p = uri_rids[1];
+
+    fs_rid attr = fs_c.empty;
+    if (statement->object->type == RAPTOR_TERM_TYPE_LITERAL) {
         char *langtag = NULL;
 	if (statement->object->value.literal.language) {
 	    langtag = (char *)statement->object->value.literal.language;
@@ -798,11 +1539,8 @@ static void store_stmt(void *user_data, raptor_statement *statement)
             }
 	    attr = fs_hash_literal(langtag, 0);
 	    buffer_res(data->link, data->segments, attr, langtag, fs_c.empty, data->dryrun);
-	} else if (statement->object->value.literal.datatype &&
-                   raptor_uri_as_string(statement->object->
-                                        value.literal.datatype)) {
-	    char *dt = (char *)raptor_uri_as_string(statement->object->value.literal.datatype);
-	    attr = fs_hash_uri(dt);
+	} else if (dt) {
+	    attr = uri_rids[2];
 	    buffer_res(data->link, data->segments, attr, dt, FS_RID_NULL, data->dryrun);
 	}
 	o = fs_hash_literal(obj, attr);
@@ -818,18 +1556,15 @@ static void store_stmt(void *user_data, raptor_statement *statement)
             fs_rid quad[4] = { m, s, p, FS_RID_NULL };
             buffer_stems(data, quad, obj, langtag);
         }
+        if (fs_rid_set_contains(inverted_set, p)) {
+            buffer_text(data, o, obj, attr);
+        }
     } else if (statement->object->type == RAPTOR_TERM_TYPE_BLANK) {
 	o = fs_bnode_id(data->link, statement->object->value.blank);
-	obj = (char *) statement->object->value.blank.string;
-        attr = FS_RID_NULL;
-    } else if (statement->object->type == RAPTOR_TERM_TYPE_URI) {
-	obj = (char *) raptor_uri_as_string(statement->object->value.uri);
         attr = FS_RID_NULL;
-	o = fs_hash_uri(obj);
     } else {
-        fs_error(LOG_CRIT, "found non-URI/bNode/Literal object");
-
-        return;
+        attr = FS_RID_NULL;
+	o = uri_rids[3];
     }
 
     buffer_res(data->link, data->segments, s, subj, FS_RID_NULL, data->dryrun);
@@ -838,6 +1573,11 @@ static void store_stmt(void *user_data, raptor_statement *statement)
 
     fs_rid tbuf[4] = { m, s, p, o };
     buffer_quad(data, tbuf);
+    count_quad(data);
+}
+
+static void count_quad(fs_parse_stuff *data)
+{
     data->count_trip++;
     total_triples_parsed++;
 
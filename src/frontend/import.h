@@ -2,6 +2,7 @@
 #define IMPORT_H
 
 #include "../common/4store.h"
+#include "query-cache.h"
 
 #define FS_DRYRUN_DELETE    0x01
 #define FS_DRYRUN_RESOURCES 0x02
@@ -13,11 +14,18 @@ int fs_import(fsp_link *link, const char *model_uri, char *resource_uri,
 
 int fs_import_commit(fsp_link *link, int verbosity, int dryrun, int has_o_index, FILE *msg, int *count);
 
-int fs_import_stream_start(fsp_link *link, const char *model_uri, const char *mimetype, int has_o_index, int *count);
+/* touched may be NULL, otherwise the (model, predicate) pairs streamed in are
+ * added to it */
+int fs_import_stream_start(fsp_link *link, const char *model_uri, const char *mimetype, int has_o_index, int *count, fs_cache_touched *touched);
 int fs_import_stream_data(fsp_link *link, unsigned char *data, size_t count);
 int fs_import_stream_finish(fsp_link *link, int *count, int *errors);
 void fs_import_reread_config();
 
+/* entries is the number of resources remembered as already sent, seed
+ * preloads it with the store's most frequent rids where available */
+void fs_import_cache_config(long entries, int seed);
+void fs_import_cache_stats(long long *hits, long long *misses, long long *bytes_saved);
+
 fs_rid fs_bnode_id(fsp_link *link, raptor_term_blank_value blank);
 
 #endif
@@ -128,6 +128,20 @@ int fs_opt_literal_is_rdf_type(rasqal_literal *l)
     return 0;
 }
 
+/* detects the text:match property function */
+int fs_opt_literal_is_text_match(rasqal_literal *l)
+{
+    if (!l) return 0;
+
+    if (l->type == RASQAL_LITERAL_URI) {
+        if (!strcmp((char *)raptor_uri_as_string(l->value.uri), FS_TEXT_MATCH)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 /* returns true if the expression has bound values, or nothing does */
 int fs_opt_is_bound(fs_binding *b, rasqal_literal *l)
 {
@@ -224,6 +238,7 @@ int fs_optimise_triple_pattern(fs_query_state *qs, fs_query *q, int block, rasqa
     }
 
     /* roughly sort into order:
+     *   text:match, answered by the full text index
      *   const subject and predicate
      *   const predicate and object
      *   const subject
@@ -246,6 +261,15 @@ int fs_optimise_triple_pattern(fs_query_state *qs, fs_query *q, int block, rasqa
 	}
     }
 #endif
+    for (int i=start; i<length; i++) {
+	if (!pbuf[i]) {
+	    continue;
+	}
+	if (fs_opt_literal_is_text_match(pbuf[i]->predicate)) {
+	    patt[append_pos++] = pbuf[i];
+	    pbuf[i] = NULL;
+	}
+    }
     for (int i=start; i<length; i++) {
 	if (!pbuf[i]) {
 	    continue;
@@ -363,6 +387,7 @@ int fs_optimise_triple_pattern(fs_query_state *qs, fs_query *q, int block, rasqa
     /* If the next two or more pattern's subjects are both variables, we might be able
      * to multi reverse bind them */
     if (var_name(patt[start]->subject) && var_name(patt[start+1]->subject) &&
+        !fs_opt_literal_is_text_match(patt[start]->predicate) &&
         !var_name(patt[start]->predicate) &&
         !var_name(patt[start]->object) &&
         fs_opt_num_vals(q->bb[block], patt[start]->predicate) == 1 &&
@@ -374,7 +399,8 @@ int fs_optimise_triple_pattern(fs_query_state *qs, fs_query *q, int block, rasqa
                !fs_opt_is_const(q->bb[block], patt[start+count]->subject) &&
                !strcmp(svname, var_name(patt[start+count]->subject)) &&
                !var_name(patt[start+count]->object) &&
-               !var_name(patt[start+count]->predicate)) {
+               !var_name(patt[start+count]->predicate) &&
+               !fs_opt_literal_is_text_match(patt[start+count]->predicate)) {
             count++;
         }
 
@@ -384,7 +410,7 @@ int fs_optimise_triple_pattern(fs_query_state *qs, fs_query *q, int block, rasqa
         if (count > 1) return count;
     }
 
-    if (length - start > 1) {
+    if (length - start > 1 && !fs_opt_literal_is_text_match(patt[start]->predicate)) {
         int freq_a = fs_bind_freq(qs, q, block, patt[start]);
         int freq_b = fs_bind_freq(qs, q, block, patt[start+1]);
         /* the 2nd is cheaper than the 1st, then swap them */
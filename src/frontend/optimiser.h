@@ -11,6 +11,9 @@ int fs_opt_num_vals(fs_binding *b, rasqal_literal *l);
 /* returns true if the expression can be hashed */
 int fs_opt_is_const(fs_binding *b, rasqal_literal *l);
 
+/* returns true if the literal is the text:match property function */
+int fs_opt_literal_is_text_match(rasqal_literal *l);
+
 /* sort a vector of triples into a good order to bind them, based on some
  * heuristics */
 int fs_optimise_triple_pattern(fs_query_state *qs, fs_query *q, int block, rasqal_triple *patt[], int length, int start);
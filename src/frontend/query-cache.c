@@ -37,6 +37,7 @@
 #include "../common/rdf-constants.h"
 
 #define CACHE_SIZE 1024
+#define TOUCHED_MAX 256
 
 struct _fs_bind_cache {
     int filled;     /* true if cache entry is in use */
@@ -50,6 +51,12 @@ struct _fs_bind_cache {
     fs_rid_vector *res[4];
 };
 
+struct _fs_cache_touched {
+    int all;        /* too many pairs to track, flush everything */
+    int length;
+    fs_rid pair[TOUCHED_MAX][2];
+};
+
 struct _acl_sec_tuple {
   int set_size;
   fs_rid_set *res;
@@ -341,9 +348,11 @@ int fs_bind_cache_wrapper_intl(fs_query_state *qs, fs_query *q, int all,
         }
     }
 
-    if (cachable && small && slots > 0) {
+    /* a bind that gave up early has no business in the cache */
+    if (cachable && small && slots > 0 && !(q && fs_query_abandoned(q))) {
         g_static_mutex_lock(&qs->cache_mutex);
         if (qs->bind_cache[cache_hash].filled == 1) {
+          qs->bind_cache_replaced++;
           for (int s=0; s<4; s++) {
             fs_rid_vector_free(qs->bind_cache[cache_hash].res[s]);
             qs->bind_cache[cache_hash].res[s] = NULL;
@@ -429,6 +438,22 @@ int fs_bind_cache_wrapper(fs_query_state *qs, fs_query *q, int all,
 }
 
 
+/* must be called with cache_mutex held */
+static void cache_entry_clear(fs_bind_cache *e)
+{
+    e->filled = 0;
+    e->hits = 0;
+    e->all = 0;
+    e->flags = 0;
+    e->offset = 0;
+    e->limit = 0;
+    for (int s=0; s<4; s++) {
+        e->key[s] = 0;
+        fs_rid_vector_free(e->res[s]);
+        e->res[s] = 0;
+    }
+}
+
 int fs_query_cache_flush(fs_query_state *qs, int verbosity)
 {
     /* assumption: the cache is created once only, ie it can't be pulled out from under us */
@@ -436,6 +461,7 @@ int fs_query_cache_flush(fs_query_state *qs, int verbosity)
 
     g_static_mutex_lock(&qs->cache_mutex);
 
+    qs->bind_cache_flushes++;
     for (int i=0; i<CACHE_SIZE; i++) {
         if (qs->bind_cache[i].filled) {
             if (verbosity > 0) {
@@ -443,16 +469,7 @@ int fs_query_cache_flush(fs_query_state *qs, int verbosity)
                 printf("#   hits=%d, all=%s, flags=%08x, offset=%d, limit=%d\n", qs->bind_cache[i].hits, qs->bind_cache[i].all ? "true" : "false", qs->bind_cache[i].flags, qs->bind_cache[i].offset, qs->bind_cache[i].limit);
                 printf("#   bind(%016llx, %016llx, %016llx, %016llx)\n", qs->bind_cache[i].key[0], qs->bind_cache[i].key[1], qs->bind_cache[i].key[2], qs->bind_cache[i].key[3]);
             }
-            qs->bind_cache[i].filled = 0;
-            qs->bind_cache[i].all = 0;
-            qs->bind_cache[i].flags = 0;
-            qs->bind_cache[i].offset = 0;
-            qs->bind_cache[i].limit = 0;
-            for (int s=0; s<4; s++) {
-                qs->bind_cache[i].key[s] = 0;
-                fs_rid_vector_free(qs->bind_cache[i].res[s]);
-                qs->bind_cache[i].res[s] = 0;
-            }
+            cache_entry_clear(&qs->bind_cache[i]);
         }
     }
     if (verbosity > 0) {
@@ -470,6 +487,68 @@ int fs_query_cache_flush(fs_query_state *qs, int verbosity)
     return 0;
 }
 
+fs_cache_touched *fs_cache_touched_new(void)
+{
+    return calloc(1, sizeof(fs_cache_touched));
+}
+
+void fs_cache_touched_add(fs_cache_touched *t, fs_rid model, fs_rid pred)
+{
+    if (!t || t->all) return;
+
+    /* writes tend to come in runs, so look at the newest pairs first */
+    for (int i=t->length-1; i>=0; i--) {
+        if ((t->pair[i][0] == FS_RID_NULL || t->pair[i][0] == model) &&
+            (t->pair[i][1] == FS_RID_NULL || t->pair[i][1] == pred)) {
+            return;
+        }
+    }
+    if (t->length == TOUCHED_MAX) {
+        t->all = 1;
+
+        return;
+    }
+    t->pair[t->length][0] = model;
+    t->pair[t->length][1] = pred;
+    t->length++;
+}
+
+void fs_cache_touched_free(fs_cache_touched *t)
+{
+    free(t);
+}
+
+int fs_query_cache_invalidate(fs_query_state *qs, fs_cache_touched *t)
+{
+    if (!t || t->all) {
+        return fs_query_cache_flush(qs, 0);
+    }
+    if (!qs->bind_cache || t->length == 0) return 1;
+
+    g_static_mutex_lock(&qs->cache_mutex);
+
+    for (int i=0; i<CACHE_SIZE; i++) {
+        fs_bind_cache *e = &qs->bind_cache[i];
+        if (!e->filled) continue;
+
+        /* a zero key means the bind didn't restrict that slot */
+        for (int j=0; j<t->length; j++) {
+            if ((e->key[0] == 0 || t->pair[j][0] == FS_RID_NULL ||
+                 e->key[0] == t->pair[j][0]) &&
+                (e->key[2] == 0 || t->pair[j][1] == FS_RID_NULL ||
+                 e->key[2] == t->pair[j][1])) {
+                cache_entry_clear(e);
+                qs->bind_cache_evictions++;
+                break;
+            }
+        }
+    }
+
+    g_static_mutex_unlock(&qs->cache_mutex);
+
+    return 0;
+}
+
 int fs_query_bind_cache_count_slots(fs_query_state *qs) {
     unsigned int xc=0;
     unsigned int count_bind=0;
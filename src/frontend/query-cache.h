@@ -6,11 +6,22 @@
 
 typedef struct _fs_bind_cache fs_bind_cache;
 
+/* the (model, predicate) pairs written by an update or import, FS_RID_NULL
+ * in either position stands for any value */
+typedef struct _fs_cache_touched fs_cache_touched;
+
 int fs_bind_cache_wrapper(fs_query_state *qs, fs_query *q, int all,
     int flags, fs_rid_vector *rids[4], fs_rid_vector ***result,
     int offset, int limit);
 
 int fs_query_cache_flush(fs_query_state *qs, int verbosity);
+
+fs_cache_touched *fs_cache_touched_new(void);
+void fs_cache_touched_add(fs_cache_touched *t, fs_rid model, fs_rid pred);
+void fs_cache_touched_free(fs_cache_touched *t);
+
+/* drop only the bind cache entries that could see quads in t */
+int fs_query_cache_invalidate(fs_query_state *qs, fs_cache_touched *t);
 int fs_acl_load_system_info(fsp_link *link);
 int fs_query_bind_cache_count_slots(fs_query_state *qs);
 int fs_query_bind_cache_size(void);
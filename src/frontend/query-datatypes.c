@@ -24,6 +24,7 @@
 
 #include "query-datatypes.h"
 #include "query-intl.h"
+#include "query.h"
 #include "filter.h"
 #include "debug.h"
 #include "../common/error.h"
@@ -783,7 +784,11 @@ void fs_binding_merge(fs_query *q, int block, fs_binding *from, fs_binding *to)
 
     int fpos = 0;
     int tpos = 0;
+    unsigned int steps = 0;
     while (fpos < length_f || tpos < length_t) {
+        if (++steps % FS_ABANDON_CHECK_INTERVAL == 0 && fs_query_abandoned(q)) {
+            break;
+        }
         if (q->flags & FS_QUERY_RESTRICTED &&
             fs_binding_length(to) >= q->soft_limit) {
             char *msg = g_strdup("some results have been dropped to prevent overunning time allocation");
@@ -1017,8 +1022,12 @@ fs_binding *fs_binding_join(fs_query *q, fs_binding *a, fs_binding *b, fs_join_t
     int apos = 0;
     int bpos = 0;
     int cmp;
+    unsigned int steps = 0;
     while (apos < length_a) {
         if (join == FS_INNER && bpos >= length_b) break;
+        if (++steps % FS_ABANDON_CHECK_INTERVAL == 0 && fs_query_abandoned(q)) {
+            break;
+        }
 	cmp = binding_row_compare(q, a, b, apos, bpos, length_a, length_b);
         if (cmp == -1) {
             /* A and B aren't compatible, A sorts lower, skip A or left join */
@@ -1249,6 +1258,9 @@ fs_binding *fs_binding_apply_filters(fs_query *q, int block, fs_binding *b, rapt
 /* PREFETCH should go here XXX */
 /* --------------------------- */
     for (int row=0; row<length; row++) {
+        if ((row+1) % FS_ABANDON_CHECK_INTERVAL == 0 && fs_query_abandoned(q)) {
+            break;
+        }
         for (int c=0; c<raptor_sequence_size(constr); c++) {
             rasqal_expression *e =
                 raptor_sequence_get_at(constr, c);
@@ -33,6 +33,23 @@ typedef struct _fs_bind_expression fs_bind_expression;
 
 typedef enum { FS_NONE, FS_INNER, FS_LEFT, FS_UNION, FS_MINUS } fs_join_type;
 
+/* limits on a running query, owned by the caller of fs_query_execute() */
+typedef struct {
+    double deadline;		/* fs_time() to give up at, or 0 for none */
+    unsigned int id;		/* identifies the query's binds, or 0 */
+    volatile int cancelled;	/* set by fs_query_cancel() */
+} fs_query_control;
+
+/* a query parsed once, to be run many times with different parameters */
+typedef struct _fs_prepared fs_prepared;
+
+/* binds the variable ?name, as though by FILTER(?name = value), value is an
+ * N-Triples style term: <uri>, "literal", "literal"@lang or "literal"^^<type> */
+typedef struct {
+    const char *name;
+    const char *value;
+} fs_query_param;
+
 fs_binding *fs_binding_new(void);
 int fs_binding_set_expression(fs_binding *b, rasqal_variable *var, rasqal_expression *ex);
 void fs_binding_free(fs_binding *b);
@@ -32,6 +32,10 @@ struct _fs_query_state {
     /* bind stats */
     unsigned int bind_hits;
     unsigned int bind_cache_success;
+    /* bind cache maintenance, always counted */
+    unsigned int bind_cache_replaced; /* entries overwritten by a colliding bind */
+    unsigned int bind_cache_evictions; /* entries dropped by writes */
+    unsigned int bind_cache_flushes; /* whole cache flushes */
 
     /* the following cache stats are filled only if verbosity > 0 */
     unsigned int cache_hits; /* total queries to the cache */
@@ -113,6 +117,12 @@ struct _fs_query {
     int group_by;
     GHashTable *tmp_resources;
     char *json_function;		/* function for JSON-P callbacks */
+    fs_query_control *control;		/* deadline and cancellation, or NULL */
+    int abandoned;			/* true once the deadline passed or the
+					   query was cancelled */
+    fs_prepared *prepared;		/* rq is returned here when freed, or NULL */
+    const fs_query_param *params;	/* bound by fs_query_process_pattern() */
+    int n_params;
 };
 
 #endif
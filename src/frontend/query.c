@@ -52,6 +52,7 @@ GStaticMutex rasqal_mutex = G_STATIC_MUTEX_INIT;
 static void graph_pattern_walk(fsp_link *link, rasqal_graph_pattern *p, fs_query *q, rasqal_literal *model, int optional, int uni);
 static int fs_handle_query_triple(fs_query *q, int block, rasqal_triple *t);
 static int fs_handle_query_triple_multi(fs_query *q, int block, int count, rasqal_triple *t[]);
+static void assign_slot(fs_query *q, rasqal_literal *l, int block);
 static fs_rid const_literal_to_rid(fs_query *q, rasqal_literal *l, fs_rid *attr);
 static void check_variables(fs_query *q, rasqal_expression *e, int dont_select);
 static int is_aggregate(fs_query *q, rasqal_expression *e);
@@ -334,7 +335,316 @@ static void tree_compact(fs_query *q)
     } while (done_something);
 }
 
-fs_query *fs_query_execute(fs_query_state *qs, fsp_link *link, raptor_uri *bu, const char *query, unsigned int flags, int opt_level, int soft_limit,const char *apikey, int explain)
+static rasqal_query *new_rasqal_query(fs_query_state *qs)
+{
+    g_static_mutex_lock(&rasqal_mutex);
+    rasqal_query *rq = rasqal_new_query(qs->rasqal_world, "sparql11", NULL);
+    if (!rq) {
+        rq = rasqal_new_query(qs->rasqal_world, "laqrs", NULL);
+    }
+    if (!rq) {
+        rq = rasqal_new_query(qs->rasqal_world, "sparql", NULL);
+    }
+    g_static_mutex_unlock(&rasqal_mutex);
+
+    return rq;
+}
+
+struct _fs_prepared {
+    char *query;
+    raptor_uri *base;
+    double estimate;
+    GStaticMutex mutex;
+    GSList *idle;		/* parses no running query is using */
+    unsigned long hits;
+    unsigned long misses;
+};
+
+/* a temporary query, enough for parsing and fs_bind_freq() */
+static fs_query *parse_only(fs_query_state *qs, fsp_link *link, raptor_uri *bu, const char *query)
+{
+    rasqal_query *rq = new_rasqal_query(qs);
+    if (!rq) {
+        return NULL;
+    }
+
+    fs_query *q = calloc(1, sizeof(fs_query));
+    q->rq = rq;
+    q->qs = qs;
+    q->link = link;
+    q->segments = fsp_link_segments(link);
+    q->base = bu;
+    q->bb[0] = fs_binding_new();
+
+    g_static_mutex_lock(&rasqal_mutex);
+    rasqal_world_set_log_handler(qs->rasqal_world, q, log_handler);
+    if (rasqal_query_prepare(rq, (unsigned char *)query, bu) && !q->errors) {
+        q->errors++;
+        q->warnings = g_slist_prepend(q->warnings, "parser error");
+    }
+    g_static_mutex_unlock(&rasqal_mutex);
+
+    return q;
+}
+
+/* nothing is bound yet, so this is the size of the cheapest place the
+ * optimiser could start from */
+static double estimate(fs_query *q)
+{
+    double cost = 0.0;
+    rasqal_triple *t;
+
+    for (int i=0; (t = rasqal_query_get_triple(q->rq, i)); i++) {
+        double freq = fs_bind_freq(q->qs, q, 0, t);
+        if (i == 0 || freq < cost) cost = freq;
+    }
+
+    return cost;
+}
+
+double fs_query_estimate(fs_query_state *qs, fsp_link *link, raptor_uri *bu, const char *query)
+{
+    fs_query *q = parse_only(qs, link, bu, query);
+    if (!q) {
+        return 0.0;
+    }
+
+    double cost = q->errors ? 0.0 : estimate(q);
+    fs_query_free(q);
+
+    return cost;
+}
+
+fs_prepared *fs_query_prepare(fs_query_state *qs, fsp_link *link, raptor_uri *bu,
+                              const char *query, char **error)
+{
+    fs_query *q = parse_only(qs, link, bu, query);
+    if (!q) {
+        *error = g_strdup("failed to initialise query system");
+
+        return NULL;
+    }
+    if (q->errors) {
+        GString *msg = g_string_new("");
+        for (GSList *w = q->warnings; w; w = w->next) {
+            if (msg->len) g_string_append(msg, "\n");
+            g_string_append(msg, w->data);
+        }
+        *error = g_string_free(msg, FALSE);
+        fs_query_free(q);
+
+        return NULL;
+    }
+
+    fs_prepared *p = g_new0(fs_prepared, 1);
+    p->query = g_strdup(query);
+    p->base = bu;
+    p->estimate = estimate(q);
+    g_static_mutex_init(&p->mutex);
+    /* the first execution can have this parse */
+    p->idle = g_slist_prepend(NULL, q->rq);
+    q->rq = NULL;
+    fs_query_free(q);
+
+    return p;
+}
+
+/* returns NULL if every parse is in use */
+static rasqal_query *prepared_checkout(fs_prepared *p)
+{
+    g_static_mutex_lock(&p->mutex);
+    rasqal_query *rq = p->idle ? p->idle->data : NULL;
+    if (rq) {
+        p->idle = g_slist_delete_link(p->idle, p->idle);
+        p->hits++;
+    } else {
+        p->misses++;
+    }
+    g_static_mutex_unlock(&p->mutex);
+
+    if (rq) {
+        /* variables remember their column in the last query's bindings */
+        raptor_sequence *vars[2] = {
+            rasqal_query_get_all_variable_sequence(rq),
+            rasqal_query_get_anonymous_variable_sequence(rq)
+        };
+        for (int s=0; s<2; s++) {
+            for (int i=0; vars[s] && i<raptor_sequence_size(vars[s]); i++) {
+                rasqal_variable *v = raptor_sequence_get_at(vars[s], i);
+                v->user_data = NULL;
+            }
+        }
+    }
+
+    return rq;
+}
+
+static void prepared_checkin(fs_prepared *p, rasqal_query *rq)
+{
+    g_static_mutex_lock(&p->mutex);
+    p->idle = g_slist_prepend(p->idle, rq);
+    g_static_mutex_unlock(&p->mutex);
+}
+
+const char *fs_prepared_query(fs_prepared *p)
+{
+    return p->query;
+}
+
+double fs_prepared_estimate(fs_prepared *p)
+{
+    return p->estimate;
+}
+
+void fs_prepared_stats(fs_prepared *p, unsigned long *hits, unsigned long *misses)
+{
+    g_static_mutex_lock(&p->mutex);
+    *hits = p->hits;
+    *misses = p->misses;
+    g_static_mutex_unlock(&p->mutex);
+}
+
+void fs_prepared_free(fs_prepared *p)
+{
+    if (!p) return;
+
+    g_static_mutex_lock(&rasqal_mutex);
+    for (GSList *it = p->idle; it; it = it->next) {
+        rasqal_free_query(it->data);
+    }
+    g_static_mutex_unlock(&rasqal_mutex);
+    g_slist_free(p->idle);
+    g_static_mutex_free(&p->mutex);
+    g_free(p->query);
+    g_free(p);
+}
+
+/* parses an N-Triples style term, returns FS_RID_NULL if it isn't one,
+ * literals set *attr to their datatype or language */
+static fs_rid param_to_rid(const char *term, fs_rid *attr)
+{
+    const int len = strlen(term);
+
+    *attr = FS_RID_NULL;
+
+    if (len > 1 && term[0] == '<' && term[len-1] == '>') {
+        char *uri = g_strndup(term+1, len-2);
+        fs_rid rid = fs_hash_uri(uri);
+        g_free(uri);
+
+        return rid;
+    }
+    if (term[0] != '"') {
+        return FS_RID_NULL;
+    }
+
+    GString *lex = g_string_new("");
+    const char *pos;
+    for (pos = term+1; *pos && *pos != '"'; pos++) {
+        if (*pos == '\\' && pos[1]) {
+            pos++;
+            switch (*pos) {
+            case 'n': g_string_append_c(lex, '\n'); break;
+            case 'r': g_string_append_c(lex, '\r'); break;
+            case 't': g_string_append_c(lex, '\t'); break;
+            case 'u':
+            case 'U': {
+                const int digits = *pos == 'u' ? 4 : 8;
+                gunichar c = 0;
+                int d;
+                for (d=1; d<=digits && g_ascii_isxdigit(pos[d]); d++) {
+                    c = c * 16 + g_ascii_xdigit_value(pos[d]);
+                }
+                if (d <= digits || c == 0 || !g_unichar_validate(c)) {
+                    g_string_free(lex, TRUE);
+
+                    return FS_RID_NULL;
+                }
+                char utf8[6];
+                g_string_append_len(lex, utf8, g_unichar_to_utf8(c, utf8));
+                pos += digits;
+                break;
+            }
+            default: g_string_append_c(lex, *pos); break;
+            }
+        } else {
+            g_string_append_c(lex, *pos);
+        }
+    }
+
+    if (*pos != '"') {
+        /* unterminated */
+    } else if (pos[1] == '\0') {
+        *attr = fs_c.empty;
+    } else if (pos[1] == '@' && pos[2]) {
+        char *langtag = g_utf8_strup(pos+2, -1);
+        *attr = fs_hash_literal(langtag, 0);
+        g_free(langtag);
+    } else if (pos[1] == '^' && pos[2] == '^' && pos[3] == '<' &&
+               pos[strlen(pos)-1] == '>') {
+        char *dt = g_strndup(pos+4, strlen(pos+4)-1);
+        *attr = fs_hash_uri(dt);
+        g_free(dt);
+    }
+
+    fs_rid rid = FS_RID_NULL;
+    if (*attr != FS_RID_NULL) {
+        rid = fs_hash_literal(lex->str, *attr);
+    }
+    g_string_free(lex, TRUE);
+
+    return rid;
+}
+
+/* bind the parameters of a prepared query into bb[0], as filter_optimise()
+ * does for FILTER(?var = const), returns non-zero if one isn't usable */
+static int bind_params(fs_query *q)
+{
+    for (int i=0; i<q->n_params; i++) {
+        const char *name = q->params[i].name;
+        if (*name == '?' || *name == '$') name++;
+        fs_binding *b = NULL;
+        for (int col=0; q->bb[0][col].name; col++) {
+            if (!strcmp(q->bb[0][col].name, name)) {
+                b = q->bb[0]+col;
+                break;
+            }
+        }
+        fs_rid attr;
+        fs_rid rid = param_to_rid(q->params[i].value, &attr);
+        char *msg = NULL;
+        if (!b) {
+            msg = g_strdup_printf("parameter ?%s is not a variable of the query", name);
+        } else if (rid == FS_RID_NULL) {
+            msg = g_strdup_printf("parameter ?%s has an unrecognised value %s", name, q->params[i].value);
+        } else if (attr != FS_RID_NULL && attr != fs_c.empty && !FS_IS_LITERAL(attr)) {
+            /* as in filter_optimise_disjunct_equality(), typed values can
+             * have other lexical forms that only a real FILTER would match */
+            msg = g_strdup_printf("parameter ?%s is a typed literal, use a FILTER in the query instead", name);
+        }
+        if (msg) {
+            q->errors++;
+            q->warnings = g_slist_prepend(q->warnings, msg);
+            fs_query_add_freeable(q, msg);
+
+            return 1;
+        }
+        if (b->bound) {
+            /* already restricted by a FILTER or an earlier parameter, both
+             * have to hold, an empty vector matches nothing */
+            const int found = fs_rid_vector_contains(b->vals, rid);
+            fs_rid_vector_truncate(b->vals, 0);
+            if (found) fs_rid_vector_append(b->vals, rid);
+        } else {
+            fs_rid_vector_append(b->vals, rid);
+            b->bound = 1;
+        }
+    }
+
+    return 0;
+}
+
+static fs_query *execute(fs_query_state *qs, fsp_link *link, raptor_uri *bu, const char *query, fs_prepared *prepared, const fs_query_param *params, int n_params, unsigned int flags, int opt_level, int soft_limit,const char *apikey, int explain, fs_query_control *control)
 {
     if (!qs) {
         fs_error(LOG_CRIT, "fs_query_execute() handed NULL query state");
@@ -343,15 +653,16 @@ fs_query *fs_query_execute(fs_query_state *qs, fsp_link *link, raptor_uri *bu, c
 
     fsp_hit_limits_reset(link);
 
-    g_static_mutex_lock(&rasqal_mutex);
-    rasqal_query *rq = rasqal_new_query(qs->rasqal_world, "sparql11", NULL);
-    if (!rq) {
-        rq = rasqal_new_query(qs->rasqal_world, "laqrs", NULL);
+    rasqal_query *rq = NULL;
+    if (prepared) {
+        rq = prepared_checkout(prepared);
+        query = prepared->query;
+        bu = prepared->base;
     }
+    const int parsed = rq != NULL;
     if (!rq) {
-        rq = rasqal_new_query(qs->rasqal_world, "sparql", NULL);
+        rq = new_rasqal_query(qs);
     }
-    g_static_mutex_unlock(&rasqal_mutex);
     if (!rq) {
         fs_error(LOG_ERR, "failed to initialise query system");
 
@@ -365,6 +676,9 @@ fs_query *fs_query_execute(fs_query_state *qs, fsp_link *link, raptor_uri *bu, c
     q->rq = rq;
     q->qs = qs;
     q->opt_level = opt_level;
+    q->control = control;
+    q->params = params;
+    q->n_params = n_params;
 
     if (fsp_is_acl_enabled(qs->link) && apikey)
         q->apikey_rid = fs_hash_literal(apikey,0);
@@ -377,13 +691,19 @@ fs_query *fs_query_execute(fs_query_state *qs, fsp_link *link, raptor_uri *bu, c
         q->soft_limit = FS_FANOUT_LIMIT;
     }
     q->boolean = 1;
-    rasqal_world_set_log_handler(q->qs->rasqal_world, q, log_handler);
-    g_static_mutex_lock(&rasqal_mutex);
-    int ret = rasqal_query_prepare(rq, (unsigned char *)query, bu);
-    g_static_mutex_unlock(&rasqal_mutex);
-    if (ret) {
-	return q;
+    if (!parsed) {
+        g_static_mutex_lock(&rasqal_mutex);
+        /* the handler belongs to the world, so set it under the lock or a
+         * concurrent parse could report into the wrong query */
+        rasqal_world_set_log_handler(q->qs->rasqal_world, q, log_handler);
+        int ret = rasqal_query_prepare(rq, (unsigned char *)query, bu);
+        g_static_mutex_unlock(&rasqal_mutex);
+        if (ret) {
+            return q;
+        }
     }
+    /* only a parse that worked goes back for reuse */
+    q->prepared = prepared;
     if (explain) {
         flags |= FS_QUERY_EXPLAIN;
     }
@@ -573,13 +893,39 @@ fs_query *fs_query_execute(fs_query_state *qs, fsp_link *link, raptor_uri *bu, c
         check_variables(q, e, 0);
     }
 
+    if (control) {
+        /* binds carry the deadline, and can be cancelled, until fs_query_free() */
+        fsp_bind_context(control->id, control->deadline);
+    }
+
     /* this is where most of the actual work happens */
     fs_query_process_pattern(q, pattern, vars);
+    /* the caller's parameters needn't outlive this call */
+    q->params = NULL;
+    q->n_params = 0;
     if (q->describe) {
         raptor_free_sequence(vars);
     }
     vars = NULL;
 
+    /* a bind that gave up answers no match, so look again even if nothing
+     * has noticed yet */
+    if (fs_query_abandoned(q)) {
+        /* with patterns or joins skipped the bindings could hold rows that
+         * don't match, so there are no results at all */
+        for (int i=1; i <= q->block; i++) {
+            if (q->bb[i]) {
+                fs_binding_free(q->bb[i]);
+                q->bb[i] = NULL;
+            }
+        }
+        for (int i=0; q->bb[0][i].name; i++) {
+            q->bb[0][i].vals->length = 0;
+        }
+        q->bt = q->bb[0];
+        q->boolean = 0;
+    }
+
 #ifndef DEBUG_MERGE
     if (explain) {
 	return q;
@@ -696,6 +1042,21 @@ fs_query *fs_query_execute(fs_query_state *qs, fsp_link *link, raptor_uri *bu, c
     return q;
 }
 
+fs_query *fs_query_execute(fs_query_state *qs, fsp_link *link, raptor_uri *bu, const char *query, unsigned int flags, int opt_level, int soft_limit,const char *apikey, int explain, fs_query_control *control)
+{
+    return execute(qs, link, bu, query, NULL, NULL, 0, flags, opt_level,
+                   soft_limit, apikey, explain, control);
+}
+
+fs_query *fs_query_execute_prepared(fs_query_state *qs, fsp_link *link, fs_prepared *p,
+                                    const fs_query_param *params, int n_params,
+                                    unsigned int flags, int opt_level, int soft_limit,
+                                    const char *apikey, int explain, fs_query_control *control)
+{
+    return execute(qs, link, NULL, NULL, p, params, n_params, flags, opt_level,
+                   soft_limit, apikey, explain, control);
+}
+
 int fs_query_process_pattern(fs_query *q, rasqal_graph_pattern *pattern, raptor_sequence *vars)
 {
     int explain = q->flags & FS_QUERY_EXPLAIN;
@@ -712,6 +1073,12 @@ int fs_query_process_pattern(fs_query *q, rasqal_graph_pattern *pattern, raptor_
 
     tree_compact(q);
 
+    if (q->params && bind_params(q)) {
+        q->boolean = 0;
+
+        return 0;
+    }
+
 #ifdef DEBUG_MERGE
     printf("\nAfter compact:\n");
     for (int b=0; b<q->block; b++) {
@@ -794,6 +1161,9 @@ int fs_query_process_pattern(fs_query *q, rasqal_graph_pattern *pattern, raptor_
             q->bb[i] = fs_binding_copy(q->bb[tocopy]);
         }
 	for (int j=0; j<q->blocks[i].length; j++) {
+            if (fs_query_abandoned(q)) {
+                break;
+            }
 	    int chunk = fs_optimise_triple_pattern(q->qs, q, i,
 	       (rasqal_triple **)(q->blocks[i].data), q->blocks[i].length, j);
 	    /* execute triple pattern query */
@@ -868,7 +1238,7 @@ int fs_query_process_pattern(fs_query *q, rasqal_graph_pattern *pattern, raptor_
         /* Evaluate BIND expressions */
         fs_bind_expression *be = q->binds[i];
         const int bind_length = fs_binding_length(q->bb[i]);
-        while (be) {
+        while (be && !fs_query_abandoned(q)) {
             fs_binding *beb = fs_binding_get(q->bb[i], be->var);
             // This is needed for fs_expression_eval() - don't ask
             q->bt = q->bb[i];
@@ -926,6 +1296,9 @@ int fs_query_process_pattern(fs_query *q, rasqal_graph_pattern *pattern, raptor_
 #endif
                 continue;
             }
+            if (fs_query_abandoned(q)) {
+                break;
+            }
             if (q->parent_block[j] == i) {
                 if (q->join_type[j] == FS_INNER) {
 #ifdef DEBUG_MERGE
@@ -1023,15 +1396,48 @@ int fs_query_process_pattern(fs_query *q, rasqal_graph_pattern *pattern, raptor_
         }
     }
 
-    fs_query_group_block(q, 0);
+    if (!q->abandoned) {
+        fs_query_group_block(q, 0);
+    }
 
     return 0;
 }
 
+/* as fs_query_process_pattern(), but for a plain sequence of triples, such as
+ * the template of a DELETE WHERE { }, which has no graph pattern of its own */
+int fs_query_process_triples(fs_query *q, raptor_sequence *triples, raptor_sequence *vars)
+{
+    (q->block)++;
+    q->parent_block[q->block] = 0;
+    q->join_type[q->block] = FS_INNER;
+
+    for (int i=0; i<raptor_sequence_size(triples); i++) {
+	rasqal_triple *rt = raptor_sequence_get_at(triples, i);
+        rasqal_triple *t = calloc(1, sizeof(rasqal_triple));
+        fs_query_add_freeable(q, t);
+        t->origin = rt->origin;
+        t->subject = rt->subject;
+        t->predicate = rt->predicate;
+        t->object = rt->object;
+	fs_p_vector_append(q->blocks+q->block, (void *)t);
+	assign_slot(q, t->origin, q->block);
+	assign_slot(q, t->subject, q->block);
+	assign_slot(q, t->predicate, q->block);
+	assign_slot(q, t->object, q->block);
+    }
+
+    return fs_query_process_pattern(q, NULL, vars);
+}
+
 void fs_query_free(fs_query *q)
 {
     if (q) {
-        if (q->rq) {
+        if (q->control) {
+            fsp_bind_context(0, 0.0);
+        }
+        if (q->rq && q->prepared) {
+            prepared_checkin(q->prepared, q->rq);
+        } else if (q->rq) {
             g_static_mutex_lock(&rasqal_mutex);
             rasqal_free_query(q->rq);
             g_static_mutex_unlock(&rasqal_mutex);
@@ -1788,6 +2194,52 @@ static int process_results(fs_query *q, int block, fs_binding *oldb,
     return ret;
 }
 
+/* ?lit text:match "query" binds ?lit to the literals matching query in the
+ * backends' full text indexes, best matches first */
+static int fs_handle_text_match(fs_query *q, int block, fs_binding *oldb,
+                                rasqal_triple *t, fs_rid_vector *slot[4],
+                                int explain)
+{
+    fs_binding *b = q->bb[block];
+    rasqal_variable *vars[4] = { NULL, NULL, NULL, NULL };
+    fs_rid_vector **results = NULL;
+
+    if (t->subject->type != RASQAL_LITERAL_VARIABLE ||
+        t->object->type != RASQAL_LITERAL_STRING) {
+        q->warnings = g_slist_prepend(q->warnings, "text:match needs a variable subject and a string object");
+        fs_binding_free(oldb);
+        q->boolean = 0;
+
+        return 0;
+    }
+
+    fs_text_match *matches = NULL;
+    int count = 0;
+    if (fsp_text_search_all(q->link, (char *)t->object->string,
+                            FS_TEXT_MAX_MATCHES, &matches, &count)) {
+        q->warnings = g_slist_prepend(q->warnings, "full text search failed");
+        count = 0;
+    }
+    if (count == FS_TEXT_MAX_MATCHES) {
+        q->warnings = g_slist_prepend(q->warnings, "full text search truncated, only the best matches are returned");
+    }
+    if (count) {
+        results = calloc(1, sizeof(fs_rid_vector *));
+        results[0] = fs_rid_vector_new(count);
+        for (int i=0; i<count; i++) {
+            results[0]->data[i] = matches[i].rid;
+        }
+        vars[0] = t->subject->value.variable;
+    }
+    free(matches);
+    if (explain) {
+        fs_query_explain(q, g_strdup_printf("text:match \"%s\" -> %d", (char *)t->object->string, count));
+    }
+
+    return process_results(q, block, oldb, b, q->flags | FS_BIND_SUBJECT,
+                           results, vars, 1, slot);
+}
+
 static int fs_handle_query_triple(fs_query *q, int block, rasqal_triple *t)
 {
     fs_rid_vector *slot[4];
@@ -1816,6 +2268,15 @@ static int fs_handle_query_triple(fs_query *q, int block, rasqal_triple *t)
     fs_binding *oldb = fs_binding_copy_and_clear(b);
     fs_rid_vector **results = NULL;
 
+    if (fs_opt_literal_is_text_match(t->predicate)) {
+        ret = fs_handle_text_match(q, block, oldb, t, slot, explain);
+        for (int x=0; x<4; x++) {
+            fs_rid_vector_free(slot[x]);
+        }
+
+        return ret;
+    }
+
     /* if theres a patterns with lots of bindings for the subject and one
      * predicate we can bind_many it */
     if (fs_opt_is_const(oldb, t->subject) &&
@@ -2232,4 +2693,29 @@ int fs_query_errors(fs_query *q)
     return 1;
 }
 
+int fs_query_abandoned(fs_query *q)
+{
+    if (q->abandoned) return 1;
+    if (!q->control) return 0;
+
+    if (q->control->cancelled) {
+        q->warnings = g_slist_prepend(q->warnings,
+                          "query cancelled, results are incomplete");
+    } else if (q->control->deadline > 0.0 && fs_time() > q->control->deadline) {
+        q->warnings = g_slist_prepend(q->warnings,
+                          "query timed out, results are incomplete");
+    } else {
+        return 0;
+    }
+    q->abandoned = 1;
+
+    return 1;
+}
+
+void fs_query_cancel(fsp_link *link, fs_query_control *control)
+{
+    control->cancelled = 1;
+    fsp_cancel(link, control->id);
+}
+
 /* vi:set expandtab sts=4 sw=4: */
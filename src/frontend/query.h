@@ -14,18 +14,52 @@ GStaticMutex rasqal_mutex;
 fs_query_state *fs_query_init(fsp_link *link, rasqal_world *rasworld, raptor_world *rapworld);
 int fs_query_fini(fs_query_state *qs);
 
-/* Execute a SPARQL query, see results.h for how to read results from the fs_query */
+/* Execute a SPARQL query, see results.h for how to read results from the fs_query,
+ * control may be NULL, otherwise it must outlive the fs_query */
 fs_query *fs_query_execute(fs_query_state *qs, fsp_link *link, raptor_uri *bu,
                            const char *query, unsigned int flags, int opt_level, int soft_limit,
-                           const char *apikey, int explain);
+                           const char *apikey, int explain, fs_query_control *control);
+
+/* rough number of rows the query's cheapest triple pattern will match, from
+ * the optimiser's frequency data, without touching the backend. Returns 0 if
+ * the query doesn't parse */
+double fs_query_estimate(fs_query_state *qs, fsp_link *link, raptor_uri *bu,
+                         const char *query);
+
+/* parse a query for fs_query_execute_prepared(), bu must outlive it. Returns
+ * NULL, with a g_malloc()ed message in *error, if it doesn't parse */
+fs_prepared *fs_query_prepare(fs_query_state *qs, fsp_link *link, raptor_uri *bu,
+                              const char *query, char **error);
+
+/* as fs_query_execute(), reusing the prepared query's parse where one is free */
+fs_query *fs_query_execute_prepared(fs_query_state *qs, fsp_link *link, fs_prepared *p,
+                                    const fs_query_param *params, int n_params,
+                                    unsigned int flags, int opt_level, int soft_limit,
+                                    const char *apikey, int explain, fs_query_control *control);
+
+const char *fs_prepared_query(fs_prepared *p);
+/* fs_query_estimate() of the query, worked out when it was prepared */
+double fs_prepared_estimate(fs_prepared *p);
+/* executions that reused a parse, and that had to parse the query again */
+void fs_prepared_stats(fs_prepared *p, unsigned long *hits, unsigned long *misses);
+/* only once no query executed from it remains */
+void fs_prepared_free(fs_prepared *p);
+
+/* abandon a running query, safe to call from another thread */
+void fs_query_cancel(fsp_link *link, fs_query_control *control);
 
 /* internal function used to process WHERE clauses */
 int fs_query_process_pattern(fs_query *q, rasqal_graph_pattern *pattern, raptor_sequence *vars);
+int fs_query_process_triples(fs_query *q, raptor_sequence *triples, raptor_sequence *vars);
 
 void fs_query_free(fs_query *q);
 double fs_query_start_time(fs_query *q);
 int fs_query_flags(fs_query *q);
 int fs_query_errors(fs_query *q);
+/* true once the query has passed its deadline or been cancelled, in which
+ * case it stops early and returns no further results. The first call to
+ * notice adds a warning */
+int fs_query_abandoned(fs_query *q);
 int fs_bind_slot(fs_query *q, int block, fs_binding *b, 
         rasqal_literal *l, fs_rid_vector *v, int *bind, rasqal_variable **var,
         int lit_allowed);
@@ -33,4 +67,8 @@ int fs_query_have_laqrs(void);
 
 void fs_check_cons_slot(fs_query *q, raptor_sequence *vars, rasqal_literal *l);
 
+/* totals over the resolver cache's stripes of lock acquisitions, and of
+ * those that found the stripe already locked */
+void fs_resolver_cache_stats(unsigned long *locks, unsigned long *contended);
+
 #endif
@@ -21,7 +21,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "4store-config.h"
 #include "results.h"
@@ -40,8 +44,17 @@
 #define CACHE_SIZE 65536
 #define CACHE_MASK (CACHE_SIZE-1)
 
+/* the resolver cache is split into stripes by the low bits of the RID, each
+ * with its own lock, L1 table and share of the L2 slots, so threads
+ * serialising results only contend when they touch the same stripe */
+#define CACHE_STRIPES 64
+#define CACHE_STRIPE(rid) (&res_stripes[(rid) & (CACHE_STRIPES-1)])
+
 #define RESOURCE_LOOKUP_BUFFER 1800
 
+/* most resources a DESCRIBE fetches with one bind */
+#define DESCRIBE_BATCH 1000
+
 /* glib 2.x headers must match the architecture we're building. If the size of a pointer
  * is smaller in the provided glibconfig.h than in our target architecture, the resulting typedef
  * should be invalid, preventing the user from building a 4store that won't work properly at runtime
@@ -52,17 +65,79 @@ typedef char wrong_glib_headers[1 + GLIB_SIZEOF_VOID_P - sizeof(void *)];
 static const char *NULL_PROXY = " ";
 static const char *BNODE_PROXY = "*";
 
+/* protects the resolver stats in fs_query_state */
 static GStaticMutex cache_mutex = G_STATIC_MUTEX_INIT;
 pthread_mutex_t rasqal_ser_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static fs_resource res_l2_cache[CACHE_SIZE];
 
-static GHashTable *res_l1_cache = NULL;
+typedef struct {
+    GStaticMutex mutex;
+    GHashTable *l1;
+    unsigned long locks;
+    unsigned long contended;
+} res_stripe;
+
+static res_stripe res_stripes[CACHE_STRIPES] = {
+    [0 ... CACHE_STRIPES-1] = { G_STATIC_MUTEX_INIT, NULL, 0, 0 }
+};
+
+static void stripe_lock(res_stripe *st)
+{
+    if (!g_static_mutex_trylock(&st->mutex)) {
+        g_static_mutex_lock(&st->mutex);
+        st->contended++;
+    }
+    st->locks++;
+    if (!st->l1) {
+        st->l1 = g_hash_table_new_full(fs_rid_hash, fs_rid_equal, NULL, NULL);
+    }
+}
+
+static void stripe_unlock(res_stripe *st)
+{
+    g_static_mutex_unlock(&st->mutex);
+}
+
+/* call with the stripe locked, takes ownership of lex */
+static void stripe_insert(res_stripe *st, fs_rid rid, fs_rid attr, char *lex)
+{
+    if (g_hash_table_lookup(st->l1, &rid)) {
+        free(lex);
+
+        return;
+    }
+    fs_rid *trid = malloc(sizeof(fs_rid));
+    fs_resource *tres = malloc(sizeof(fs_resource));
+    *trid = rid;
+    tres->rid = rid;
+    tres->attr = attr;
+    tres->lex = lex;
+    g_hash_table_insert(st->l1, trid, tres);
+}
+
+/* true if rid is in the L1 or L2 cache */
+static int cache_has(fs_rid rid)
+{
+    res_stripe *st = CACHE_STRIPE(rid);
+    stripe_lock(st);
+    int hit = res_l2_cache[rid & CACHE_MASK].rid == rid ||
+              g_hash_table_lookup(st->l1, &rid);
+    stripe_unlock(st);
+
+    return hit;
+}
 
-/* must hold mutex to call this function */
-static void setup_l1_cache()
+void fs_resolver_cache_stats(unsigned long *locks, unsigned long *contended)
 {
-    res_l1_cache = g_hash_table_new_full(fs_rid_hash, fs_rid_equal, NULL, NULL);
+    *locks = 0;
+    *contended = 0;
+    for (int i=0; i<CACHE_STRIPES; i++) {
+        g_static_mutex_lock(&res_stripes[i].mutex);
+        *locks += res_stripes[i].locks;
+        *contended += res_stripes[i].contended;
+        g_static_mutex_unlock(&res_stripes[i].mutex);
+    }
 }
 
 static int resolve(fs_query *q, fs_rid rid, fs_resource *res)
@@ -114,42 +189,41 @@ static int resolve(fs_query *q, fs_rid rid, fs_resource *res)
         return 0;
     }
 
-    q->qs->cache_hits++;
-    g_static_mutex_lock(&cache_mutex);
+    /* the counters are shared by every query, and only the stripe is locked */
+    __sync_fetch_and_add(&q->qs->cache_hits, 1);
+    res_stripe *st = CACHE_STRIPE(rid);
+    stripe_lock(st);
 
     if (res_l2_cache[rid & CACHE_MASK].rid == rid) {
-        q->qs->cache_success_l2++;
+        __sync_fetch_and_add(&q->qs->cache_success_l2, 1);
         /* deep copy resource */
         res->rid = res_l2_cache[rid & CACHE_MASK].rid;
         res->attr = res_l2_cache[rid & CACHE_MASK].attr;
         res->lex = g_strdup(res_l2_cache[rid & CACHE_MASK].lex);
         fs_query_add_row_freeable(q, res->lex);
-        g_static_mutex_unlock(&cache_mutex);
+        stripe_unlock(st);
 
 	return 0;
     }
 
-    if (!res_l1_cache) {
-        setup_l1_cache();
-    }
-    if ((hit = g_hash_table_lookup(res_l1_cache, &rid))) {
-        q->qs->cache_success_l1++;
+    if ((hit = g_hash_table_lookup(st->l1, &rid))) {
+        __sync_fetch_and_add(&q->qs->cache_success_l1, 1);
         /* deep copy */
         res->rid = hit->rid;
         res->attr = hit->attr;
         res->lex = g_strdup(hit->lex);
         fs_query_add_row_freeable(q, res->lex);
-        g_static_mutex_unlock(&cache_mutex);
+        stripe_unlock(st);
 
         return 0;
     }
 
-    g_static_mutex_unlock(&cache_mutex);
+    stripe_unlock(st);
 
     GTimer *tmr = NULL;
     if (q->qs->verbosity || q->qs->cache_stats) {
         tmr = g_timer_new();
-        q->qs->cache_fail++;
+        __sync_fetch_and_add(&q->qs->cache_fail, 1);
     }
 
     fs_rid_vector *r = fs_rid_vector_new(1);
@@ -157,19 +231,13 @@ static int resolve(fs_query *q, fs_rid rid, fs_resource *res)
 #ifdef DEBUG_FILTER
     printf("resolving %016llx\n", rid);
 #endif
-    g_static_mutex_lock(&cache_mutex);
-    if (g_hash_table_lookup(res_l1_cache, &rid) == NULL) {
-        fsp_resolve(q->link, FS_RID_SEGMENT(rid, q->segments), r, res);
-        fs_rid *trid = malloc(sizeof(fs_rid));
-        fs_resource *tres = malloc(sizeof(fs_resource));
-        *trid = rid;
-        tres->rid = res->rid;
-        tres->attr = res->attr;
-        tres->lex = g_strdup(res->lex);
-        fs_query_add_row_freeable(q, res->lex);
-        g_hash_table_insert(res_l1_cache, trid, tres);
-    }
-    g_static_mutex_unlock(&cache_mutex);
+    /* the stripe isn't held over the network round trip, if another thread
+     * resolves the same RID meanwhile the first insert wins */
+    fsp_resolve(q->link, FS_RID_SEGMENT(rid, q->segments), r, res);
+    fs_query_add_row_freeable(q, res->lex);
+    stripe_lock(st);
+    stripe_insert(st, rid, res->attr, g_strdup(res->lex));
+    stripe_unlock(st);
     fs_rid_vector_free(r);
 
     if (q->qs->verbosity || q->qs->cache_stats) {
@@ -944,12 +1012,6 @@ fs_value fs_expression_eval(fs_query *q, int row, int block, rasqal_expression *
 
 static int resolve_precache_all(fsp_link *l, fs_rid_vector *rv[], int segments)
 {
-    g_static_mutex_lock(&cache_mutex);
-    if (!res_l1_cache) {
-        setup_l1_cache();
-    }
-    g_static_mutex_unlock(&cache_mutex);
-
     fs_resource *res[segments];
     for (int s=0; s<segments; s++) {
         fs_rid_vector_sort(rv[s]);
@@ -963,26 +1025,43 @@ static int resolve_precache_all(fsp_link *l, fs_rid_vector *rv[], int segments)
         return 1;
     }
 
-    g_static_mutex_lock(&cache_mutex);
+    /* bucket the replies by stripe, so each stripe is locked once */
+    int total = 0;
+    for (int s=0; s<segments; s++) {
+        total += rv[s]->length;
+    }
+    fs_resource **bucketed = malloc(total * sizeof(fs_resource *));
+    int start[CACHE_STRIPES+1];
+    memset(start, 0, sizeof(start));
     for (int s=0; s<segments; s++) {
         for (int i=0; i<rv[s]->length; i++) {
             if (res[s][i].rid == FS_RID_NULL) break;
-            if (g_hash_table_lookup(res_l1_cache, &(res[s][i].rid))) {
-                free(res[s][i].lex);
-   
-                continue;
-            }
-            fs_rid *trid = malloc(sizeof(fs_rid));
-            fs_resource *tres = malloc(sizeof(fs_resource));
-            *trid = res[s][i].rid;
-            tres->rid = res[s][i].rid;
-            tres->attr = res[s][i].attr;
-            tres->lex = res[s][i].lex;
-            g_hash_table_insert(res_l1_cache, trid, tres);
+            start[(res[s][i].rid & (CACHE_STRIPES-1)) + 1]++;
+        }
+    }
+    for (int st=0; st<CACHE_STRIPES; st++) {
+        start[st+1] += start[st];
+    }
+    int fill[CACHE_STRIPES];
+    memcpy(fill, start, sizeof(fill));
+    for (int s=0; s<segments; s++) {
+        for (int i=0; i<rv[s]->length; i++) {
+            if (res[s][i].rid == FS_RID_NULL) break;
+            bucketed[fill[res[s][i].rid & (CACHE_STRIPES-1)]++] = &res[s][i];
+        }
+    }
+
+    for (int i=0; i<CACHE_STRIPES; i++) {
+        if (start[i] == start[i+1]) continue;
+        res_stripe *st = &res_stripes[i];
+        stripe_lock(st);
+        for (int j=start[i]; j<start[i+1]; j++) {
+            stripe_insert(st, bucketed[j]->rid, bucketed[j]->attr, bucketed[j]->lex);
         }
+        stripe_unlock(st);
     }
-    g_static_mutex_unlock(&cache_mutex);
 
+    free(bucketed);
     for (int s=0; s<segments; s++) {
         free(res[s]);
     }
@@ -1327,60 +1406,6 @@ static int apply_constraints(fs_query *q, int row)
     return 1;
 }
 
-static int csv_needs_escape(const char *str, int *escaped_length)
-{
-    int esc_len = 0;
-    int escape = 0;
-
-    if (!str) return 0;
-
-    for (const char *c = str; *c; c++) {
-        switch (*c) {
-        case '"':
-            esc_len += 2;
-            escape = 1;
-            break;
-        case ',':
-        case '\r':
-        case '\n':
-            esc_len += 1;
-            escape = 1;
-            break;
-        default:
-            esc_len += 1;
-        }
-    }
-    if (escape) {
-        esc_len += 2;
-    }
-    *escaped_length = esc_len;
-
-    return escape;
-}
-
-static char *csv_escape(const char *str, int length)
-{
-    char *to = malloc(length+1);
-    char *outp = to;
-
-    *outp++ = '"';
-    for (const char *inp = str; *inp; inp++) {
-        switch (*inp) {
-        case '"':
-            *outp++ = '"';
-            *outp++ = '"';
-            break;
-        default:
-            *outp++ = *inp;
-            break;
-        }
-    }
-    *outp++ = '"';
-    *outp = '\0';
-
-    return to;
-}
-
 static int uri_needs_escape(const char *str, int *escaped_length)
 {
     int esc_len = 0;
@@ -1465,305 +1490,924 @@ char *fs_uri_escape(const char *str)
     return g_strdup(str);
 }
 
-static int tsv_needs_escape(const char *str, int *escaped_length)
+/* buffered output for the result formats, values are escaped straight into
+ * the buffer, which is written with one fwrite() each time it fills */
+
+#define RES_WRITER_SIZE 65536
+
+typedef struct {
+    FILE *out;
+    size_t len;
+    char buf[RES_WRITER_SIZE];
+} res_writer;
+
+/* escaping schemes */
+enum {
+    ESC_JSON,
+    ESC_TSV,
+    ESC_URI,
+    ESC_CSV,
+    ESC_CSV_URI,
+    ESC_XML,
+    ESC_SCHEMES
+};
+
+/* bytes that may need escaping, apart from control characters, which are
+ * always checked, padded with repeats for the vector scan */
+static const char esc_specials[ESC_SCHEMES][5] = {
+    [ESC_JSON] = { '"', '\\', '"', '"', '"' },
+    [ESC_TSV] = { '"', '\\', '"', '"', '"' },
+    [ESC_URI] = { ' ', '<', '>', '>', '>' },
+    [ESC_CSV] = { '"', ',', '"', '"', '"' },
+    [ESC_CSV_URI] = { '"', ',', ' ', '<', '>' },
+    [ESC_XML] = { '<', '>', '&', '&', '&' },
+};
+
+static res_writer *res_writer_new(FILE *out)
 {
-    int esc_len = 0;
-    int escape = 0;
+    res_writer *w = malloc(sizeof(res_writer));
+    w->out = out;
+    w->len = 0;
 
-    if (!str) return 0;
+    return w;
+}
 
-    for (const char *c = str; *c; c++) {
-        switch (*c) {
-        case '\\':
-        case '\t':
-        case '\r':
-        case '\n':
-        case '"':
-            esc_len += 2;
-            escape = 1;
-            break;
-        default:
-            esc_len += 1;
-        }
+static void res_writer_flush(res_writer *w)
+{
+    if (w->len) {
+        fwrite(w->buf, 1, w->len, w->out);
+        w->len = 0;
     }
-    *escaped_length = esc_len;
+}
 
-    return escape;
+static void res_writer_free(res_writer *w)
+{
+    res_writer_flush(w);
+    free(w);
 }
 
-static char *tsv_escape(const char *str, int length)
+static void rw_write(res_writer *w, const char *str, size_t len)
 {
-    char *to = malloc(length+1);
-    char *outp = to;
+    if (w->len + len > RES_WRITER_SIZE) {
+        res_writer_flush(w);
+        if (len > RES_WRITER_SIZE) {
+            fwrite(str, 1, len, w->out);
 
-    for (const char *inp = str; *inp; inp++) {
-        switch (*inp) {
-        case '\t':
-            *outp++ = '\\';
-            *outp++ = 't';
-            break;
-        case '\r':
-            *outp++ = '\\';
-            *outp++ = 'r';
-            break;
-        case '\n':
-            *outp++ = '\\';
-            *outp++ = 'n';
-            break;
-        case '\\':
-        case '"':
-            *outp++ = '\\';
-            *outp++ = *inp;
-            break;
-        default:
-            *outp++ = *inp;
-            break;
+            return;
         }
     }
-    *outp = '\0';
+    memcpy(w->buf + w->len, str, len);
+    w->len += len;
+}
 
-    return to;
+static inline void rw_putc(res_writer *w, char c)
+{
+    if (w->len == RES_WRITER_SIZE) res_writer_flush(w);
+    w->buf[w->len++] = c;
 }
 
-static int json_needs_escape(const char *str, int *escaped_length)
+static inline void rw_puts(res_writer *w, const char *str)
 {
-    int esc_len = 0;
-    int escape = 0;
+    rw_write(w, str, strlen(str));
+}
 
-    if (!str) return 0;
+static inline int esc_special(int scheme, unsigned char c)
+{
+    const char *s = esc_specials[scheme];
 
-    for (const char *c = str; *c; c++) {
-        switch (*c) {
-        case '\\':
-        case '\t':
-        case '\r':
-        case '\n':
-        case '"':
-            esc_len += 2;
-            escape = 1;
-            break;
-        default:
-            esc_len += 1;
-        }
+    return c < 0x20 || c == 0x7f || c == s[0] || c == s[1] || c == s[2] ||
+           c == s[3] || c == s[4];
+}
+
+/* returns the first byte in [p, end) that may need escaping, or end */
+static const char *esc_scan(int scheme, const char *p, const char *end)
+{
+#ifdef __SSE2__
+    const char *s = esc_specials[scheme];
+    const __m128i ctrl = _mm_set1_epi8(0x1f);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    const __m128i s0 = _mm_set1_epi8(s[0]);
+    const __m128i s1 = _mm_set1_epi8(s[1]);
+    const __m128i s2 = _mm_set1_epi8(s[2]);
+    const __m128i s3 = _mm_set1_epi8(s[3]);
+    const __m128i s4 = _mm_set1_epi8(s[4]);
+
+    while (end - p >= 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i *)p);
+        /* v <= 0x1f unsigned */
+        __m128i hit = _mm_cmpeq_epi8(_mm_min_epu8(v, ctrl), v);
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, del));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, s0));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, s1));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, s2));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, s3));
+        hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, s4));
+        const int mask = _mm_movemask_epi8(hit);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
     }
-    *escaped_length = esc_len;
+#endif
+    while (p < end && !esc_special(scheme, *p)) p++;
 
-    return escape;
+    return p;
 }
 
-static char *json_escape(const char *str, int length)
+static void rw_hex_escape(res_writer *w, const char *prefix, unsigned char c)
 {
-    char *to = malloc(length+1);
-    char *outp = to;
+    static const char hex[] = "0123456789ABCDEF";
 
-    for (const char *inp = str; *inp; inp++) {
-        switch (*inp) {
+    rw_puts(w, prefix);
+    rw_putc(w, hex[c >> 4]);
+    rw_putc(w, hex[c & 15]);
+}
+
+/* writes the escaped form of a special byte */
+static void rw_escape_byte(res_writer *w, int scheme, unsigned char c)
+{
+    switch (scheme) {
+    case ESC_JSON:
+    case ESC_TSV:
+        switch (c) {
+        case '\t': rw_write(w, "\\t", 2); return;
+        case '\r': rw_write(w, "\\r", 2); return;
+        case '\n': rw_write(w, "\\n", 2); return;
+        case '\\':
+        case '"':
+            rw_putc(w, '\\');
+            rw_putc(w, c);
+            return;
+        }
+        if (scheme == ESC_JSON && c < 0x20) {
+            /* JSON strings can't contain raw control characters */
+            rw_hex_escape(w, "\\u00", c);
+            return;
+        }
+        break;
+    case ESC_CSV:
+    case ESC_CSV_URI:
+        if (c == '"') {
+            rw_write(w, "\"\"", 2);
+            return;
+        }
+        if (scheme == ESC_CSV || c == ',') break;
+        /* fall through */
+    case ESC_URI:
+        switch (c) {
+        case ' ':
         case '\t':
-            *outp++ = '\\';
-            *outp++ = 't';
-            break;
         case '\r':
-            *outp++ = '\\';
-            *outp++ = 'r';
-            break;
         case '\n':
-            *outp++ = '\\';
-            *outp++ = 'n';
-            break;
-        case '\\':
-        case '"':
-            *outp++ = '\\';
-            *outp++ = *inp;
-            break;
-        default:
-            *outp++ = *inp;
-            break;
+        case '<':
+        case '>':
+            rw_hex_escape(w, "%", c);
+            return;
+        }
+        break;
+    case ESC_XML:
+        switch (c) {
+        case '<': rw_write(w, "&lt;", 4); return;
+        case '>': rw_write(w, "&gt;", 4); return;
+        case '&': rw_write(w, "&amp;", 5); return;
         }
+        if (c != '\t' && c != '\n' && c != '\r') {
+            /* in the XML 1.1 RestrictedChar set, these aren't legal */
+            return;
+        }
+        break;
     }
-    *outp = '\0';
-
-    return to;
+    rw_putc(w, c);
 }
 
-static int is_xml_restricted(int c) {
-    /* RestrictedSet from http://www.w3.org/TR/xml11/#charsets */
-    if ((c >= 0x01 && c <= 0x08) ||
-        (c >= 0x0b && c <= 0x0c) ||
-        (c >= 0x0e && c <= 0x1f) ||
-        (c >= 0x7f && c <= 0x84) ||
-        (c >= 0x86 && c <= 0x9f)) {
-        return 1;
+/* writes str escaped by scheme, CSV values containing separators are
+ * quoted */
+static void rw_escape(res_writer *w, int scheme, const char *str)
+{
+    if (!str) return;
+
+    const char *p = str;
+    const char *end = str + strlen(str);
+    int quote = 0;
+
+    if (scheme == ESC_CSV || scheme == ESC_CSV_URI) {
+        for (const char *c = esc_scan(ESC_CSV, p, end); c < end;
+             c = esc_scan(ESC_CSV, c + 1, end)) {
+            if (*c == '"' || *c == ',' || (scheme == ESC_CSV &&
+                (*c == '\r' || *c == '\n'))) {
+                quote = 1;
+                break;
+            }
+        }
+        if (quote) rw_putc(w, '"');
     }
-
-    return 0;
+    while (p < end) {
+        const char *special = esc_scan(scheme, p, end);
+        rw_write(w, p, special - p);
+        if (special == end) break;
+        rw_escape_byte(w, scheme, *special);
+        p = special + 1;
+    }
+    if (quote) rw_putc(w, '"');
 }
 
-static int xml_needs_escape(const char *str, int *escaped_length)
-{
-    int esc_len = 0;
-    int escape = 0;
-
-    if (!str) return 0;
+/* the resources a DESCRIBE has found so far, and those still to be
+ * fetched */
+typedef struct {
+    GHashTable *subjects;  /* rid -> raptor_term for the subject */
+    fs_rid_vector *pending;
+    fs_rid_vector *bnodes; /* blank node objects, for the CBD */
+} describe_state;
 
-    for (const char *c = str; *c; c++) {
-	if (*c == '<') {
-            esc_len += 4;
-            escape = 1;
-        } else if (*c == '>') {
-            esc_len += 4;
-            escape = 1;
-        } else if (*c == '&') {
-            esc_len += 5;
-            escape = 1;
-        } else if (is_xml_restricted(*c)) {
-            escape = 1;
-        } else {
-            esc_len++;
-	}
+static raptor_term *describe_subject(fs_query *q, fs_rid rid, raptor_uri *uri)
+{
+    /* labelled as they are when they're objects, so the CBD joins up */
+    if (FS_IS_BNODE(rid)) {
+        return slot_fill_from_rid(q, rid);
     }
 
-    *escaped_length = esc_len;
-
-    return escape;
+    return raptor_new_term_from_uri(q->qs->raptor_world, uri);
 }
 
-static char *xml_escape(const char *from, int len)
+static void describe_add(fs_query *q, describe_state *ds, fs_rid rid, raptor_uri *uri)
 {
-    char *to = malloc(len+1);
-    char *outp = to;
-
-    for (const char *inp = from; *inp; inp++) {
-	if (*inp == '<') {
-            strcpy(outp, "&lt;");
-            outp += 4;
-        } else if (*inp == '>') {
-            strcpy(outp, "&gt;");
-            outp += 4;
-        } else if (*inp == '&') {
-            strcpy(outp, "&amp;");
-            outp += 5;
-        } else if (is_xml_restricted(*inp)) {
-            /* skip, these aren't legal in XML */
-        } else {
-            *outp++ = *inp;
-	}
+    if (g_hash_table_lookup(ds->subjects, &rid)) {
+        return;
     }
-
-    *outp++ = '\0';
-
-    return to;
+    fs_rid *key = malloc(sizeof(fs_rid));
+    *key = rid;
+    g_hash_table_insert(ds->subjects, key, describe_subject(q, rid, uri));
+    fs_rid_vector_append(ds->pending, rid);
 }
 
-/* must be called with rasqal_mutex held if multithreaded */
-
-static void describe_uri(fs_query *q, fs_rid rid, raptor_uri *uri)
+static void describe_triple(fs_query *q, describe_state *ds, raptor_term *subject,
+                            fs_rid p, fs_rid o)
 {
-    if (rid == FS_RID_NULL) {
-        if (uri) {
-            rid = fs_hash_uri((char *)raptor_uri_as_string(uri));
-        }
-    }
     raptor_statement st;
     raptor_statement_init(&st, q->qs->raptor_world);
     st.graph = NULL;
+    st.subject = subject;
+    st.predicate = slot_fill_from_rid(q, p);
+    st.object = slot_fill_from_rid(q, o);
+    raptor_serializer_serialize_statement(q->ser, &st);
+    raptor_free_term(st.predicate);
+    raptor_free_term(st.object);
+    if ((q->flags & FS_QUERY_DESCRIBE_CBD) && FS_IS_BNODE(o)) {
+        fs_rid_vector_append(ds->bnodes, o);
+    }
+}
+
+/* describes one subject with its own bind, as DESCRIBE did before
+ * batching */
+static void describe_one(fs_query *q, describe_state *ds, fs_rid rid, fs_rid_vector *gs)
+{
     fs_rid_vector *es = fs_rid_vector_new(0);
     fs_rid_vector *ss = fs_rid_vector_new_from_args(1, rid);
-    fs_rid_vector *gs = es;
-    if (q->default_graphs) {
-        gs = q->default_graphs;
-    }
     fs_rid_vector **result = NULL;
     fsp_bind_limit(q->link, FS_RID_SEGMENT(rid, q->segments),
         FS_BIND_BY_SUBJECT | FS_BIND_PREDICATE | FS_BIND_OBJECT, gs, ss,
         es, es, &result, 0, q->soft_limit);
     fs_rid_vector_free(es);
     fs_rid_vector_free(ss);
-    raptor_term *subject;
-    if (FS_IS_BNODE(rid)) {
-        if (uri) {
-            subject = raptor_new_term_from_blank(q->qs->raptor_world,
-                raptor_uri_as_string(uri));
-        } else {
-            char tmp[256];
-            if (FS_SKOLEMIZE)
-                sprintf(tmp,"%s%llx", fs_global_skolem_prefix, FS_BNODE_NUM(rid));
-            else
-                sprintf(tmp, "b%016llx", rid);
-            subject = raptor_new_term_from_blank(q->qs->raptor_world, (unsigned char *)tmp);
-        }
-    } else {
-        subject = raptor_new_term_from_uri(q->qs->raptor_world, uri);
+    if (!result) {
+        return;
     }
+
+    raptor_term *subject = g_hash_table_lookup(ds->subjects, &rid);
     for (int row = 0; row < result[0]->length; row++) {
-        st.subject = subject;
-        st.predicate = slot_fill_from_rid(q, result[0]->data[row]);
-        st.object = slot_fill_from_rid(q, result[1]->data[row]);
-        raptor_serializer_serialize_statement(q->ser, &st);
-        raptor_free_term(st.predicate);
-        raptor_free_term(st.object);
-    }
-    raptor_free_term(subject);
-    for (int col=0; col<2; col++) {
-        fs_rid_vector_free(result[col]);
+        describe_triple(q, ds, subject, result[0]->data[row], result[1]->data[row]);
     }
+    fs_rid_vector_free(result[0]);
+    fs_rid_vector_free(result[1]);
     free(result);
 }
 
-static void handle_describe(fs_query *q, const char *type, FILE *output)
+/* fetches the triples of up to DESCRIBE_BATCH pending subjects with one bind
+ * across the segments, resolves their predicates and objects in bulk and
+ * serialises them */
+static void describe_batch(fs_query *q, describe_state *ds, fs_rid_vector *subjects)
 {
-    g_static_mutex_lock(&rasqal_mutex);
-    q->ser = raptor_new_serializer(q->qs->raptor_world, type);
-    if (!q->ser) {
-        fs_error(LOG_ERR, "no such serialiser '%s'", type);
-        g_static_mutex_unlock(&rasqal_mutex);
-
+    fs_rid_vector *es = fs_rid_vector_new(0);
+    fs_rid_vector *gs = q->default_graphs ? q->default_graphs : es;
+    /* the soft limit is per described resource, a segment gets enough for
+     * all of them, but one with many triples can still crowd out others */
+    const int per = q->soft_limit;
+    long long limit = per > 0 ? (long long)per * subjects->length : -1;
+    if (limit > INT_MAX) limit = INT_MAX;
+
+    const int hits_before = fsp_hit_limits(q->link);
+    fs_rid_vector **result = NULL;
+    fsp_bind_limit_many(q->link, FS_BIND_BY_SUBJECT | FS_BIND_SUBJECT |
+        FS_BIND_PREDICATE | FS_BIND_OBJECT, gs, subjects, es, es, &result,
+        0, limit);
+    /* the batch limit isn't the user's, hits are counted per subject below */
+    fsp_hit_limits_add(q->link, hits_before - fsp_hit_limits(q->link));
+    if (!result) {
+        fs_rid_vector_free(es);
         return;
     }
-    for (int i=0; 1; i++) {
-        rasqal_prefix *p = rasqal_query_get_prefix(q->rq, i);
-        if (!p) break;
-        raptor_serializer_set_namespace(q->ser, p->uri, p->prefix);
+
+    GHashTable *counts = g_hash_table_new(fs_rid_hash, fs_rid_equal);
+    int seg_rows[q->segments];
+    for (int s=0; s<q->segments; s++) {
+        seg_rows[s] = 0;
+    }
+    for (int row = 0; row < result[0]->length; row++) {
+        fs_rid *s = result[0]->data + row;
+        const int n = GPOINTER_TO_INT(g_hash_table_lookup(counts, s));
+        g_hash_table_insert(counts, s, GINT_TO_POINTER(n + 1));
+        seg_rows[FS_RID_SEGMENT(*s, q->segments)]++;
+    }
+
+    /* subjects in a segment that filled the batch limit may be missing
+     * triples, unless they already have as many as they're allowed */
+    fs_rid_set *again = fs_rid_set_new();
+    for (int i=0; i<subjects->length; i++) {
+        fs_rid s = subjects->data[i];
+        const int n = GPOINTER_TO_INT(g_hash_table_lookup(counts, &s));
+        if (per > 0 && n >= per) {
+            fsp_hit_limits_add(q->link, 1);
+        } else if (limit > 0 && seg_rows[FS_RID_SEGMENT(s, q->segments)] >= limit) {
+            fs_rid_set_add(again, s);
+        }
+    }
+
+    fs_rid_vector *rv[q->segments];
+    for (int s=0; s<q->segments; s++) {
+        rv[s] = fs_rid_vector_new(0);
+    }
+    for (int row = 0; row < result[0]->length; row++) {
+        for (int col=1; col<3; col++) {
+            fs_rid rid = result[col]->data[row];
+            if (FS_IS_BNODE(rid) || rid == FS_RID_NULL || cache_has(rid)) continue;
+            fs_rid_vector_append(rv[FS_RID_SEGMENT(rid, q->segments)], rid);
+        }
+    }
+    resolve_precache_all(q->link, rv, q->segments);
+    for (int s=0; s<q->segments; s++) {
+        fs_rid_vector_free(rv[s]);
+    }
+
+    /* now counts how many of each subject's triples have been written */
+    g_hash_table_remove_all(counts);
+    for (int row = 0; row < result[0]->length; row++) {
+        fs_rid *s = result[0]->data + row;
+        raptor_term *subject = g_hash_table_lookup(ds->subjects, s);
+        if (!subject || fs_rid_set_contains(again, *s)) continue;
+        const int n = GPOINTER_TO_INT(g_hash_table_lookup(counts, s));
+        if (per > 0 && n >= per) continue;
+        g_hash_table_insert(counts, s, GINT_TO_POINTER(n + 1));
+        describe_triple(q, ds, subject, result[1]->data[row], result[2]->data[row]);
+    }
+    for (int i=0; i<subjects->length; i++) {
+        if (fs_rid_set_contains(again, subjects->data[i])) {
+            describe_one(q, ds, subjects->data[i], gs);
+        }
+    }
+
+    fs_rid_set_free(again);
+    g_hash_table_destroy(counts);
+    fs_rid_vector_free(es);
+    for (int col=0; col<3; col++) {
+        fs_rid_vector_free(result[col]);
+    }
+    free(result);
+}
+
+static void describe_flush(fs_query *q, describe_state *ds)
+{
+    for (int start = 0; start < ds->pending->length; start += DESCRIBE_BATCH) {
+        int count = ds->pending->length - start;
+        if (count > DESCRIBE_BATCH) count = DESCRIBE_BATCH;
+        fs_rid_vector *batch = fs_rid_vector_new(count);
+        memcpy(batch->data, ds->pending->data + start, count * sizeof(fs_rid));
+        describe_batch(q, ds, batch);
+        fs_rid_vector_free(batch);
+    }
+    fs_rid_vector_clear(ds->pending);
+}
+
+/* must be called with rasqal_mutex held if multithreaded */
+
+static void handle_describe(fs_query *q, const char *type, FILE *output)
+{
+    g_static_mutex_lock(&rasqal_mutex);
+    q->ser = raptor_new_serializer(q->qs->raptor_world, type);
+    if (!q->ser) {
+        fs_error(LOG_ERR, "no such serialiser '%s'", type);
+        g_static_mutex_unlock(&rasqal_mutex);
+
+        return;
+    }
+    for (int i=0; 1; i++) {
+        rasqal_prefix *p = rasqal_query_get_prefix(q->rq, i);
+        if (!p) break;
+        raptor_serializer_set_namespace(q->ser, p->uri, p->prefix);
     }
     raptor_serializer_start_to_file_handle(q->ser, q->base, output);
 
+    describe_state ds;
+    ds.subjects = g_hash_table_new_full(fs_rid_hash, fs_rid_equal, free,
+                                        (GDestroyNotify)raptor_free_term);
+    ds.pending = fs_rid_vector_new(0);
+    ds.bnodes = fs_rid_vector_new(0);
+
     fs_p_vector *vars = fs_p_vector_new(0);
     raptor_sequence *desc = rasqal_query_get_describe_sequence(q->rq);
     for (int i=0; 1; i++) {
         rasqal_literal *l = raptor_sequence_get_at(desc, i);
         if (!l) break;
         if (l->type == RASQAL_LITERAL_URI) {
-            describe_uri(q, FS_RID_NULL, l->value.uri);
+            fs_rid rid = fs_hash_uri((char *)raptor_uri_as_string(l->value.uri));
+            describe_add(q, &ds, rid, l->value.uri);
         } else if (l->type == RASQAL_LITERAL_VARIABLE) {
             fs_p_vector_append(vars, l);
         }
     }
 
     fs_row *row;
-    fs_rid_set *described_uris = fs_rid_set_new();
+    fs_rid_set *seen = fs_rid_set_new();
     while ((row = fs_query_fetch_row(q))) {
         for (int i=0; i<vars->length; i++) {
-            if (!fs_rid_set_contains(described_uris, row[i].rid)) {
+            if (!fs_rid_set_contains(seen, row[i].rid)) {
                 raptor_term *dterm = slot_fill(q, vars->data[i], row);
                 /* can only describe URIs or bNodes */
                 if (dterm->type == RAPTOR_TERM_TYPE_URI) {
-                    describe_uri(q, row[i].rid, dterm->value.uri);
+                    describe_add(q, &ds, row[i].rid, dterm->value.uri);
                 } else if (dterm->type == RAPTOR_TERM_TYPE_BLANK) {
-                    describe_uri(q, row[i].rid, NULL);
+                    describe_add(q, &ds, row[i].rid, NULL);
                 }
-                fs_rid_set_add(described_uris, row[i].rid);
+                fs_rid_set_add(seen, row[i].rid);
                 raptor_free_term(dterm);
             }
         }
+        if (ds.pending->length >= DESCRIBE_BATCH) {
+            describe_flush(q, &ds);
+        }
     }
-    fs_rid_set_free(described_uris);
+    fs_rid_set_free(seen);
+    describe_flush(q, &ds);
+
+    /* the concise bounded description also describes blank node objects,
+     * a step further each round */
+    for (int depth = 0; (q->flags & FS_QUERY_DESCRIBE_CBD) &&
+                        depth < FS_DESCRIBE_CBD_DEPTH && ds.bnodes->length; depth++) {
+        fs_rid_vector *bnodes = ds.bnodes;
+        ds.bnodes = fs_rid_vector_new(0);
+        for (int i=0; i<bnodes->length; i++) {
+            describe_add(q, &ds, bnodes->data[i], NULL);
+        }
+        fs_rid_vector_free(bnodes);
+        describe_flush(q, &ds);
+    }
+
+    g_hash_table_destroy(ds.subjects);
+    fs_rid_vector_free(ds.pending);
+    fs_rid_vector_free(ds.bnodes);
     raptor_serializer_serialize_end(q->ser);
     raptor_free_serializer(q->ser);
     g_static_mutex_unlock(&rasqal_mutex);
     fs_p_vector_free(vars);
 }
 
+/* native N-Triples output for CONSTRUCT, rows are copied into chunks which
+ * are formatted by a few worker threads and written in order, without
+ * raptor terms or the serialiser lock */
+
+#define NT_CHUNK_ROWS 1024
+#define NT_WORKERS 4
+
+/* a CONSTRUCT template slot, a result column or a constant */
+typedef struct {
+    int col;            /* -1 for constants */
+    const char *var;
+    char *nt;           /* constant in N-Triples syntax, NULL if invalid here */
+    char *bnode;        /* template bNode label, made unique per row */
+} nt_slot;
+
+typedef struct {
+    fs_rid rid;
+    const char *lex;
+    const char *dt;
+    const char *lang;
+} nt_cell;
+
+typedef struct {
+    int rows;
+    int cols;
+    int *rownum;
+    nt_cell *cells;
+    GStringChunk *strings;
+} nt_chunk;
+
+typedef struct {
+    GThread *thread;
+    GMutex *mutex;
+    GCond *cond;
+    int busy;
+    int quit;
+    nt_chunk chunk;
+    GString *out;
+    const nt_slot *template;
+    int triples;
+} nt_worker;
+
+static void nt_escape(GString *out, const char *str, char delim)
+{
+    const unsigned char *p = (const unsigned char *)str;
+
+    while (*p) {
+        const unsigned char c = *p;
+        if (c == delim || c == '\\') {
+            g_string_append_c(out, '\\');
+            g_string_append_c(out, c);
+            p++;
+        } else if (c == '\n') {
+            g_string_append(out, "\\n");
+            p++;
+        } else if (c == '\r') {
+            g_string_append(out, "\\r");
+            p++;
+        } else if (c == '\t') {
+            g_string_append(out, "\\t");
+            p++;
+        } else if (c < 0x20 || c == 0x7f) {
+            g_string_append_printf(out, "\\u%04X", c);
+            p++;
+        } else if (c < 0x80) {
+            g_string_append_c(out, c);
+            p++;
+        } else {
+            /* N-Triples is ASCII, other characters are escaped */
+            int len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+            unsigned int uc = len == 4 ? c & 0x07 : len == 3 ? c & 0x0f : c & 0x1f;
+            int i;
+            for (i=1; i<len && (p[i] & 0xc0) == 0x80; i++) {
+                uc = (uc << 6) | (p[i] & 0x3f);
+            }
+            if (len == 1 || i < len) {
+                /* not valid UTF-8 */
+                uc = 0xfffd;
+                len = i;
+            }
+            if (uc > 0xffff) {
+                g_string_append_printf(out, "\\U%08X", uc);
+            } else {
+                g_string_append_printf(out, "\\u%04X", uc);
+            }
+            p += len;
+        }
+    }
+}
+
+static void nt_uri(GString *out, const char *uri)
+{
+    g_string_append_c(out, '<');
+    nt_escape(out, uri, '>');
+    g_string_append_c(out, '>');
+}
+
+static void nt_literal(GString *out, const char *lex, const char *dt, const char *lang)
+{
+    g_string_append_c(out, '"');
+    nt_escape(out, lex, '"');
+    g_string_append_c(out, '"');
+    if (dt) {
+        g_string_append(out, "^^");
+        nt_uri(out, dt);
+    } else if (lang) {
+        g_string_append_c(out, '@');
+        g_string_append(out, lang);
+    }
+}
+
+/* pos is 0, 1, 2 for subject, predicate, object */
+static void nt_slot_init(nt_slot *slot, rasqal_literal *l, int pos)
+{
+    GString *nt = g_string_new("");
+    const char *dt = NULL;
+    int valid = 1;
+
+    slot->col = -1;
+    slot->var = NULL;
+    slot->bnode = NULL;
+    switch (l->type) {
+    case RASQAL_LITERAL_VARIABLE:
+        slot->var = (const char *)l->value.variable->name;
+        break;
+    case RASQAL_LITERAL_URI:
+        nt_uri(nt, (const char *)raptor_uri_as_string(l->value.uri));
+        break;
+    case RASQAL_LITERAL_BLANK:
+        slot->bnode = g_strdup((const char *)l->string);
+        break;
+    case RASQAL_LITERAL_INTEGER:
+    case RASQAL_LITERAL_INTEGER_SUBTYPE:
+        dt = XSD_INTEGER;
+        break;
+    case RASQAL_LITERAL_DECIMAL:
+        dt = XSD_DECIMAL;
+        break;
+    case RASQAL_LITERAL_DOUBLE:
+    case RASQAL_LITERAL_FLOAT:
+        dt = XSD_DOUBLE;
+        break;
+    case RASQAL_LITERAL_DATETIME:
+        dt = XSD_DATETIME;
+        break;
+#if RASQAL_VERSION >= 929
+    case RASQAL_LITERAL_DATE:
+        dt = XSD_DATE;
+        break;
+#endif
+    case RASQAL_LITERAL_XSD_STRING:
+    case RASQAL_LITERAL_UDT:
+    case RASQAL_LITERAL_STRING:
+    case RASQAL_LITERAL_BOOLEAN:
+        break;
+    default:
+        fs_error(LOG_CRIT, "fell through result handler");
+        valid = 0;
+        break;
+    }
+    if (slot->var || slot->bnode) {
+        valid = 0;
+    } else if (l->type != RASQAL_LITERAL_URI) {
+        /* literals can only be objects */
+        nt_literal(nt, (const char *)l->string, dt, NULL);
+        valid = valid && pos == 2;
+    }
+    slot->nt = g_string_free(nt, !valid);
+}
+
+/* appends the term for slot in row to out, returns false if the triple
+ * shouldn't be output */
+static int nt_slot_write(GString *out, const nt_slot *slot, const nt_chunk *chunk,
+                         int row, int pos)
+{
+    if (slot->col == -1) {
+        if (slot->bnode) {
+            if (pos == 1) return 0;
+            g_string_append_printf(out, "_:%s_%d", slot->bnode, chunk->rownum[row]);
+
+            return 1;
+        }
+        if (!slot->nt) return 0;
+        g_string_append(out, slot->nt);
+
+        return 1;
+    }
+
+    const nt_cell *c = &chunk->cells[row * chunk->cols + slot->col];
+    if (c->rid == FS_RID_NULL || !c->lex) {
+        /* unbound */
+        return 0;
+    }
+    if (FS_IS_BNODE(c->rid)) {
+        if (pos == 1) return 0;
+        if (FS_SKOLEMIZE) {
+            nt_uri(out, c->lex+2);
+        } else {
+            g_string_append(out, "_:");
+            g_string_append(out, c->lex+2);
+        }
+    } else if (FS_IS_URI(c->rid)) {
+        nt_uri(out, c->lex);
+    } else {
+        if (pos != 2) return 0;
+        nt_literal(out, c->lex, c->dt, c->lang);
+    }
+
+    return 1;
+}
+
+static void nt_format(nt_worker *w)
+{
+    nt_chunk *chunk = &w->chunk;
+
+    for (int row=0; row<chunk->rows; row++) {
+        for (int t=0; t<w->triples; t++) {
+            const gsize start = w->out->len;
+            int ok = 1;
+            for (int pos=0; pos<3 && ok; pos++) {
+                ok = nt_slot_write(w->out, &w->template[t*3+pos], chunk, row, pos);
+                g_string_append_c(w->out, pos < 2 ? ' ' : '.');
+            }
+            if (ok) {
+                g_string_append_c(w->out, '\n');
+            } else {
+                g_string_truncate(w->out, start);
+            }
+        }
+    }
+}
+
+static gpointer nt_worker_thread(gpointer data)
+{
+    nt_worker *w = data;
+
+    g_mutex_lock(w->mutex);
+    while (1) {
+        while (!w->busy && !w->quit) {
+            g_cond_wait(w->cond, w->mutex);
+        }
+        if (w->quit) break;
+        g_mutex_unlock(w->mutex);
+
+        nt_format(w);
+
+        g_mutex_lock(w->mutex);
+        w->busy = 0;
+        g_cond_broadcast(w->cond);
+    }
+    g_mutex_unlock(w->mutex);
+
+    return NULL;
+}
+
+/* waits for the worker to finish its chunk, writes its output and readies
+ * the chunk to be filled again */
+static void nt_worker_collect(nt_worker *w, FILE *output)
+{
+    if (w->thread) {
+        g_mutex_lock(w->mutex);
+        while (w->busy) {
+            g_cond_wait(w->cond, w->mutex);
+        }
+        g_mutex_unlock(w->mutex);
+    }
+    if (w->out->len) {
+        fwrite(w->out->str, 1, w->out->len, output);
+        g_string_truncate(w->out, 0);
+    }
+    w->chunk.rows = 0;
+    if (w->chunk.strings) g_string_chunk_free(w->chunk.strings);
+    w->chunk.strings = g_string_chunk_new(4096);
+}
+
+static void nt_worker_post(nt_worker *w)
+{
+    if (!w->mutex) {
+        w->mutex = g_mutex_new();
+        w->cond = g_cond_new();
+        w->thread = g_thread_create(nt_worker_thread, w, TRUE, NULL);
+    }
+    if (!w->thread) {
+        /* format it ourselves */
+        nt_format(w);
+
+        return;
+    }
+    g_mutex_lock(w->mutex);
+    w->busy = 1;
+    g_cond_signal(w->cond);
+    g_mutex_unlock(w->mutex);
+}
+
+static const char *nt_strdup(nt_chunk *chunk, const char *str)
+{
+    return str ? g_string_chunk_insert(chunk->strings, str) : NULL;
+}
+
+/* finds the columns of the template variables, returns the number of
+ * columns needed from each row */
+static int nt_template_bind(nt_slot *template, int slots, fs_row *row)
+{
+    int ncols = 0;
+
+    for (int i=0; i<slots; i++) {
+        if (!template[i].var) continue;
+        for (int col=0; row && row[col].name; col++) {
+            if (!strcmp(template[i].var, row[col].name)) {
+                template[i].col = col;
+                if (col >= ncols) ncols = col + 1;
+                break;
+            }
+        }
+        if (template[i].col == -1) {
+            fs_error(LOG_CRIT, "cannot find column in binding table");
+        }
+    }
+
+    return ncols;
+}
+
+static void nt_chunk_add(nt_chunk *chunk, fs_row *row, int rownum)
+{
+    const int r = chunk->rows++;
+
+    chunk->rownum[r] = rownum;
+    for (int col=0; row && col<chunk->cols; col++) {
+        nt_cell *c = &chunk->cells[r * chunk->cols + col];
+        c->rid = row[col].rid;
+        c->lex = nt_strdup(chunk, row[col].lex);
+        c->dt = nt_strdup(chunk, row[col].dt);
+        c->lang = nt_strdup(chunk, row[col].lang);
+    }
+}
+
+static void construct_ntriples(fs_query *q, FILE *output)
+{
+    int triples = 0;
+    while (rasqal_query_get_construct_triple(q->rq, triples)) triples++;
+
+    nt_slot *template = calloc(triples * 3 + 1, sizeof(nt_slot));
+    for (int t=0; t<triples; t++) {
+        rasqal_triple *trip = rasqal_query_get_construct_triple(q->rq, t);
+        nt_slot_init(&template[t*3], trip->subject, 0);
+        nt_slot_init(&template[t*3+1], trip->predicate, 1);
+        nt_slot_init(&template[t*3+2], trip->object, 2);
+    }
+
+    nt_worker workers[NT_WORKERS];
+    memset(workers, 0, sizeof(workers));
+    for (int i=0; i<NT_WORKERS; i++) {
+        workers[i].out = g_string_sized_new(65536);
+        workers[i].template = template;
+        workers[i].triples = triples;
+        workers[i].chunk.rownum = malloc(NT_CHUNK_ROWS * sizeof(int));
+        workers[i].chunk.strings = g_string_chunk_new(4096);
+    }
+
+    const int cols = fs_query_get_columns(q);
+    int current = 0;
+    int bound = 0;
+    int posted = 0;
+    fs_row *row;
+    while (1) {
+        row = fs_query_fetch_row(q);
+        if (!row) {
+            /* if were CONSTRUCTing a constant expression, and the query is
+             * true, the template is output once */
+            if (cols != 0 || !q->boolean || bound) break;
+        }
+        if (!bound) {
+            const int ncols = nt_template_bind(template, triples * 3, row);
+            for (int i=0; i<NT_WORKERS; i++) {
+                workers[i].chunk.cols = ncols;
+                workers[i].chunk.cells = calloc(NT_CHUNK_ROWS * ncols + 1,
+                                                sizeof(nt_cell));
+            }
+            bound = 1;
+        }
+        if (workers[current].chunk.rows == NT_CHUNK_ROWS) {
+            /* hand the chunk to its worker and take the oldest one back */
+            nt_worker_post(&workers[current]);
+            posted = 1;
+            current = (current + 1) % NT_WORKERS;
+            nt_worker_collect(&workers[current], output);
+        }
+        nt_chunk_add(&workers[current].chunk, row, q->row);
+        if (!row) break;
+    }
+    if (workers[current].chunk.rows) {
+        if (posted) {
+            nt_worker_post(&workers[current]);
+        } else {
+            /* everything fitted in one chunk, no need for threads */
+            nt_format(&workers[current]);
+        }
+    }
+
+    /* write the rest in order, starting with the oldest */
+    for (int i=1; i<=NT_WORKERS; i++) {
+        nt_worker_collect(&workers[(current + i) % NT_WORKERS], output);
+    }
+
+    for (int i=0; i<NT_WORKERS; i++) {
+        nt_worker *w = &workers[i];
+        if (w->thread) {
+            g_mutex_lock(w->mutex);
+            w->quit = 1;
+            g_cond_signal(w->cond);
+            g_mutex_unlock(w->mutex);
+            g_thread_join(w->thread);
+        }
+        if (w->mutex) {
+            g_cond_free(w->cond);
+            g_mutex_free(w->mutex);
+        }
+        g_string_free(w->out, TRUE);
+        g_string_chunk_free(w->chunk.strings);
+        free(w->chunk.rownum);
+        free(w->chunk.cells);
+    }
+    for (int i=0; i<triples*3; i++) {
+        g_free(template[i].nt);
+        g_free(template[i].bnode);
+    }
+    free(template);
+}
+
 static void handle_construct(fs_query *q, const char *type, FILE *output)
 {
+    if (!strcmp(type, "ntriples") &&
+        !(q->flags & FS_RESULT_FLAG_CONSTRUCT_AS_INSERT)) {
+        construct_ntriples(q, output);
+
+        return;
+    }
+
     const int cols = fs_query_get_columns(q);
     fs_row *row;
     fs_rid quad[4] = { FS_RID_NULL, FS_RID_NULL, FS_RID_NULL,
@@ -1917,26 +2561,24 @@ static void output_sparql(fs_query *q, int flags, FILE *out)
         handle_describe(q, "rdfxml", out);
     } else {
 	/* XML output */
+        res_writer *w = res_writer_new(out);
 
-	fprintf(out, "<?xml version=\"1.0\"?>\n"
+	rw_puts(w, "<?xml version=\"1.0\"?>\n"
 		"<sparql xmlns=\"http://www.w3.org/2005/sparql-results#\">\n");
 	row = fs_query_fetch_header_row(q);
-	fprintf(out, "  <head>\n");
+	rw_puts(w, "  <head>\n");
 	for (int c=0; c<cols; c++) {
-	    fprintf(out, "    <variable name=\"%s\"/>\n", row[c].name);
+	    rw_puts(w, "    <variable name=\"");
+	    rw_puts(w, row[c].name);
+	    rw_puts(w, "\"/>\n");
 	}
-	fprintf(out, "  </head>\n");
+	rw_puts(w, "  </head>\n");
         if (q->warnings) {
             GSList *it;
             for (it = q->warnings; it; it = it->next) {
-                int esc_len;
-		if (xml_needs_escape(it->data, &esc_len)) {
-		    char *lex = xml_escape(it->data, esc_len);
-                    fprintf(out, "<!-- %s -->\n", lex);
-                    free(lex);
-                } else {
-                    fprintf(out, "<!-- %s -->\n", (char *)it->data);
-                }
+                rw_puts(w, "<!-- ");
+                rw_escape(w, ESC_XML, it->data);
+                rw_puts(w, " -->\n");
             }
             g_slist_free(q->warnings);
             q->warnings = NULL;
@@ -1944,52 +2586,52 @@ static void output_sparql(fs_query *q, int flags, FILE *out)
         if (q->ask) {
             while (q->boolean && fs_query_fetch_row(q));
             if (q->boolean) {
-                fprintf(out, "  <boolean>true</boolean>\n");
+                rw_puts(w, "  <boolean>true</boolean>\n");
             } else {
-                fprintf(out, "  <boolean>false</boolean>\n");
+                rw_puts(w, "  <boolean>false</boolean>\n");
             }
         } else {
-            fprintf(out, "  <results>\n");
+            rw_puts(w, "  <results>\n");
             while ((!row || !row->stop) && (row = fs_query_fetch_row(q))) {
-                fprintf(out, "    <result>\n");
+                rw_puts(w, "    <result>\n");
                 for (int c=0; c<cols; c++) {
-                    int esc_len;
-                    char *lex;
-                    int need_free = 0;
-                    if (xml_needs_escape(row[c].lex, &esc_len)) {
-                        lex = xml_escape(row[c].lex, esc_len);
-                        need_free = 1;
-                    } else {
-                        lex = (char *)row[c].lex;
-                    }
                     if (row[c].type == FS_TYPE_NONE) continue;
-                    fprintf(out, "      <binding name=\"%s\">", row[c].name);
+                    rw_puts(w, "      <binding name=\"");
+                    rw_puts(w, row[c].name);
+                    rw_puts(w, "\">");
                     switch (row[c].type) {
                         case FS_TYPE_NONE:
                             break;
                         case FS_TYPE_URI:
-                            fprintf(out, "<uri>%s</uri>", lex);
+                            rw_puts(w, "<uri>");
+                            rw_escape(w, ESC_XML, row[c].lex);
+                            rw_puts(w, "</uri>");
                             break;
                         case FS_TYPE_LITERAL:
                             if (row[c].lang) {
-                                fprintf(out, "<literal xml:lang=\"%s\">%s</literal>", row[c].lang, lex);
+                                rw_puts(w, "<literal xml:lang=\"");
+                                rw_puts(w, row[c].lang);
+                                rw_puts(w, "\">");
                             } else if (row[c].dt) {
-                                fprintf(out, "<literal datatype=\"%s\">%s</literal>", row[c].dt, lex);
+                                rw_puts(w, "<literal datatype=\"");
+                                rw_puts(w, row[c].dt);
+                                rw_puts(w, "\">");
                             } else {
-                                fprintf(out, "<literal>%s</literal>", lex);
+                                rw_puts(w, "<literal>");
                             }
+                            rw_escape(w, ESC_XML, row[c].lex);
+                            rw_puts(w, "</literal>");
                             break;
                         case FS_TYPE_BNODE:
-                            fprintf(out, "<bnode>%s</bnode>", lex+2);
-                    }
-                    fprintf(out, "</binding>\n");
-                    if (need_free) {
-                        free(lex);
+                            rw_puts(w, "<bnode>");
+                            rw_escape(w, ESC_XML, row[c].lex+2);
+                            rw_puts(w, "</bnode>");
                     }
+                    rw_puts(w, "</binding>\n");
                 }
-                fprintf(out, "    </result>\n");
+                rw_puts(w, "    </result>\n");
             }
-            fprintf(out, "  </results>\n");
+            rw_puts(w, "  </results>\n");
         }
         if (q->warnings) {
             GSList *it;
@@ -1997,18 +2639,33 @@ static void output_sparql(fs_query *q, int flags, FILE *out)
             for (it = q->warnings; it; it = it->next) {
                 if (it->data == last) continue;
                 last = it->data;
-                int esc_len;
-                if (xml_needs_escape(it->data, &esc_len)) {
-                    char *lex = xml_escape(it->data, esc_len);
-                    fprintf(out, "<!-- warning: %s -->\n", lex);
-                    free(lex);
-                } else {
-                    fprintf(out, "<!-- warning: %s -->\n", (char *)it->data);
-                }
+                rw_puts(w, "<!-- warning: ");
+                rw_escape(w, ESC_XML, it->data);
+                rw_puts(w, " -->\n");
             }
         }
-        fprintf(out, "</sparql>\n");
+        rw_puts(w, "</sparql>\n");
+        res_writer_free(w);
+    }
+}
+
+/* writes warnings as comments, and frees them */
+static void rw_warning_comments(res_writer *w, fs_query *q, const char *eol)
+{
+    if (!q->warnings) return;
+
+    GSList *it;
+    for (it = q->warnings; it; it = it->next) {
+        if (it->data) {
+            rw_puts(w, "# ");
+            rw_puts(w, it->data);
+            rw_puts(w, eol);
+        } else {
+            fs_error(LOG_ERR, "found NULL warning");
+        }
     }
+    g_slist_free(q->warnings);
+    q->warnings = NULL;
 }
 
 static void output_text(fs_query *q, int flags, FILE *out)
@@ -2041,103 +2698,81 @@ static void output_text(fs_query *q, int flags, FILE *out)
     }
 
     fs_row *row=NULL;
+    res_writer *w = res_writer_new(out);
 
     int cols = fs_query_get_columns(q);
     if (!q->construct) {
 	row = fs_query_fetch_header_row(q);
 	for (int i=0; i<cols; i++) {
-	    if (i) fputc('\t', out);
-	    fprintf(out, "?%s", row[i].name);
+	    if (i) rw_putc(w, '\t');
+	    rw_putc(w, '?');
+	    rw_puts(w, row[i].name);
 	}
-	fprintf(out, "\n");
+	rw_putc(w, '\n');
     }
 
-    if (q->warnings) {
-        GSList *it;
-        for (it = q->warnings; it; it = it->next) {
-            if (it->data) {
-                fprintf(out, "# %s\n", (char *)it->data);
-            } else {
-                fs_error(LOG_ERR, "found NULL warning");
-            }
-        }
-        g_slist_free(q->warnings);
-        q->warnings = NULL;
-    }
+    rw_warning_comments(w, q, "\n");
 
     if (q->construct) {
+        res_writer_flush(w);
         handle_construct(q, "ntriples", out);
     } else {
 	while ((!row || !row->stop) && (row = fs_query_fetch_row(q))) {
 	    for (int c=0; c<cols; c++) {
-		int esclen = 0;
-		char *escd = NULL;
 		const char *lex = row[c].lex;
-		if (c) fputc('\t', out);
+		if (c) rw_putc(w, '\t');
 		switch (row[c].type) {
 		    case FS_TYPE_NONE:
-			//fprintf(out, "NULL");
 			break;
 		    case FS_TYPE_URI:
-                        if (uri_needs_escape(row[c].lex, &esclen)) {
-                            escd = uri_escape(row[c].lex, esclen);
-                            lex = escd;
-                        }
-			fprintf(out, "<%s>", lex);
-                        if (escd) free(escd);
+			rw_putc(w, '<');
+			rw_escape(w, ESC_URI, lex);
+			rw_putc(w, '>');
 			break;
 		    case FS_TYPE_LITERAL:
-                        if (tsv_needs_escape(row[c].lex, &esclen)) {
-                            escd = tsv_escape(row[c].lex, esclen);
-                            lex = escd;
-                        }
                         if (row[c].lang) {
-			    fprintf(out, "\"%s\"@%s", lex, row[c].lang);
+			    rw_putc(w, '"');
+			    rw_escape(w, ESC_TSV, lex);
+			    rw_puts(w, "\"@");
+			    rw_puts(w, row[c].lang);
                         } else if (row[c].dt) {
                             if (!strcmp(row[c].dt, XSD_INTEGER)) {
-                                fprintf(out, "%s", lex);
+                                rw_escape(w, ESC_TSV, lex);
                             } else if (!strcmp(row[c].dt, XSD_DECIMAL)) {
-                                if (strchr(lex, '.')) {
-                                    fprintf(out, "%s", lex);
-                                } else {
-                                    fprintf(out, "%s.0", lex);
+                                rw_escape(w, ESC_TSV, lex);
+                                if (!strchr(lex, '.')) {
+                                    rw_puts(w, ".0");
                                 }
                             } else if (!strcmp(row[c].dt, XSD_DOUBLE)) {
-                                if (*lex && (strchr(lex, 'e') ||
+                                rw_escape(w, ESC_TSV, lex);
+                                if (!*lex || !(strchr(lex, 'e') ||
                                     !strcmp(lex, "-inf") ||
                                     !strcmp(lex, "inf"))) {
-                                    fprintf(out, "%s", lex);
-                                } else {
-                                    fprintf(out, "%se0", lex);
+                                    rw_puts(w, "e0");
                                 }
                             } else {
-                                fprintf(out, "\"%s\"^^<%s>", lex, row[c].dt);
+                                rw_putc(w, '"');
+                                rw_escape(w, ESC_TSV, lex);
+                                rw_puts(w, "\"^^<");
+                                rw_puts(w, row[c].dt);
+                                rw_putc(w, '>');
                             }
                         } else {
-			    fprintf(out, "\"%s\"", lex);
+			    rw_putc(w, '"');
+			    rw_escape(w, ESC_TSV, lex);
+			    rw_putc(w, '"');
                         }
-                        if (escd) free(escd);
 			break;
 		    case FS_TYPE_BNODE:
-			fprintf(out, "%s", row[c].lex);
+			rw_puts(w, lex);
 		}
 	    }
-	    fprintf(out, "\n");
+	    rw_putc(w, '\n');
 	}
     }
 
-    if (q->warnings) {
-        GSList *it;
-        for (it = q->warnings; it; it = it->next) {
-            if (it->data) {
-                fprintf(out, "# %s\n", (char *)it->data);
-            } else {
-                fs_error(LOG_ERR, "found NULL warning");
-            }
-        }
-        g_slist_free(q->warnings);
-        q->warnings = NULL;
-    }
+    rw_warning_comments(w, q, "\n");
+    res_writer_free(w);
 }
 
 static void output_csv(fs_query *q, int flags, FILE *out)
@@ -2170,79 +2805,46 @@ static void output_csv(fs_query *q, int flags, FILE *out)
     }
 
     fs_row *row=NULL;
+    res_writer *w = res_writer_new(out);
 
     int cols = fs_query_get_columns(q);
     if (!q->construct) {
 	row = fs_query_fetch_header_row(q);
 	for (int i=0; i<cols; i++) {
-	    if (i) fputc(',', out);
-	    fprintf(out, "%s", row[i].name);
+	    if (i) rw_putc(w, ',');
+	    rw_puts(w, row[i].name);
 	}
-	fprintf(out, "\r\n");
+	rw_puts(w, "\r\n");
     }
 
-    if (q->warnings) {
-        GSList *it;
-        for (it = q->warnings; it; it = it->next) {
-            if (it->data) {
-                fprintf(out, "# %s\r\n", (char *)it->data);
-            } else {
-                fs_error(LOG_ERR, "found NULL warning");
-            }
-        }
-        g_slist_free(q->warnings);
-        q->warnings = NULL;
-    }
+    rw_warning_comments(w, q, "\r\n");
 
     if (q->construct) {
+        res_writer_flush(w);
         handle_construct(q, "ntriples", out);
     } else {
 	while ((!row || !row->stop) && (row = fs_query_fetch_row(q))) {
 	    for (int c=0; c<cols; c++) {
-		int esclen = 0;
-		char *escd = NULL;
-		const char *lex = row[c].lex;
-		if (c) fputc(',', out);
+		if (c) rw_putc(w, ',');
 		switch (row[c].type) {
 		    case FS_TYPE_NONE:
-			//fprintf(out, "NULL");
 			break;
 		    case FS_TYPE_URI:
-                        if (csv_needs_escape(row[c].lex, &esclen)) {
-                            escd = uri_escape(row[c].lex, esclen);
-                            lex = escd;
-                        }
-			fprintf(out, "%s", lex);
-                        if (escd) free(escd);
+			rw_escape(w, ESC_CSV_URI, row[c].lex);
 			break;
 		    case FS_TYPE_LITERAL:
-                        if (csv_needs_escape(row[c].lex, &esclen)) {
-                            escd = csv_escape(row[c].lex, esclen);
-                            lex = escd;
-                        }
-                        fprintf(out, "%s", lex);
-                        if (escd) free(escd);
+			rw_escape(w, ESC_CSV, row[c].lex);
 			break;
 		    case FS_TYPE_BNODE:
-			fprintf(out, "%s", row[c].lex);
+			rw_puts(w, row[c].lex);
 		}
 	    }
-	    fprintf(out, "\r\n");
+	    rw_puts(w, "\r\n");
 	}
     }
 
-    if (q->warnings) {
-        GSList *it;
-        for (it = q->warnings; it; it = it->next) {
-            if (it->data) {
-                fprintf(out, "# %s\r\n", (char *)it->data);
-            } else {
-                fs_error(LOG_ERR, "found NULL warning");
-            }
-        }
-        g_slist_free(q->warnings);
-        q->warnings = NULL;
-    }
+    rw_warning_comments(w, q, "\r\n");
+    res_writer_free(w);
 }
 
 static void output_json(fs_query *q, int flags, FILE *out)
@@ -2290,108 +2892,306 @@ static void output_json(fs_query *q, int flags, FILE *out)
     }
 
     const int cols = fs_query_get_columns(q);
+    res_writer *w = res_writer_new(out);
 
     fs_row *row, *header;
     row = header = fs_query_fetch_header_row(q);
     if (q->json_function) {
-        fprintf(out, "%s(", q->json_function);
+        rw_puts(w, q->json_function);
+        rw_putc(w, '(');
     }
-    fprintf(out, "{\"head\":{\"vars\":[");
+    rw_puts(w, "{\"head\":{\"vars\":[");
     for (int i=0; i<cols; i++) {
-        if (i) fputs(",", out);
-        fprintf(out, "\"%s\"", header[i].name);
+        if (i) rw_putc(w, ',');
+        rw_putc(w, '"');
+        rw_puts(w, header[i].name);
+        rw_putc(w, '"');
     }
-    fprintf(out, "]},\n");
+    rw_puts(w, "]},\n");
 
     if (q->ask) {
         while (q->boolean && fs_query_fetch_row(q));
         if (q->boolean) {
-            fprintf(out, "\"boolean\": true");
+            rw_puts(w, "\"boolean\": true");
         } else {
-            fprintf(out, "\"boolean\": false");
+            rw_puts(w, "\"boolean\": false");
         }
     } else {
-        fprintf(out, " \"results\": {\n");
-        fprintf(out, "  \"bindings\":[");
+        rw_puts(w, " \"results\": {\n");
+        rw_puts(w, "  \"bindings\":[");
         int rownum = 0;
         while ((!row || !row->stop) && (row = fs_query_fetch_row(q))) {
             if (rownum++ > 0) {
-                fprintf(out, ",\n");
+                rw_puts(w, ",\n");
             } else {
-                fprintf(out, "\n");
+                rw_putc(w, '\n');
             }
-            fprintf(out, "   {");
+            rw_puts(w, "   {");
             for (int c=0; c<cols; c++) {
-                if (c) fputs(",\n    ", out);
-                fprintf(out, "\"%s\":{", header[c].name);
-                int esclen = 0;
-                char *escd = NULL;
-                const char *lex = row[c].lex;
+                if (c) rw_puts(w, ",\n    ");
+                rw_putc(w, '"');
+                rw_puts(w, header[c].name);
+                rw_puts(w, "\":{");
                 switch (row[c].type) {
                     case FS_TYPE_NONE:
                         break;
                     case FS_TYPE_URI:
-                        if (json_needs_escape(row[c].lex, &esclen)) {
-                            escd = json_escape(row[c].lex, esclen);
-                            lex = escd;
-                        }
-                        fprintf(out, "\"type\":\"uri\",\"value\":\"%s\"", lex);
-                        if (escd) free(escd);
+                        rw_puts(w, "\"type\":\"uri\",\"value\":\"");
+                        rw_escape(w, ESC_JSON, row[c].lex);
+                        rw_putc(w, '"');
                         break;
                     case FS_TYPE_LITERAL:
-                        if (json_needs_escape(row[c].lex, &esclen)) {
-                            escd = json_escape(row[c].lex, esclen);
-                            lex = escd;
-                        }
+                        rw_puts(w, "\"type\":\"literal\",\"value\":\"");
+                        rw_escape(w, ESC_JSON, row[c].lex);
                         if (row[c].lang) {
-                            fprintf(out, "\"type\":\"literal\",\"value\":\"%s\",\"xml:lang\":\"%s\"", lex, row[c].lang);
+                            rw_puts(w, "\",\"xml:lang\":\"");
+                            rw_puts(w, row[c].lang);
                         } else if (row[c].dt) {
-                            fprintf(out, "\"type\":\"literal\",\"value\":\"%s\",\"datatype\":\"%s\"", lex, row[c].dt);
-                        } else {
-                            fprintf(out, "\"type\":\"literal\",\"value\":\"%s\"", lex);
+                            rw_puts(w, "\",\"datatype\":\"");
+                            rw_puts(w, row[c].dt);
                         }
-                        if (escd) free(escd);
+                        rw_putc(w, '"');
                         break;
                     case FS_TYPE_BNODE:
-                        fprintf(out, "\"type\":\"bnode\",\"value\":\"%s\"", row[c].lex + 2);
+                        rw_puts(w, "\"type\":\"bnode\",\"value\":\"");
+                        rw_puts(w, row[c].lex + 2);
+                        rw_putc(w, '"');
                 }
-                fputs("}", out);
+                rw_putc(w, '}');
             }
-            fputs("}", out);
+            rw_putc(w, '}');
         }
         if (rownum) {
-            fputs("\n  ", out);
+            rw_puts(w, "\n  ");
         }
-        fprintf(out, "]\n }");
+        rw_puts(w, "]\n }");
     }
 
     if (q->warnings) {
-        fprintf(out, ",\n \"warnings\": [");
+        rw_puts(w, ",\n \"warnings\": [");
         GSList *it;
         for (it = q->warnings; it; it = it->next) {
-            char *text = it->data;
-            char *escd = NULL;
-            int esclen = 0;
-            if (json_needs_escape(text, &esclen)) {
-                escd = json_escape(text, esclen);
-                text = escd;
-            }
-            fprintf(out, "\"%s\"", text);
+            rw_putc(w, '"');
+            rw_escape(w, ESC_JSON, it->data);
+            rw_putc(w, '"');
             if (it->next)
-                fprintf(out, ",\n");
-
-            if (escd) free(escd);
+                rw_puts(w, ",\n");
         }
         g_slist_free(q->warnings);
         q->warnings = NULL;
-        fprintf(out, "]\n");
+        rw_puts(w, "]\n");
     }
 
     if (q->json_function) {
-        fprintf(out, "});\n");
+        rw_puts(w, "});\n");
+    } else {
+        rw_puts(w, "}\n");
+    }
+    res_writer_free(w);
+}
+
+/* columnar binary results, see docs/binary-results */
+
+#define BINARY_BATCH_ROWS 8192
+#define BINARY_UNBOUND 0xffffffff
+
+typedef struct {
+    GHashTable *rids;       /* rid -> index + 1 */
+    GHashTable *values;     /* computed values, key -> index + 1 */
+    guint32 size;
+    GString *pending;       /* dictionary entries not yet written */
+    guint32 pending_count;
+    guint32 *index;
+} binary_column;
+
+static void rw_u32(res_writer *w, guint32 v)
+{
+    rw_write(w, (const char *)&v, sizeof(v));
+}
+
+static void rw_record(res_writer *w, char type, guint32 length)
+{
+    const char head[4] = { type, 0, 0, 0 };
+
+    rw_write(w, head, 4);
+    rw_u32(w, length);
+}
+
+static void rw_pad(res_writer *w, size_t length)
+{
+    static const char zeros[8] = { 0 };
+
+    if (length % 8) rw_write(w, zeros, 8 - length % 8);
+}
+
+static inline size_t padded(size_t length)
+{
+    return (length + 7) & ~(size_t)7;
+}
+
+static void rw_text_record(res_writer *w, char type, const char *text)
+{
+    const size_t len = strlen(text);
+
+    rw_record(w, type, padded(len));
+    rw_write(w, text, len);
+    rw_pad(w, len);
+}
+
+static guint32 binary_dict_index(binary_column *col, fs_row *r)
+{
+    gpointer found;
+    char *key = NULL;
+
+    if (r->type == FS_TYPE_NONE) return BINARY_UNBOUND;
+
+    /* computed values all have the rid 1, so are looked up by value */
+    const int by_value = r->rid == 1 || r->rid == FS_RID_NULL;
+    if (by_value) {
+        key = g_strdup_printf("%d %s\001%s\001%s", r->type, r->lex,
+                              r->dt ? r->dt : "", r->lang ? r->lang : "");
+        found = g_hash_table_lookup(col->values, key);
+    } else {
+        found = g_hash_table_lookup(col->rids, &r->rid);
+    }
+    if (found) {
+        g_free(key);
+
+        return GPOINTER_TO_UINT(found) - 1;
+    }
+
+    const guint32 index = col->size++;
+    if (by_value) {
+        g_hash_table_insert(col->values, key, GUINT_TO_POINTER(index + 1));
+    } else {
+        fs_rid *rid = g_new(fs_rid, 1);
+        *rid = r->rid;
+        g_hash_table_insert(col->rids, rid, GUINT_TO_POINTER(index + 1));
+    }
+
+    const char *lex = r->lex ? r->lex : "";
+    if (r->type == FS_TYPE_BNODE && !strncmp(lex, "_:", 2)) lex += 2;
+    const char *attr = r->dt ? r->dt : r->lang ? r->lang : "";
+    const unsigned char head[4] = { r->type, r->dt ? 1 : r->lang ? 2 : 0, 0, 0 };
+    const guint32 lens[2] = { strlen(lex), strlen(attr) };
+    g_string_append_len(col->pending, (const char *)head, 4);
+    g_string_append_len(col->pending, (const char *)lens, sizeof(lens));
+    g_string_append_len(col->pending, lex, lens[0]);
+    g_string_append_len(col->pending, attr, lens[1]);
+    col->pending_count++;
+
+    return index;
+}
+
+/* writes the new dictionary entries and the indexes of a batch of rows */
+static void binary_batch(res_writer *w, binary_column *columns, int cols,
+                         guint32 rows)
+{
+    for (int c=0; c<cols; c++) {
+        binary_column *col = &columns[c];
+        if (!col->pending_count) continue;
+        rw_record(w, 'D', padded(8 + col->pending->len));
+        rw_u32(w, c);
+        rw_u32(w, col->pending_count);
+        rw_write(w, col->pending->str, col->pending->len);
+        rw_pad(w, col->pending->len);
+        g_string_truncate(col->pending, 0);
+        col->pending_count = 0;
+    }
+
+    rw_record(w, 'B', 8 + cols * padded(rows * 4));
+    rw_u32(w, rows);
+    rw_u32(w, 0);
+    for (int c=0; c<cols; c++) {
+        rw_write(w, (const char *)columns[c].index, rows * 4);
+        rw_pad(w, rows * 4);
+    }
+}
+
+static void output_binary(fs_query *q, int flags, FILE *out)
+{
+    if (!q) return;
+
+    if (q->construct || q->describe) {
+        /* not tabular */
+        output_text(q, flags, out);
+
+        return;
+    }
+
+    if (flags & FS_RESULT_FLAG_HEADERS) {
+        fprintf(out, "Content-Type: application/x-4store-results\r\n\r\n");
+    }
+
+    const int cols = fs_query_get_columns(q);
+    res_writer *w = res_writer_new(out);
+
+    rw_write(w, "4SRES\000\000\001", 8);
+    rw_u32(w, 0x01020304);
+    rw_u32(w, cols);
+
+    fs_row *row = fs_query_fetch_header_row(q);
+    GString *names = g_string_new("");
+    for (int c=0; c<cols; c++) {
+        const guint32 len = strlen(row[c].name);
+        g_string_append_len(names, (const char *)&len, sizeof(len));
+        g_string_append_len(names, row[c].name, len);
+    }
+    rw_record(w, 'V', padded(names->len));
+    rw_write(w, names->str, names->len);
+    rw_pad(w, names->len);
+    g_string_free(names, TRUE);
+
+    GSList *it;
+    for (it = q->warnings; it; it = it->next) {
+        if (it->data) rw_text_record(w, 'W', it->data);
+    }
+    g_slist_free(q->warnings);
+    q->warnings = NULL;
+
+    if (q->ask) {
+        while (q->boolean && fs_query_fetch_row(q));
+        rw_record(w, 'A', 8);
+        rw_u32(w, q->boolean ? 1 : 0);
+        rw_u32(w, 0);
     } else {
-        fprintf(out, "}\n");
+        binary_column *columns = calloc(cols + 1, sizeof(binary_column));
+        for (int c=0; c<cols; c++) {
+            columns[c].rids = g_hash_table_new_full(fs_rid_hash, fs_rid_equal,
+                                                    g_free, NULL);
+            columns[c].values = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                      g_free, NULL);
+            columns[c].pending = g_string_new("");
+            columns[c].index = malloc(BINARY_BATCH_ROWS * sizeof(guint32));
+        }
+        guint32 rows = 0;
+        while ((!row || !row->stop) && (row = fs_query_fetch_row(q))) {
+            for (int c=0; c<cols; c++) {
+                columns[c].index[rows] = binary_dict_index(&columns[c], &row[c]);
+            }
+            if (++rows == BINARY_BATCH_ROWS) {
+                binary_batch(w, columns, cols, rows);
+                rows = 0;
+            }
+        }
+        if (rows) binary_batch(w, columns, cols, rows);
+        for (int c=0; c<cols; c++) {
+            g_hash_table_destroy(columns[c].rids);
+            g_hash_table_destroy(columns[c].values);
+            g_string_free(columns[c].pending, TRUE);
+            free(columns[c].index);
+        }
+        free(columns);
     }
+
+    for (it = q->warnings; it; it = it->next) {
+        if (it->data) rw_text_record(w, 'W', it->data);
+    }
+    g_slist_free(q->warnings);
+    q->warnings = NULL;
+
+    rw_record(w, 'E', 0);
+    res_writer_free(w);
 }
 
 static void output_testcase(fs_query *q, int flags, FILE *out)
@@ -2514,7 +3314,7 @@ fs_row *fs_query_fetch_header_row(fs_query *q)
     return q->resrow;
 }
 
-/* call with mutex held only, pushed L1 cache entry into L2 */
+/* call with the entry's stripe locked, pushes L1 cache entry into L2 */
 static gboolean cache_dump(gpointer key, gpointer value, gpointer user_data)
 {
     fs_resource *res = value;
@@ -2541,9 +3341,13 @@ static void prefetch_lexical_data(fs_query *q, long int next_row,const int rows)
         fs_rid_vector_clear(q->pending[i]);
     }
 
-    /* dump L1 cache into L2 */
-    g_static_mutex_lock(&cache_mutex);
-    if (res_l1_cache) g_hash_table_foreach_steal(res_l1_cache, cache_dump, NULL);
+    /* dump L1 cache into L2, the L2 slots of an entry belong to its stripe */
+    for (int i=0; i<CACHE_STRIPES; i++) {
+        res_stripe *st = &res_stripes[i];
+        stripe_lock(st);
+        g_hash_table_foreach_steal(st->l1, cache_dump, NULL);
+        stripe_unlock(st);
+    }
 
     int lookup_buffer_size = RESOURCE_LOOKUP_BUFFER;
     if (q->limit > 0 && q->limit < RESOURCE_LOOKUP_BUFFER) {
@@ -2572,7 +3376,11 @@ static void prefetch_lexical_data(fs_query *q, long int next_row,const int rows)
                 rid = FS_RID_NULL;
             }
             if (FS_IS_BNODE(rid)) continue;
-            if (res_l2_cache[rid & CACHE_MASK].rid == rid) {
+            res_stripe *st = CACHE_STRIPE(rid);
+            stripe_lock(st);
+            const int l2_hit = res_l2_cache[rid & CACHE_MASK].rid == rid;
+            stripe_unlock(st);
+            if (l2_hit) {
                 cache_l2_hit++; 
                 continue;
             }
@@ -2581,12 +3389,13 @@ static void prefetch_lexical_data(fs_query *q, long int next_row,const int rows)
         }
     }
     if (q->qs->cache_stats) {
+        g_static_mutex_lock(&cache_mutex);
         double avg_saved = (cache_l2_hit+0.00001) / (cache_l2_hit+pre_cache_len+0.00001);
         double total_avg_saved = q->qs->resolve_all_calls * q->qs->avg_cache_saves_l2;
         q->qs->avg_cache_saves_l2 = (avg_saved + total_avg_saved) /
                                     (q->qs->resolve_all_calls + 1.0001);
+        g_static_mutex_unlock(&cache_mutex);
     }
-    g_static_mutex_unlock(&cache_mutex);
     if (pre_cache_len)
         resolve_precache_all_with_stats(q);
     q->qs->pre_cache_total += pre_cache_len;
@@ -2603,6 +3412,10 @@ fs_row *fs_query_fetch_row(fs_query *q)
     fs_query_free_row_freeable(q);
 
 nextrow: ;
+    if (q->abandoned ||
+        ((q->row + 1) % FS_ABANDON_CHECK_INTERVAL == 0 && fs_query_abandoned(q))) {
+        return NULL;
+    }
     long int next_row = q->row + 1;
     fs_rid_vector *grows = NULL;
 
@@ -2909,6 +3722,8 @@ void fs_query_results_output(fs_query *q, const char *fmt, int flags, FILE *out)
         output_csv(q, flags, out);
     } else if (!strcmp(fmt, "json")) {
         output_json(q, flags, out);
+    } else if (!strcmp(fmt, "binary")) {
+        output_binary(q, flags, out);
     } else if (!strcmp(fmt, "testcase")) {
         output_testcase(q, flags, out);
     } else {
@@ -24,6 +24,7 @@
 #include "update.h"
 #include "import.h"
 #include "query.h"
+#include "query-cache.h"
 #include "../common/4store.h"
 #include "../common/4s-internals.h"
 #include "../common/error.h"
@@ -41,6 +42,7 @@ struct update_context {
     rasqal_update_operation *op;
     int opid;
     int error;
+    fs_cache_touched *touched; /* what was written, for bind cache invalidation */
 };
 
 #define QUAD_BUF_SIZE 4096
@@ -62,9 +64,13 @@ int fs_move(struct update_context *uc, char *from, char *to);
 int fs_copy(struct update_context *uc, char *from, char *to);
 
 fs_rid fs_hash_rasqal_literal(struct update_context *uc, rasqal_literal *l, int row);
+void fs_hash_rasqal_literals(struct update_context *uc, rasqal_literal *l[],
+                             fs_rid rid[], int count, int row);
 void fs_resource_from_rasqal_literal(struct update_context *uctxt,
                                      rasqal_literal *l, fs_resource *res, int row);
 
+static int flush_triples(struct update_context *uc);
+
 static void add_message(struct update_context *uc, char *m, int freeable)
 {
     uc->messages = g_slist_append(uc->messages, m);
@@ -127,12 +133,17 @@ static int delete_rasqal_triple(struct update_context *uc, fs_rid_vector *vec[],
         /* m can be wildcard in the absence of GRAPH, WITH etc. */
         m = FS_RID_NULL;
     }
-    s = fs_hash_rasqal_literal(uc, triple->subject, row);
+    rasqal_literal *terms[3] = { triple->subject, triple->predicate,
+                                 triple->object };
+    fs_rid spo[3];
+    fs_hash_rasqal_literals(uc, terms, spo, 3, row);
+    s = spo[0];
     if (s == FS_RID_NULL) return 1;
-    p = fs_hash_rasqal_literal(uc, triple->predicate, row);
+    p = spo[1];
     if (p == FS_RID_NULL) return 1;
-    o = fs_hash_rasqal_literal(uc, triple->object, row);
+    o = spo[2];
     if (o == FS_RID_NULL) return 1;
+    fs_cache_touched_add(uc->touched, m, p);
 
     /* as long as s, p, and o are bound, we can add this quad */
     fs_rid_vector_append(vec[0], m);
@@ -177,15 +188,15 @@ static int insert_rasqal_triple(struct update_context *uc, rasqal_triple *triple
     if (!FS_IS_URI(quad_buf[0][0])) {
         return 1;
     }
-    quad_buf[0][1] = fs_hash_rasqal_literal(uc, triple->subject, row);
+    rasqal_literal *terms[3] = { triple->subject, triple->predicate,
+                                 triple->object };
+    fs_hash_rasqal_literals(uc, terms, &quad_buf[0][1], 3, row);
     if (FS_IS_LITERAL(quad_buf[0][1])) {
         return 1;
     }
-    quad_buf[0][2] = fs_hash_rasqal_literal(uc, triple->predicate, row);
     if (!FS_IS_URI(quad_buf[0][2])) {
         return 1;
     }
-    quad_buf[0][3] = fs_hash_rasqal_literal(uc, triple->object, row);
     res.rid = quad_buf[0][0];
     if (res.lex) fsp_res_import(uc->link, FS_RID_SEGMENT(quad_buf[0][0], uc->segments), 1, &res);
     res.rid = quad_buf[0][1];
@@ -197,12 +208,152 @@ static int insert_rasqal_triple(struct update_context *uc, rasqal_triple *triple
     res.rid = quad_buf[0][3];
     fs_resource_from_rasqal_literal(uc, triple->object, &res, 0);
     if (res.lex) fsp_res_import(uc->link, FS_RID_SEGMENT(quad_buf[0][3], uc->segments), 1, &res);
+    fs_cache_touched_add(uc->touched, quad_buf[0][0], quad_buf[0][2]);
     fsp_quad_import(uc->link, FS_RID_SEGMENT(quad_buf[0][1], uc->segments), FS_BIND_BY_SUBJECT, 1, quad_buf);
 //printf("I %016llx %016llx %016llx %016llx\n", quad_buf[0][0], quad_buf[0][1], quad_buf[0][2], quad_buf[0][3]);
 
     return 0;
 }
 
+/* quads instantiated from the template and WHERE results sent per
+ * fsp_delete_quads_all() call, bounds the size of the messages */
+#define DELETE_BATCH 1048576
+
+/* one slot of a template, either a constant or a column of the WHERE
+ * results */
+struct template_slot {
+    fs_rid constant;
+    fs_rid_vector *column;
+};
+
+static void template_slot(struct update_context *uc, rasqal_literal *l,
+                          fs_rid constant, struct template_slot *slot)
+{
+    slot->constant = constant;
+    slot->column = NULL;
+    if (!l || l->type != RASQAL_LITERAL_VARIABLE) {
+        return;
+    }
+    fs_binding *b = fs_binding_get(uc->q->bb[0], l->value.variable);
+    if (!b || !b->bound) {
+        slot->constant = FS_RID_NULL;
+    } else if (!b->need_val) {
+        slot->constant = FS_RID_GONE;
+    } else {
+        slot->column = b->vals;
+    }
+}
+
+static inline fs_rid slot_value(struct template_slot *slot, int row)
+{
+    if (!slot->column) return slot->constant;
+    if (row < slot->column->length) return slot->column->data[row];
+
+    return FS_RID_NULL;
+}
+
+/* instantiates a template triple against every row of the WHERE results,
+ * constant terms are hashed once and variables are read straight out of
+ * their binding columns, the quads are appended to vec */
+static void instantiate_template(struct update_context *uc, rasqal_triple *triple,
+                                 int insert, fs_rid_vector *vec[4])
+{
+    rasqal_literal *terms[4] = { triple->origin, triple->subject,
+                                 triple->predicate, triple->object };
+    fs_rid constant[4];
+    fs_hash_rasqal_literals(uc, terms, constant, 4, 0);
+    if (!triple->origin) {
+        if (uc->op->graph_uri) {
+            constant[0] = fs_hash_uri((char *)raptor_uri_as_string(uc->op->graph_uri));
+        } else if (insert) {
+            constant[0] = fs_c.default_graph;
+        } else {
+            /* m can be wildcard in the absence of GRAPH, WITH etc. */
+            constant[0] = FS_RID_NULL;
+        }
+    }
+
+    struct template_slot slot[4];
+    for (int i=0; i<4; i++) {
+        template_slot(uc, terms[i], constant[i], slot + i);
+    }
+
+    if (insert) {
+        /* constant terms need their resources stored, bound variables
+         * already exist */
+        fs_resource res;
+        for (int i=0; i<4; i++) {
+            if (slot[i].column || slot[i].constant == FS_RID_NULL ||
+                slot[i].constant == FS_RID_GONE) {
+                continue;
+            }
+            if (i == 0 && !triple->origin) {
+                res.lex = uc->op->graph_uri ?
+                    (char *)raptor_uri_as_string(uc->op->graph_uri) :
+                    FS_DEFAULT_GRAPH;
+                res.attr = FS_RID_NULL;
+            } else {
+                fs_resource_from_rasqal_literal(uc, terms[i], &res, 0);
+            }
+            res.rid = slot[i].constant;
+            if (res.lex) {
+                fsp_res_import(uc->link, FS_RID_SEGMENT(res.rid, uc->segments), 1, &res);
+            }
+        }
+    }
+
+    fs_rid last_m = FS_RID_GONE, last_p = FS_RID_GONE;
+    for (int row=0; row < uc->q->length; row++) {
+        const fs_rid m = slot_value(slot + 0, row);
+        const fs_rid s = slot_value(slot + 1, row);
+        const fs_rid p = slot_value(slot + 2, row);
+        const fs_rid o = slot_value(slot + 3, row);
+
+        if (s == FS_RID_NULL || p == FS_RID_NULL || o == FS_RID_NULL ||
+            s == FS_RID_GONE || p == FS_RID_GONE || o == FS_RID_GONE) {
+            continue;
+        }
+        if (insert) {
+            if (!FS_IS_URI(m) || FS_IS_LITERAL(s) || !FS_IS_URI(p)) {
+                continue;
+            }
+        } else if (m == FS_RID_NULL && (triple->origin || uc->op->graph_uri)) {
+            continue;
+        }
+
+        if (m != last_m || p != last_p) {
+            fs_cache_touched_add(uc->touched, m, p);
+            if (m == fs_c.system_config) {
+                fsp_reload_acl_system(uc->link);
+            }
+            last_m = m;
+            last_p = p;
+        }
+        fs_rid_vector_append(vec[0], m);
+        fs_rid_vector_append(vec[1], s);
+        fs_rid_vector_append(vec[2], p);
+        fs_rid_vector_append(vec[3], o);
+    }
+}
+
+/* sends quads to the segment of their subject, through quad_buffer */
+static void insert_quads(struct update_context *uc, fs_rid_vector *vec[4])
+{
+    for (int i=0; i<vec[0]->length; i++) {
+        int segment = FS_RID_SEGMENT(vec[1]->data[i], uc->segments);
+        int pos = quad_buffer[segment].length;
+        for (int s=0; s<4; s++) {
+            quad_buffer[segment].quads[pos][s] = vec[s]->data[i];
+        }
+        quad_buffer[segment].length++;
+        if (quad_buffer[segment].length == QUAD_BUF_SIZE) {
+            fsp_quad_import(uc->link, segment, FS_BIND_BY_SUBJECT, quad_buffer[segment].length, quad_buffer[segment].quads);
+            quad_buffer[segment].length = 0;
+        }
+    }
+    flush_triples(uc);
+}
+
 static char *graph_arg(raptor_uri *u)
 {
     if (!u) {
@@ -254,27 +405,20 @@ static int update_op(struct update_context *uc)
     raptor_sequence *todel = NULL;
     raptor_sequence *toins = NULL;
 
+    /* DELETE WHERE { x } is DELETE { x } WHERE { x } */
+    int delete_where = 0;
     if (uc->op->delete_templates && !uc->op->where) {
-        int where = 0;
-
-        /* check to see if it's a DELETE WHERE { } */
         for (int t=0; t<raptor_sequence_size(uc->op->delete_templates); t++) {
             rasqal_triple *tr = raptor_sequence_get_at(uc->op->delete_templates, t);
             if (any_vars(tr)) {
-                where = 1;
+                delete_where = 1;
                 break;
             }
         }
-        if (where) {
-            fs_error(LOG_ERR, "DELETE WHERE { x } not yet supported");
-            add_message(uc, "DELETE WHERE { x } not yet supported, use DELETE { x } WHERE { x }", 0);
-
-            return 1;
-        }
     }
 
 #if RASQAL_VERSION >= 923
-    if (uc->op->where) {
+    if (uc->op->where || delete_where) {
         todel = raptor_new_sequence(NULL, NULL);
         toins = raptor_new_sequence(NULL, NULL);
         raptor_sequence *todel_p = raptor_new_sequence(NULL, NULL);
@@ -339,37 +483,54 @@ static int update_op(struct update_context *uc)
         }
 
         /* perform the WHERE match */
-        fs_query_process_pattern(q, uc->op->where, vars);
+        if (uc->op->where) {
+            fs_query_process_pattern(q, uc->op->where, vars);
+        } else {
+            fs_query_process_triples(q, uc->op->delete_templates, vars);
+        }
 
         q->length = fs_binding_length(q->bb[0]);
 
+        if (delete_where && q->length == 0) {
+            /* the constant triples were part of the pattern too */
+            raptor_free_sequence(todel);
+            todel = NULL;
+        }
+
+        /* apply the templates a column at a time, all the deletes go before
+         * any of the inserts */
         for (int s=0; s<4; s++) {
             vec[s] = fs_rid_vector_new(0);
         }
         for (int t=0; t<raptor_sequence_size(todel_p); t++) {
             rasqal_triple *triple = raptor_sequence_get_at(todel_p, t);
-            for (int row=0; row < q->length; row++) {
-                delete_rasqal_triple(uc, vec, triple, row);
-            }
-            if (fs_rid_vector_length(vec[0]) > 1000) {
+            instantiate_template(uc, triple, 0, vec);
+            if (fs_rid_vector_length(vec[0]) >= DELETE_BATCH) {
                 fsp_delete_quads_all(uc->link, vec);
+                for (int s=0; s<4; s++) {
+                    fs_rid_vector_truncate(vec[s], 0);
+                }
             }
         }
         if (fs_rid_vector_length(vec[0]) > 0) {
             fsp_delete_quads_all(uc->link, vec);
-        }
-        for (int s=0; s<4; s++) {
-//fs_rid_vector_print(vec[s], 0, stdout);
-            fs_rid_vector_free(vec[s]);
-            vec[s] = NULL;
+            for (int s=0; s<4; s++) {
+                fs_rid_vector_truncate(vec[s], 0);
+            }
         }
 
         for (int t=0; t<raptor_sequence_size(toins_p); t++) {
             rasqal_triple *triple = raptor_sequence_get_at(toins_p, t);
-            for (int row=0; row < q->length; row++) {
-                insert_rasqal_triple(uc, triple, row);
+            instantiate_template(uc, triple, 1, vec);
+            insert_quads(uc, vec);
+            for (int s=0; s<4; s++) {
+                fs_rid_vector_truncate(vec[s], 0);
             }
         }
+        for (int s=0; s<4; s++) {
+            fs_rid_vector_free(vec[s]);
+            vec[s] = NULL;
+        }
 
         /* must not free the rasqal_query */
         q->rq = NULL;
@@ -450,9 +611,16 @@ int fs_update(fs_query_state *qs, char *update, char **message, int unsafe)
     if (!quad_buffer) {
         quad_buffer = calloc(uctxt.segments, sizeof(struct quad_buf));
     }
+    uctxt.touched = fs_cache_touched_new();
 
     int ok = 1;
-    for (int i=0; 1; i++) {
+    /* inside an import the backends hold small inserts and log them when
+     * it stops, rather than committing them to the indexes */
+    if (fsp_start_import_all(qs->link)) {
+        add_message(&uctxt, "aborting update", 0);
+        ok = 0;
+    }
+    for (int i=0; ok; i++) {
         rasqal_update_operation *op = rasqal_query_get_update_operation(rq, i);
         if (!op) {
             break;
@@ -468,6 +636,9 @@ int fs_update(fs_query_state *qs, char *update, char **message, int unsafe)
     fsp_quad_import_commit_all(qs->link, FS_BIND_BY_SUBJECT);
     fsp_stop_import_all(qs->link);
 
+    fs_query_cache_invalidate(qs, uctxt.touched);
+    fs_cache_touched_free(uctxt.touched);
+
     rasqal_free_query(rq);
 
     if (uctxt.messages) {
@@ -490,65 +661,113 @@ int fs_update(fs_query_state *qs, char *update, char **message, int unsafe)
 
 fs_rid fs_hash_rasqal_literal(struct update_context *uc, rasqal_literal *l, int row)
 {
-    if (!l) return FS_RID_NULL;
+    fs_rid rid;
+    fs_hash_rasqal_literals(uc, &l, &rid, 1, row);
 
-    if (l->type == RASQAL_LITERAL_VARIABLE) {
-        if (uc->q) {
-            return fs_binding_get_val(uc->q->bb[0], l->value.variable, row, NULL);
-        }
-        fs_error(LOG_ERR, "no variables bound");
+    return rid;
+}
 
-        return FS_RID_NULL;
-    }
+#define HASH_BATCH 16
 
-    rasqal_literal_type type = rasqal_literal_get_rdf_term_type(l);
-    switch (type) {
-    case RASQAL_LITERAL_URI:
-        return fs_hash_uri((char *)raptor_uri_as_string(l->value.uri));
-    
-    case RASQAL_LITERAL_UNKNOWN:
-    case RASQAL_LITERAL_STRING:
-    case RASQAL_LITERAL_XSD_STRING: {
-        fs_rid attr = 0;
-        if (l->datatype) {
-            attr = fs_hash_uri((char *)raptor_uri_as_string(l->datatype));
-        } else if (l->language) {
-            /* lang tags are normalised to upper case internally */
-            char *lang = g_ascii_strup((char *)l->language, -1);
-            attr = fs_hash_literal(lang, 0);
-            g_free(lang);
-        }
+/* hashes count literals, the URIs and datatypes go through
+ * fs_hash_uri_multi() together, then the lexical forms through
+ * fs_hash_literal_multi() */
+void fs_hash_rasqal_literals(struct update_context *uc, rasqal_literal *l[],
+                             fs_rid rid[], int count, int row)
+{
+    if (count > HASH_BATCH) {
+        fs_hash_rasqal_literals(uc, l, rid, HASH_BATCH, row);
+        fs_hash_rasqal_literals(uc, l + HASH_BATCH, rid + HASH_BATCH,
+                                count - HASH_BATCH, row);
 
-        return fs_hash_literal((char *)rasqal_literal_as_string(l), attr);
+        return;
     }
 
-    case RASQAL_LITERAL_BLANK: {
-        raptor_term_blank_value bnode;
-        bnode.string = (unsigned char *)rasqal_literal_as_string(l);
-        bnode.string_len = strlen((char *)bnode.string);
+    const char *uris[HASH_BATCH];
+    fs_rid uri_rids[HASH_BATCH];
+    const char *lex[HASH_BATCH];
+    fs_rid attr[HASH_BATCH];
+    char *lang[HASH_BATCH];
+
+    for (int i=0; i<count; i++) {
+        uris[i] = NULL;
+        lex[i] = NULL;
+        attr[i] = 0;
+        lang[i] = NULL;
+        rid[i] = FS_RID_NULL;
+        if (!l[i]) continue;
+
+        if (l[i]->type == RASQAL_LITERAL_VARIABLE) {
+            if (uc->q) {
+                rid[i] = fs_binding_get_val(uc->q->bb[0], l[i]->value.variable, row, NULL);
+            } else {
+                fs_error(LOG_ERR, "no variables bound");
+            }
+            continue;
+        }
 
-        return fs_bnode_id(uc->link, bnode);
-    }
+        rasqal_literal_type type = rasqal_literal_get_rdf_term_type(l[i]);
+        switch (type) {
+        case RASQAL_LITERAL_URI:
+            uris[i] = (char *)raptor_uri_as_string(l[i]->value.uri);
+            continue;
+
+        case RASQAL_LITERAL_UNKNOWN:
+        case RASQAL_LITERAL_STRING:
+        case RASQAL_LITERAL_XSD_STRING:
+            lex[i] = (char *)rasqal_literal_as_string(l[i]);
+            if (l[i]->datatype) {
+                uris[i] = (char *)raptor_uri_as_string(l[i]->datatype);
+            } else if (l[i]->language) {
+                /* lang tags are normalised to upper case internally */
+                lang[i] = g_ascii_strup((char *)l[i]->language, -1);
+            }
+            continue;
 
-    case RASQAL_LITERAL_VARIABLE:
-    case RASQAL_LITERAL_QNAME:
-    case RASQAL_LITERAL_PATTERN:
-    case RASQAL_LITERAL_BOOLEAN:
-    case RASQAL_LITERAL_INTEGER:
-    case RASQAL_LITERAL_INTEGER_SUBTYPE:
-    case RASQAL_LITERAL_DECIMAL:
-    case RASQAL_LITERAL_FLOAT:
-    case RASQAL_LITERAL_DOUBLE:
-    case RASQAL_LITERAL_DATETIME:
-    case RASQAL_LITERAL_UDT:
+        case RASQAL_LITERAL_BLANK: {
+            raptor_term_blank_value bnode;
+            bnode.string = (unsigned char *)rasqal_literal_as_string(l[i]);
+            bnode.string_len = strlen((char *)bnode.string);
+            rid[i] = fs_bnode_id(uc->link, bnode);
+            continue;
+        }
+
+        case RASQAL_LITERAL_VARIABLE:
+        case RASQAL_LITERAL_QNAME:
+        case RASQAL_LITERAL_PATTERN:
+        case RASQAL_LITERAL_BOOLEAN:
+        case RASQAL_LITERAL_INTEGER:
+        case RASQAL_LITERAL_INTEGER_SUBTYPE:
+        case RASQAL_LITERAL_DECIMAL:
+        case RASQAL_LITERAL_FLOAT:
+        case RASQAL_LITERAL_DOUBLE:
+        case RASQAL_LITERAL_DATETIME:
+        case RASQAL_LITERAL_UDT:
 #if RASQAL_VERSION >= 929
-    case RASQAL_LITERAL_DATE:
+        case RASQAL_LITERAL_DATE:
 #endif
-        break;
+            break;
+        }
+        fs_error(LOG_ERR, "bad rasqal literal (type %d)", type);
     }
-    fs_error(LOG_ERR, "bad rasqal literal (type %d)", type);
 
-    return FS_RID_NULL;
+    fs_hash_uri_multi(uris, uri_rids, count);
+    for (int i=0; i<count; i++) {
+        if (!lex[i]) {
+            if (uris[i]) rid[i] = uri_rids[i];
+            continue;
+        }
+        if (uris[i]) {
+            attr[i] = uri_rids[i];
+        } else if (lang[i]) {
+            attr[i] = fs_hash_literal(lang[i], 0);
+            g_free(lang[i]);
+        }
+    }
+    fs_hash_literal_multi(lex, attr, uri_rids, count);
+    for (int i=0; i<count; i++) {
+        if (lex[i]) rid[i] = uri_rids[i];
+    }
 }
 
 void fs_resource_from_rasqal_literal(struct update_context *uctxt, rasqal_literal *l, fs_resource *res, int row)
@@ -599,18 +818,12 @@ int fs_load(struct update_context *uc, char *resuri, char *graphuri)
     errout = tmpfile();
     int count = 0;
     int errors = 0;
-    if (fsp_start_import_all(uc->link)) {
-        errors++;
-        add_message(uc, "aborting import", 0);
-        fclose(errout);
-
-        return errors;
-    }
 
+    /* fs_update() has started the import already */
     char *model = graphuri ? graphuri : resuri;
+    fs_cache_touched_add(uc->touched, fs_hash_uri(model), FS_RID_NULL);
     fs_import(uc->link, model, resuri, "auto", 0, 0, 0, errout, &count);
     fs_import_commit(uc->link, 0, 0, 0, errout, &count);
-    fsp_stop_import_all(uc->link);
     rewind(errout);
     char tmp[1024];
     if (fgets(tmp, 1024, errout)) {
@@ -642,6 +855,7 @@ int fs_clear(struct update_context *uc, char *graphuri)
         mrid = fs_c.default_graph;
     }
     fs_rid_vector_append(mvec, mrid);
+    fs_cache_touched_add(uc->touched, mrid, FS_RID_NULL);
 
     int errors = 0;
     if (fsp_delete_model_all(uc->link, mvec)) {
@@ -736,6 +950,7 @@ int fs_add(struct update_context *uc, char *from, char *to)
     }
 
     fs_rid_vector_append(mvec, fromrid);
+    fs_cache_touched_add(uc->touched, torid, FS_RID_NULL);
 
     int errors = 0;
 
@@ -816,6 +1031,8 @@ int fs_move(struct update_context *uc, char *from, char *to)
     }
 
     fs_rid_vector_append(mvec, fromrid);
+    fs_cache_touched_add(uc->touched, torid, FS_RID_NULL);
+    fs_cache_touched_add(uc->touched, fromrid, FS_RID_NULL);
 
     /* search for all the triples in from */
     fs_rid_vector **results;
@@ -914,6 +1131,7 @@ int fs_copy(struct update_context *uc, char *from, char *to)
     }
 
     fs_rid_vector_append(mvec, fromrid);
+    fs_cache_touched_add(uc->touched, torid, FS_RID_NULL);
 
     /* search for all the triples in from */
     fs_rid_vector **results;
@@ -8,7 +8,8 @@
 
 The UTF-8 text of the update operation should be in update, and any error
 messages will be piunted to by *message. Set unsafe to non-0 to enable unsafe
-network operations, eg. LOAD */
+network operations, eg. LOAD. Bind cache entries that could see the written
+quads are invalidated. */
 
 int fs_update(fs_query_state *qs, char *update, char **message, int unsafe);
 
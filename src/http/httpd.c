@@ -29,7 +29,10 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <poll.h>
 #include <libgen.h>
 #include <glib.h>
 #include <sys/types.h>
@@ -45,11 +48,16 @@
 
 #include "../frontend/query.h"
 #include "../frontend/import.h"
+#include "../frontend/binary-rdf.h"
 #include "../frontend/update.h"
 
 #include "httpd.h"
+#include "result-cache.h"
+#include "scheduler.h"
 
 #define WATCHDOG_RATE 16000 /* bytes per second */
+#define HTTP_CHUNK_SIZE 16384 /* response bytes buffered before sending */
+#define HTTP_SEND_TIMEOUT 60000 /* ms to wait for a stalled client */
 
 /* is this request a valid CORS request? */
 
@@ -66,6 +74,7 @@ static int has_o_index = 0;
 
 static long all_time_import_count = 0;
 static int global_import_count = 0;
+static fs_cache_touched *import_touched = NULL; /* what the running import wrote */
 static int unsafe = 0;
 static int default_graph = 0;
 static int cache_stats = 0;
@@ -73,12 +82,28 @@ static int graph_access_control = 0;
 static int soft_limit = 0; /* default value for soft limit */
 static int opt_level = -1;  /* default value for optimisation level */
 static int cors_support = -1; /* cross-origin resource sharing (CORS) support */
+static int keepalive_timeout = -1; /* idle seconds before closing, 0 disables */
+static int result_cache_mb = -1; /* result cache budget, 0 disables */
+static fs_result_cache *result_cache = NULL;
+static volatile int result_cache_disabled = 0; /* backends can't support it */
+static double query_timeout = -1.0; /* seconds a query may run, 0 for no limit */
+static GSList *running = NULL; /* clients whose query is executing */
+static GStaticMutex running_mutex = G_STATIC_MUTEX_INIT;
 
 static fs_query_state *query_state;
 
 static GThreadPool* pool;
 #define QUERY_THREAD_POOL_SIZE 16
 
+static fs_scheduler *scheduler;
+static int default_priority = -1; /* fs_sched_class of queries without an apikey */
+static int priority_limit[FS_SCHED_CLASSES] = { -1, -1, -1 };
+static double expensive_cost = -1.0; /* estimated rows that demote a query, 0 disables */
+static GHashTable *apikey_priority = NULL; /* apikey -> fs_sched_class + 1 */
+
+static GHashTable *prepared_queries = NULL; /* handle -> fs_prepared */
+#define PREPARED_QUERY_MAX 4096
+
 static gboolean recv_fn (GIOChannel *source, GIOCondition condition, gpointer data);
 static void http_import_queue_remove(client_ctxt *ctxt);
 static void http_put_finished(client_ctxt *ctxt, const char *msg);
@@ -154,6 +179,10 @@ static void query_log (client_ctxt *ctxt, const char *query)
       fprintf(ql_file, "##### %s Q%u-pid%u\n%s\n", time_str, ctxt->query_id, cpid, query);
     else
       fprintf(ql_file, "##### %s Q%u-pid%u %s\n%s\n", time_str, ctxt->query_id, cpid, ctxt->apikey, query);
+    for (int i = 0; ctxt->params && i < ctxt->params->len; i++) {
+      fs_query_param *param = &g_array_index(ctxt->params, fs_query_param, i);
+      fprintf(ql_file, "# $%s=%s\n", param->name, param->value);
+    }
     fflush(ql_file);
   }
 }
@@ -265,15 +294,137 @@ static char *just_content_type(client_ctxt *ctxt)
   return result;
 }
 
+static void http_send_all(client_ctxt *ctxt, const char *buf, size_t len)
+{
+  while (len > 0 && !ctxt->broken) {
+    ssize_t sent = send(ctxt->sock, buf, len, 0 /* flags */);
+    if (sent >= 0) {
+      buf += sent;
+      len -= sent;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      struct pollfd pfd = { ctxt->sock, POLLOUT, 0 };
+      if (poll(&pfd, 1, HTTP_SEND_TIMEOUT) == 0) {
+        fs_error(LOG_INFO, "timed out sending to client");
+        ctxt->broken = 1;
+      }
+    } else if (errno != EINTR) {
+      ctxt->broken = 1;
+    }
+  }
+}
+
+static void http_flush(client_ctxt *ctxt)
+{
+  if (ctxt->chunked && ctxt->chunk->len) {
+    g_string_append_printf(ctxt->out, "%zx\r\n", ctxt->chunk->len);
+    g_string_append_len(ctxt->out, ctxt->chunk->str, ctxt->chunk->len);
+    g_string_append(ctxt->out, "\r\n");
+    g_string_truncate(ctxt->chunk, 0);
+  }
+  http_send_all(ctxt, ctxt->out->str, ctxt->out->len);
+  g_string_truncate(ctxt->out, 0);
+}
+
+/* the handlers write complete responses, status line and headers included,
+ * response framing is added here once the end of the headers is seen */
+static void http_write(client_ctxt *ctxt, const char *buf, size_t len)
+{
+  if (ctxt->broken) return;
+
+  if (ctxt->in_body) {
+    if (ctxt->method == FS_HTTP_HEAD) return;
+    GString *dest = ctxt->chunked ? ctxt->chunk : ctxt->out;
+    g_string_append_len(dest, buf, len);
+    if (dest->len >= HTTP_CHUNK_SIZE) {
+      http_flush(ctxt);
+    }
+
+    return;
+  }
+
+  gsize start = ctxt->out->len > 3 ? ctxt->out->len - 3 : 0;
+  g_string_append_len(ctxt->out, buf, len);
+  char *end = strstr(ctxt->out->str + start, "\r\n\r\n");
+  if (!end) return;
+
+  gsize head = end - ctxt->out->str + 2;
+  gsize rest_len = ctxt->out->len - head - 2;
+  char *rest = g_memdup(end + 4, rest_len);
+  g_string_truncate(ctxt->out, head);
+
+  /* answer in the protocol version the client spoke */
+  if (!strncmp(ctxt->out->str, "HTTP/1.", 7)) {
+    ctxt->out->str[7] = ctxt->http11 ? '1' : '0';
+  }
+  if (ctxt->method != FS_HTTP_HEAD && ctxt->keepalive &&
+      !strcasestr(ctxt->out->str, "\ncontent-length:")) {
+    ctxt->chunked = 1;
+    g_string_append(ctxt->out, "Transfer-Encoding: chunked\r\n");
+  }
+  if (!ctxt->keepalive) {
+    g_string_append(ctxt->out, "Connection: close\r\n");
+  }
+  g_string_append(ctxt->out, "\r\n");
+  ctxt->in_body = 1;
+  if (rest_len) {
+    http_write(ctxt, rest, rest_len);
+  }
+  g_free(rest);
+}
+
 static void http_send(client_ctxt *ctxt, const char *msg)
 {
   if (msg) {
-    send(ctxt->sock, msg, strlen(msg), 0 /* flags */);
+    http_write(ctxt, msg, strlen(msg));
   } else {
     fs_error(LOG_ERR, "tried to send NULL message");
   }
 }
 
+/* keep a copy of what the serialisers write, unless it gets too big */
+static void http_capture(client_ctxt *ctxt, const char *buf, size_t len)
+{
+  if (!ctxt->capture) return;
+
+  if (ctxt->capture->len + len > fs_result_cache_max_entry(result_cache)) {
+    g_string_free(ctxt->capture, TRUE);
+    ctxt->capture = NULL;
+
+    return;
+  }
+  g_string_append_len(ctxt->capture, buf, len);
+}
+
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+static int http_stream_write(void *cookie, const char *buf, int size)
+{
+  http_capture((client_ctxt *) cookie, buf, size);
+  http_write((client_ctxt *) cookie, buf, size);
+
+  return size;
+}
+#else
+static ssize_t http_stream_write(void *cookie, const char *buf, size_t size)
+{
+  http_capture((client_ctxt *) cookie, buf, size);
+  http_write((client_ctxt *) cookie, buf, size);
+
+  return size;
+}
+#endif
+
+/* stdio stream feeding http_write(), for the results serialisers */
+static FILE *http_stream(client_ctxt *ctxt)
+{
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__)
+  return funopen(ctxt, NULL, http_stream_write, NULL, NULL);
+#else
+  cookie_io_functions_t io = { NULL, http_stream_write, NULL, NULL };
+
+  return fopencookie(ctxt, "w", io);
+#endif
+}
+
 static void http_header(client_ctxt *ctxt, const char *code, const char *mimetype)
 {
   http_send(ctxt, "HTTP/1.0 "); http_send(ctxt, code); http_send(ctxt, "\r\n");
@@ -334,6 +485,30 @@ static void http_redirect(client_ctxt *ctxt, const char *to)
   http_send(ctxt, "</body></html>\n");
 }
 
+static void http_free_params(client_ctxt *ctxt)
+{
+  if (!ctxt->params) return;
+
+  for (int i = 0; i < ctxt->params->len; i++) {
+    fs_query_param *param = &g_array_index(ctxt->params, fs_query_param, i);
+    g_free((char *) param->name);
+    g_free((char *) param->value);
+  }
+  g_array_free(ctxt->params, TRUE);
+  ctxt->params = NULL;
+}
+
+/* a $name=value request parameter, binding ?name in a prepared query */
+static void http_add_param(client_ctxt *ctxt, const char *name, const char *value)
+{
+  fs_query_param param = { g_strdup(name), g_strdup(value) };
+
+  if (!ctxt->params) {
+    ctxt->params = g_array_new(FALSE, FALSE, sizeof(fs_query_param));
+  }
+  g_array_append_val(ctxt->params, param);
+}
+
 static void client_free(client_ctxt *ctxt)
 {
   if (ctxt->watchdog) {
@@ -346,27 +521,260 @@ static void client_free(client_ctxt *ctxt)
   free(ctxt->request);
   if (ctxt->apikey)
     g_free(ctxt->apikey);
+  g_free(ctxt->json_function);
+  g_string_free(ctxt->out, TRUE);
+  g_string_free(ctxt->chunk, TRUE);
+  if (ctxt->capture)
+    g_string_free(ctxt->capture, TRUE);
+  http_free_params(ctxt);
   g_free(ctxt);
 }
 
-static void http_close(client_ctxt *ctxt)
+/* clear the per-request state, ready for the next request on this connection */
+static void client_reset(client_ctxt *ctxt)
+{
+  g_hash_table_remove_all(ctxt->headers);
+  free(ctxt->request);
+  ctxt->request = NULL;
+  ctxt->importing = 0;
+  ctxt->appending = 0;
+  g_free(ctxt->import_uri);
+  ctxt->import_uri = NULL;
+  ctxt->bytes_left = 0;
+  ctxt->query_string = NULL;
+  ctxt->update_string = NULL;
+  ctxt->qr = NULL;
+  ctxt->query_flags = default_graph ? FS_QUERY_DEFAULT_GRAPH : 0;
+  ctxt->soft_limit = soft_limit;
+  ctxt->timeout = query_timeout;
+  g_free(ctxt->output);
+  ctxt->output = NULL;
+  g_free(ctxt->apikey);
+  ctxt->apikey = NULL;
+  g_free(ctxt->json_function);
+  ctxt->json_function = NULL;
+  ctxt->prepared = NULL;
+  http_free_params(ctxt);
+  ctxt->http11 = 0;
+  ctxt->keepalive = 0;
+  ctxt->chunked = 0;
+  ctxt->in_body = 0;
+  ctxt->body_pending = 0;
+  g_string_truncate(ctxt->out, 0);
+  g_string_truncate(ctxt->chunk, 0);
+}
+
+static void http_hangup(client_ctxt *ctxt)
 {
-  GSource *s =
-    g_main_context_find_source_by_user_data(g_main_context_default(), ctxt);
-  if (s) g_source_destroy(s);
+  GSource *s;
+  while ((s = g_main_context_find_source_by_user_data(g_main_context_default(), ctxt))) {
+    g_source_destroy(s);
+  }
   g_io_channel_shutdown(ctxt->ioch, TRUE, NULL);
   g_io_channel_unref(ctxt->ioch);
   client_free(ctxt);
 }
 
-static void http_query_worker(gpointer data, gpointer user_data)
+static gboolean http_idle_timeout(gpointer data)
 {
   client_ctxt *ctxt = (client_ctxt *) data;
 
+  ctxt->idle = 0;
+  http_hangup(ctxt);
+
+  return FALSE;
+}
+
+/* runs in the main loop, so it's safe after responses from the query pool */
+static gboolean http_resume(gpointer data)
+{
+  client_ctxt *ctxt = (client_ctxt *) data;
+
+  client_reset(ctxt);
+  g_io_add_watch(ctxt->ioch, G_IO_IN, recv_fn, ctxt);
+  ctxt->idle = g_timeout_add_seconds(keepalive_timeout, http_idle_timeout, ctxt);
+
+  return FALSE;
+}
+
+/* finish the response, then either wait for the next request on this
+ * connection or close it */
+static void http_close(client_ctxt *ctxt)
+{
+  if (!ctxt->in_body) {
+    /* no end of headers, we can't frame this, so just send it */
+    ctxt->keepalive = 0;
+  } else if (ctxt->chunked) {
+    http_flush(ctxt);
+    g_string_append(ctxt->out, "0\r\n\r\n");
+  }
+  http_flush(ctxt);
+
+  if (!ctxt->keepalive || ctxt->broken || ctxt->body_pending) {
+    http_hangup(ctxt);
+
+    return;
+  }
+
+  GSource *s;
+  while ((s = g_main_context_find_source_by_user_data(g_main_context_default(), ctxt))) {
+    g_source_destroy(s);
+  }
+  g_idle_add(http_resume, ctxt);
+}
+
+/* everything besides the query text that changes the response bytes, each
+ * part length prefixed so one can't be made to look like another */
+static char *http_result_cache_key(client_ctxt *ctxt)
+{
+  const char *accept = g_hash_table_lookup(ctxt->headers, "accept");
+  const char *output = ctxt->output ? ctxt->output : "";
+  const char *apikey = ctxt->apikey ? ctxt->apikey : "";
+  const char *json_function = ctxt->json_function ? ctxt->json_function : "";
+  if (!accept) accept = "";
+
+  char *variant = g_strdup_printf("%zu:%s %zu:%s %zu:%s %zu:%s %d %d",
+                                  strlen(output), output, strlen(accept), accept,
+                                  strlen(apikey), apikey,
+                                  strlen(json_function), json_function,
+                                  ctxt->soft_limit, ctxt->query_flags);
+  if (ctxt->params) {
+    GString *bound = g_string_new(variant);
+    for (int i = 0; i < ctxt->params->len; i++) {
+      fs_query_param *param = &g_array_index(ctxt->params, fs_query_param, i);
+      g_string_append_printf(bound, " %zu:%s %zu:%s", strlen(param->name), param->name,
+                             strlen(param->value), param->value);
+    }
+    g_free(variant);
+    variant = g_string_free(bound, FALSE);
+  }
+  char *key = fs_result_cache_key(result_cache, ctxt->query_string, variant);
+  g_free(variant);
+
+  return key;
+}
+
+/* answer from the result cache if we can, without running the query */
+static int http_cached_result(client_ctxt *ctxt, const char *key,
+                              unsigned long long generation)
+{
+  char *data;
+  size_t length;
+
+  if (!fs_result_cache_get(result_cache, key, generation, &data, &length)) {
+    return 0;
+  }
+
+  http_send(ctxt, "HTTP/1.0 200 OK\r\n");
+  http_send(ctxt, "Server: 4s-httpd/" GIT_REV "\r\n");
+  if(IS_CORS(ctxt)) {
+    http_send(ctxt, "Access-Control-Allow-Origin: *\r\n");
+  }
+  /* the cached bytes start with the content type header */
+  http_write(ctxt, data, length);
+  g_free(data);
+
+  free(ctxt->query_string);
+  ctxt->query_string = NULL;
+  g_free(ctxt->output);
+  ctxt->output = NULL;
+
+  if (ql_file) {
+    fprintf(ql_file, "#### execution time for Q%u: %fs, from result cache.\n", ctxt->query_id, fs_time() - ctxt->start_time);
+    fflush(ql_file);
+  }
+  http_close(ctxt);
+
+  return 1;
+}
+
+static void http_running_add(client_ctxt *ctxt)
+{
+  g_static_mutex_lock(&running_mutex);
+  running = g_slist_prepend(running, ctxt);
+  g_static_mutex_unlock(&running_mutex);
+}
+
+static void http_running_remove(client_ctxt *ctxt)
+{
+  g_static_mutex_lock(&running_mutex);
+  running = g_slist_remove(running, ctxt);
+  g_static_mutex_unlock(&running_mutex);
+}
+
+/* runs in the main loop, cancels queries whose client has gone away, so
+ * that their binds stop using backend CPU */
+static gboolean http_check_running(gpointer data)
+{
+  g_static_mutex_lock(&running_mutex);
+  for (GSList *it = running; it; it = it->next) {
+    client_ctxt *ctxt = (client_ctxt *) it->data;
+    char c;
+
+    if (ctxt->control.cancelled) continue;
+    /* a pipelined request is readable too, but only a closed socket
+       reads as end of file */
+    ssize_t count = recv(ctxt->sock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (ctxt->broken || count == 0 ||
+        (count == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+      fs_error(LOG_INFO, "client went away, cancelling Q%u", ctxt->query_id);
+      fs_query_cancel(fsplink, &ctxt->control);
+    }
+  }
+  g_static_mutex_unlock(&running_mutex);
+
+  return TRUE;
+}
+
+/* a request can ask for less time than the endpoint allows, not more */
+static void http_set_timeout(client_ctxt *ctxt, const char *value)
+{
+  double timeout = atof(value);
+
+  if (timeout <= 0.0) return; /* includes the empty default form value */
+  if (query_timeout > 0.0 && timeout > query_timeout) return;
+  ctxt->timeout = timeout;
+}
+
+static void http_run_query(client_ctxt *ctxt)
+{
   ctxt->start_time = fs_time();
-  ctxt->qr = fs_query_execute(query_state, fsplink, bu, ctxt->query_string, 
-                              ctxt->query_flags, opt_level, ctxt->soft_limit, 
-                              ctxt->apikey, 0);
+
+  char *cache_key = NULL;
+  unsigned long long generation = 0;
+  if (result_cache && !result_cache_disabled &&
+      (cache_key = http_result_cache_key(ctxt))) {
+    if (fsp_get_generation_all(fsplink, &generation)) {
+      /* without a generation we can't tell if entries are current */
+      fs_error(LOG_ERR, "backend can't report its write generation, disabling result cache");
+      result_cache_disabled = 1;
+      g_free(cache_key);
+      cache_key = NULL;
+    } else if (http_cached_result(ctxt, cache_key, generation)) {
+      g_free(cache_key);
+
+      return;
+    } else {
+      ctxt->capture = g_string_new("");
+    }
+  }
+
+  ctxt->control.deadline = ctxt->timeout > 0.0 ? ctxt->start_time + ctxt->timeout : 0.0;
+  ctxt->control.id = ctxt->query_id;
+  ctxt->control.cancelled = 0;
+  http_running_add(ctxt);
+
+  if (ctxt->prepared) {
+    ctxt->qr = fs_query_execute_prepared(query_state, fsplink, ctxt->prepared,
+                              ctxt->params ? (fs_query_param *) ctxt->params->data : NULL,
+                              ctxt->params ? ctxt->params->len : 0,
+                              ctxt->query_flags, opt_level, ctxt->soft_limit,
+                              ctxt->apikey, 0, &ctxt->control);
+  } else {
+    ctxt->qr = fs_query_execute(query_state, fsplink, bu, ctxt->query_string, 
+                                ctxt->query_flags, opt_level, ctxt->soft_limit, 
+                                ctxt->apikey, 0, &ctxt->control);
+  }
   ctxt->qr->json_function = ctxt->json_function;
   if (ctxt->qr->errors) {
     http_error(ctxt, "400 Parser error");
@@ -381,6 +789,7 @@ static void http_query_worker(gpointer data, gpointer user_data)
     }
     fs_query_free(ctxt->qr);
     ctxt->qr = NULL;
+    http_running_remove(ctxt);
     if (ctxt->query_string) {
       free(ctxt->query_string);
       ctxt->query_string = NULL;
@@ -389,6 +798,11 @@ static void http_query_worker(gpointer data, gpointer user_data)
       g_free(ctxt->output);
       ctxt->output = NULL;
     }
+    if (ctxt->capture) {
+      g_string_free(ctxt->capture, TRUE);
+      ctxt->capture = NULL;
+    }
+    g_free(cache_key);
     http_close(ctxt);
 
     return;
@@ -404,8 +818,8 @@ static void http_query_worker(gpointer data, gpointer user_data)
   const char *accept = g_hash_table_lookup(ctxt->headers, "accept");
 
   int rows_returned = -1;
-  fcntl(ctxt->sock, F_SETFL, 0 /* not O_NONBLOCK */); /* blocking */
-  FILE *fp = fdopen(dup(ctxt->sock), "a+");
+  int abandoned = 0;
+  FILE *fp = http_stream(ctxt);
   if (fp != NULL) {
     const char *type = "sparql"; /* default */
     int flags = FS_RESULT_FLAG_HEADERS;
@@ -421,6 +835,8 @@ static void http_query_worker(gpointer data, gpointer user_data)
       flags = 0;
     } else if ((ctxt->qr->construct || ctxt->qr->describe) && accept && strstr(accept, "application/rdf+xml")) {
       type = "sparql";
+    } else if (accept && strstr(accept, "application/x-4store-results")) {
+      type = "binary";
     } else if (accept && strstr(accept, "application/sparql-results+xml")) {
       type = "sparql";
     } else if (accept && strstr(accept, "application/sparql-results+json")) {
@@ -444,6 +860,7 @@ static void http_query_worker(gpointer data, gpointer user_data)
     rows_returned = ctxt->qr->rows_output;
     if (ctxt->qr->offset > 0)
       rows_returned -= ctxt->qr->offset;
+    abandoned = ctxt->qr->abandoned;
     fs_query_free(ctxt->qr);
     ctxt->qr = NULL;
     free(ctxt->query_string);
@@ -455,6 +872,19 @@ static void http_query_worker(gpointer data, gpointer user_data)
 
     fclose(fp);
   }
+  http_running_remove(ctxt);
+
+  if (ctxt->capture) {
+    /* fclose() has flushed the last of the output through http_capture(),
+       incomplete results aren't worth keeping */
+    if (!abandoned) {
+      fs_result_cache_put(result_cache, cache_key, generation,
+                          ctxt->capture->str, ctxt->capture->len);
+    }
+    g_string_free(ctxt->capture, TRUE);
+    ctxt->capture = NULL;
+  }
+  g_free(cache_key);
 
   if (ql_file) {
     if (rows_returned > -1) {
@@ -469,6 +899,42 @@ static void http_query_worker(gpointer data, gpointer user_data)
   http_close(ctxt);
 }
 
+static void http_query_worker(gpointer data, gpointer user_data)
+{
+  client_ctxt *ctxt = (client_ctxt *) data;
+  /* ctxt may be gone once the query has run */
+  fs_sched_class class = ctxt->sched_class;
+  double then = fs_time();
+
+  http_run_query(ctxt);
+  fs_scheduler_done(scheduler, class, fs_time() - then);
+}
+
+static void http_sched_start(void *item)
+{
+  g_thread_pool_push(pool, item, NULL);
+}
+
+static fs_sched_class http_query_class(client_ctxt *ctxt, const char *query, int *demoted)
+{
+  fs_sched_class class = default_priority;
+
+  if (ctxt->apikey && apikey_priority) {
+    long found = (long) g_hash_table_lookup(apikey_priority, ctxt->apikey);
+    if (found) class = found - 1;
+  }
+
+  *demoted = 0;
+  if (class < FS_SCHED_LOW && expensive_cost > 0.0 &&
+      (ctxt->prepared ? fs_prepared_estimate(ctxt->prepared) :
+       fs_query_estimate(query_state, fsplink, bu, query)) > expensive_cost) {
+    class = FS_SCHED_LOW;
+    *demoted = 1;
+  }
+
+  return class;
+}
+
 static void http_answer_query(client_ctxt *ctxt, const char *query)
 {
   ctxt->query_id = ++last_query_id;
@@ -476,7 +942,71 @@ static void http_answer_query(client_ctxt *ctxt, const char *query)
   ctxt->query_string = g_strdup(query);
   ctxt->update_string = NULL;
   g_source_remove_by_user_data(ctxt);
-  g_thread_pool_push(pool, ctxt, NULL);
+
+  int demoted;
+  ctxt->sched_class = http_query_class(ctxt, query, &demoted);
+  fs_scheduler_submit(scheduler, ctxt->sched_class, ctxt, demoted);
+}
+
+/* register a query to be run later with prepared=handle, the same query
+ * always gets the same handle */
+static void http_prepare_query(client_ctxt *ctxt, const char *query)
+{
+  char *handle = g_strdup_printf("%016llx", fs_hash_literal(query, 0));
+  fs_prepared *p = g_hash_table_lookup(prepared_queries, handle);
+
+  if (p && strcmp(fs_prepared_query(p), query)) {
+    http_error(ctxt, "500 prepared query handle collision");
+  } else if (!p && g_hash_table_size(prepared_queries) >= PREPARED_QUERY_MAX) {
+    http_error(ctxt, "503 too many prepared queries");
+  } else {
+    char *error = NULL;
+    if (!p) {
+      p = fs_query_prepare(query_state, fsplink, bu, query, &error);
+    }
+    if (!p) {
+      http_error(ctxt, "400 Parser error");
+      http_send(ctxt, "\n");
+      http_send(ctxt, error);
+      http_send(ctxt, "\n");
+      g_free(error);
+    } else {
+      http_header(ctxt, "200 OK", "text/plain; charset=UTF-8");
+      http_send(ctxt, handle);
+      http_send(ctxt, "\n");
+      if (!g_hash_table_lookup(prepared_queries, handle)) {
+        /* the table keeps the handle */
+        g_hash_table_insert(prepared_queries, handle, p);
+        handle = NULL;
+      }
+    }
+  }
+  g_free(handle);
+  http_close(ctxt);
+}
+
+static void http_sparql_request(client_ctxt *ctxt, const char *query,
+                                const char *prepared, int prepare)
+{
+  if (graph_access_control && !ctxt->apikey) {
+    http_error(ctxt, "403 forbidden - apikey parameter has to be included in request.");
+    http_close(ctxt);
+  } else if (prepare && query) {
+    http_prepare_query(ctxt, query);
+  } else if (prepared) {
+    ctxt->prepared = g_hash_table_lookup(prepared_queries, prepared);
+    if (ctxt->prepared) {
+      http_answer_query(ctxt, fs_prepared_query(ctxt->prepared));
+    } else {
+      http_error(ctxt, "404 no such prepared query");
+      http_close(ctxt);
+    }
+  } else if (query) {
+    http_answer_query(ctxt, query);
+  } else {
+    http_error(ctxt, "500 SPARQL protocol error");
+    http_close(ctxt);
+  }
 }
 
 static GSList *import_queue = NULL;
@@ -510,7 +1040,6 @@ static void http_import_start(client_ctxt *ctxt)
 #if RASQAL_VERSION > 917
     char *message = NULL;
     int ret = fs_update(query_state, ctxt->update_string, &message, unsafe);
-    fs_query_cache_flush(query_state, 0);
     http_import_queue_remove(ctxt);
     if (ret == 0) {
       http_send(ctxt, "HTTP/1.0 200 OK\r\n");
@@ -548,7 +1077,9 @@ static void http_import_start(client_ctxt *ctxt)
 
   const char *expect = g_hash_table_lookup(ctxt->headers, "expect");
   if (expect && !strcasecmp(expect, "100-continue")) {
-    http_send(ctxt, "HTTP/1.0 100 Continue\r\n\r\n");
+    /* interim response, outside the normal framing */
+    const char *cont = "HTTP/1.1 100 Continue\r\n\r\n";
+    http_send_all(ctxt, cont, strlen(cont));
   }
 
   if (fsp_start_import_all(fsplink)) {
@@ -563,7 +1094,9 @@ static void http_import_start(client_ctxt *ctxt)
   fs_rid muri = fs_hash_uri(ctxt->import_uri);
   fs_rid_vector_append(mvec, muri);
 
-  if (fsp_delete_model_all(fsplink, mvec) || fsp_new_model_all(fsplink, mvec)) {
+  /* appends leave the existing graph alone */
+  if (!ctxt->appending &&
+      (fsp_delete_model_all(fsplink, mvec) || fsp_new_model_all(fsplink, mvec))) {
     fs_error(LOG_ERR, "fsp_{delete,new}_model_all failed");
     fs_rid_vector_free(mvec);
     fsp_stop_import_all(fsplink);
@@ -574,8 +1107,12 @@ static void http_import_start(client_ctxt *ctxt)
   }
 
   fs_rid_vector_free(mvec);
+  import_touched = fs_cache_touched_new();
+  if (!ctxt->appending) {
+    fs_cache_touched_add(import_touched, muri, FS_RID_NULL);
+  }
   char *type = just_content_type(ctxt);
-  if (fs_import_stream_start(fsplink, ctxt->import_uri, type, has_o_index, &global_import_count)) {
+  if (fs_import_stream_start(fsplink, ctxt->import_uri, type, has_o_index, &global_import_count, import_touched)) {
     fs_error(LOG_CRIT, "failed to start stream parse");
   }
   g_free(type);
@@ -601,7 +1138,8 @@ static void http_post_data(client_ctxt *ctxt, char *model, const char *content_t
     return;
   }
 
-  fs_import_stream_start(fsplink, model, content_type, has_o_index, &global_import_count);
+  import_touched = fs_cache_touched_new();
+  fs_import_stream_start(fsplink, model, content_type, has_o_index, &global_import_count, import_touched);
 
   guint timeout = 30 + (ctxt->bytes_left / WATCHDOG_RATE);
   ctxt->watchdog = g_timeout_add(1000 * timeout, import_watchdog, ctxt);
@@ -619,7 +1157,9 @@ static void http_post_data(client_ctxt *ctxt, char *model, const char *content_t
   global_import_count = 0;
   fsp_stop_import_all(fsplink);
 
-  fs_query_cache_flush(query_state, 0);
+  fs_query_cache_invalidate(query_state, import_touched);
+  fs_cache_touched_free(import_touched);
+  import_touched = NULL;
 
   ctxt->importing = 0;
   fs_error(LOG_INFO, "finished add to %s", model);
@@ -658,9 +1198,12 @@ static void http_put_finished(client_ctxt *ctxt, const char *msg)
   global_import_count = 0;
   fsp_stop_import_all(fsplink);
 
-  fs_query_cache_flush(query_state, 0);
+  fs_query_cache_invalidate(query_state, import_touched);
+  fs_cache_touched_free(import_touched);
+  import_touched = NULL;
 
   ctxt->importing = 0;
+  ctxt->body_pending = ctxt->bytes_left;
   if (ctxt->bytes_left) {
     fs_error(LOG_INFO, "finished import %s (%ld bytes left)", ctxt->import_uri, ctxt->bytes_left);
   } else {
@@ -820,7 +1363,10 @@ static void http_delete_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
     fs_error(LOG_ERR, "error while trying to delete model <%s>", url);
     http_error(ctxt, "500 failed while adding new model");
   } else {
-    fs_query_cache_flush(query_state, 0);
+    fs_cache_touched *touched = fs_cache_touched_new();
+    fs_cache_touched_add(touched, muri, FS_RID_NULL);
+    fs_query_cache_invalidate(query_state, touched);
+    fs_cache_touched_free(touched);
     fs_error(LOG_INFO, "deleted model <%s>", url);
     http_error(ctxt, "200 deleted successfully");
   }
@@ -829,6 +1375,16 @@ static void http_delete_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
   http_close(ctxt);
 }
 
+static void http_prepared_totals(gpointer key, gpointer value, gpointer data)
+{
+  unsigned long *totals = data;
+  unsigned long hits, misses;
+
+  fs_prepared_stats(value, &hits, &misses);
+  totals[0] += hits;
+  totals[1] += misses;
+}
+
 static void http_status_report(client_ctxt *ctxt)
 {
   http_send(ctxt, "HTTP/1.0 200 OK\r\n"
@@ -842,19 +1398,90 @@ static void http_status_report(client_ctxt *ctxt)
   http_send(ctxt, fsp_kb_name(fsplink));
   http_send(ctxt, "</h2>\n");
 
-  char *running = g_strdup_printf("%u", g_thread_pool_get_num_threads(pool));
-  char *outstanding = g_strdup_printf("%u", g_thread_pool_unprocessed(pool));
+  fs_sched_stats stats[FS_SCHED_CLASSES];
+  int running = 0, outstanding = 0;
+  for (int c = 0; c < FS_SCHED_CLASSES; c++) {
+    fs_scheduler_stats(scheduler, c, &stats[c]);
+    running += stats[c].running;
+    outstanding += stats[c].queued;
+  }
+
+  char *line = g_strdup_printf("<table><tr><th>Running queries</th><td>%d</td></tr>\n"
+                               "<tr><th>Outstanding queries</th><td>%d</td></tr>\n"
+                               "</table>\n", running, outstanding);
+  http_send(ctxt, line);
+  g_free(line);
 
-  http_send(ctxt, "<table><tr><th>Running queries</th><td>");
-  http_send(ctxt, running); http_send(ctxt, "</td></tr>\n");
-  http_send(ctxt, "<tr><th>Outstanding queries</th><td>");
-  http_send(ctxt, outstanding); http_send(ctxt, "</td></tr>\n");
+  http_send(ctxt, "<h3>Query priorities</h3>\n<table border=1 cellpadding=4>\n"
+            "<tr><th>Class</th><th>Running</th><th>Queued</th><th>Limit</th>"
+            "<th>Admitted</th><th>Demoted</th></tr>\n");
+  for (int c = 0; c < FS_SCHED_CLASSES; c++) {
+    line = g_strdup_printf("<tr><th>%s</th><td>%d</td><td>%d</td><td>%d</td><td>%lu</td><td>%lu</td></tr>\n",
+                           fs_sched_class_name(c), stats[c].running, stats[c].queued,
+                           stats[c].limit, stats[c].admitted, stats[c].demoted);
+    http_send(ctxt, line);
+    g_free(line);
+  }
   http_send(ctxt, "</table>\n");
 
-  g_free(running);
-  g_free(outstanding);
+  http_send(ctxt, "<h3>Queue depth on arrival</h3>\n<table border=1 cellpadding=4>\n<tr><th>Class</th>");
+  for (int b = 0; b < FS_SCHED_DEPTH_BUCKETS; b++) {
+    line = g_strdup_printf("<th>%s</th>", fs_sched_depth_label(b));
+    http_send(ctxt, line);
+    g_free(line);
+  }
+  http_send(ctxt, "</tr>\n");
+  for (int c = 0; c < FS_SCHED_CLASSES; c++) {
+    http_send(ctxt, "<tr><th>");
+    http_send(ctxt, fs_sched_class_name(c));
+    http_send(ctxt, "</th>");
+    for (int b = 0; b < FS_SCHED_DEPTH_BUCKETS; b++) {
+      line = g_strdup_printf("<td>%lu</td>", stats[c].depth[b]);
+      http_send(ctxt, line);
+      g_free(line);
+    }
+    http_send(ctxt, "</tr>\n");
+  }
+  http_send(ctxt, "</table>\n");
+
+  http_send(ctxt, "<h3>Query latency</h3>\n<table border=1 cellpadding=4>\n<tr><th>Class</th><th></th>");
+  for (int b = 0; b < FS_SCHED_TIME_BUCKETS; b++) {
+    line = g_strdup_printf("<th>%s</th>", fs_sched_time_label(b));
+    http_send(ctxt, line);
+    g_free(line);
+  }
+  http_send(ctxt, "</tr>\n");
+  for (int c = 0; c < FS_SCHED_CLASSES; c++) {
+    for (int which = 0; which < 2; which++) {
+      unsigned long *hist = which ? stats[c].run : stats[c].wait;
+      line = g_strdup_printf("<tr><th>%s</th><th>%s</th>", fs_sched_class_name(c),
+                             which ? "running" : "queued");
+      http_send(ctxt, line);
+      g_free(line);
+      for (int b = 0; b < FS_SCHED_TIME_BUCKETS; b++) {
+        line = g_strdup_printf("<td>%lu</td>", hist[b]);
+        http_send(ctxt, line);
+        g_free(line);
+      }
+      http_send(ctxt, "</tr>\n");
+    }
+  }
+  http_send(ctxt, "</table>\n");
 
 
+  unsigned long totals[2] = { 0, 0 };
+  g_hash_table_foreach(prepared_queries, http_prepared_totals, totals);
+  unsigned long hits = totals[0], misses = totals[1];
+  line = g_strdup_printf("<h3>Prepared queries</h3>\n<table border=1 cellpadding=4>\n"
+                         "<tr><th>Registered</th><td>%u</td></tr>\n"
+                         "<tr><th>Executions</th><td>%lu</td></tr>\n"
+                         "<tr><th>Plan cache hits</th><td>%lu (%.1f%%)</td></tr>\n"
+                         "<tr><th>Plan cache misses</th><td>%lu</td></tr>\n</table>\n",
+                         g_hash_table_size(prepared_queries), hits + misses, hits,
+                         hits + misses ? 100.0 * hits / (hits + misses) : 0.0, misses);
+  http_send(ctxt, line);
+  g_free(line);
+
   http_send(ctxt, "<p><a href=\"/status/size/\">4store backend size info</a></p>\n");
   http_send(ctxt, "<p><a href=\"/test/\">Execute a test query</a></p>\n");
 
@@ -926,6 +1553,17 @@ static void http_cache_report(client_ctxt *ctxt) {
     100 * (query_state->cache_fail / (query_state->cache_hits+0.000)));
   http_send(ctxt, line);
   g_free(line);
+
+  unsigned long locks, contended;
+  fs_resolver_cache_stats(&locks, &contended);
+  line = g_strdup_printf("<tr><td>resolver_locks</td><td>%lu</td></tr>\n", locks);
+  http_send(ctxt, line);
+  g_free(line);
+
+  line = g_strdup_printf("<tr><td>resolver_contended</td><td>%lu (%.2f%%)</td></tr>\n",
+    contended, 100 * (contended / (locks+0.000)));
+  http_send(ctxt, line);
+  g_free(line);
   http_send(ctxt, "</table>\n");
 
   http_send(ctxt, "<h3>BIND cache stats</h3>\n");
@@ -942,6 +1580,26 @@ static void http_cache_report(client_ctxt *ctxt) {
   http_send(ctxt, line);
   g_free(line);
 
+  line = g_strdup_printf("<tr><td>bind_cache_miss</td><td>%d</td></tr>\n",
+    query_state->bind_hits - query_state->bind_cache_success);
+  http_send(ctxt, line);
+  g_free(line);
+
+  line = g_strdup_printf("<tr><td>bind_cache_replaced</td><td>%d</td></tr>\n",
+    query_state->bind_cache_replaced);
+  http_send(ctxt, line);
+  g_free(line);
+
+  line = g_strdup_printf("<tr><td>bind_cache_evictions</td><td>%d</td></tr>\n",
+    query_state->bind_cache_evictions);
+  http_send(ctxt, line);
+  g_free(line);
+
+  line = g_strdup_printf("<tr><td>bind_cache_flushes</td><td>%d</td></tr>\n",
+    query_state->bind_cache_flushes);
+  http_send(ctxt, line);
+  g_free(line);
+
   unsigned int count_bind = fs_query_bind_cache_count_slots(query_state);
   line = g_strdup_printf("<tr><td>bind_slots</td><td>%d (%.4f%%)</td></tr>\n",
     count_bind,
@@ -952,6 +1610,30 @@ static void http_cache_report(client_ctxt *ctxt) {
   g_static_mutex_unlock(&query_state->cache_mutex);
   http_send(ctxt, "</table>\n");
 
+  if (result_cache) {
+    fs_result_cache_stats rs;
+    fs_result_cache_get_stats(result_cache, &rs);
+
+    http_send(ctxt, "<h3>Result cache stats</h3>\n");
+    http_send(ctxt, "<table border=1 cellpadding=6>\n");
+    line = g_strdup_printf("<tr><td>result_hits</td><td>%lu (%.2f%%)</td></tr>\n"
+      "<tr><td>result_misses</td><td>%lu</td></tr>\n"
+      "<tr><td>result_stale</td><td>%lu</td></tr>\n"
+      "<tr><td>result_uncacheable</td><td>%lu</td></tr>\n"
+      "<tr><td>result_evictions</td><td>%lu</td></tr>\n"
+      "<tr><td>result_entries</td><td>%u</td></tr>\n"
+      "<tr><td>result_bytes</td><td>%zu of %zu (%.2f%%)</td></tr>\n",
+      rs.hits, 100 * (rs.hits / (rs.hits + rs.misses + 0.0001)),
+      rs.misses, rs.stale, rs.uncacheable, rs.evictions, rs.entries,
+      rs.bytes, rs.budget, 100 * (rs.bytes / (rs.budget + 0.0001)));
+    http_send(ctxt, line);
+    g_free(line);
+    if (result_cache_disabled) {
+      http_send(ctxt, "<tr><td colspan=2>disabled, backend has no write generation</td></tr>\n");
+    }
+    http_send(ctxt, "</table>\n");
+  }
+
   http_send(ctxt, "</body></html>\n");
   http_close(ctxt);
 }
@@ -1087,6 +1769,7 @@ static void http_query_widget(client_ctxt *ctxt)
    "\nSELECT * WHERE {\n ?s ?p ?o\n} LIMIT 10\n"
    "</textarea><br>\n"
    "<em>Soft limit</em> <input type=\"text\" name=\"soft-limit\">\n"
+   "<em>Timeout</em> <input type=\"text\" name=\"timeout\">\n"
    "<select name=\"output\">\n"
    "<option>xml</option>\n"   
    "<option>json</option>\n"
@@ -1112,6 +1795,8 @@ static void http_get_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
   url_decode(path);
   if (!strcmp(path, "/sparql/")) {
     char *query = NULL;
+    char *prepared = NULL;
+    int prepare = 0;
     while (qs) {
       char *ampersand = strchr(qs, '&');
       char *next = ampersand ? ampersand + 1 : NULL;
@@ -1130,6 +1815,8 @@ static void http_get_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
         query = value;
       } else if (!strcmp(key, "restricted")) {
         ctxt->query_flags |= FS_QUERY_RESTRICTED;
+      } else if (!strcmp(key, "cbd")) {
+        ctxt->query_flags |= FS_QUERY_DESCRIBE_CBD;
       } else if (!strcmp(key, "soft-limit") && value) {
         url_decode(value);
         if (strlen(value)) { /* ignore empty string, default form value */
@@ -1138,6 +1825,9 @@ static void http_get_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
   	    ctxt->soft_limit = -1;
 	  }
         }
+      } else if (!strcmp(key, "timeout") && value) {
+        url_decode(value);
+        http_set_timeout(ctxt, value);
       } else if (!strcmp(key, "output") && value) {
         url_decode(value);
         ctxt->output = g_strdup(value);
@@ -1150,19 +1840,18 @@ static void http_get_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
       } else if (!strcmp(key, "callback") && value) {
         url_decode(value);
         ctxt->json_function = g_strdup(value);
+      } else if (!strcmp(key, "prepare")) {
+        prepare = 1;
+      } else if (!strcmp(key, "prepared") && value) {
+        url_decode(value);
+        prepared = value;
+      } else if (key[0] == '$' && key[1] && value) {
+        url_decode(value);
+        http_add_param(ctxt, key + 1, value);
       }
       qs = next;
     }
-    if (graph_access_control && !ctxt->apikey) {
-        http_error(ctxt, "403 forbidden - apikey parameter has to be included in request.");
-        http_close(ctxt);
-    }
-    else if (query) {
-      http_answer_query(ctxt, query);
-    } else {
-      http_error(ctxt, "500 SPARQL protocol error");
-      http_close(ctxt);
-    }
+    http_sparql_request(ctxt, query, prepared, prepare);
   } else if (!strcmp(path, "/update/")) {
       http_error(ctxt, "500 SPARQL protocol error, update requests must use POST");
       http_close(ctxt);
@@ -1258,8 +1947,11 @@ static void http_post_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
         return;
       }
     }
+    ctxt->body_pending = 0;
 
     char *query = NULL;
+    char *prepared = NULL;
+    int prepare = 0;
     char *qs = form;
     while (qs) {
       char *ampersand = strchr(qs, '&');
@@ -1279,11 +1971,16 @@ static void http_post_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
         query = value;
       } else if (!strcmp(key, "restricted")) {
         ctxt->query_flags= FS_QUERY_RESTRICTED;
+      } else if (!strcmp(key, "cbd")) {
+        ctxt->query_flags |= FS_QUERY_DESCRIBE_CBD;
       } else if (!strcmp(key, "soft-limit") && value) {
         url_decode(value);
         if (strlen(value)) { /* ignore empty string, default form value */
           ctxt->soft_limit = atoi(value);
         }
+      } else if (!strcmp(key, "timeout") && value) {
+        url_decode(value);
+        http_set_timeout(ctxt, value);
       } else if (!strcmp(key, "output") && value) {
         url_decode(value);
         ctxt->output = g_strdup(value);
@@ -1296,19 +1993,18 @@ static void http_post_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
       } else if (!strcmp(key, "callback") && value) {
         url_decode(value);
         ctxt->json_function = g_strdup(value);
+      } else if (!strcmp(key, "prepare")) {
+        prepare = 1;
+      } else if (!strcmp(key, "prepared") && value) {
+        url_decode(value);
+        prepared = value;
+      } else if (key[0] == '$' && key[1] && value) {
+        url_decode(value);
+        http_add_param(ctxt, key + 1, value);
       }
       qs = next;
     }
-    if (graph_access_control && !ctxt->apikey) {
-        http_error(ctxt, "403 forbidden - apikey parameter has to be included in request.");
-        http_close(ctxt);
-    }
-    else if (query) {
-      http_answer_query(ctxt, query);
-    } else {
-      http_error(ctxt, "500 SPARQL protocol error");
-      http_close(ctxt);
-    }
+    http_sparql_request(ctxt, query, prepared, prepare);
     g_free(form);
 
   } else if (!strcmp(url, "/update/")) {
@@ -1347,6 +2043,7 @@ static void http_post_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
         return;
       }
     }
+    ctxt->body_pending = 0;
 
     char *update = NULL;
     char *qs = form;
@@ -1392,6 +2089,68 @@ static void http_post_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
     }
     g_free(form);
 
+  } else if (!strncmp(url, "/data/?", 7)) {
+    /* bulk append of pre-hashed data, see docs/binary-import */
+    char *form_type = just_content_type(ctxt);
+    if (!form_type || strcasecmp(form_type, FS_BINARY_MIME)) {
+      http_error(ctxt, "400 only " FS_BINARY_MIME " can be POSTed to /data/?graph=");
+      http_close(ctxt);
+      g_free(form_type);
+      return;
+    }
+    g_free(form_type);
+
+    char *graph = NULL;
+    char *qs = url + 7;
+    while (qs) {
+      char *ampersand = strchr(qs, '&');
+      char *next = ampersand ? ampersand + 1 : NULL;
+      if (next) {
+        *ampersand = '\0';
+      }
+      char *key = qs;
+      char *equals = strchr(qs, '=');
+      char *value = equals ? equals + 1 : NULL;
+      if (equals) {
+        *equals = '\0';
+      }
+      if (!strcmp(key, "graph") && value) {
+        url_decode(value);
+        graph = value;
+      } else if (!strcmp(key, "apikey") && value) {
+        url_decode(value);
+        ctxt->apikey = g_strdup(value);
+      }
+      qs = next;
+    }
+    if (!graph) {
+      http_error(ctxt, "400 graph parameter required");
+      http_close(ctxt);
+      return;
+    }
+    if (!data_modification_acl_granted(ctxt)) {
+      http_error(ctxt, "403 forbidden - updates only with admin API KEY when ACL is enabled");
+      http_close(ctxt);
+      return;
+    }
+    if (!g_hash_table_lookup(ctxt->headers, "content-length")) {
+      http_error(ctxt, "411 content length required");
+      http_close(ctxt);
+      return;
+    }
+
+    ctxt->import_uri = g_strdup(graph);
+    ctxt->update_string = NULL;
+    ctxt->appending = 1;
+
+    g_source_remove_by_user_data(ctxt);
+    if (import_queue) {
+      import_queue = g_slist_append(import_queue, ctxt);
+    } else {
+      import_queue = g_slist_append(import_queue, ctxt);
+      http_import_start(ctxt);
+    }
+
   } else if (!strcmp(url, "/data/")) {
     char *form_type = just_content_type(ctxt);
     if (!form_type || strcasecmp(form_type, "application/x-www-form-urlencoded")) {
@@ -1428,6 +2187,7 @@ static void http_post_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
         return;
       }
     }
+    ctxt->body_pending = 0;
 
     char *graph = NULL;
     char *mime_type = NULL;
@@ -1462,7 +2222,11 @@ static void http_post_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
       qs = next;
     }
 
-    if (graph && data) {
+    if (mime_type && !strcmp(mime_type, FS_BINARY_MIME)) {
+      /* form values end at the first NUL, binary streams are full of them */
+      http_error(ctxt, "400 " FS_BINARY_MIME " can't be sent in a form, POST it to /data/?graph=");
+      http_close(ctxt);
+    } else if (graph && data) {
       if (!data_modification_acl_granted(ctxt)) {
             http_error(ctxt, "403 forbidden - updates only with admin API KEY when ACL is enabled");
             http_close(ctxt);
@@ -1504,6 +2268,16 @@ static void http_options_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
 
 static void http_request(client_ctxt *ctxt, gchar *request)
 {
+  const char *version = strrchr(request, ' ');
+  const char *connection = g_hash_table_lookup(ctxt->headers, "connection");
+  const char *length = g_hash_table_lookup(ctxt->headers, "content-length");
+  ctxt->http11 = version && !strcmp(version + 1, "HTTP/1.1");
+  ctxt->body_pending = length ? atol(length) : 0;
+  /* HTTP/1.0 responses can't be chunked, so those connections just close */
+  ctxt->keepalive = keepalive_timeout > 0 && ctxt->http11 &&
+    !(connection && strcasestr(connection, "close")) &&
+    !g_hash_table_lookup(ctxt->headers, "transfer-encoding");
+
   if (!strncasecmp(request, "POST ", 5)) {
     /* POST request */
     ctxt->method = FS_HTTP_POST;
@@ -1609,6 +2383,11 @@ static gboolean recv_fn (GIOChannel *source, GIOCondition condition, gpointer da
   client_ctxt *ctxt = (client_ctxt *) data;
   GError *err = NULL;
 
+  if (ctxt->idle) {
+    g_source_remove(ctxt->idle);
+    ctxt->idle = 0;
+  }
+
   if (ctxt->importing) {
     gchar buffer[2048];
     gsize max = sizeof(buffer), read = 0;
@@ -1688,19 +2467,27 @@ gboolean accept_fn (GIOChannel *source, GIOCondition condition, gpointer data)
 {
   client_ctxt *ctxt = g_new0(client_ctxt, 1);
   ctxt->headers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  ctxt->out = g_string_sized_new(1024);
+  ctxt->chunk = g_string_sized_new(1024);
   ctxt->sock = accept(g_io_channel_unix_get_fd(source), NULL, NULL);
+  int on = 1;
+  setsockopt(ctxt->sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
   ctxt->query_flags = 0; /* FS_QUERY_RESTRICTED; default to unrestricted */
   if (default_graph) {
     ctxt->query_flags |= FS_QUERY_DEFAULT_GRAPH;
   }
   /* set default value */
   ctxt->soft_limit = soft_limit;
+  ctxt->timeout = query_timeout;
   fcntl(ctxt->sock, F_SETFL, O_NONBLOCK); /* non-blocking */
   GIOChannel *connector = g_io_channel_unix_new (ctxt->sock);
   g_io_channel_set_encoding(connector, NULL, NULL);
   g_io_channel_set_line_term(connector, "\r\n", -1);
   ctxt->ioch = connector;
   g_io_add_watch(connector, G_IO_IN, recv_fn, ctxt);
+  if (keepalive_timeout > 0) {
+    ctxt->idle = g_timeout_add_seconds(keepalive_timeout, http_idle_timeout, ctxt);
+  }
 
   return TRUE;
 }
@@ -1925,6 +2712,15 @@ static void child (int srv, char *kb_name, char *password)
   bu = raptor_new_uri(query_state->raptor_world, (unsigned char *)"local:local");
   g_thread_init(NULL);
   pool = g_thread_pool_new(http_query_worker, NULL, QUERY_THREAD_POOL_SIZE, FALSE, NULL);
+  scheduler = fs_scheduler_new(QUERY_THREAD_POOL_SIZE, http_sched_start);
+  prepared_queries = g_hash_table_new(g_str_hash, g_str_equal);
+  for (int c = 0; c < FS_SCHED_CLASSES; c++) {
+    fs_scheduler_set_limit(scheduler, c, priority_limit[c]);
+  }
+  g_timeout_add(1000, http_check_running, NULL);
+  if (result_cache_mb > 0) {
+    result_cache = fs_result_cache_new((size_t) result_cache_mb * 1024 * 1024);
+  }
 
   GMainLoop *loop = g_main_loop_new (NULL, FALSE);
   GIOChannel *listener = g_io_channel_unix_new (srv);
@@ -1986,7 +2782,7 @@ int main(int argc, char *argv[])
 
 
   int o;
-  while (!help && (o = getopt(argc, argv, "DCAH:p:Uds:O:Xc:")) != -1) {
+  while (!help && (o = getopt(argc, argv, "DCAH:p:Uds:O:Xc:k:R:T:")) != -1) {
     switch (o) {
       case 'D':
         daemonize = 0;
@@ -2025,6 +2821,15 @@ int main(int argc, char *argv[])
       case 'A':
         graph_access_control = 1;
         break;
+      case 'k':
+        keepalive_timeout = atoi(optarg);
+        break;
+      case 'R':
+        result_cache_mb = atoi(optarg);
+        break;
+      case 'T':
+        query_timeout = atof(optarg);
+        break;
       default:
         help = 1;
         break;
@@ -2032,7 +2837,7 @@ int main(int argc, char *argv[])
   }
 
   if (help || optind >= argc || optind < argc - 1) {
-    fprintf(stdout, "Usage: %s [-D] [-H host] [-p port] [-U] [-s limit] [-c path] <kbname>\n", basename(argv[0]));
+    fprintf(stdout, "Usage: %s [-D] [-H host] [-p port] [-U] [-s limit] [-k secs] [-R MB] [-T secs] [-c path] <kbname>\n", basename(argv[0]));
     fprintf(stdout, "       -H   specify host to listen on\n");
     fprintf(stdout, "       -p   specify port to listen on\n");
     fprintf(stdout, "       -D   do not daemonise\n");
@@ -2044,6 +2849,9 @@ int main(int argc, char *argv[])
     fprintf(stdout, "       -c   path to config file\n");
     fprintf(stdout, "       -C   enable cache stats in /status/cache\n");
     fprintf(stdout, "       -A   enable access control at graph level\n");
+    fprintf(stdout, "       -k   keep-alive idle timeout in seconds (0 to disable)\n");
+    fprintf(stdout, "       -R   result cache size in MB (0 to disable)\n");
+    fprintf(stdout, "       -T   seconds a query may run before it's abandoned (0 for no limit)\n");
     fprintf(stdout, "Options can also be set permenantly in /etc/4store.conf\n");
     fprintf(stdout, "see http://4store.org/trac/wiki/SparqlServer for details\n");
 
@@ -2094,6 +2902,76 @@ int main(int argc, char *argv[])
       }
     }
 
+    if (keepalive_timeout == -1) {
+      const char *keepalive_str = NULL;
+      set_string(keyfile, kb_name, "keepalive-timeout", &keepalive_str);
+      if (keepalive_str) {
+        keepalive_timeout = atoi(keepalive_str);
+      }
+    }
+
+    if (result_cache_mb == -1) {
+      const char *result_cache_str = NULL;
+      set_string(keyfile, kb_name, "result-cache-size", &result_cache_str);
+      if (result_cache_str) {
+        result_cache_mb = atoi(result_cache_str);
+      }
+    }
+
+    if (query_timeout < 0.0) {
+      const char *query_timeout_str = NULL;
+      set_string(keyfile, kb_name, "query-timeout", &query_timeout_str);
+      if (query_timeout_str) {
+        query_timeout = atof(query_timeout_str);
+      }
+    }
+
+    const char *priority_str = NULL;
+    set_string(keyfile, kb_name, "query-priority", &priority_str);
+    if (priority_str) {
+      default_priority = fs_sched_class_parse(priority_str);
+      if (default_priority < 0) {
+        fs_error(LOG_ERR, "unknown query-priority \"%s\", should be high, normal or low", priority_str);
+      }
+    }
+
+    static const char *slot_keys[FS_SCHED_CLASSES] = {
+      "high-priority-slots", "normal-priority-slots", "low-priority-slots"
+    };
+    for (int c = 0; c < FS_SCHED_CLASSES; c++) {
+      const char *slots_str = NULL;
+      set_string(keyfile, kb_name, slot_keys[c], &slots_str);
+      if (slots_str) {
+        priority_limit[c] = atoi(slots_str);
+      }
+    }
+
+    const char *apikey_keys[2] = { "priority-apikeys", "low-priority-apikeys" };
+    const fs_sched_class apikey_classes[2] = { FS_SCHED_HIGH, FS_SCHED_LOW };
+    for (int k = 0; k < 2; k++) {
+      const char *keys_str = NULL;
+      set_string(keyfile, kb_name, apikey_keys[k], &keys_str);
+      if (!keys_str) continue;
+      if (!apikey_priority) {
+        apikey_priority = g_hash_table_new(g_str_hash, g_str_equal);
+      }
+      char **keys = g_strsplit(keys_str, ",", 0);
+      for (int i = 0; keys[i]; i++) {
+        g_strstrip(keys[i]);
+        if (*keys[i]) {
+          g_hash_table_insert(apikey_priority, g_strdup(keys[i]),
+                              (gpointer) (long) (apikey_classes[k] + 1));
+        }
+      }
+      g_strfreev(keys);
+    }
+
+    const char *expensive_str = NULL;
+    set_string(keyfile, kb_name, "expensive-query-cost", &expensive_str);
+    if (expensive_str) {
+      expensive_cost = atof(expensive_str);
+    }
+
     if (opt_level == -1) {
       const char *opt_level_str = NULL;
       set_string(keyfile, kb_name, "opt-level", &opt_level_str);
@@ -2112,6 +2990,25 @@ int main(int argc, char *argv[])
   if (opt_level == -1) {
     opt_level = 3;
   }
+  if (keepalive_timeout == -1) {
+    keepalive_timeout = 15;
+  }
+  if (query_timeout < 0.0) {
+    query_timeout = 0.0;
+  }
+  if (default_priority < 0) {
+    default_priority = FS_SCHED_NORMAL;
+  }
+  /* unless configured, classes only decide which queued query starts next */
+  for (int c = 0; c < FS_SCHED_CLASSES; c++) {
+    if (priority_limit[c] < 1) {
+      priority_limit[c] = QUERY_THREAD_POOL_SIZE;
+    }
+  }
+  /* estimating parses every query on the main loop, so it's opt-in */
+  if (expensive_cost < 0.0) {
+    expensive_cost = 0.0;
+  }
   if (!port) {
     port = "8080";
   }
@@ -2131,6 +3028,15 @@ int main(int argc, char *argv[])
   if (opt_level != 3) {
     fs_error(LOG_INFO, "Setting query optimiser level to %d", opt_level);
   }
+  if (result_cache_mb > 0) {
+    fs_error(LOG_INFO, "result cache enabled, %dMB", result_cache_mb);
+  }
+  if (query_timeout > 0.0) {
+    fs_error(LOG_INFO, "queries time out after %gs", query_timeout);
+  }
+  if (default_priority != FS_SCHED_NORMAL) {
+    fs_error(LOG_INFO, "queries run at %s priority", fs_sched_class_name(default_priority));
+  }
 
   pid_t wpid;
   do {
@@ -35,6 +35,7 @@ typedef struct {
   GIOChannel *ioch;
   GHashTable *headers;
   int importing;
+  int appending;
   char *import_uri;
   long bytes_left;
   GByteArray *partial;
@@ -49,4 +50,19 @@ typedef struct {
   double start_time;
   char *apikey;
   char *json_function;
+  int http11;        /* request was HTTP/1.1 */
+  int keepalive;     /* connection persists after this response */
+  int chunked;       /* response body uses chunked transfer encoding */
+  int in_body;       /* response headers have been sent */
+  int broken;        /* a send failed, drop further output */
+  long body_pending; /* request body bytes not yet consumed */
+  GString *out;      /* framed response bytes waiting to be sent */
+  GString *chunk;    /* response body waiting to be framed */
+  guint idle;        /* keep-alive idle timeout source */
+  GString *capture;  /* copy of the query response for the result cache */
+  double timeout;    /* seconds the query may run, 0 for no limit */
+  fs_query_control control; /* deadline and cancellation of the running query */
+  int sched_class;   /* fs_sched_class the query was admitted to */
+  fs_prepared *prepared; /* the request runs this rather than query_string */
+  GArray *params;    /* fs_query_params for the prepared query */
 } client_ctxt;
@@ -0,0 +1,296 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <glib.h>
+
+#include "result-cache.h"
+
+/* rough per-entry cost of the hash table and list links */
+#define ENTRY_OVERHEAD 64
+
+typedef struct _entry {
+    char *key;
+    char *data;
+    size_t length;
+    unsigned long long generation;
+    struct _entry *prev; /* more recently used */
+    struct _entry *next; /* less recently used */
+} entry;
+
+struct _fs_result_cache {
+    GStaticMutex mutex;
+    GHashTable *table;
+    entry *newest;
+    entry *oldest;
+    fs_result_cache_stats stats;
+};
+
+/* functions whose value differs from one execution to the next */
+static const char *volatile_functions[] = {
+    "rand", "now", "uuid", "struuid", "bnode", NULL
+};
+
+static size_t entry_cost(entry *e)
+{
+    return strlen(e->key) + e->length + ENTRY_OVERHEAD;
+}
+
+static void unlink_entry(fs_result_cache *rc, entry *e)
+{
+    if (e->prev) e->prev->next = e->next;
+    else rc->newest = e->next;
+    if (e->next) e->next->prev = e->prev;
+    else rc->oldest = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void push_entry(fs_result_cache *rc, entry *e)
+{
+    e->prev = NULL;
+    e->next = rc->newest;
+    if (rc->newest) rc->newest->prev = e;
+    rc->newest = e;
+    if (!rc->oldest) rc->oldest = e;
+}
+
+/* the table owns the entries, removing the key frees the entry */
+static void remove_entry(fs_result_cache *rc, entry *e)
+{
+    unlink_entry(rc, e);
+    rc->stats.bytes -= entry_cost(e);
+    rc->stats.entries--;
+    g_hash_table_remove(rc->table, e->key);
+}
+
+static void free_entry(gpointer data)
+{
+    entry *e = data;
+
+    g_free(e->key);
+    g_free(e->data);
+    g_free(e);
+}
+
+fs_result_cache *fs_result_cache_new(size_t budget)
+{
+    fs_result_cache *rc = g_new0(fs_result_cache, 1);
+
+    g_static_mutex_init(&rc->mutex);
+    rc->table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, free_entry);
+    rc->stats.budget = budget;
+
+    return rc;
+}
+
+void fs_result_cache_free(fs_result_cache *rc)
+{
+    if (!rc) return;
+
+    g_hash_table_destroy(rc->table);
+    g_static_mutex_free(&rc->mutex);
+    g_free(rc);
+}
+
+size_t fs_result_cache_max_entry(fs_result_cache *rc)
+{
+    /* one result shouldn't be able to flush most of the cache */
+    return rc->stats.budget / 4;
+}
+
+static int is_volatile(const char *word, size_t len)
+{
+    for (int i=0; volatile_functions[i]; i++) {
+        if (strlen(volatile_functions[i]) == len &&
+            !g_ascii_strncasecmp(word, volatile_functions[i], len)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* collapses whitespace and comments outside of strings and IRIs, so that
+ * trivially different spellings of a query share an entry, returns NULL if
+ * the query calls a function that makes its results unrepeatable */
+static char *normalise_query(const char *query)
+{
+    GString *out = g_string_sized_new(strlen(query));
+    const char *p = query;
+    int space = 0;
+
+    while (*p) {
+        if (isspace((unsigned char) *p)) {
+            space = 1;
+            p++;
+            continue;
+        }
+        if (*p == '#') {
+            while (*p && *p != '\n') p++;
+            space = 1;
+            continue;
+        }
+        if (space && out->len) {
+            g_string_append_c(out, ' ');
+        }
+        space = 0;
+
+        if (*p == '"' || *p == '\'') {
+            const char q = *p;
+            const char *start = p;
+            if (p[1] == q && p[2] == q) {
+                /* long string, ends at the next unescaped triple quote */
+                p += 3;
+                while (*p && !(p[0] == q && p[1] == q && p[2] == q)) {
+                    if (*p == '\\' && p[1]) p++;
+                    p++;
+                }
+                p += *p ? 3 : 0;
+            } else {
+                p++;
+                while (*p && *p != q) {
+                    if (*p == '\\' && p[1]) p++;
+                    p++;
+                }
+                p += *p ? 1 : 0;
+            }
+            g_string_append_len(out, start, p - start);
+        } else if (*p == '<') {
+            /* an IRI can't contain whitespace, so if there's none before the
+             * closing > copy it verbatim, otherwise it's an operator */
+            const char *end = p + 1;
+            while (*end && *end != '>' && *end != '<' &&
+                   !isspace((unsigned char) *end)) {
+                end++;
+            }
+            if (*end == '>') {
+                g_string_append_len(out, p, end - p + 1);
+                p = end + 1;
+            } else {
+                g_string_append_c(out, *p++);
+            }
+        } else if (isalpha((unsigned char) *p)) {
+            const char *start = p;
+            while (isalnum((unsigned char) *p) || *p == '_' || *p == ':' ||
+                   *p == '-' || *p == '.') {
+                p++;
+            }
+            const char *after = p;
+            while (isspace((unsigned char) *after)) after++;
+            if (*after == '(' && is_volatile(start, p - start)) {
+                g_string_free(out, TRUE);
+
+                return NULL;
+            }
+            g_string_append_len(out, start, p - start);
+        } else {
+            g_string_append_c(out, *p++);
+        }
+    }
+
+    return g_string_free(out, FALSE);
+}
+
+char *fs_result_cache_key(fs_result_cache *rc, const char *query,
+                          const char *variant)
+{
+    char *norm = normalise_query(query);
+    if (!norm) {
+        g_static_mutex_lock(&rc->mutex);
+        rc->stats.uncacheable++;
+        g_static_mutex_unlock(&rc->mutex);
+
+        return NULL;
+    }
+    char *key = g_strconcat(variant, "\n", norm, NULL);
+    g_free(norm);
+
+    return key;
+}
+
+int fs_result_cache_get(fs_result_cache *rc, const char *key,
+                        unsigned long long generation,
+                        char **data, size_t *length)
+{
+    int ret = 0;
+
+    g_static_mutex_lock(&rc->mutex);
+    entry *e = g_hash_table_lookup(rc->table, key);
+    if (e && e->generation != generation) {
+        /* the store has been written to since, it will never be valid again */
+        remove_entry(rc, e);
+        rc->stats.stale++;
+        e = NULL;
+    }
+    if (e) {
+        unlink_entry(rc, e);
+        push_entry(rc, e);
+        *data = g_memdup(e->data, e->length);
+        *length = e->length;
+        rc->stats.hits++;
+        ret = 1;
+    } else {
+        rc->stats.misses++;
+    }
+    g_static_mutex_unlock(&rc->mutex);
+
+    return ret;
+}
+
+void fs_result_cache_put(fs_result_cache *rc, const char *key,
+                         unsigned long long generation,
+                         const char *data, size_t length)
+{
+    entry *e = g_new0(entry, 1);
+    e->key = g_strdup(key);
+    e->data = g_memdup(data, length);
+    e->length = length;
+    e->generation = generation;
+    const size_t cost = entry_cost(e);
+
+    g_static_mutex_lock(&rc->mutex);
+    if (cost > fs_result_cache_max_entry(rc)) {
+        g_static_mutex_unlock(&rc->mutex);
+        free_entry(e);
+
+        return;
+    }
+    entry *old = g_hash_table_lookup(rc->table, key);
+    if (old) {
+        remove_entry(rc, old);
+    }
+    while (rc->oldest && rc->stats.bytes + cost > rc->stats.budget) {
+        remove_entry(rc, rc->oldest);
+        rc->stats.evictions++;
+    }
+    g_hash_table_insert(rc->table, e->key, e);
+    push_entry(rc, e);
+    rc->stats.bytes += cost;
+    rc->stats.entries++;
+    g_static_mutex_unlock(&rc->mutex);
+}
+
+void fs_result_cache_get_stats(fs_result_cache *rc, fs_result_cache_stats *stats)
+{
+    g_static_mutex_lock(&rc->mutex);
+    *stats = rc->stats;
+    g_static_mutex_unlock(&rc->mutex);
+}
+
+/* vi:set expandtab sts=4 sw=4: */
@@ -0,0 +1,45 @@
+#ifndef RESULT_CACHE_H
+#define RESULT_CACHE_H
+
+/* Whole-result cache for 4s-httpd, holds serialised query responses keyed on
+ * the query and everything else that affects the bytes sent. Entries are
+ * tagged with the store write generation they were computed at, and are
+ * only served while the store is still at that generation. */
+
+#include <stddef.h>
+
+typedef struct _fs_result_cache fs_result_cache;
+
+typedef struct {
+    size_t budget;
+    size_t bytes;
+    unsigned int entries;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long stale;
+    unsigned long evictions;
+    unsigned long uncacheable;
+} fs_result_cache_stats;
+
+/* budget is in bytes, keys and bookkeeping included */
+fs_result_cache *fs_result_cache_new(size_t budget);
+void fs_result_cache_free(fs_result_cache *rc);
+
+/* largest response worth capturing for the cache */
+size_t fs_result_cache_max_entry(fs_result_cache *rc);
+
+/* returns a newly allocated key, or NULL if the query shouldn't be cached */
+char *fs_result_cache_key(fs_result_cache *rc, const char *query,
+                          const char *variant);
+
+/* on a hit returns 1 and a copy of the cached bytes in *data */
+int fs_result_cache_get(fs_result_cache *rc, const char *key,
+                        unsigned long long generation,
+                        char **data, size_t *length);
+void fs_result_cache_put(fs_result_cache *rc, const char *key,
+                         unsigned long long generation,
+                         const char *data, size_t length);
+
+void fs_result_cache_get_stats(fs_result_cache *rc, fs_result_cache_stats *stats);
+
+#endif
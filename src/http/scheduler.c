@@ -0,0 +1,179 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "scheduler.h"
+#include "../common/4s-datatypes.h"
+
+typedef struct {
+    void *item;
+    double queued_at;
+} waiting;
+
+struct _fs_scheduler {
+    GStaticMutex mutex;
+    void (*start)(void *item);
+    int slots;
+    int running;
+    GQueue *queue[FS_SCHED_CLASSES];
+    fs_sched_stats stats[FS_SCHED_CLASSES];
+};
+
+static const char *class_names[FS_SCHED_CLASSES] = {
+    "high", "normal", "low"
+};
+
+static const char *depth_labels[FS_SCHED_DEPTH_BUCKETS] = {
+    "0", "1", "2-3", "4-7", "8-15", "16-31", "32-63", "64+"
+};
+
+static const char *time_labels[FS_SCHED_TIME_BUCKETS] = {
+    "&lt;1ms", "&lt;10ms", "&lt;100ms", "&lt;1s", "&lt;10s", "&lt;100s", "100s+"
+};
+
+static int depth_bucket(int depth)
+{
+    int b = 0;
+
+    while (depth > 0 && b < FS_SCHED_DEPTH_BUCKETS - 1) {
+        depth >>= 1;
+        b++;
+    }
+
+    return b;
+}
+
+static int time_bucket(double secs)
+{
+    double limit = 0.001;
+    int b = 0;
+
+    while (secs >= limit && b < FS_SCHED_TIME_BUCKETS - 1) {
+        limit *= 10.0;
+        b++;
+    }
+
+    return b;
+}
+
+fs_scheduler *fs_scheduler_new(int slots, void (*start)(void *item))
+{
+    fs_scheduler *s = g_new0(fs_scheduler, 1);
+
+    g_static_mutex_init(&s->mutex);
+    s->start = start;
+    s->slots = slots;
+    for (int c=0; c<FS_SCHED_CLASSES; c++) {
+        s->queue[c] = g_queue_new();
+        s->stats[c].limit = slots;
+    }
+
+    return s;
+}
+
+void fs_scheduler_set_limit(fs_scheduler *s, fs_sched_class c, int limit)
+{
+    g_static_mutex_lock(&s->mutex);
+    /* a class that can never run would hold its queries forever */
+    s->stats[c].limit = limit < 1 ? 1 : limit;
+    g_static_mutex_unlock(&s->mutex);
+}
+
+/* start as many queued queries as the limits allow, highest class first,
+ * called with the scheduler locked */
+static void dispatch(fs_scheduler *s)
+{
+    for (int c=0; c<FS_SCHED_CLASSES && s->running < s->slots; c++) {
+        fs_sched_stats *st = &s->stats[c];
+        while (st->queued && st->running < st->limit && s->running < s->slots) {
+            waiting *w = g_queue_pop_head(s->queue[c]);
+            st->queued--;
+            st->running++;
+            s->running++;
+            st->wait[time_bucket(fs_time() - w->queued_at)]++;
+            s->start(w->item);
+            g_free(w);
+        }
+    }
+}
+
+void fs_scheduler_submit(fs_scheduler *s, fs_sched_class c, void *item,
+                         int demoted)
+{
+    waiting *w = g_new(waiting, 1);
+
+    w->item = item;
+    w->queued_at = fs_time();
+
+    g_static_mutex_lock(&s->mutex);
+    fs_sched_stats *st = &s->stats[c];
+    st->depth[depth_bucket(st->queued)]++;
+    st->admitted++;
+    if (demoted) st->demoted++;
+    g_queue_push_tail(s->queue[c], w);
+    st->queued++;
+    dispatch(s);
+    g_static_mutex_unlock(&s->mutex);
+}
+
+void fs_scheduler_done(fs_scheduler *s, fs_sched_class c, double run_time)
+{
+    g_static_mutex_lock(&s->mutex);
+    s->stats[c].running--;
+    s->running--;
+    s->stats[c].run[time_bucket(run_time)]++;
+    dispatch(s);
+    g_static_mutex_unlock(&s->mutex);
+}
+
+void fs_scheduler_stats(fs_scheduler *s, fs_sched_class c, fs_sched_stats *stats)
+{
+    g_static_mutex_lock(&s->mutex);
+    *stats = s->stats[c];
+    g_static_mutex_unlock(&s->mutex);
+}
+
+const char *fs_sched_class_name(fs_sched_class c)
+{
+    return class_names[c];
+}
+
+int fs_sched_class_parse(const char *name)
+{
+    for (int c=0; c<FS_SCHED_CLASSES; c++) {
+        if (!g_ascii_strcasecmp(name, class_names[c])) {
+            return c;
+        }
+    }
+
+    return -1;
+}
+
+const char *fs_sched_depth_label(int bucket)
+{
+    return depth_labels[bucket];
+}
+
+const char *fs_sched_time_label(int bucket)
+{
+    return time_labels[bucket];
+}
+
+/* vi:set expandtab sts=4 sw=4: */
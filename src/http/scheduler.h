@@ -0,0 +1,56 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+/* Admission control for 4s-httpd queries. Each query is put in a priority
+ * class, classes are served in priority order, and each has its own limit
+ * on how many of its queries run at once, so a flood of expensive queries
+ * can't hold every worker. */
+
+typedef enum {
+    FS_SCHED_HIGH = 0,
+    FS_SCHED_NORMAL,
+    FS_SCHED_LOW,
+    FS_SCHED_CLASSES
+} fs_sched_class;
+
+/* queue lengths seen on arrival: 0, 1, 2-3, 4-7 ... 64 and over */
+#define FS_SCHED_DEPTH_BUCKETS 8
+/* times: under 1ms, 10ms, 100ms, 1s, 10s, 100s, and longer */
+#define FS_SCHED_TIME_BUCKETS 7
+
+typedef struct {
+    int limit;          /* most queries of the class running at once */
+    int running;
+    int queued;
+    unsigned long admitted;
+    unsigned long demoted; /* sent here because of their estimated cost */
+    unsigned long depth[FS_SCHED_DEPTH_BUCKETS];
+    unsigned long wait[FS_SCHED_TIME_BUCKETS]; /* time spent queued */
+    unsigned long run[FS_SCHED_TIME_BUCKETS];  /* time spent running */
+} fs_sched_stats;
+
+typedef struct _fs_scheduler fs_scheduler;
+
+/* start is called, with the scheduler locked, to hand a query to a worker,
+ * slots is the most that can run at once in all classes */
+fs_scheduler *fs_scheduler_new(int slots, void (*start)(void *item));
+
+void fs_scheduler_set_limit(fs_scheduler *s, fs_sched_class c, int limit);
+
+/* queue a query, starting it now if its class has a free slot */
+void fs_scheduler_submit(fs_scheduler *s, fs_sched_class c, void *item,
+                         int demoted);
+
+/* a query of class c has finished after running for the given seconds */
+void fs_scheduler_done(fs_scheduler *s, fs_sched_class c, double run_time);
+
+void fs_scheduler_stats(fs_scheduler *s, fs_sched_class c, fs_sched_stats *stats);
+
+const char *fs_sched_class_name(fs_sched_class c);
+/* returns -1 for a name that isn't a class */
+int fs_sched_class_parse(const char *name);
+
+const char *fs_sched_depth_label(int bucket);
+const char *fs_sched_time_label(int bucket);
+
+#endif
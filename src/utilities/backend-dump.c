@@ -0,0 +1,489 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Dumps the primary segments held on this node straight from the index
+ * files, one thread and one output file per segment. N-Quads output needs
+ * every segment on this node to resolve RIDs, the binary form (see
+ * docs/binary-import) doesn't, as each file carries the resources stored in
+ * its own segment.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <glib.h>
+
+#include "../common/4store.h"
+#include "../common/error.h"
+#include "../common/params.h"
+#include "../common/4s-store-root.h"
+#include "../backend/backend.h"
+#include "../backend/backend-intl.h"
+#include "../backend/lock.h"
+#include "../frontend/binary-rdf.h"
+
+#define QUAD_BATCH 4096
+
+#define CACHE_SIZE (1 << 16)
+#define CACHE_MASK (CACHE_SIZE - 1)
+
+#define OUT_BUFFER (1 << 20)
+
+typedef struct {
+    const char *kb;
+    fs_backend *be;
+    fs_segment segment;
+    int segments;
+    int binary;
+    char *filename;
+    FILE *out;
+    fs_rhash **res;         /* every segment's resources, N-Quads only */
+    fs_resource *cache;
+    long long quads;
+    long long resources;
+    int errors;
+    double time;
+} dump_job;
+
+static int verbosity = 0;
+
+static void binary_record(FILE *out, int type, const void *payload, uint32_t length)
+{
+    unsigned char header[FS_BINARY_RECORD_HEADER] = { type, 0, 0, 0 };
+
+    memcpy(header + 4, &length, sizeof(length));
+    fwrite(header, sizeof(header), 1, out);
+    if (length) fwrite(payload, length, 1, out);
+}
+
+static void binary_header(FILE *out)
+{
+    unsigned char header[FS_BINARY_HEADER];
+    uint32_t bom = FS_BINARY_BOM;
+    uint32_t hash = FS_HASH_UMAC; /* the only one fs_backend_init accepts */
+
+    memcpy(header, FS_BINARY_MAGIC, FS_BINARY_MAGIC_LEN);
+    memcpy(header + 8, &bom, sizeof(bom));
+    memcpy(header + 12, &hash, sizeof(hash));
+    fwrite(header, sizeof(header), 1, out);
+}
+
+/* stream this segment's resources in table order */
+static void dump_resources(dump_job *job)
+{
+    char *filename = g_strdup_printf(fs_get_rhash_format(), job->kb, job->segment, "res");
+    fs_rhash *rh = fs_rhash_open_filename(filename, O_RDONLY);
+    g_free(filename);
+    if (!rh) {
+        job->errors++;
+
+        return;
+    }
+
+    fs_rhash_it *it = fs_rhash_scan(rh);
+    fs_resource res;
+    GByteArray *payload = g_byte_array_new();
+    while (fs_rhash_scan_next(it, &res)) {
+        g_byte_array_set_size(payload, 0);
+        g_byte_array_append(payload, (guint8 *)&res.rid, sizeof(fs_rid));
+        g_byte_array_append(payload, (guint8 *)&res.attr, sizeof(fs_rid));
+        g_byte_array_append(payload, (guint8 *)res.lex, strlen(res.lex));
+        binary_record(job->out, FS_BINARY_RESOURCE, payload->data, payload->len);
+        free(res.lex);
+        job->resources++;
+    }
+    g_byte_array_free(payload, TRUE);
+    fs_rhash_it_free(it);
+    fs_rhash_close(rh);
+}
+
+/* make sure every RID in the batch is in the cache, one sorted pass over
+ * each segment's resource table */
+static void resolve_batch(dump_job *job, fs_rid *rids, int count)
+{
+    fs_resource *todo[job->segments];
+    int length[job->segments];
+
+    for (int s = 0; s < job->segments; s++) {
+        todo[s] = malloc(count * sizeof(fs_resource));
+        length[s] = 0;
+    }
+    for (int i = 0; i < count; i++) {
+        const fs_rid rid = rids[i];
+        if (rid == FS_RID_NULL || rid == 0 || FS_IS_BNODE(rid) ||
+            job->cache[rid & CACHE_MASK].rid == rid) continue;
+        const int s = FS_RID_SEGMENT(rid, job->segments);
+        todo[s][length[s]++].rid = rid;
+        /* stops duplicates in this batch, filled in below */
+        free(job->cache[rid & CACHE_MASK].lex);
+        job->cache[rid & CACHE_MASK].lex = NULL;
+        job->cache[rid & CACHE_MASK].rid = rid;
+    }
+    for (int s = 0; s < job->segments; s++) {
+        if (length[s] && fs_rhash_get_multi(job->res[s], todo[s], length[s])) {
+            job->errors++;
+        }
+        for (int i = 0; i < length[s]; i++) {
+            fs_resource *c = &job->cache[todo[s][i].rid & CACHE_MASK];
+            if (c->rid == todo[s][i].rid && !c->lex) {
+                *c = todo[s][i];
+            } else {
+                free(todo[s][i].lex);
+            }
+        }
+        free(todo[s]);
+    }
+}
+
+static const char *lookup(dump_job *job, fs_rid rid)
+{
+    fs_resource *c = &job->cache[rid & CACHE_MASK];
+    if (c->rid != rid || !c->lex) {
+        /* evicted by a colliding RID in the same batch */
+        fs_resource res = { .rid = rid, .lex = NULL };
+        if (fs_rhash_get(job->res[FS_RID_SEGMENT(rid, job->segments)], &res)) {
+            job->errors++;
+        }
+        free(c->lex);
+        *c = res;
+    }
+
+    return c->lex;
+}
+
+static void write_escaped(FILE *out, const char *str)
+{
+    for (const char *c = str; *c; c++) {
+        switch (*c) {
+        case '\\': fputs("\\\\", out); break;
+        case '"': fputs("\\\"", out); break;
+        case '\n': fputs("\\n", out); break;
+        case '\r': fputs("\\r", out); break;
+        case '\t': fputs("\\t", out); break;
+        default:
+            if ((unsigned char)*c < 0x20 || *c == 0x7f) {
+                fprintf(out, "\\u%04X", (unsigned char)*c);
+            } else {
+                putc(*c, out);
+            }
+        }
+    }
+}
+
+/* characters N-Quads doesn't allow in an IRI are written as \u escapes, as
+ * IRIs have no other escapes */
+static void write_uri(FILE *out, const char *uri)
+{
+    putc('<', out);
+    for (const unsigned char *c = (const unsigned char *)uri; *c; c++) {
+        if (*c <= 0x20 || *c == 0x7f || strchr("<>\"{}|^`\\", *c)) {
+            fprintf(out, "\\u%04X", *c);
+        } else {
+            putc(*c, out);
+        }
+    }
+    putc('>', out);
+}
+
+static void write_term(dump_job *job, fs_rid rid)
+{
+    if (FS_IS_BNODE(rid)) {
+        fprintf(job->out, "_:b%llx", FS_BNODE_NUM(rid));
+    } else if (FS_IS_URI(rid)) {
+        write_uri(job->out, lookup(job, rid));
+    } else {
+        putc('"', job->out);
+        write_escaped(job->out, lookup(job, rid));
+        putc('"', job->out);
+        const fs_rid attr = job->cache[rid & CACHE_MASK].attr;
+        if (attr == FS_RID_NULL || attr == 0) {
+            /* plain literal */
+        } else if (FS_IS_URI(attr)) {
+            fputs("^^", job->out);
+            write_uri(job->out, lookup(job, attr));
+        } else {
+            fprintf(job->out, "@%s", lookup(job, attr));
+        }
+    }
+}
+
+static void write_quads(dump_job *job, fs_rid (*quads)[4], int count)
+{
+    if (job->binary) {
+        binary_record(job->out, FS_BINARY_QUADS, quads, count * sizeof(fs_rid) * 4);
+        job->quads += count;
+
+        return;
+    }
+
+    resolve_batch(job, (fs_rid *)quads, count * 4);
+    /* datatypes and languages of the literals we just found */
+    fs_rid attrs[count * 4];
+    int nattrs = 0;
+    for (int i = 0; i < count * 4; i++) {
+        const fs_rid rid = ((fs_rid *)quads)[i];
+        if (FS_IS_LITERAL(rid) && job->cache[rid & CACHE_MASK].rid == rid) {
+            attrs[nattrs++] = job->cache[rid & CACHE_MASK].attr;
+        }
+    }
+    resolve_batch(job, attrs, nattrs);
+
+    for (int i = 0; i < count; i++) {
+        write_term(job, quads[i][1]);
+        putc(' ', job->out);
+        write_term(job, quads[i][2]);
+        putc(' ', job->out);
+        write_term(job, quads[i][3]);
+        if (quads[i][0] != fs_c.default_graph) {
+            putc(' ', job->out);
+            write_term(job, quads[i][0]);
+        }
+        fputs(" .\n", job->out);
+    }
+    job->quads += count;
+}
+
+/* every quad is in exactly one subject ptree, in the subject's segment */
+static void dump_quads(dump_job *job)
+{
+    fs_backend *be = job->be;
+    fs_rid (*quads)[4] = malloc(QUAD_BATCH * sizeof(fs_rid) * 4);
+    int count = 0;
+
+    for (int n = 0; n < be->ptree_length; n++) {
+        const fs_rid pred = be->ptrees_priv[n].pred;
+        fs_ptree *pt = fs_backend_get_ptree(be, pred, 0);
+        if (!pt) {
+            fs_error(LOG_ERR, "cannot open ptree %016llx in segment %d", pred, job->segment);
+            job->errors++;
+
+            continue;
+        }
+        fs_ptree_it *it = fs_ptree_traverse(pt, FS_RID_NULL);
+        while (fs_ptree_traverse_next(it, quads[count])) {
+            quads[count][2] = pred;
+            if (++count == QUAD_BATCH) {
+                write_quads(job, quads, count);
+                count = 0;
+            }
+        }
+        fs_ptree_it_free(it);
+    }
+    if (count) {
+        write_quads(job, quads, count);
+    }
+    free(quads);
+}
+
+static gpointer dump_segment(gpointer data)
+{
+    dump_job *job = data;
+    double then = fs_time();
+
+    if (job->binary) {
+        binary_header(job->out);
+        dump_resources(job);
+    }
+    dump_quads(job);
+    if (job->binary) {
+        binary_record(job->out, FS_BINARY_END, NULL, 0);
+    }
+    job->time = fs_time() - then;
+
+    return NULL;
+}
+
+static int open_job(dump_job *job)
+{
+    job->be = fs_backend_init(job->kb, 0);
+    if (!job->be || fs_backend_open_files(job->be, job->segment, O_RDONLY, 0)) {
+        fs_error(LOG_ERR, "cannot open segment %d of “%s”", job->segment, job->kb);
+
+        return 1;
+    }
+
+    if (!job->binary) {
+        job->res = calloc(job->segments, sizeof(fs_rhash *));
+        for (int s = 0; s < job->segments; s++) {
+            char *filename = g_strdup_printf(fs_get_rhash_format(), job->kb, s, "res");
+            job->res[s] = fs_rhash_open_filename(filename, O_RDONLY);
+            g_free(filename);
+            if (!job->res[s]) {
+                return 1;
+            }
+        }
+        job->cache = calloc(CACHE_SIZE, sizeof(fs_resource));
+    }
+
+    job->out = fopen(job->filename, "w");
+    if (!job->out) {
+        fs_error(LOG_ERR, "cannot open “%s” for writing: %s", job->filename, strerror(errno));
+
+        return 1;
+    }
+    setvbuf(job->out, NULL, _IOFBF, OUT_BUFFER);
+
+    return 0;
+}
+
+static int close_job(dump_job *job)
+{
+    int ret = job->errors;
+
+    if (job->out && fclose(job->out)) {
+        fs_error(LOG_ERR, "error writing “%s”: %s", job->filename, strerror(errno));
+        ret++;
+    }
+    if (job->res) {
+        for (int s = 0; s < job->segments; s++) {
+            if (job->res[s]) fs_rhash_close(job->res[s]);
+        }
+        free(job->res);
+    }
+    if (job->cache) {
+        for (int i = 0; i < CACHE_SIZE; i++) {
+            free(job->cache[i].lex);
+        }
+        free(job->cache);
+    }
+    if (job->be) fs_backend_fini(job->be);
+    g_free(job->filename);
+
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    int binary = 0;
+    int help = 0;
+    int help_return = 1;
+    int c, opt_index = 0;
+
+    static struct option long_options[] = {
+        { "help", 0, 0, 'h' },
+        { "version", 0, 0, 'V' },
+        { "verbose", 0, 0, 'v' },
+        { "binary", 0, 0, 'b' },
+        { 0, 0, 0, 0 }
+    };
+
+    while ((c = getopt_long(argc, argv, "vb", long_options, &opt_index)) != -1) {
+        if (c == 'v') {
+            verbosity++;
+        } else if (c == 'b') {
+            binary = 1;
+        } else if (c == 'h') {
+            help = 1;
+            help_return = 0;
+        } else if (c == 'V') {
+            printf("%s, built for 4store %s\n", basename(argv[0]), GIT_REV);
+            exit(0);
+        } else {
+            help = 1;
+        }
+    }
+
+    if (help || argc - optind != 2) {
+        fprintf(stderr, "Usage: %s [-v] [--binary] <kbname> <output-prefix>\n", basename(argv[0]));
+        fprintf(stderr, "  writes <output-prefix>-<segment>.nq (or %s) for each primary\n", FS_BINARY_SUFFIX);
+        fprintf(stderr, "  segment on this node, 4s-backend must not be running\n");
+
+        return help_return;
+    }
+
+    const char *kb = argv[optind];
+    const char *prefix = argv[optind + 1];
+
+    if (fs_lock_kb_shared(kb)) {
+        fs_error(LOG_ERR, "is 4s-backend running for “%s”? stop it before dumping", kb);
+
+        return 1;
+    }
+
+    fs_backend *be = fs_backend_init(kb, 0);
+    if (!be) {
+        return 1;
+    }
+    const int segments = fs_backend_get_segments(be);
+    char seg_type[segments];
+    fs_node_segments(be, seg_type);
+    fs_backend_fini(be);
+
+    fs_hash_init(FS_HASH_UMAC);
+
+    int jobs = 0;
+    dump_job job[segments];
+    memset(job, 0, sizeof(job));
+    for (fs_segment s = 0; s < segments; s++) {
+        if (!binary && !seg_type[s]) {
+            fs_error(LOG_ERR, "segment %d is not on this node, N-Quads output needs them all, use --binary", s);
+
+            return 1;
+        }
+        if (seg_type[s] != 'p') continue;
+        job[jobs].kb = kb;
+        job[jobs].segment = s;
+        job[jobs].segments = segments;
+        job[jobs].binary = binary;
+        job[jobs].filename = g_strdup_printf("%s-%04d%s", prefix, s, binary ? FS_BINARY_SUFFIX : ".nq");
+        jobs++;
+    }
+
+    /* open everything up front, the backend code isn't thread safe */
+    int errors = 0;
+    for (int j = 0; j < jobs; j++) {
+        if (open_job(&job[j])) {
+            for (int k = 0; k <= j; k++) close_job(&job[k]);
+
+            return 1;
+        }
+    }
+
+    if (!g_thread_supported()) g_thread_init(NULL);
+    GThread *thread[jobs];
+    double then = fs_time();
+    for (int j = 0; j < jobs; j++) {
+        thread[j] = g_thread_create(dump_segment, &job[j], TRUE, NULL);
+    }
+    long long quads = 0;
+    for (int j = 0; j < jobs; j++) {
+        g_thread_join(thread[j]);
+        quads += job[j].quads;
+        if (verbosity) {
+            printf("segment %d: %lld quads, %lld resources in %.1fs\n",
+                   job[j].segment, job[j].quads, job[j].resources, job[j].time);
+        }
+        errors += close_job(&job[j]);
+    }
+    if (verbosity) {
+        printf("dumped %lld quads from %d segments in %.1fs\n", quads, jobs, fs_time() - then);
+    }
+    if (errors) {
+        fs_error(LOG_ERR, "%d errors while dumping “%s”", errors, kb);
+
+        return 2;
+    }
+
+    return 0;
+}
+
+/* vi:set expandtab sts=4 sw=4: */
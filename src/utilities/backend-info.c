@@ -27,6 +27,7 @@
 
 #include "../backend/backend.h"
 #include "../backend/backend-intl.h"
+#include "../backend/metadata.h"
 #include "../common/gnu-options.h"
 #include "../common/4s-store-root.h"
 
@@ -56,6 +57,25 @@ int main(int argc, char *argv[])
     g_free(tmp);
     g_free(tmp_format);
 
+    printf("  ptree limits %d open, %zdMB mapped per process%s\n",
+           be->ptree_max_open, be->ptree_max_mapped >> 20,
+           be->shared_ptrees ? ", small predicates in shared files" : "");
+    fs_rid_vector *segs = fs_metadata_get_int_vector(be->md, FS_MD_SEGMENT_P);
+    for (int i=0; i<segs->length; i++) {
+        fs_ptree_stats st;
+        if (fs_backend_ptree_stats(kbname, segs->data[i], &st)) {
+            printf("  segment %lld: can't read ptree stats\n", segs->data[i]);
+            continue;
+        }
+        long long lookups = st.hits + st.opens + st.reopens;
+        printf("  segment %lld: ptrees %lld hits (%.1f%%), %lld opens, "
+               "%lld reopens, %lld evictions, %lld busy\n", segs->data[i],
+               st.hits, lookups ? 100.0 * st.hits / lookups : 0.0,
+               st.opens, st.reopens, st.evictions, st.busy);
+    }
+    fs_rid_vector_free(segs);
+    fs_backend_fini(be);
+
     return 0;
 }
 
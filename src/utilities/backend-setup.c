@@ -50,6 +50,9 @@ typedef struct {
   int segments;
   int mirror;
   int model_files;
+  int shared_ptrees;
+  int ptree_max_open;
+  int ptree_max_mapped;
 } kbconfig;
 
 void create_dir(kbconfig *config);
@@ -92,6 +95,9 @@ int main(int argc, char *argv[])
         .segments = 2,
         .mirror = 0,
         .model_files = 0,
+        .shared_ptrees = 0,
+        .ptree_max_open = 0,
+        .ptree_max_mapped = 0,
     };
 
     static struct option long_options[] = {
@@ -105,6 +111,9 @@ int main(int argc, char *argv[])
         { "cluster", 1, 0, 'C' },
         { "segments", 1, 0, 'S' },
         { "password", 1, 0, 'P' },
+        { "shared-ptrees", 0, 0, 's' },
+        { "max-open-ptrees", 1, 0, 'O' },
+        { "max-mapped", 1, 0, 'M' },
         { 0, 0, 0, 0 }
     };
 
@@ -128,6 +137,12 @@ int main(int argc, char *argv[])
 	    config.segments = atoi(optarg);
 	} else if (c == 'P') {
 	    config.password = optarg;
+	} else if (c == 's') {
+	    config.shared_ptrees = 1;
+	} else if (c == 'O') {
+	    config.ptree_max_open = atoi(optarg);
+	} else if (c == 'M') {
+	    config.ptree_max_mapped = atoi(optarg);
 	} else if (c == 'h') {
 	    help = 1;
 	    help_return = 0;
@@ -144,7 +159,8 @@ int main(int argc, char *argv[])
     }
 
     if (config.segments < 1 || config.node < 0 ||
-        config.node >= config.cluster || config.name == NULL) {
+        config.node >= config.cluster || config.name == NULL ||
+        config.ptree_max_open < 0 || config.ptree_max_mapped < 0) {
         help = 1;
     }
 
@@ -157,6 +173,9 @@ int main(int argc, char *argv[])
         fprintf(stdout, "   --password <pw>   password for authentication\n");
         fprintf(stdout, "   -m, --mirror      mirror segments\n");
         fprintf(stdout, "   --model-files     use a file per-model (for large models)\n");
+        fprintf(stdout, "   --shared-ptrees   keep predicates with few quads in shared files\n");
+        fprintf(stdout, "   --max-open-ptrees <n>  predicates each backend process keeps open\n");
+        fprintf(stdout, "   --max-mapped <MB> limit on index files each backend process maps\n");
         fprintf(stdout, "   -v, --verbose     increase verbosity\n");
         fprintf(stdout, "   -n, --print-only  dont execute commands, just show\n");
         fprintf(stdout, "This command creates KBs, if the KB already exists, its contents are lost.\n");
@@ -264,6 +283,15 @@ void setup_metadata(kbconfig *config)
     } else {
         fs_metadata_set(md, FS_MD_MODEL_FILES, "false");
     }
+    if (config->shared_ptrees) {
+        fs_metadata_set(md, FS_MD_SHARED_PTREES, "true");
+    }
+    if (config->ptree_max_open) {
+        fs_metadata_set_int(md, FS_MD_PTREE_MAX_OPEN, config->ptree_max_open);
+    }
+    if (config->ptree_max_mapped) {
+        fs_metadata_set_int(md, FS_MD_PTREE_MAX_MAPPED, config->ptree_max_mapped);
+    }
     fs_metadata_set(md, FS_MD_CODE_VERSION, GIT_REV);
     for (int seg = 0; seg < config->segments; seg++) {
         if (primary_segment(config, seg))
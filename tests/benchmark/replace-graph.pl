@@ -0,0 +1,92 @@
+#!/usr/bin/perl -w
+
+# Times replacing (PUT) and deleting a small graph in a large KB, the case
+# that the backend handles by walking the graph's model list.
+#
+# usage: replace-graph.pl [-e endpoint] [-b bulk-triples] [-t triples]
+#                         [-p predicates] [-n iterations]
+#
+# Start a server first, eg.
+#   4s-httpd -D -p 13579 bench_$USER
+# -b loads a background graph of that many triples before timing, it only
+# needs doing once per KB.
+
+use strict;
+use HTTP::Tiny;
+use Time::HiRes qw(time);
+use Getopt::Std;
+
+my %opts;
+getopts('e:b:t:p:n:', \%opts) || die "usage: $0 [-e endpoint] [-b bulk] [-t triples] [-p predicates] [-n iterations]\n";
+
+my $endpoint = $opts{'e'} || "http://localhost:13579";
+my $bulk = $opts{'b'} || 0;
+my $triples = $opts{'t'} || 3000;
+my $preds = $opts{'p'} || 300;
+my $its = $opts{'n'} || 20;
+
+my $http = HTTP::Tiny->new(timeout => 3600);
+my $ns = "http://example.org/bench/";
+
+sub graph_data {
+	my ($count, $npreds, $tag) = @_;
+	my $data = "";
+	for my $i (0..$count-1) {
+		my $p = $i % $npreds;
+		$data .= "<${ns}s/$tag/".int($i / $npreds)."> <${ns}p/$p> \"$tag $i\" .\n";
+	}
+
+	return $data;
+}
+
+sub put_graph {
+	my ($graph, $data) = @_;
+	my $res = $http->request('PUT', "$endpoint/data/$graph",
+		{ headers => { 'Content-Type' => 'application/x-turtle' }, content => $data });
+	die "PUT $graph failed: $res->{status} $res->{content}\n" unless $res->{success};
+}
+
+sub delete_graph {
+	my ($graph) = @_;
+	my $res = $http->request('DELETE', "$endpoint/data/$graph");
+	die "DELETE $graph failed: $res->{status} $res->{content}\n" unless $res->{success};
+}
+
+if ($bulk) {
+	my $then = time();
+	my $chunk = 100000;
+	for (my $done = 0; $done < $bulk; $done += $chunk) {
+		my $n = $bulk - $done < $chunk ? $bulk - $done : $chunk;
+		put_graph("${ns}bulk/$done", graph_data($n, $preds, "bulk$done"));
+	}
+	printf("loaded %d background triples in %.1fs\n", $bulk, time() - $then);
+}
+
+my $graph = "${ns}small";
+my @put;
+my @del;
+for my $i (1..$its) {
+	my $data = graph_data($triples, $preds, "small$i");
+	my $then = time();
+	put_graph($graph, $data);
+	push @put, (time() - $then) * 1000.0;
+	if ($i == $its) {
+		$then = time();
+		delete_graph($graph);
+		push @del, (time() - $then) * 1000.0;
+	}
+}
+
+sub report {
+	my ($name, @t) = @_;
+	my ($best, $worst, $total) = (9999999.0, 0.0, 0.0);
+	for (@t) {
+		$best = $_ if $_ < $best;
+		$worst = $_ if $_ > $worst;
+		$total += $_;
+	}
+	printf("%-40s %10.3fms %10.3fms %10.3fms\n", $name, $best, $total/@t, $worst);
+}
+
+report("replace $triples triples/$preds preds", @put);
+report("delete $triples triples/$preds preds", @del);
@@ -0,0 +1,97 @@
+#!/usr/bin/perl -w
+
+# Times serialising a large SELECT result in each of the result formats. The
+# result is the cross product of two synthetic graphs, with literals that
+# need escaping in every format, so it mostly measures the writers.
+#
+# usage: result-output.pl [-e endpoint] [-r rows] [-n iterations]
+#
+# Start a server first, eg.
+#   4s-httpd -D -p 13579 bench_$USER
+
+use strict;
+use utf8;
+use HTTP::Tiny;
+use Time::HiRes qw(time);
+use Getopt::Std;
+
+my %opts;
+getopts('e:r:n:', \%opts) || die "usage: $0 [-e endpoint] [-r rows] [-n iterations]\n";
+
+my $endpoint = $opts{'e'} || "http://localhost:13579";
+my $rows = $opts{'r'} || 10000000;
+my $its = $opts{'n'} || 3;
+
+my $http = HTTP::Tiny->new(timeout => 3600);
+my $ns = "http://example.org/bench/";
+my @formats = qw(json xml text csv);
+my $right = $rows < 1000 ? $rows : 1000;
+my $left = int(($rows + $right - 1) / $right);
+$rows = $left * $right;
+
+my @objects = (
+	sub { "\"plain literal $_[0]\"" },
+	sub { "\"says \\\"hello\\\", then <leaves> & goes $_[0]\"\@en" },
+	sub { "\"$_[0]\"^^<http://www.w3.org/2001/XMLSchema#integer>" },
+	sub { "\"line one\\nline two\\tcolumn\\\\ $_[0]\"" },
+	sub { "\"Straße, naïve, Ωmega $_[0]\"\@de" },
+	sub { "<${ns}o/$_[0]>" },
+);
+
+sub put_graph {
+	my ($graph, $data) = @_;
+	utf8::encode($data);
+	my $res = $http->request('PUT', "$endpoint/data/$graph",
+		{ headers => { 'Content-Type' => 'application/x-turtle' }, content => $data });
+	die "PUT $graph failed: $res->{status} $res->{content}\n" unless $res->{success};
+}
+
+sub delete_graph {
+	my ($graph) = @_;
+	my $res = $http->request('DELETE', "$endpoint/data/$graph");
+	die "DELETE $graph failed: $res->{status} $res->{content}\n" unless $res->{success};
+}
+
+sub report {
+	my ($name, $bytes, @t) = @_;
+	my ($best, $worst, $total) = (9999999.0, 0.0, 0.0);
+	for (@t) {
+		$best = $_ if $_ < $best;
+		$worst = $_ if $_ > $worst;
+		$total += $_;
+	}
+	my $mean = $total / @t;
+	printf("%-30s %10.0fms %10.0fms %10.0fms %10.0f rows/s %8.1f MB/s\n", $name,
+		$best, $mean, $worst, $rows * 1000.0 / $mean,
+		$bytes / 1048576.0 * 1000.0 / $mean);
+}
+
+my $data = "";
+for my $i (0..$left-1) {
+	$data .= "<${ns}s/$i> <${ns}value> ".$objects[$i % @objects]->($i)." .\n";
+}
+put_graph("${ns}left", $data);
+$data = "";
+for my $i (0..$right-1) {
+	$data .= "<${ns}k/$i> <${ns}key> \"$i\" .\n";
+}
+put_graph("${ns}right", $data);
+
+my $query = "SELECT ?s ?o ?k WHERE { GRAPH <${ns}left> { ?s <${ns}value> ?o } GRAPH <${ns}right> { ?k <${ns}key> ?x } }";
+for my $format (@formats) {
+	my @t;
+	my $bytes;
+	for my $i (1..$its) {
+		$bytes = 0;
+		my $then = time();
+		my $res = $http->request('GET', "$endpoint/sparql/?".
+			$http->www_form_urlencode({ query => $query, output => $format, 'soft-limit' => -1 }),
+			{ data_callback => sub { $bytes += length($_[0]); } });
+		die "query failed: $res->{status}\n" unless $res->{success};
+		push @t, (time() - $then) * 1000.0;
+	}
+	report("select $rows rows, $format", $bytes, @t);
+}
+
+delete_graph("${ns}left");
+delete_graph("${ns}right");
@@ -0,0 +1,67 @@
+#!/usr/bin/perl -w
+
+# Measures throughput of small SPARQL updates, each inserting a few triples,
+# sent by several concurrent clients. These go through the backend's redo
+# log, so concurrent clients should share fsyncs.
+#
+# usage: small-updates.pl [-e endpoint] [-c clients] [-n updates-per-client]
+#                         [-t triples-per-update]
+#
+# Start a server first, eg.
+#   4s-httpd -D -p 13579 bench_$USER
+
+use strict;
+use HTTP::Tiny;
+use Time::HiRes qw(time);
+use Getopt::Std;
+
+my %opts;
+getopts('e:c:n:t:', \%opts) || die "usage: $0 [-e endpoint] [-c clients] [-n updates] [-t triples]\n";
+
+my $endpoint = $opts{'e'} || "http://localhost:13579";
+my $clients = $opts{'c'} || 8;
+my $its = $opts{'n'} || 200;
+my $triples = $opts{'t'} || 1;
+
+my $ns = "http://example.org/bench/";
+
+sub client {
+	my ($id) = @_;
+	my $http = HTTP::Tiny->new(timeout => 600);
+	for my $i (1..$its) {
+		my $data = "";
+		for my $t (1..$triples) {
+			$data .= "<${ns}s/$id/$i> <${ns}p/$t> \"$id $i $t\" . ";
+		}
+		my $res = $http->post_form("$endpoint/update/",
+			{ update => "INSERT DATA { GRAPH <${ns}small-updates> { $data } }" });
+		die "update failed: $res->{status} $res->{content}\n" unless $res->{success};
+	}
+}
+
+my $then = time();
+my @pids;
+for my $c (1..$clients) {
+	my $pid = fork();
+	die "fork failed: $!\n" unless defined $pid;
+	if (!$pid) {
+		client($c);
+		exit(0);
+	}
+	push @pids, $pid;
+}
+my $failed = 0;
+for (@pids) {
+	waitpid($_, 0);
+	$failed++ if $?;
+}
+my $elapsed = time() - $then;
+die "$failed clients failed\n" if $failed;
+
+my $total = $clients * $its;
+printf("%d updates of %d triples from %d clients in %.2fs, %.1f updates/s\n",
+	$total, $triples, $clients, $elapsed, $total / $elapsed);
+
+my $http = HTTP::Tiny->new(timeout => 600);
+my $res = $http->request('DELETE', "$endpoint/data/${ns}small-updates");
+die "cleanup failed: $res->{status} $res->{content}\n" unless $res->{success};
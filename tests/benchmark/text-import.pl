@@ -0,0 +1,93 @@
+#!/usr/bin/perl -w
+
+# Times importing literal heavy data with each kind of full text indexing
+# configured, to compare their cost against a plain import.
+#
+# usage: text-import.pl [-e endpoint] [-t triples] [-w words-per-literal]
+#                       [-n iterations]
+#
+# Start a server first, eg.
+#   4s-httpd -D -p 13579 bench_$USER
+# The KB's system:config graph is replaced while this runs.
+
+use strict;
+use utf8;
+use HTTP::Tiny;
+use Time::HiRes qw(time);
+use Getopt::Std;
+
+my %opts;
+getopts('e:t:w:n:', \%opts) || die "usage: $0 [-e endpoint] [-t triples] [-w words] [-n iterations]\n";
+
+my $endpoint = $opts{'e'} || "http://localhost:13579";
+my $triples = $opts{'t'} || 20000;
+my $words = $opts{'w'} || 12;
+my $its = $opts{'n'} || 5;
+
+my $http = HTTP::Tiny->new(timeout => 3600);
+my $ns = "http://example.org/bench/";
+my @modes = qw(none token dmetaphone stem);
+my @langs = ('', '@en', '@en-GB', '@de', '@fr', '@es');
+my @vocab = qw(Alpha bravo Charlie delta ECHO foxtrot golf Hotel india
+	juliet kilo Lima mike november oscar papa quebec romeo sierra tango
+	uniform victor whiskey xray yankee zulu Über Straße élan naïve Ωmega);
+
+sub graph_data {
+	my ($count, $tag) = @_;
+	my $data = "";
+	for my $i (0..$count-1) {
+		my @lit;
+		for my $w (1..$words) {
+			push @lit, $vocab[($i * 7 + $w * 13) % @vocab].($i % 97);
+		}
+		my $lang = $langs[$i % @langs];
+		$data .= "<${ns}s/$tag/$i> <${ns}text> \"@lit\"$lang .\n";
+	}
+
+	return $data;
+}
+
+sub put_graph {
+	my ($graph, $data) = @_;
+	utf8::encode($data);
+	my $res = $http->request('PUT', "$endpoint/data/$graph",
+		{ headers => { 'Content-Type' => 'application/x-turtle' }, content => $data });
+	die "PUT $graph failed: $res->{status} $res->{content}\n" unless $res->{success};
+}
+
+sub delete_graph {
+	my ($graph, $missing_ok) = @_;
+	my $res = $http->request('DELETE', "$endpoint/data/$graph");
+	die "DELETE $graph failed: $res->{status} $res->{content}\n" unless $res->{success} || $missing_ok;
+}
+
+sub report {
+	my ($name, @t) = @_;
+	my ($best, $worst, $total) = (9999999.0, 0.0, 0.0);
+	for (@t) {
+		$best = $_ if $_ < $best;
+		$worst = $_ if $_ > $worst;
+		$total += $_;
+	}
+	printf("%-40s %10.3fms %10.3fms %10.3fms %10.0f triples/s\n", $name,
+		$best, $total/@t, $worst, $triples * 1000.0 / ($total/@t));
+}
+
+my $graph = "${ns}text";
+for my $mode (@modes) {
+	if ($mode eq 'none') {
+		delete_graph("system:config", 1);
+	} else {
+		put_graph("system:config", "<${ns}text> <http://4store.org/fulltext#index> <http://4store.org/fulltext#$mode> .\n");
+	}
+	my @put;
+	for my $i (1..$its) {
+		my $data = graph_data($triples, "$mode$i");
+		my $then = time();
+		put_graph($graph, $data);
+		push @put, (time() - $then) * 1000.0;
+	}
+	delete_graph($graph);
+	report("import $triples literals, $mode", @put);
+}
+delete_graph("system:config");
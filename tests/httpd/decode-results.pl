@@ -0,0 +1,77 @@
+#!/usr/bin/perl -w
+
+# Reads 4store binary results (docs/binary-results) on stdin and prints them
+# as TSV, for checking the format.
+
+use strict;
+
+binmode(STDIN);
+local $/;
+my $data = <STDIN>;
+
+my ($magic, $bom, $cols) = unpack("a8 L L", $data);
+die "bad magic\n" unless $magic eq "4SRES\0\0\1";
+die "wrong byte order\n" unless $bom == 0x01020304;
+my $pos = 16;
+
+my @dict = map { [] } 1..$cols;
+
+sub term {
+	my ($e) = @_;
+	my ($type, $attrtype, $lex, $attr) = @$e;
+	return "<$lex>" if $type == 1;
+	return "_:$lex" if $type == 3;
+	return "\"$lex\"^^<$attr>" if $attrtype == 1;
+	return "\"$lex\"\@$attr" if $attrtype == 2;
+	return "\"$lex\"";
+}
+
+while ($pos < length($data)) {
+	my ($type, $len) = unpack("a1 x3 L", substr($data, $pos, 8));
+	my $payload = substr($data, $pos + 8, $len);
+	die "truncated record\n" if length($payload) != $len;
+	die "unaligned record\n" if $len % 8;
+	$pos += 8 + $len;
+
+	if ($type eq 'V') {
+		my @names;
+		my $p = 0;
+		for (1..$cols) {
+			my $l = unpack("L", substr($payload, $p, 4));
+			push @names, "?".substr($payload, $p + 4, $l);
+			$p += 4 + $l;
+		}
+		print join("\t", @names)."\n";
+	} elsif ($type eq 'D') {
+		my ($col, $count) = unpack("L L", $payload);
+		my $p = 8;
+		for (1..$count) {
+			my ($t, $at, $ll, $al) = unpack("C C x2 L L", substr($payload, $p, 12));
+			push @{$dict[$col]}, [$t, $at, substr($payload, $p + 12, $ll),
+				substr($payload, $p + 12 + $ll, $al)];
+			$p += 12 + $ll + $al;
+		}
+	} elsif ($type eq 'B') {
+		my $rows = unpack("L", $payload);
+		my $stride = ($rows * 4 + 7) & ~7;
+		for my $r (0..$rows-1) {
+			my @row;
+			for my $c (0..$cols-1) {
+				my $i = unpack("L", substr($payload, 8 + $c * $stride + $r * 4, 4));
+				die "index $i not in dictionary\n" if $i != 0xffffffff && $i >= @{$dict[$c]};
+				push @row, $i == 0xffffffff ? "" : term($dict[$c][$i]);
+			}
+			print join("\t", @row)."\n";
+		}
+	} elsif ($type eq 'A') {
+		print unpack("L", $payload) ? "true\n" : "false\n";
+	} elsif ($type eq 'W') {
+		$payload =~ s/\0+$//;
+		print "# $payload\n";
+	} elsif ($type eq 'E') {
+		print "# end\n";
+		last;
+	} else {
+		die "unknown record type $type\n";
+	}
+}
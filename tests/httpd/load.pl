@@ -0,0 +1,154 @@
+#!/usr/bin/perl -w
+
+# Measures 4s-httpd requests/second with a new connection per request and
+# with persistent (keep-alive) connections, optionally pipelined.
+#
+# usage: load.pl [-e endpoint] [-n requests] [-c clients] [-p depth] [query]
+#
+# Start a server first, eg. as run.pl does:
+#   4s-httpd -D -p 13579 http_test_$USER
+
+use strict;
+use IO::Socket::INET;
+use Socket qw(IPPROTO_TCP TCP_NODELAY);
+use Time::HiRes qw(time);
+use Getopt::Std;
+
+my %opts;
+getopts('e:n:c:p:', \%opts) || die "usage: $0 [-e endpoint] [-n requests] [-c clients] [-p depth] [query]\n";
+
+my $endpoint = $opts{'e'} || "http://localhost:13579";
+my $requests = $opts{'n'} || 2000;
+my $clients = $opts{'c'} || 8;
+my $depth = $opts{'p'} || 1;
+my $query = $ARGV[0] || "SELECT * WHERE { ?s ?p ?o } LIMIT 10";
+
+$endpoint =~ m|^http://([^/:]+)(?::(\d+))?| || die "bad endpoint $endpoint\n";
+my ($host, $port) = ($1, $2 || 80);
+(my $escaped = $query) =~ s/([^A-Za-z0-9_.~-])/sprintf("%%%02X", ord($1))/ge;
+my $path = "/sparql/?query=$escaped";
+
+sub connect_server {
+	my $sock = IO::Socket::INET->new(PeerAddr => $host, PeerPort => $port,
+	                                 Proto => 'tcp') || die "connect: $!\n";
+	setsockopt($sock, IPPROTO_TCP, TCP_NODELAY, 1);
+
+	return $sock;
+}
+
+sub request {
+	my ($keepalive) = @_;
+
+	return "GET $path HTTP/1.1\r\nHost: $host\r\nAccept: text/tab-separated-values\r\n".
+	       ($keepalive ? "" : "Connection: close\r\n")."\r\n";
+}
+
+# reads one response from $sock, buffering extra bytes in $$buf,
+# returns the status code and whether the connection is still usable
+sub read_response {
+	my ($sock, $buf) = @_;
+
+	my $fill = sub {
+		my $n = sysread($sock, $$buf, 65536, length($$buf));
+		die "read: $!\n" unless defined $n;
+		return $n;
+	};
+	my $line = sub {
+		while ($$buf !~ /\r\n/) {
+			&$fill() || return undef;
+		}
+		$$buf =~ s/^(.*?)\r\n//s;
+		return $1;
+	};
+
+	my $status = &$line();
+	die "no response\n" unless defined $status;
+	my ($code) = $status =~ m|^HTTP/1\.\d (\d+)|;
+	my %headers;
+	while (defined(my $h = &$line())) {
+		last if $h eq "";
+		$headers{lc($1)} = $2 if $h =~ /^([^:]+):\s*(.*)$/;
+	}
+
+	my $open = ($headers{'connection'} || "") !~ /close/i;
+	if (($headers{'transfer-encoding'} || "") =~ /chunked/i) {
+		while (1) {
+			my $size = hex(&$line());
+			while (length($$buf) < $size + 2) {
+				&$fill() || die "short chunk\n";
+			}
+			substr($$buf, 0, $size + 2) = "";
+			last if $size == 0;
+		}
+	} elsif (defined $headers{'content-length'}) {
+		my $len = $headers{'content-length'};
+		while (length($$buf) < $len) {
+			&$fill() || die "short body\n";
+		}
+		substr($$buf, 0, $len) = "";
+	} else {
+		while (&$fill()) {}
+		$$buf = "";
+		$open = 0;
+	}
+
+	return ($code, $open);
+}
+
+sub client {
+	my ($count, $keepalive, $depth) = @_;
+	my $done = 0;
+	my $errors = 0;
+
+	while ($done < $count) {
+		my $sock = connect_server();
+		my $buf = "";
+		my $open = 1;
+		my $sent = $done;
+		my $batch = $keepalive ? $count - $done : 1;
+		while ($done < $count && $open) {
+			while ($sent - $done < $depth && $sent < $done + $batch) {
+				print $sock request($keepalive);
+				$sent++;
+			}
+			my $code;
+			($code, $open) = read_response($sock, \$buf);
+			$errors++ if $code != 200;
+			$done++;
+			last if !$keepalive;
+		}
+		close($sock);
+	}
+
+	return $errors;
+}
+
+sub run {
+	my ($name, $keepalive, $depth) = @_;
+	my $per_client = int($requests / $clients) || 1;
+	my @pids;
+
+	my $then = time();
+	for my $c (1..$clients) {
+		my $pid = fork();
+		die "fork: $!\n" unless defined $pid;
+		if (!$pid) {
+			exit(client($per_client, $keepalive, $depth) ? 1 : 0);
+		}
+		push @pids, $pid;
+	}
+	my $failed = 0;
+	for my $pid (@pids) {
+		waitpid($pid, 0);
+		$failed++ if $?;
+	}
+	my $elapsed = time() - $then;
+	my $total = $per_client * $clients;
+
+	printf("%-12s %6d requests %3d clients %8.1f req/s%s\n", $name, $total,
+	       $clients, $total / $elapsed, $failed ? " ($failed clients saw errors)" : "");
+}
+
+run("close", 0, 1);
+run("keep-alive", 1, 1);
+run("pipelined", 1, $depth) if $depth > 1;
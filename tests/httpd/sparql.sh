@@ -13,6 +13,26 @@ function sparql {
 	curl -s -H "Accept: text/plain" "$1/sparql/?query=${escaped}$3" | sed 's/ v[0-9]\.[.0-9a-z-]*/ [VERSION]/'
 }
 
+# usage: sparql-binary $endpoint $query
+function sparql-binary {
+	uriescape "$2";
+	echo "Query: $2"
+	curl -s -H "Accept: application/x-4store-results" "$1/sparql/?query=${escaped}" | ./decode-results.pl
+}
+
+# usage: prepare $endpoint $query, sets $handle
+function prepare {
+	uriescape "$2";
+	echo "Prepare: $2"
+	handle=`curl -s "$1/sparql/?prepare=1&query=${escaped}"`
+}
+
+# usage: sparql-prepared $endpoint $handle $params
+function sparql-prepared {
+	echo "Prepared: $3"
+	curl -s -H "Accept: text/plain" "$1/sparql/?prepared=$2$3" | sed 's/ v[0-9]\.[.0-9a-z-]*/ [VERSION]/'
+}
+
 # usage: update $endpoint $update
 function update {
         postescape "$2"